@@ -5,37 +5,60 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/sysinfo.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 #include "util.h"
 #include "bios.h"
 
+/* Older C libraries do not name the target thread of SIGEV_THREAD_ID */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /*
 	Implementation of bios.h API
 
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
+	- One POSIX timer per core thread or, with VM_ALARM_PIC, per-core
+	deadlines in memory, multiplexed by the PIC thread over a timerfd.
 	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- The PIC thread receives timer signals and device readiness (via
+	epoll) and dispatches them to the right core thread by raising SIGUSR1.
+	- With VM_IRQ_FUTEX delivery, interrupts are masked in software (the
+	signal mask is not changed), and SIGUSR1 is only sent to cores running
+	with interrupts enabled. Other cores find their pending interrupts 
+	when they enable interrupts, and halted cores sleep on a futex.
 
  */
 
 
-#if 0
-#define CORE_STATISTICS
-#endif
-
+/* The state of a VM */
+typedef struct vm_instance vm_instance;
 
 /*
 	Per-core data.
@@ -43,28 +66,41 @@
 typedef struct core
 {
 	uint id;
+	vm_instance* vm;
 	interrupt_handler* bootfunc;
 	pthread_t thread;
+	int host_cpu;				/* the host CPU of the thread, or -1 */
 
 	struct sigevent timer_sigevent;
 	timer_t timer_id;
+	uint64_t alarm_deadline;	/* VM_ALARM_PIC: ALARM time in nsec, or 0 */
 
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	/* Used by VM_IRQ_FUTEX delivery */
+	volatile int* intr_off;		/* the cpu_intr_off flag of the core thread */
+	volatile int halted;		/* core is in cpu_core_halt() */
+	volatile int halt_futex;	/* halted core sleeps while this is 0 */
 
-#if defined(CORE_STATISTICS)
-	/* Statistics */
-	volatile uintptr_t irq_count;
-	volatile uintptr_t irq_raised[maximum_interrupt_no];
-	volatile uintptr_t irq_delivered[maximum_interrupt_no];
-	volatile uintptr_t hlt_count;
-	volatile uintptr_t rst_count;
-	volatile TimerDuration hlt_time;
-	volatile TimerDuration run_time;
-#endif
 
-} Core;
+	/* Statistics updated by the core thread */
+	struct {
+		unsigned long irq_count;
+		unsigned long irq_delivered[maximum_interrupt_no];
+		unsigned long hlt_count;
+		TimerDuration hlt_time;
+		TimerDuration start_time;
+		TimerDuration stop_time;	/* 0 while the core is running */
+	} __attribute__((aligned(64))) stat;
+
+	/* Statistics updated by other threads */
+	struct {
+		unsigned long irq_raised[maximum_interrupt_no];
+		unsigned long rst_count;
+	} __attribute__((aligned(64))) rstat;
+
+} __attribute__((aligned(64))) Core;
 
 
 /* Used to store the set of core threads' signal mask */
@@ -79,26 +115,73 @@ static sigset_t sigalrm_set;
 /* Used to create the signalfd */
 static sigset_t signalfd_set;
 
-/* Array of Core objects, one per core */
-static Core CORE[MAX_CORES];
+/* Bit vector denoting halted cores, one bit per core */
+#define CORE_MASK_WORDS ((MAX_CORES+63)/64)
+
+/*
+	The state of a VM. Several VMs may run at the same time in the
+	process. Each one runs its PIC daemon on the host thread that called
+	vm_run(), and has its own core and device threads. Each core thread
+	has a pointer to its VM, in cpu_vm.
+
+	The devices are defined further below, and are kept in separate arrays.
+ */
+struct vm_instance
+{
+	Core CORE[MAX_CORES];			/* Array of Core objects, one per core */
+	unsigned int ncores;			/* Number of cores */
+
+	pthread_barrier_t system_barrier, core_barrier;
+
+	volatile sig_atomic_t PIC_active;	/* the PIC daemon should be active */
+	int PIC_eventfd;				/* used to wake up the PIC thread */
+	pid_t PIC_tid;					/* the PIC thread, which receives SIGALRM */
+
+	_Atomic uint64_t halt_vector[CORE_MASK_WORDS];
 
-/* Number of cores */
-static unsigned int ncores = 0;
+	vm_irq_delivery irq_delivery;	/* the interrupt delivery mechanism */
+	vm_alarm alarm_mode;			/* the core alarm mechanism */
+	uint64_t pic_alarm_armed;		/* VM_ALARM_PIC: the expiration time of the
+									   PIC's timerfd, UINT64_MAX if unset */
+	uint64_t pic_alarm_set;			/* VM_ALARM_PIC: the setting of the timerfd */
+	int tsc_clock;					/* use the TSC for the fine clock */
 
-/* Core barrier */
-static pthread_barrier_t system_barrier, core_barrier;
+	uint restart_cores;				/* cores restarted by cpu_core_restart_one() */
 
-/* Flag that signals that PIC daemon should be active */
-static volatile sig_atomic_t PIC_active;
+	unsigned long sigmask_calls;	/* Number of signal mask changes by cores */
+	unsigned long PIC_loops;		/* PIC daemon statistics */
 
-/* Bit vector denoting halted cores */
-static _Atomic uint32_t halt_vector;
+	void* data;						/* from vm_config */
 
-/* PIC thread id */
-static pthread_t PIC_thread;
+	struct terminal* TERM;			/* The terminal table */
+	uint nterm;						/* Current number of terminals */
+	struct serial_device* SERIAL;	/* The queues of the terminals */
+	struct disk_device* DISK;		/* The disk table */
+	uint ndisk;						/* Current number of disks */
+	struct nic_device* NIC;
+	int nic_present;
+};
 
-/* Save the sigaction for SIGUSR1 */
+/* The VM of the core thread */
+static _Thread_local vm_instance* cpu_vm;
+
+/* Set the halt bit of core c */
+static inline void halt_vector_set(vm_instance* vm, uint c)
+{
+	__atomic_fetch_or(& vm->halt_vector[c>>6], 1ull<<(c&63), __ATOMIC_RELAXED);
+}
+
+/* Clear the halt bit of core c, returning its previous value */
+static inline int halt_vector_clear(vm_instance* vm, uint c)
+{
+	uint64_t cmask = 1ull<<(c&63);
+	return (__atomic_fetch_and(& vm->halt_vector[c>>6], ~cmask, __ATOMIC_RELAXED) & cmask) != 0;
+}
+
+/* Save the sigaction for SIGUSR1, while any VM is running */
 static struct sigaction USR1_saved_sigaction;
+static pthread_mutex_t USR1_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint running_vms = 0;
 
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
@@ -106,21 +189,30 @@ static struct sigaction USR1_sigaction;
 /* This gives a rough serial port timeout of 300 msec */
 #define SERIAL_TIMEOUT 300000
 
+/* Statistics counters are only updated with relaxed atomics */
+#define STAT_ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
+/* Forward decl. of the statistics report */
+static void core_stats_report(vm_instance* vm, FILE* out);
+
 /* Forward decl. of per-core signal handler */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
-/* PIC daemon statistics */
-static unsigned long PIC_loops;
+/* Forward decl. of the device shutdown helper */
+static void devices_stop_interrupts(vm_instance* vm);
 
 /* Physical cores (needed for some heuristics) */
 static unsigned int physical_cores;
 
+/* Forward decl. of the host topology scan */
+static void host_topology_init();
+
 
 /* Initialize static vars. This is called via pthread_once() */
 static pthread_once_t init_control = PTHREAD_ONCE_INIT;
 static void initialize()
 {
-	physical_cores = get_nprocs();
+	host_topology_init();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
 	USR1_sigaction.sa_flags = SA_SIGINFO;
@@ -152,21 +244,81 @@ static void initialize()
 	Static func to access the thread-local Core.
 */
 _Thread_local uint cpu_core_id;
+
+/* 
+	This must not be inlined or treated as pure: after a context switch,
+	the same thread may continue on a different core (pthread).
+ */
+uint __attribute__((noipa)) cpu_core_id_now() { return cpu_core_id; }
 static inline Core* curr_core() {
-	return CORE+cpu_core_id;
+	return cpu_vm->CORE+cpu_core_id;
+}
+
+
+/*
+	Software interrupt masking (VM_IRQ_FUTEX).
+
+	Each core thread has a thread-local flag, set while interrupts are
+	disabled. The SIGUSR1 handler returns immediately if it finds the flag
+	set, leaving the interrupt pending, to be dispatched when interrupts
+	are enabled.
+
+	The flag must be accessed by single instructions (an %fs-relative
+	address on x86-64): if the address of the flag was computed first, a
+	signal handler could move the thread to another core before the access.
+ */
+#if defined(__x86_64__)
+
+#define SOFT_INTR_MASK 1
+
+__attribute__((tls_model("local-exec"), visibility("hidden")))
+_Thread_local volatile int cpu_intr_off;
+
+/* Set the flag to v, return its old value. This is also a full barrier. */
+static inline int intr_off_swap(int v)
+{
+	__asm__ volatile("xchgl %0, %%fs:cpu_intr_off@tpoff" : "+r"(v) : : "memory");
+	return v;
+}
+
+static inline int intr_off_get()
+{
+	int v;
+	__asm__ volatile("movl %%fs:cpu_intr_off@tpoff, %0" : "=r"(v) : : "memory");
+	return v;
+}
+
+#else
+
+/* Not supported, VM_IRQ_SIGNAL must be used */
+#define SOFT_INTR_MASK 0
+
+static _Thread_local volatile int cpu_intr_off;
+static inline int intr_off_swap(int v) { abort(); }
+static inline int intr_off_get() { abort(); }
+
+#endif
+
+
+/* Change the signal mask of the core thread */
+static inline void core_sigmask(int how, const sigset_t* set, sigset_t* oldset)
+{
+	__atomic_fetch_add(& cpu_vm->sigmask_calls, 1, __ATOMIC_RELAXED);
+	CHECKRC(pthread_sigmask(how, set, oldset));
 }
 
 
 /*
-	Cause PIC daemon to loop. This needs to happen when we wish 
-	the PIC daemon to refresh the list of fds it is polling.
+	Cause PIC daemon to loop. This needs to happen when some
+	io_device becomes not ready, or the PIC daemon must stop.
  */
-static inline void interrupt_pic_thread()
+static inline void interrupt_pic_thread(vm_instance* vm)
 {
-	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is silly, but silences valgrind */
-	coreval.sival_int = -1;
-	CHECKRC(pthread_sigqueue(PIC_thread, SIGUSR1, coreval));
+	uint64_t one = 1;
+	int rc;
+	while((rc = write(vm->PIC_eventfd, &one, sizeof(one)))==-1 && errno==EINTR);
+	/* EAGAIN means that the counter is saturated, the PIC will wake up anyway */
+	assert(rc==sizeof(one) || errno==EAGAIN);
 }
 
 
@@ -177,28 +329,39 @@ static inline void interrupt_pic_thread()
 static void* core_thread(void* _core)
 {
 	Core* core = (Core*)_core;
+	vm_instance* vm = core->vm;
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	core->intr_off = & cpu_intr_off;
+	cpu_intr_off = 0;
+	core->halted = 0;
+	core->halt_futex = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
 		core->intvec[i] = NULL;
 
 	cpu_core_id = core->id;
+	cpu_vm = vm;
 
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
 	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
-	core->timer_sigevent.sigev_value.sival_int = core->id;
-	// Could also be CLOCK_REALTIME
-	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
+	core->alarm_deadline = 0;
+	if(vm->alarm_mode == VM_ALARM_POSIX) {
+		/* The signal is sent to the PIC thread of this VM */
+		core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+		core->timer_sigevent.sigev_notify_thread_id = vm->PIC_tid;
+		core->timer_sigevent.sigev_signo = SIGALRM;
+		core->timer_sigevent.sigev_value.sival_int = core->id;
+		// Could also be CLOCK_REALTIME
+		CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
+	}
 
 	/* sync with all cores */
-	pthread_barrier_wait(& system_barrier);
+	pthread_barrier_wait(& vm->system_barrier);
 
 	/* execute the boot code */
 	core->bootfunc();
@@ -209,18 +372,22 @@ static void* core_thread(void* _core)
 	}		
 
 	/* Delete the core timer */
-	CHECK(timer_delete(core->timer_id));
+	if(vm->alarm_mode == VM_ALARM_POSIX) {
+		CHECK(timer_delete(core->timer_id));
+	} else
+		__atomic_store_n(& core->alarm_deadline, 0, __ATOMIC_RELAXED);
 
-	pthread_barrier_wait(& core_barrier);
+	pthread_barrier_wait(& vm->core_barrier);
 
 	/* Stop PIC daemon */
 	if(core->id==0) {
-		PIC_active = 0;
-		interrupt_pic_thread();
+		devices_stop_interrupts(vm);
+		vm->PIC_active = 0;
+		interrupt_pic_thread(vm);
 	}
 
 	/* sync with all cores */
-	pthread_barrier_wait(& system_barrier);
+	pthread_barrier_wait(& vm->system_barrier);
 
 	return _core;
 }
@@ -232,7 +399,7 @@ static void* core_thread(void* _core)
 static inline int intr_fetch_set(Core* core, Interrupt intno)
 {
 	uint32_t sel = 1<<intno;
-	uint32_t old = __atomic_fetch_or(& core->intr_pending, sel, __ATOMIC_ACQ_REL);
+	uint32_t old = __atomic_fetch_or(& core->intr_pending, sel, __ATOMIC_SEQ_CST);
 	return (old & sel) != 0;
 }
 
@@ -273,16 +440,46 @@ static inline int intr_fetch_lowest(Core* core, Interrupt* intp)
 }
 
 
+/*
+	Futex helpers
+ */
+static inline long futex(volatile int* uaddr, int op, int val, const struct timespec* timeout)
+{
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+/* Wake up a core sleeping in cpu_core_halt() */
+static inline void wake_core(Core* core)
+{
+	__atomic_store_n(& core->halt_futex, 1, __ATOMIC_SEQ_CST);
+	futex(& core->halt_futex, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+
 /* 
 	Cause the given core to be interrupted in the future.
 	This function does not add a pending interrupt, but
 	causes a signal to be sent to the core.
+
+	With VM_IRQ_FUTEX, a halted core is woken up instead, and nothing
+	is sent to a core with interrupts disabled. This relies on the
+	pending interrupt being set (SEQ_CST) before this call: the core sets
+	'halted' or clears 'intr_off' before checking 'intr_pending', so that either
+	it sees the interrupt, or we see its flag.
  */
 static inline void interrupt_core(Core* core)
 {
+	if(core->vm->irq_delivery == VM_IRQ_FUTEX) {
+		if(__atomic_load_n(& core->halted, __ATOMIC_SEQ_CST)) {
+			wake_core(core);
+			return;
+		}
+		if(__atomic_load_n(core->intr_off, __ATOMIC_SEQ_CST))
+			return;
+	}
+
 	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is to silence valgrind */
-	coreval.sival_int = core->id;	
+	coreval.sival_ptr = core;
 
 	CHECKRC(pthread_sigqueue(core->thread, SIGUSR1, coreval));
 }
@@ -297,11 +494,7 @@ static inline void interrupt_core(Core* core)
 static inline void raise_interrupt(Core* core, Interrupt intno) 
 {
 	if(! intr_fetch_set(core, intno) ) {
-
-#if defined(CORE_STATISTICS)
-		core->irq_raised[intno] ++;
-#endif
-
+		STAT_ADD(core->rstat.irq_raised[intno], 1);
 		interrupt_core(core);
 	}
 }
@@ -323,9 +516,7 @@ static inline void dispatch_interrupts(Core* core)
 		if(! intr_fetch_lowest(core, &irq)) break;
 	
 		assert(0 <= irq  && irq < maximum_interrupt_no);
-#if defined(CORE_STATISTICS)
-		core->irq_delivered[irq]++;
-#endif
+		STAT_ADD(core->stat.irq_delivered[irq], 1);
 		interrupt_handler* handler =  core->intvec[irq];
 		if(handler != NULL) handler();
 	
@@ -342,18 +533,55 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Enable interrupts with VM_IRQ_FUTEX delivery. This is called with
+	interrupts disabled. Dispatch the interrupts that were raised while
+	interrupts were disabled, and clear 'cpu_intr_off'.
+ */
+static void intr_safe_point()
+{
+	while(1) {
+		/* The dispatch may move us to a different core */
+		Core* core = cpu_vm->CORE + cpu_core_id_now();
+
+		if(__atomic_load_n(& core->intr_pending, __ATOMIC_SEQ_CST)) {
+			dispatch_interrupts(core);
+			continue;
+		}
+
+		intr_off_swap(0);
+
+		/* Check again, for interrupts that were not signalled. If we
+		   are interrupted here, the handler dispatches them. */
+		if(! __atomic_load_n(& core->intr_pending, __ATOMIC_SEQ_CST))
+			break;
+
+		intr_off_swap(1);
+	}
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
-	Core* core = & CORE[si->si_value.sival_int];
+	/* Interrupts disabled in software, leave them pending */
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX && intr_off_swap(1))
+		return;
 
-#if defined(CORE_STATISTICS)
-	core->irq_count++;
-#endif
+	Core* core = si->si_value.sival_ptr;
+
+	STAT_ADD(core->stat.irq_count, 1);
 
 	dispatch_interrupts(core);
+
+	/* 
+		We return to a context with interrupts enabled (possibly on 
+		another core, if the interrupted thread was scheduled).
+	 */
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX)
+		intr_safe_point();
 }
 
 
@@ -362,15 +590,233 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
  */
 
 
-/* Coarse clock */
+/* Coarse monotonic clock, for timeouts and statistics */
 static TimerDuration get_coarse_time()
 {
 	struct timespec curtime;
-	CHECK(clock_gettime(CLOCK_REALTIME_COARSE, &curtime));
+	CHECK(clock_gettime(CLOCK_MONOTONIC_COARSE, &curtime));
 	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
 }
 
 
+/*
+	Fine monotonic clock, in nsec.
+
+	The TSC fast path is used if requested by the VM configuration and the
+	TSC is invariant. The TSC is calibrated against CLOCK_MONOTONIC once, on
+	the first vm_run() that uses it: then,
+
+	     nsec = tsc_base_ns + ((tsc - tsc_base) * tsc_mult) >> 32
+ */
+static pthread_once_t tsc_control = PTHREAD_ONCE_INIT;
+static int tsc_calibrated = 0;
+static uint64_t tsc_base, tsc_base_ns, tsc_mult;
+
+static inline uint64_t get_monotonic_ns()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec + curtime.tv_sec*1000000000ull;
+}
+
+#if defined(__x86_64__)
+
+static int tsc_invariant()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if(! __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return 0;
+	return (edx & (1u<<8)) != 0;
+}
+
+static int tsc_calibrate()
+{
+	if(! tsc_invariant()) return 0;
+
+	/* Measure over 20 msec */
+	uint64_t ns0 = get_monotonic_ns();
+	uint64_t c0 = __rdtsc();
+	struct timespec delay = { .tv_sec=0, .tv_nsec=20000000l };
+	while(nanosleep(&delay, &delay)==-1 && errno==EINTR);
+	uint64_t ns1 = get_monotonic_ns();
+	uint64_t c1 = __rdtsc();
+
+	if(c1 <= c0) return 0;
+	tsc_mult = ((ns1-ns0) << 32) / (c1-c0);
+	tsc_base = c1;
+	tsc_base_ns = ns1;
+	return 1;
+}
+
+static inline uint64_t get_fine_ns(vm_instance* vm)
+{
+	if(vm->tsc_clock)
+		return tsc_base_ns + (uint64_t)(((unsigned __int128)(__rdtsc() - tsc_base) * tsc_mult) >> 32);
+	return get_monotonic_ns();
+}
+
+#else
+
+static int tsc_calibrate() { return 0; }
+static inline uint64_t get_fine_ns(vm_instance* vm) { return get_monotonic_ns(); }
+
+#endif
+
+static void tsc_initialize()
+{
+	tsc_calibrated = tsc_calibrate() ? 1 : -1;
+}
+
+
+
+/*
+	Host topology.
+
+	The CPUs the process may run on (when the first VM starts), with their
+	physical core and NUMA node, as reported by sysfs. If sysfs is not 
+	available, each CPU is taken to be a physical core of node 0.
+
+	The automatic layout (VM_AFFINITY_AUTO) orders the CPUs by SMT index
+	first, i.e., the first thread of every physical core comes before any
+	second thread, and then by node, package and core.
+ */
+typedef struct host_cpu {
+	int cpu;
+	int package, core, node;
+	int smt;				/* the index of the CPU among its siblings */
+} host_cpu;
+
+static host_cpu HOST_CPU[CPU_SETSIZE];
+static uint host_ncpus;
+
+/* The host CPUs, in the order of the automatic layout */
+static int auto_layout[CPU_SETSIZE];
+
+
+static int sysfs_cpu_value(int cpu, const char* attr, int defval)
+{
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, attr);
+	FILE* f = fopen(path, "r");
+	if(f == NULL) return defval;
+	int val;
+	if(fscanf(f, "%d", &val) != 1) val = defval;
+	fclose(f);
+	return val;
+}
+
+static int sysfs_cpu_node(int cpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir = opendir(path);
+	if(dir == NULL) return 0;
+	int node = 0;
+	struct dirent* ent;
+	while((ent = readdir(dir)) != NULL)
+		if(sscanf(ent->d_name, "node%d", &node) == 1) break;
+	closedir(dir);
+	return node;
+}
+
+static int host_cpu_order(const void* _a, const void* _b)
+{
+	const host_cpu* a = _a;
+	const host_cpu* b = _b;
+	if(a->smt != b->smt) return a->smt - b->smt;
+	if(a->node != b->node) return a->node - b->node;
+	if(a->package != b->package) return a->package - b->package;
+	if(a->core != b->core) return a->core - b->core;
+	return a->cpu - b->cpu;
+}
+
+static void host_topology_init()
+{
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		CPU_ZERO(&allowed);
+		for(int cpu=0; cpu<get_nprocs() && cpu<CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &allowed);
+	}
+
+	host_ncpus = 0;
+	physical_cores = 0;
+	for(int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if(! CPU_ISSET(cpu, &allowed)) continue;
+		host_cpu* h = & HOST_CPU[host_ncpus++];
+		h->cpu = cpu;
+		h->package = sysfs_cpu_value(cpu, "physical_package_id", 0);
+		h->core = sysfs_cpu_value(cpu, "core_id", cpu);
+		h->node = sysfs_cpu_node(cpu);
+		h->smt = 0;
+		for(host_cpu* g = HOST_CPU; g != h; g++)
+			if(g->package == h->package && g->core == h->core)
+				h->smt++;
+		if(h->smt == 0) physical_cores++;
+	}
+
+	host_cpu order[CPU_SETSIZE];
+	memcpy(order, HOST_CPU, host_ncpus*sizeof(host_cpu));
+	qsort(order, host_ncpus, sizeof(host_cpu), host_cpu_order);
+	for(uint i=0; i<host_ncpus; i++)
+		auto_layout[i] = order[i].cpu;
+}
+
+/* Return the physical core of a host CPU, as an index of HOST_CPU */
+static int host_physical_core(int cpu)
+{
+	for(uint i=0; i<host_ncpus; i++)
+		if(HOST_CPU[i].cpu == cpu) {
+			/* The first sibling comes first in HOST_CPU */
+			for(uint j=0; j<=i; j++)
+				if(HOST_CPU[j].package == HOST_CPU[i].package && HOST_CPU[j].core == HOST_CPU[i].core)
+					return j;
+		}
+	return -1;
+}
+
+
+/*
+	Place the cores of the VM on host CPUs, and compute the number of cores
+	restarted by cpu_core_restart_one(): the cores up to the first one which
+	shares a physical core with a lower one.
+ */
+static void vm_layout(vm_instance* vm, vm_config* vmc)
+{
+	for(uint c=0; c<vm->ncores; c++) {
+		int cpu = -1;
+		switch(vmc->affinity) {
+			case VM_AFFINITY_NONE:
+				break;
+			case VM_AFFINITY_LIST:
+				cpu = vmc->core_cpu[c];
+				CHECK_CONDITION(cpu >= 0 && cpu < CPU_SETSIZE);
+				break;
+			case VM_AFFINITY_AUTO:
+				cpu = auto_layout[c % host_ncpus];
+				break;
+		}
+		vm->CORE[c].host_cpu = cpu;
+	}
+
+	if(vmc->affinity == VM_AFFINITY_NONE) {
+		vm->restart_cores = (vm->ncores < physical_cores) ? vm->ncores : physical_cores;
+		return;
+	}
+
+	uint c;
+	for(c=0; c<vm->ncores; c++) {
+		int pc = host_physical_core(vm->CORE[c].host_cpu);
+		uint d;
+		for(d=0; d<c; d++)
+			if(vm->CORE[d].host_cpu == vm->CORE[c].host_cpu 
+				|| (pc != -1 && host_physical_core(vm->CORE[d].host_cpu) == pc))
+				break;
+		if(d < c) break;
+	}
+	vm->restart_cores = c;
+}
+
+
 
 /*
 	An io_device handles a file descriptor that is connected to some
@@ -388,6 +834,10 @@ static TimerDuration get_coarse_time()
 
 	An io_device is ready if I/O operations may succeed (as reported by select()).
 
+	An io_device of a loopback terminal has no fd (it is -1). Its transfers
+	call the producer or consumer of the terminal's backend, and it is 
+	always ready, until its input ends.
+
 	A not-ready device is made ready when select() returns it as such.
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
@@ -406,14 +856,27 @@ typedef enum io_direction
 /*
 	An io_device is a file descriptor from which we either read or write bytes.
  */
+/* Size of the receive buffer of a device */
+#define IO_BUFFER_SIZE 4096
+
 typedef struct io_device
 {
-	int fd;              		/* file descriptor */
+	int fd;              		/* file descriptor, -1 for loopback */
 	io_direction iodir;  		/* device direction */
+	const vm_loopback* loop;	/* the backend of a loopback device */
+	uint serial;				/* the serial port of the device */
 
 	Core* volatile int_core;	/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
+	volatile int recheck;		/* set when the device becomes not ready */
 	TimerDuration last_int;	    /* used by PIC for timeouts */
+	volatile int queued;		/* served by the serial I/O thread, through
+								   its device queue, and not by the PIC */
+
+	/* Receive buffer (RX devices), filled by bulk reads */
+	char lock;					/* spinlock, held with interrupts disabled */
+	uint rx_head, rx_count;		/* unread bytes are rx_buf[rx_head .. rx_head+rx_count) */
+	char rx_buf[IO_BUFFER_SIZE];
 } io_device;
 
 
@@ -430,35 +893,27 @@ static int io_device_ready(int fd, io_direction dir) {
 }
 
 
-/*
-	Check that the a device is connected and in a good state.
- */
-static int io_device_check(io_device* dev)
-{
-	struct pollfd fds = { .fd=dev->fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	rc = (fds.revents & (POLLHUP|POLLERR))==0;
-	assert(rc);
-	return rc;
-}
-
-
-
 /*
 	Initialize device
  */
-static void io_device_init(io_device* this, int fd, io_direction iodir)
+static void io_device_init(io_device* this, Core* int_core, uint serial, int fd, 
+	io_direction iodir, const vm_loopback* loop)
 {
+	this->serial = serial;
 	this->fd = fd;
 	this->iodir = iodir;
-	this->int_core = &CORE[0];
-	this->ready = io_device_ready(fd, iodir);
+	this->loop = loop;
+	this->int_core = int_core;
+	this->ready = (fd == -1) ? 1 : io_device_ready(fd, iodir);
+	this->recheck = 0;
 	this->last_int = get_coarse_time();
+	this->queued = 0;
+	this->lock = 0;
+	this->rx_head = this->rx_count = 0;
 
 	/* Set file descriptor to non-blocking */
-	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
+	if(fd != -1)
+		CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
 }
 
 /*
@@ -466,6 +921,7 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
  */
 static int io_device_destroy(io_device* this)
 {
+	if(this->fd == -1) return 0;
 	int rc;
 	while((rc = close(this->fd))==-1 && errno==EINTR);
 	if(rc==-1) perror("io_device_destroy: ");
@@ -473,42 +929,143 @@ static int io_device_destroy(io_device* this)
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Mark the device not ready, after a failed transfer. The PIC will raise
+	an interrupt when it becomes ready.
+ */
+static void io_device_not_ready(io_device* this)
+{
+	if(this->ready) {
+		this->ready = 0;
+		this->recheck = 1;
+		interrupt_pic_thread(((Core*) this->int_core)->vm);
+	}
+}
+
+
+/*
+	The receive buffer is locked with interrupts disabled, since an 
+	interrupt may switch the core to a thread that reads the same device.
+ */
+static inline int io_device_lock(io_device* this)
+{
+	int intr = cpu_disable_interrupts();
+	while(__atomic_test_and_set(&this->lock, __ATOMIC_ACQUIRE)) {
+#if defined(__x86__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+	return intr;
+}
+
+static inline void io_device_unlock(io_device* this, int intr)
+{
+	__atomic_clear(&this->lock, __ATOMIC_RELEASE);
+	if(intr) cpu_enable_interrupts();
+}
+
+
+/* Call the producer of a loopback device */
+static inline uint loopback_produce(const vm_loopback* loop, char* buf, uint size)
+{
+	return (loop->produce == NULL) ? 0 : loop->produce(loop->producer_arg, buf, size);
+}
+
+/* Call the consumer of a loopback device */
+static inline void loopback_consume(const vm_loopback* loop, const char* buf, uint size)
+{
+	if(loop->consume != NULL) loop->consume(loop->consumer_arg, buf, size);
+}
+
+
+/*
+	Read up to size bytes. The receive buffer is refilled with one read()
+	at a time. Large requests are read directly into ptr.
+ */
+static int io_device_read(io_device* this, char* ptr, uint size)
 {
 	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
 
-	int ok = rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
-	if(!ok) perror("io_device_read:");
-	assert(ok);
+	uint count = 0;
+	int drained = 0;	/* a short read has (probably) drained the fd */
+	int intr = io_device_lock(this);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
+	while(count < size) {
+
+		if(this->rx_count == 0) {
+			if(drained) break;
+
+			uint remain = size - count;
+			int direct = remain >= IO_BUFFER_SIZE;
+			uint want = direct ? remain : IO_BUFFER_SIZE;
+			char* dst = direct ? ptr+count : this->rx_buf;
+
+			int rc;
+			if(this->fd == -1)
+				rc = loopback_produce(this->loop, dst, want);
+			else
+				while((rc=read(this->fd, dst, want))==-1 && errno == EINTR);
+
+			int ok = rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
+			if(!ok) perror("io_device_read:");
+			assert(ok);
+
+			if(rc<=0) {
+				io_device_not_ready(this);
+				break;
+			}
+
+			drained = (uint)rc < want;
+			if(direct) {
+				count += rc;
+				continue;
+			}
+			this->rx_head = 0;
+			this->rx_count = rc;
+		}
+
+		uint n = size - count;
+		if(n > this->rx_count) n = this->rx_count;
+		memcpy(ptr+count, this->rx_buf + this->rx_head, n);
+		this->rx_head += n;
+		this->rx_count -= n;
+		count += n;
 	}
-	return rc==1;
+
+	io_device_unlock(this, intr);
+	return count;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Write up to size bytes, with a single write().
+ */
+static int io_device_write(io_device* this, const char* ptr, uint size)
 {
 	assert(this->iodir == IODIR_TX);
 
+	if(this->fd == -1) {
+		/* The consumer is not re-entrant */
+		int intr = io_device_lock(this);
+		loopback_consume(this->loop, ptr, size);
+		io_device_unlock(this, intr);
+		return size;
+	}
+
 	/* Try to write */
 	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	while((rc = write(this->fd, ptr, size))==-1 && errno == EINTR);
 
-	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
+	int ok = rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
 	if(! ok) perror("io_device_write:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	} 
+	if(rc<=0 && size>0) {
+		io_device_not_ready(this);
+		return 0;
+	}
 
-	return rc==1;
+	return rc;
 }
 
 
@@ -521,21 +1078,19 @@ static int io_device_write(io_device* this, char value)
 typedef struct terminal
 {
 	io_device con, kbd;            /* fds for terminal fifos */
+	vm_loopback loop;              /* the backend of a loopback terminal */
 } terminal;
 
-/* The terminal table */
-static terminal TERM[MAX_TERMINALS];
-
-/* Current number of terminals */
-static uint nterm = 0;
-
 /*
-	Init the devices for this terminal
+	Init the devices for this terminal. If both fds are -1, it is a
+	loopback terminal.
  */
-static void terminal_init(terminal* this, int fdin, int fdout)
+static void terminal_init(terminal* this, Core* int_core, uint serial, int fdin, int fdout, 
+	const vm_loopback* loop)
 {
-	io_device_init(& this->kbd, fdin, IODIR_RX);
-	io_device_init(& this->con, fdout, IODIR_TX);
+	this->loop = *loop;
+	io_device_init(& this->kbd, int_core, serial, fdin, IODIR_RX, & this->loop);
+	io_device_init(& this->con, int_core, serial, fdout, IODIR_TX, & this->loop);
 }
 
 /*
@@ -549,45 +1104,900 @@ static int terminal_destroy(terminal* this)
 
 
 
+/*
+	A virtqueue is a ring of descriptors, shared between the cores and the
+	I/O thread of a device. Descriptors complete in the order they were 
+	posted, so a single ring suffices:
+	- ring[head .. head+used) are completed, to be collected by the cores,
+	- ring[head+used .. head+count) are available to the device.
+
+	The queue is protected by the lock of its device, which the cores 
+	hold with interrupts disabled.
+ */
+struct virtqueue
+{
+	pthread_mutex_t* lock;		/* the lock of the device */
+	int kick_fd;				/* eventfd, written to wake up the I/O thread */
+	uint head, used, count;
+	uint offset;				/* bytes transferred from the first available 
+								   descriptor, for partial transfers */
+	vq_desc* ring[VQ_SIZE];
+};
+
+static void vq_init(virtqueue* vq, pthread_mutex_t* lock, int kick_fd)
+{
+	vq->lock = lock;
+	vq->kick_fd = kick_fd;
+	vq->head = vq->used = vq->count = vq->offset = 0;
+}
 
+/* The number of descriptors available to the device */
+static inline uint vq_available(virtqueue* vq)
+{
+	return vq->count - vq->used;
+}
 
-/*
-	The PIC daemon dispatches interrupts to core threads,
-	by calling raise_interrupt().
+/* The i-th available descriptor */
+static inline vq_desc* vq_peek(virtqueue* vq, uint i)
+{
+	return vq->ring[(vq->head + vq->used + i) % VQ_SIZE];
+}
 
-	Interrupts sent include
-	(a) ALARM, when the core timer expires
-	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
-		io_device becomes ready.
+/* Complete the first n available descriptors */
+static inline void vq_complete(virtqueue* vq, uint n)
+{
+	vq->used += n;
+}
 
-	Implementation:
-	- Use Linux signal file descriptors to receive signals. Currently,
-	  two signals are used:
-	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
 
-	  * SIGALRM is sent to indicate that some core timer has expired. This
-	    results to an interrupt on the core.
 
-	- Monitor these fds together with the fds of the terminals.
-	
-	- At each loop dispatch interrupts as needed:
-	  * ALARM interrupts to those cores whose timer has expired
-	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
-	    an io_device which is now READY.		
- */
 
+/*
+	The serial I/O thread serves the device queues of all terminals.
+	It polls the fds of the queues which have available descriptors, and
+	transfers data with one readv()/writev() per ready queue.
+ */
+_Static_assert(MAX_TERMINALS <= 32, "the pending mask of the terminals is a uint");
 
+typedef struct serial_device
+{
+	pthread_mutex_t lock;
+	int evfd;					/* wakes up the thread */
+	volatile int stop;
+	int quiet;					/* do not raise interrupts, at shutdown */
+	int rx_eof[MAX_TERMINALS];	/* the keyboard was closed */
+	_Atomic uint rx_pending;	/* terminals which raised SERIAL_RX_READY */
 
-/******************************
+	virtqueue rxq[MAX_TERMINALS], txq[MAX_TERMINALS];
 
-	Helpers for signal fds
+	terminal* term;				/* the terminals of the VM */
+	uint nterm;
 
- ******************************/
+	pthread_t thread;
+} serial_device;
 
 
-static inline int read_signalfd(int sfd, struct signalfd_siginfo* sfdinfo)
+/* Raise SERIAL_RX_READY for a terminal, marking it pending */
+static inline void serial_raise_rx(serial_device* this, uint t)
+{
+	__atomic_fetch_or(& this->rx_pending, 1u<<t, __ATOMIC_SEQ_CST);
+	raise_interrupt((Core*) this->term[t].kbd.int_core, SERIAL_RX_READY);
+}
+
+
+/* Fill the available buffers of a receive queue. Called with the lock held. */
+static void serial_receive(serial_device* this, uint t)
+{
+	virtqueue* vq = & this->rxq[t];
+	uint n = vq_available(vq);
+	struct iovec iov[VQ_SIZE];
+	for(uint i=0; i<n; i++) {
+		vq_desc* d = vq_peek(vq, i);
+		iov[i] = (struct iovec){ d->buf, d->len };
+	}
+
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	ssize_t rc;
+	if(this->term[t].kbd.fd == -1) {
+		/* Fill the buffers in turn, until the producer falls short */
+		rc = 0;
+		for(uint i=0; i<n; i++) {
+			uint got = loopback_produce(& this->term[t].loop, iov[i].iov_base, iov[i].iov_len);
+			rc += got;
+			if(got < iov[i].iov_len) break;
+		}
+	}
+	else
+		while((rc = readv(this->term[t].kbd.fd, iov, n))==-1 && errno==EINTR);
+	CHECKRC(pthread_mutex_lock(& this->lock));
+
+	if(rc == 0) {
+		this->rx_eof[t] = 1;
+		return;
+	}
+	if(rc == -1) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("serial_receive: ");
+			this->rx_eof[t] = 1;
+		}
+		return;
+	}
+
+	/* Complete the buffers that were filled, even partially */
+	uint done = 0;
+	while(rc > 0) {
+		vq_desc* d = vq_peek(vq, done++);
+		d->used = ((size_t)rc < d->len) ? (uint)rc : d->len;
+		d->status = 0;
+		rc -= d->used;
+	}
+	vq_complete(vq, done);
+	if(! this->quiet)
+		serial_raise_rx(this, t);
+}
+
+
+/* Drain the available buffers of a transmit queue. Called with the lock held. */
+static void serial_transmit(serial_device* this, uint t)
+{
+	virtqueue* vq = & this->txq[t];
+	uint n = vq_available(vq);
+	struct iovec iov[VQ_SIZE];
+	for(uint i=0; i<n; i++) {
+		vq_desc* d = vq_peek(vq, i);
+		iov[i] = (struct iovec){ d->buf, d->len };
+	}
+	iov[0].iov_base = (char*)iov[0].iov_base + vq->offset;
+	iov[0].iov_len -= vq->offset;
+
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	ssize_t rc;
+	if(this->term[t].con.fd == -1) {
+		rc = 0;
+		for(uint i=0; i<n; i++) {
+			loopback_consume(& this->term[t].loop, iov[i].iov_base, iov[i].iov_len);
+			rc += iov[i].iov_len;
+		}
+	}
+	else
+		while((rc = writev(this->term[t].con.fd, iov, n))==-1 && errno==EINTR);
+	CHECKRC(pthread_mutex_lock(& this->lock));
+
+	uint done = 0;
+	if(rc == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+
+		/* Fail the first buffer */
+		vq_desc* d = vq_peek(vq, done++);
+		d->used = vq->offset;
+		d->status = -1;
+		vq->offset = 0;
+	}
+	else {
+		/* Complete the buffers that were sent entirely */
+		size_t sent = vq->offset + rc;
+		while(done < n && sent >= vq_peek(vq, done)->len) {
+			vq_desc* d = vq_peek(vq, done++);
+			d->used = d->len;
+			d->status = 0;
+			sent -= d->len;
+		}
+		vq->offset = sent;
+	}
+
+	if(done == 0) return;
+	vq_complete(vq, done);
+	if(! this->quiet)
+		raise_interrupt((Core*) this->term[t].con.int_core, SERIAL_TX_READY);
+}
+
+
+static void* serial_thread(void* arg)
+{
+	serial_device* this = arg;
+	struct pollfd pfd[2*MAX_TERMINALS+1];
+	uint qid[2*MAX_TERMINALS+1];
+
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	while(! this->stop) {
+
+		/* Serve the loopback terminals, which are always ready, until their
+		   queues are drained. Buffers posted while we serve a queue do not
+		   kick us, since the queue is not empty. */
+		int again;
+		do {
+			again = 0;
+			for(uint t=0; t<this->nterm; t++) {
+				if(this->term[t].kbd.fd != -1) continue;
+				if(vq_available(& this->rxq[t]) && ! this->rx_eof[t]) {
+					serial_receive(this, t);
+					again = 1;
+				}
+				if(vq_available(& this->txq[t])) {
+					serial_transmit(this, t);
+					again = 1;
+				}
+			}
+		} while(again && ! this->stop);
+
+		/* Poll the queues which have available buffers */
+		uint n = 0;
+		pfd[n++] = (struct pollfd){ .fd = this->evfd, .events = POLLIN };
+		for(uint t=0; t<this->nterm; t++) {
+			if(this->term[t].kbd.fd == -1) continue;
+			if(vq_available(& this->rxq[t]) && ! this->rx_eof[t]) {
+				qid[n] = 2*t;
+				pfd[n++] = (struct pollfd){ .fd = this->term[t].kbd.fd, .events = POLLIN };
+			}
+			if(vq_available(& this->txq[t])) {
+				qid[n] = 2*t+1;
+				pfd[n++] = (struct pollfd){ .fd = this->term[t].con.fd, .events = POLLOUT };
+			}
+		}
+
+		CHECKRC(pthread_mutex_unlock(& this->lock));
+		int rc;
+		while((rc = poll(pfd, n, -1))==-1 && errno==EINTR);
+		CHECK(rc);
+		if(pfd[0].revents & POLLIN) {
+			uint64_t count;
+			while(read(this->evfd, &count, sizeof(count))==-1 && errno==EINTR);
+		}
+		CHECKRC(pthread_mutex_lock(& this->lock));
+
+		for(uint i=1; i<n; i++) {
+			if(pfd[i].revents == 0) continue;
+			uint t = qid[i]/2;
+			if(qid[i] % 2 == 0) {
+				if(pfd[i].revents & POLLIN)
+					serial_receive(this, t);
+				else
+					this->rx_eof[t] = 1;		/* POLLHUP or POLLERR */
+			}
+			else
+				serial_transmit(this, t);
+		}
+	}
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	return NULL;
+}
+
+
+static void serial_init(serial_device* this, terminal* term, uint nterm)
+{
+	this->term = term;
+	this->nterm = nterm;
+	CHECKRC(pthread_mutex_init(& this->lock, NULL));
+	this->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	CHECK(this->evfd);
+	this->stop = 0;
+	this->quiet = 0;
+	this->rx_pending = 0;
+	for(uint t=0; t<MAX_TERMINALS; t++) {
+		this->rx_eof[t] = 0;
+		vq_init(& this->rxq[t], & this->lock, this->evfd);
+		vq_init(& this->txq[t], & this->lock, this->evfd);
+	}
+
+	/* The thread must not receive any signals */
+	sigset_t all, saved;
+	CHECK(sigfillset(&all));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &all, &saved));
+	CHECKRC(pthread_create(& this->thread, NULL, serial_thread, this));
+	CHECKRC(pthread_setname_np(this->thread, "serial-io"));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved, NULL));
+}
+
+
+static void serial_destroy(serial_device* this)
+{
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	this->stop = 1;
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	uint64_t one = 1;
+	CHECK(write(this->evfd, &one, sizeof(one)));
+	CHECKRC(pthread_join(this->thread, NULL));
+
+	CHECK(close(this->evfd));
+	CHECKRC(pthread_mutex_destroy(& this->lock));
+}
+
+
+
+
+/*
+	A disk_device is a file of the host, accessed by a pool of worker 
+	threads with pread()/pwrite(). A RAM disk has no workers: its requests
+	are copied to/from memory by the submitting core, and complete at once.
+
+	Requests submitted by the cores are queued in the submission queue 'sq'.
+	A worker takes a request, performs it and appends it to the completion 
+	queue 'cq', raising DISK_COMPLETE. The number of incomplete requests 
+	('inflight', submitted and not collected) is at most DISK_QUEUE_SIZE, so 
+	neither queue can overflow.
+
+	The cores lock the disk with interrupts disabled, since the interrupt
+	handler may call the disk API.
+ */
+
+/* Number of worker threads per disk */
+#define DISK_WORKERS 4
+
+typedef struct disk_device
+{
+	int fd;
+	char* mem;						/* the memory of a RAM disk, or NULL */
+	uint64_t memsize;
+	uint64_t nsectors;
+	Core* volatile int_core;		/* core to receive interrupts, NULL at shutdown */
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;			/* signalled when sq is not empty */
+	int stop;						/* workers should exit */
+	uint inflight;
+
+	disk_request* sq[DISK_QUEUE_SIZE];
+	uint sq_head, sq_count;
+	disk_request* cq[DISK_QUEUE_SIZE];
+	uint cq_head, cq_count;
+
+	pthread_t worker[DISK_WORKERS];
+} disk_device;
+
+
+
+/* Perform a request, return its status */
+static int disk_transfer(disk_device* this, disk_request* req)
+{
+	if(req->sector > this->nsectors || req->nsectors > this->nsectors - req->sector)
+		return -1;
+
+	char* buf = req->buf;
+	size_t size = (size_t)req->nsectors * DISK_SECTOR_SIZE;
+	off_t off = (off_t)req->sector * DISK_SECTOR_SIZE;
+
+	if(this->mem != NULL) {
+		if(req->write) memcpy(this->mem + off, buf, size);
+		else memcpy(buf, this->mem + off, size);
+		return 0;
+	}
+
+	while(size > 0) {
+		ssize_t rc = req->write ? pwrite(this->fd, buf, size, off)
+		                        : pread(this->fd, buf, size, off);
+		if(rc == -1 && errno == EINTR) continue;
+		if(rc <= 0) return -1;
+		buf += rc;  off += rc;  size -= rc;
+	}
+	return 0;
+}
+
+
+/* Append a request to the completion queue and raise the interrupt.
+   Called with the lock held. */
+static void disk_complete(disk_device* this, disk_request* req, int status)
+{
+	req->status = status;
+	this->cq[(this->cq_head + this->cq_count++) % DISK_QUEUE_SIZE] = req;
+	if(this->int_core)
+		raise_interrupt(this->int_core, DISK_COMPLETE);
+}
+
+
+static void* disk_worker(void* arg)
+{
+	disk_device* this = arg;
+
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	while(1) {
+		while(!this->stop && this->sq_count == 0)
+			CHECKRC(pthread_cond_wait(& this->work, & this->lock));
+		if(this->sq_count == 0) break;
+
+		disk_request* req = this->sq[this->sq_head];
+		this->sq_head = (this->sq_head + 1) % DISK_QUEUE_SIZE;
+		this->sq_count--;
+		CHECKRC(pthread_mutex_unlock(& this->lock));
+
+		int status = disk_transfer(this, req);
+
+		CHECKRC(pthread_mutex_lock(& this->lock));
+		disk_complete(this, req, status);
+	}
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	return NULL;
+}
+
+
+static void disk_init(disk_device* this, Core* int_core, uint no, int fd, void* mem, uint64_t memsize)
+{
+	this->fd = fd;
+	this->mem = mem;
+	this->memsize = memsize;
+	if(mem != NULL)
+		this->nsectors = memsize / DISK_SECTOR_SIZE;
+	else {
+		struct stat st;
+		CHECK(fstat(fd, &st));
+		this->nsectors = st.st_size / DISK_SECTOR_SIZE;
+	}
+	this->int_core = int_core;
+
+	CHECKRC(pthread_mutex_init(& this->lock, NULL));
+	CHECKRC(pthread_cond_init(& this->work, NULL));
+	this->stop = 0;
+	this->inflight = 0;
+	this->sq_head = this->sq_count = 0;
+	this->cq_head = this->cq_count = 0;
+	if(mem != NULL) return;
+
+	/* The workers must not receive any signals */
+	sigset_t all, saved;
+	CHECK(sigfillset(&all));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &all, &saved));
+	for(uint w=0; w<DISK_WORKERS; w++) {
+		CHECKRC(pthread_create(& this->worker[w], NULL, disk_worker, this));
+		char thread_name[16];
+		CHECK(snprintf(thread_name,16,"disk-%u.%u", no, w));
+		CHECKRC(pthread_setname_np(this->worker[w], thread_name));
+	}
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved, NULL));
+}
+
+
+static int disk_destroy(disk_device* this)
+{
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	this->stop = 1;
+	CHECKRC(pthread_cond_broadcast(& this->work));
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	if(this->mem == NULL)
+		for(uint w=0; w<DISK_WORKERS; w++)
+			CHECKRC(pthread_join(this->worker[w], NULL));
+
+	CHECKRC(pthread_cond_destroy(& this->work));
+	CHECKRC(pthread_mutex_destroy(& this->lock));
+
+	if(this->mem != NULL) {
+		int rc = munmap(this->mem, this->memsize);
+		if(rc==-1) perror("disk_destroy: ");
+		return rc;
+	}
+
+	int rc;
+	while((rc = close(this->fd))==-1 && errno==EINTR);
+	if(rc==-1) perror("disk_destroy: ");
+	return rc;
+}
+
+
+static inline int disk_lock(disk_device* this)
+{
+	int intr = cpu_disable_interrupts();
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	return intr;
+}
+
+static inline void disk_unlock(disk_device* this, int intr)
+{
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	if(intr) cpu_enable_interrupts();
+}
+
+
+
+/*
+	The nic_device is served by two threads of the host.
+
+	The transmit thread takes packets from the transmit queue 'txq' and 
+	sends them over a connection to the destination node. Connections are
+	made on demand, by connecting to the node's listening socket, and are
+	used only for sending. Each message carries the sender's node id,
+	followed by the packet.
+
+	The receive thread accepts connections on the listening socket and
+	polls them (via epoll). Packets are received into the buffers posted
+	in the receive queue 'rxq'. While no buffers are posted, the receive 
+	thread does not read the connections.
+
+	Completed descriptors are appended to 'txc' and 'rxc', raising 
+	NIC_TX_COMPLETE and NIC_RX_COMPLETE. As with disks, the number of 
+	incomplete descriptors of each direction is at most NIC_RING_SIZE, 
+	so no queue can overflow.
+ */
+
+/* A ring of descriptors */
+typedef struct nic_ring {
+	nic_packet* pkt[NIC_RING_SIZE];
+	uint head, count;
+} nic_ring;
+
+static inline void nic_ring_push(nic_ring* r, nic_packet* p)
+{
+	r->pkt[(r->head + r->count++) % NIC_RING_SIZE] = p;
+}
+
+static inline nic_packet* nic_ring_pop(nic_ring* r)
+{
+	if(r->count == 0) return NULL;
+	nic_packet* p = r->pkt[r->head];
+	r->head = (r->head + 1) % NIC_RING_SIZE;
+	r->count--;
+	return p;
+}
+
+/* Max. number of incoming connections */
+#define NIC_MAX_INCOMING (2*NIC_MAX_NODES)
+
+typedef struct nic_device
+{
+	int lfd;						/* the listening socket */
+	uint node;
+	char dir[NIC_DIR_MAX];
+	Core* volatile int_core;		/* core to receive interrupts, NULL at shutdown */
+
+	pthread_mutex_t lock;
+	pthread_cond_t tx_work;			/* signalled when txq is not empty */
+	pthread_cond_t rx_work;			/* signalled when rxq is not empty */
+	int stop;						/* threads should exit */
+	uint tx_inflight, rx_inflight;
+
+	nic_ring txq, txc, rxq, rxc;
+
+	/* Used only by the transmit thread */
+	int peer_fd[NIC_MAX_NODES];
+
+	/* Used only by the receive thread */
+	int epfd, evfd;
+	int in_fd[NIC_MAX_INCOMING];
+
+	pthread_t tx_thread, rx_thread;
+} nic_device;
+
+
+/* Fill in the address of a node */
+static int nic_address(struct sockaddr_un* addr, const char* dir, uint node)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/node-%u", dir, node);
+	return (len > 0 && len < sizeof(addr->sun_path)) ? 0 : -1;
+}
+
+
+/* Return a connection to a node, or -1 */
+static int nic_peer(nic_device* this, uint node)
+{
+	if(this->peer_fd[node] != -1) return this->peer_fd[node];
+
+	struct sockaddr_un addr;
+	if(nic_address(&addr, this->dir, node) == -1) return -1;
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(fd == -1) return -1;
+	int rc;
+	while((rc = connect(fd, (struct sockaddr*)&addr, sizeof(addr)))==-1 && errno==EINTR);
+	if(rc == -1) { close(fd); return -1; }
+	return this->peer_fd[node] = fd;
+}
+
+
+/* Send a packet, return its status */
+static int nic_transmit(nic_device* this, nic_packet* pkt)
+{
+	if(pkt->node >= NIC_MAX_NODES || pkt->len > NIC_MTU) return -1;
+
+	uint32_t src = this->node;
+	struct iovec iov[2] = { { &src, sizeof(src) }, { pkt->buf, pkt->len } };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+	/* A stale connection (e.g., the peer has restarted) is retried once */
+	for(int attempt = 0; attempt < 2; attempt++) {
+		int fd = nic_peer(this, pkt->node);
+		if(fd == -1) return -1;
+
+		while(1) {
+			if(sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != -1) return 0;
+			if(errno == EINTR) continue;
+			if(errno != EAGAIN) break;
+
+			/* The peer is not receiving, wait unless we are stopping */
+			if(__atomic_load_n(& this->stop, __ATOMIC_RELAXED)) return -1;
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+			poll(&pfd, 1, 100);
+		}
+
+		close(fd);
+		this->peer_fd[pkt->node] = -1;
+	}
+	return -1;
+}
+
+
+static void nic_tx_complete(nic_device* this, nic_packet* pkt, int status)
+{
+	pkt->status = status;
+	nic_ring_push(& this->txc, pkt);
+	if(this->int_core)
+		raise_interrupt(this->int_core, NIC_TX_COMPLETE);
+}
+
+
+static void* nic_tx_thread(void* arg)
+{
+	nic_device* this = arg;
+
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	while(1) {
+		while(!this->stop && this->txq.count == 0)
+			CHECKRC(pthread_cond_wait(& this->tx_work, & this->lock));
+		nic_packet* pkt = nic_ring_pop(& this->txq);
+		if(pkt == NULL) break;
+		CHECKRC(pthread_mutex_unlock(& this->lock));
+
+		int status = nic_transmit(this, pkt);
+
+		CHECKRC(pthread_mutex_lock(& this->lock));
+		nic_tx_complete(this, pkt, status);
+	}
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	return NULL;
+}
+
+
+static void nic_add_incoming(nic_device* this, int fd)
+{
+	for(uint i=0; i<NIC_MAX_INCOMING; i++)
+		if(this->in_fd[i] == -1) {
+			struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+			CHECK(epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev));
+			this->in_fd[i] = fd;
+			return;
+		}
+	close(fd);
+}
+
+
+static void nic_drop_incoming(nic_device* this, uint i)
+{
+	CHECK(epoll_ctl(this->epfd, EPOLL_CTL_DEL, this->in_fd[i], NULL));
+	close(this->in_fd[i]);
+	this->in_fd[i] = -1;
+}
+
+
+/* Receive a packet from an incoming connection, if a buffer is posted */
+static void nic_receive(nic_device* this, uint i)
+{
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	nic_packet* pkt = nic_ring_pop(& this->rxq);
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	if(pkt == NULL) return;
+
+	uint32_t src;
+	struct iovec iov[2] = { { &src, sizeof(src) }, { pkt->buf, NIC_MTU } };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	ssize_t rc;
+	while((rc = recvmsg(this->in_fd[i], &msg, MSG_DONTWAIT))==-1 && errno==EINTR);
+
+	int received = rc >= (ssize_t)sizeof(src) && !(msg.msg_flags & MSG_TRUNC);
+	if(rc == 0 || (rc == -1 && errno != EAGAIN))
+		nic_drop_incoming(this, i);
+
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	if(received) {
+		pkt->node = src;
+		pkt->len = rc - sizeof(src);
+		pkt->status = 0;
+		nic_ring_push(& this->rxc, pkt);
+		if(this->int_core)
+			raise_interrupt(this->int_core, NIC_RX_COMPLETE);
+	} else {
+		/* Give the buffer back */
+		this->rxq.head = (this->rxq.head + NIC_RING_SIZE - 1) % NIC_RING_SIZE;
+		this->rxq.pkt[this->rxq.head] = pkt;
+		this->rxq.count++;
+	}
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+}
+
+
+/* epoll data for the listening socket and the eventfd */
+#define NIC_EV_LISTEN  NIC_MAX_INCOMING
+#define NIC_EV_STOP    (NIC_MAX_INCOMING+1)
+
+static void* nic_rx_thread(void* arg)
+{
+	nic_device* this = arg;
+	struct epoll_event events[16];
+
+	while(1) {
+		/* Wait for buffers */
+		CHECKRC(pthread_mutex_lock(& this->lock));
+		while(!this->stop && this->rxq.count == 0)
+			CHECKRC(pthread_cond_wait(& this->rx_work, & this->lock));
+		int stop = this->stop;
+		CHECKRC(pthread_mutex_unlock(& this->lock));
+		if(stop) break;
+
+		int n = epoll_wait(this->epfd, events, 16, -1);
+		if(n == -1) { assert(errno == EINTR); continue; }
+
+		for(int e=0; e<n; e++) {
+			uint i = events[e].data.u32;
+			if(i == NIC_EV_LISTEN) {
+				int fd = accept4(this->lfd, NULL, NULL, SOCK_CLOEXEC);
+				if(fd != -1) nic_add_incoming(this, fd);
+			}
+			else if(i < NIC_MAX_INCOMING && this->in_fd[i] != -1)
+				nic_receive(this, i);
+		}
+	}
+	return NULL;
+}
+
+
+static void nic_init(nic_device* this, Core* int_core, int lfd, uint node, const char* dir)
+{
+	this->lfd = lfd;
+	this->node = node;
+	strcpy(this->dir, dir);
+	this->int_core = int_core;
+
+	CHECKRC(pthread_mutex_init(& this->lock, NULL));
+	CHECKRC(pthread_cond_init(& this->tx_work, NULL));
+	CHECKRC(pthread_cond_init(& this->rx_work, NULL));
+	this->stop = 0;
+	this->tx_inflight = this->rx_inflight = 0;
+	this->txq.head = this->txq.count = 0;
+	this->txc = this->rxq = this->rxc = this->txq;
+
+	for(uint i=0; i<NIC_MAX_NODES; i++) this->peer_fd[i] = -1;
+	for(uint i=0; i<NIC_MAX_INCOMING; i++) this->in_fd[i] = -1;
+
+	this->epfd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(this->epfd);
+	this->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	CHECK(this->evfd);
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = NIC_EV_LISTEN };
+	CHECK(epoll_ctl(this->epfd, EPOLL_CTL_ADD, lfd, &ev));
+	ev.data.u32 = NIC_EV_STOP;
+	CHECK(epoll_ctl(this->epfd, EPOLL_CTL_ADD, this->evfd, &ev));
+
+	/* The threads must not receive any signals */
+	sigset_t all, saved;
+	CHECK(sigfillset(&all));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &all, &saved));
+	CHECKRC(pthread_create(& this->tx_thread, NULL, nic_tx_thread, this));
+	CHECKRC(pthread_setname_np(this->tx_thread, "nic-tx"));
+	CHECKRC(pthread_create(& this->rx_thread, NULL, nic_rx_thread, this));
+	CHECKRC(pthread_setname_np(this->rx_thread, "nic-rx"));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved, NULL));
+}
+
+
+static int nic_destroy(nic_device* this)
+{
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	this->stop = 1;
+	CHECKRC(pthread_cond_signal(& this->tx_work));
+	CHECKRC(pthread_cond_signal(& this->rx_work));
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	uint64_t one = 1;
+	CHECK(write(this->evfd, &one, sizeof(one)));
+	CHECKRC(pthread_join(this->tx_thread, NULL));
+	CHECKRC(pthread_join(this->rx_thread, NULL));
+
+	CHECKRC(pthread_cond_destroy(& this->tx_work));
+	CHECKRC(pthread_cond_destroy(& this->rx_work));
+	CHECKRC(pthread_mutex_destroy(& this->lock));
+
+	for(uint i=0; i<NIC_MAX_NODES; i++) 
+		if(this->peer_fd[i] != -1) close(this->peer_fd[i]);
+	for(uint i=0; i<NIC_MAX_INCOMING; i++) 
+		if(this->in_fd[i] != -1) close(this->in_fd[i]);
+	close(this->evfd);
+	close(this->epfd);
+
+	struct sockaddr_un addr;
+	if(nic_address(&addr, this->dir, this->node) == 0) 
+		unlink(addr.sun_path);
+
+	int rc;
+	while((rc = close(this->lfd))==-1 && errno==EINTR);
+	if(rc==-1) perror("nic_destroy: ");
+	return rc;
+}
+
+
+static inline int nic_lock(nic_device* this)
+{
+	int intr = cpu_disable_interrupts();
+	CHECKRC(pthread_mutex_lock(& this->lock));
+	return intr;
+}
+
+static inline void nic_unlock(nic_device* this, int intr)
+{
+	CHECKRC(pthread_mutex_unlock(& this->lock));
+	if(intr) cpu_enable_interrupts();
+}
+
+
+
+/*
+	Stop the device threads from raising interrupts, since the cores are
+	about to exit. Their work is completed silently.
+ */
+static void devices_stop_interrupts(vm_instance* vm)
+{
+	for(uint i=0; i<vm->ndisk; i++) {
+		CHECKRC(pthread_mutex_lock(& vm->DISK[i].lock));
+		vm->DISK[i].int_core = NULL;
+		CHECKRC(pthread_mutex_unlock(& vm->DISK[i].lock));
+	}
+	if(vm->nic_present) {
+		CHECKRC(pthread_mutex_lock(& vm->NIC->lock));
+		vm->NIC->int_core = NULL;
+		CHECKRC(pthread_mutex_unlock(& vm->NIC->lock));
+	}
+	if(vm->nterm > 0) {
+		CHECKRC(pthread_mutex_lock(& vm->SERIAL->lock));
+		vm->SERIAL->quiet = 1;
+		CHECKRC(pthread_mutex_unlock(& vm->SERIAL->lock));
+	}
+}
+
+
+
+
+
+/*
+	The PIC daemon dispatches interrupts to core threads,
+	by calling raise_interrupt().
+
+	Interrupts sent include
+	(a) ALARM, when the core timer expires
+	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
+		io_device becomes ready.
+
+	Implementation:
+	- An epoll instance monitors the following fds. They are registered
+	  once, when the PIC daemon starts.
+	  * A signalfd for SIGALRM, which is sent to indicate that some core timer
+	    has expired. This results to an interrupt on the core. The timers
+	    of the cores send the signal to the PIC thread of their VM.
+
+	  * With VM_ALARM_PIC, a timerfd set to the earliest core deadline 
+	    (see pic_alarm_scan).
+
+	  * An eventfd (vm->PIC_eventfd), written by an io_device to signify that it
+	    became NOT READY (it also sets its 'recheck' flag). The PIC then 
+	    polls the device, in case it became ready again before it was 
+	    marked not ready. The eventfd also wakes up the PIC to stop.
+
+	  * The fds of the terminals, in edge-triggered mode. An edge on a
+	    device which is NOT READY makes it READY. A device whose queue
+	    is used is served by the serial I/O thread: its fd is removed at
+	    its first event, and it is not checked for timeouts.
+
+	- At each loop dispatch interrupts as needed:
+	  * ALARM interrupts to those cores whose timer (or deadline) has expired
+	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
+	    an io_device which is now READY. 
+	  * SERIAL_RX/TX_READY for devices that have not raised an interrupt
+	    for SERIAL_TIMEOUT (unless they are served by the serial I/O thread).
+ */
+
+
+
+/******************************
+
+	Helpers for signal fds
+
+ ******************************/
+
+
+static inline int read_signalfd(int sfd, struct signalfd_siginfo* sfdinfo)
 {
 	int rc = read(sfd, sfdinfo, sizeof(struct signalfd_siginfo));
 
@@ -621,98 +2031,123 @@ static void close_signalfd(int sfd)
 
 /********************************
 
-	PIC loop state and helpers
+	PIC loop helpers
 
  ********************************/
 
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
 
+/* Maximum number of events returned by epoll_wait() */
+#define PIC_EVENTS (2*MAX_TERMINALS+3)
 
-static void pic_selector_reset(pic_selector* ps)
+static void pic_add_fd(int epfd, int fd, uint32_t events, void* ptr)
 {
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
+	struct epoll_event ev = { .events = events, .data.ptr = ptr };
+	CHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev));
 }
 
 
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
+static inline void pic_add_io_device(int epfd, io_device* dev)
 {
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
+	if(dev->fd == -1) return;
+	uint32_t evt = (dev->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT;
+	pic_add_fd(epfd, dev->fd, evt | EPOLLET, dev);
 }
 
 
-
-static int pic_select(pic_selector* ps)
+/* Mark a device ready and raise its interrupt */
+static void term_dev_raise(io_device* dev, TimerDuration now)
 {
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
+	dev->ready = 1;
+	dev->last_int = now;
+	Core* core = (Core*) dev->int_core;
+	switch(dev->iodir) {
+		case IODIR_RX:
+			serial_raise_rx(core->vm->SERIAL, dev->serial); break;
+		case IODIR_TX:
+			raise_interrupt(core, SERIAL_TX_READY); break;
 	}
-	return selcode;
 }
 
 
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
+/* Handle an epoll event for a device */
+static void term_dev_event(int epfd, io_device* dev, uint32_t events, TimerDuration now)
 {
-	return FD_ISSET(fd, & ps->fds[dir]);
+	if((events & (EPOLLERR|EPOLLHUP)) || dev->queued) {
+		/* The device is disconnected, or served by its queue; stop monitoring it */
+		epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+		return;
+	}
+	if(! dev->ready) term_dev_raise(dev, now);
 }
 
 
+/*
+	With VM_ALARM_PIC, raise ALARM on the cores whose deadline has passed,
+	and set the timerfd to the earliest remaining deadline.
 
+	Deadlines are kept in CLOCK_MONOTONIC time (not the fine clock, which
+	may be the TSC), since they are given to the timerfd as absolute times.
 
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
+	A core sets its deadline and then, if the deadline is earlier than 
+	pic_alarm_armed, it wakes up the PIC. Because pic_alarm_armed is 
+	UINT64_MAX while we scan, a deadline set after we read it always
+	wakes us up, to scan again.
+ */
+static void pic_alarm_scan(vm_instance* vm, int tfd)
 {
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
-}
-
+	__atomic_store_n(& vm->pic_alarm_armed, UINT64_MAX, __ATOMIC_SEQ_CST);
+
+	uint64_t now = get_monotonic_ns();
+	uint64_t next = UINT64_MAX;
+	for(uint c=0; c<vm->ncores; c++) {
+		Core* core = vm->CORE+c;
+		uint64_t dl = __atomic_load_n(& core->alarm_deadline, __ATOMIC_SEQ_CST);
+		if(dl == 0) continue;
+		if(dl <= now) {
+			/* If this fails, the core just reset its deadline */
+			if(__atomic_compare_exchange_n(& core->alarm_deadline, &dl, 0, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				raise_interrupt(core, ALARM);
+				continue;
+			}
+			if(dl == 0) continue;
+		}
+		if(dl < next) next = dl;
+	}
 
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
-{
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
+	if(next != vm->pic_alarm_set) {
+		struct itimerspec its = {
+			.it_interval = {0, 0},
+			.it_value = (next == UINT64_MAX) ? (struct timespec){0, 0}
+				: (struct timespec){ next / 1000000000ull, next % 1000000000ull }
+		};
+		CHECK(timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL));
+		vm->pic_alarm_set = next;
 	}
+	__atomic_store_n(& vm->pic_alarm_armed, next, __ATOMIC_SEQ_CST);
 }
 
 
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+/* Check a device that became not ready, or timed out */
+static void term_dev_check(io_device* dev, TimerDuration now)
 {
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
+	if(dev->queued) return;
+
+	if(__atomic_exchange_n(& dev->recheck, 0, __ATOMIC_SEQ_CST)) {
+		if(! dev->ready && dev->fd != -1 && io_device_ready(dev->fd, dev->iodir)) {
+			term_dev_raise(dev, now);
+			return;
 		}
 	}
+
+	if((now - dev->last_int) > SERIAL_TIMEOUT)
+		term_dev_raise(dev, now);
 }
 
 
 
 
-static void PIC_daemon(void)
+static void PIC_daemon(vm_instance* vm)
 {
 
 	/* Change the thread name */
@@ -720,55 +2155,83 @@ static void PIC_daemon(void)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	/* Open signal queues */
-	int sigusr1fd = open_signalfd(&sigusr1_set);
+	/* Open signal queue */
 	int sigalrmfd = open_signalfd(&sigalrm_set);
 
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
-		
-	/* sync with all cores */
-	pthread_barrier_wait(& system_barrier);
-	
-	/* The PIC multiplexing loop */
-	while(PIC_active) {
 
-		pic_selector ps;
+	/* The alarm timerfd, for VM_ALARM_PIC */
+	int alarmfd = -1;
+	if(vm->alarm_mode == VM_ALARM_PIC) {
+		alarmfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		CHECK(alarmfd);
+	}
 
-		pic_selector_reset(&ps);
+	/* Register the fds */
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(epfd);
+	pic_add_fd(epfd, sigalrmfd, EPOLLIN, &sigalrmfd);
+	if(alarmfd != -1)
+		pic_add_fd(epfd, alarmfd, EPOLLIN, &alarmfd);
+	pic_add_fd(epfd, vm->PIC_eventfd, EPOLLIN, &vm->PIC_eventfd);
+	for(uint i=0; i<vm->nterm; i++) {
+		pic_add_io_device(epfd, & vm->TERM[i].kbd);
+		pic_add_io_device(epfd, & vm->TERM[i].con);
+	}
 
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
+	/* sync with all cores */
+	pthread_barrier_wait(& vm->system_barrier);
 
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
+	/* The PIC multiplexing loop */
+	while(vm->PIC_active) {
 
-		if(pic_select(&ps) == -1)
+		struct epoll_event events[PIC_EVENTS];
+		int nev = epoll_wait(epfd, events, PIC_EVENTS, SERIAL_TIMEOUT/1000);
+		if(nev == -1) {
+			/* An error is likely EINTR */
+			if(errno != EINTR)  perror("PIC_loops: "); 
 			continue;
+		}
 
-		PIC_loops++ ;
+		vm->PIC_loops++ ;
 
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
+		TimerDuration now = get_coarse_time();
 
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
-			}
-		}
+		for(int e=0; e<nev; e++) {
+			void* ptr = events[e].data.ptr;
 
+			if(ptr == &sigalrmfd) {
+				struct signalfd_siginfo sfdinfo;
 
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
+				while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
+					Core* core = & vm->CORE[sfdinfo.ssi_int];
+					raise_interrupt(core, ALARM);
+				}
+			}
+			else if(ptr == &vm->PIC_eventfd) {
+				uint64_t count;
+				while(read(vm->PIC_eventfd, &count, sizeof(count))==-1 && errno==EINTR);
+			}
+			else if(ptr == &alarmfd) {
+				uint64_t count;
+				while(read(alarmfd, &count, sizeof(count))==-1 && errno==EINTR);
+				/* The timerfd expired, so it is no longer set */
+				vm->pic_alarm_set = UINT64_MAX;
+			}
+			else
+				term_dev_event(epfd, (io_device*) ptr, events[e].events, now);
 		}
 
+		if(alarmfd != -1)
+			pic_alarm_scan(vm, alarmfd);
 
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
+		for(uint i=0; i<vm->nterm; i++) {
+			terminal* term = & vm->TERM[i];			
 
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
+			term_dev_check(& term->con, now);
+			term_dev_check(& term->kbd, now);
 		}
 
 
@@ -776,10 +2239,12 @@ static void PIC_daemon(void)
 
 
 	/* sync with all cores */
-	pthread_barrier_wait(& system_barrier);
+	pthread_barrier_wait(& vm->system_barrier);
 
-	/* Close signal fds */
-	close_signalfd(sigusr1fd);
+	/* Close the fds */
+	CHECK(close(epfd));
+	if(alarmfd != -1)
+		CHECK(close(alarmfd));
 	close_signalfd(sigalrmfd);
 
 	/* Restore sigmask */
@@ -850,10 +2315,190 @@ int vm_config_terminals(vm_config* vmc, uint serialno, int nowait)
 }
 
 
+int vm_config_loopback(vm_config* vmc, uint serialno, const vm_loopback* loop)
+{
+	if(serialno>MAX_TERMINALS) return -1;
+	vmc->serialno = serialno;
+	for(uint i=0; i<serialno; i++) {
+		vmc->serial_in[i] = vmc->serial_out[i] = -1;
+		vmc->loopback[i] = (loop != NULL) ? loop[i] : (vm_loopback){ NULL, NULL, NULL, NULL };
+	}
+	return 0;
+}
+
+
+uint vm_term_script_produce(void* arg, char* buf, uint size)
+{
+	vm_term_script* script = arg;
+	if(script->len == 0 || script->pos >= script->total) return 0;
+	if(size > script->total - script->pos) size = script->total - script->pos;
+
+	uint count = 0;
+	while(count < size) {
+		uint off = script->pos % script->len;
+		uint n = script->len - off;
+		if(n > size - count) n = size - count;
+		memcpy(buf+count, script->data+off, n);
+		count += n;
+		script->pos += n;
+	}
+	return count;
+}
+
+
+void vm_term_discard(void* arg, const char* buf, uint size)
+{
+	vm_term_sink* sink = arg;
+	sink->bytes += size;
+}
+
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+void vm_term_sink_init(vm_term_sink* sink)
+{
+	sink->bytes = 0;
+	sink->checksum = FNV_OFFSET;
+}
+
+void vm_term_checksum(void* arg, const char* buf, uint size)
+{
+	vm_term_sink* sink = arg;
+	uint64_t h = sink->checksum;
+	for(uint i=0; i<size; i++) {
+		h ^= (unsigned char) buf[i];
+		h *= FNV_PRIME;
+	}
+	sink->checksum = h;
+	sink->bytes += size;
+}
+
+
+int vm_config_disk(vm_config* vmc, const char* path)
+{
+	if(vmc->diskno >= MAX_DISKS) return -1;
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if(fd == -1) return -1;
+	vmc->disk_mem[vmc->diskno] = NULL;
+	vmc->disk_memsize[vmc->diskno] = 0;
+	vmc->disk_fd[vmc->diskno++] = fd;
+	return 0;
+}
+
+
+int vm_config_ramdisk(vm_config* vmc, uint64_t size, const char* path)
+{
+	if(vmc->diskno >= MAX_DISKS) return -1;
+
+	void* mem = MAP_FAILED;
+	if(path == NULL) {
+		if(size > 0)
+			mem = mmap(NULL, size, PROT_READ|PROT_WRITE, 
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	} else {
+		int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		if(fd == -1) return -1;
+		struct stat st;
+		if(fstat(fd, &st) == 0 && (size <= st.st_size || ftruncate(fd, size) == 0)) {
+			if(size == 0) size = st.st_size;
+			if(size > 0)
+				mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+	}
+	if(mem == MAP_FAILED) return -1;
+
+	vmc->disk_fd[vmc->diskno] = -1;
+	vmc->disk_mem[vmc->diskno] = mem;
+	vmc->disk_memsize[vmc->diskno++] = size;
+	return 0;
+}
+
+
+int vm_config_nic(vm_config* vmc, const char* dir, uint node)
+{
+	if(node >= NIC_MAX_NODES || strlen(dir) >= NIC_DIR_MAX) return -1;
+	struct sockaddr_un addr;
+	if(nic_address(&addr, dir, node) == -1) return -1;
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(fd == -1) return -1;
+	unlink(addr.sun_path);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, NIC_MAX_NODES) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	vmc->nic_fd = fd;
+	vmc->nic_node = node;
+	strcpy(vmc->nic_dir, dir);
+	return 0;
+}
+
+
 void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint serialno)
 {
 	vmc->bootfunc = bootfunc;
 	vmc->cores = cores;
+
+	vmc->diskno = 0;
+	const char* disks = getenv("TINYOS_DISKS");
+	if(disks != NULL) {
+		char paths[strlen(disks)+1];
+		strcpy(paths, disks);
+		char* save;
+		for(char* path = strtok_r(paths, ":", &save); path != NULL; path = strtok_r(NULL, ":", &save))
+			if(vm_config_disk(vmc, path) == -1)
+				fprintf(stderr, "Cannot open disk image %s\n", path);
+	}
+	const char* ramdisk = getenv("TINYOS_RAMDISK");
+	if(ramdisk != NULL) {
+		const char* path = strchr(ramdisk, ',');
+		if(vm_config_ramdisk(vmc, (uint64_t)atoi(ramdisk) << 20, path ? path+1 : NULL) == -1)
+			fprintf(stderr, "Cannot create RAM disk %s\n", ramdisk);
+	}
+
+	vmc->nic_fd = -1;
+	const char* net = getenv("TINYOS_NET");
+	const char* node = getenv("TINYOS_NODE");
+	if(net != NULL && node != NULL)
+		if(vm_config_nic(vmc, net, atoi(node)) == -1)
+			fprintf(stderr, "Cannot create network socket for node %s in %s\n", node, net);
+
+	const char* tsc = getenv("TINYOS_TSC");
+	vmc->clock_tsc = (tsc!=NULL && strcmp(tsc, "1")==0);
+
+	const char* stats = getenv("TINYOS_CORE_STATS");
+	vmc->core_stats = (stats!=NULL && strcmp(stats, "1")==0);
+
+	const char* alarm = getenv("TINYOS_ALARM");
+	vmc->alarm = (alarm!=NULL && strcmp(alarm, "posix")==0) ? VM_ALARM_POSIX : VM_ALARM_PIC;
+
+	const char* irq = getenv("TINYOS_IRQ");
+	vmc->irq_delivery = (!SOFT_INTR_MASK || (irq!=NULL && strcmp(irq, "signal")==0)) 
+		? VM_IRQ_SIGNAL : VM_IRQ_FUTEX;
+	vmc->affinity = VM_AFFINITY_NONE;
+	const char* affinity = getenv("TINYOS_AFFINITY");
+	if(affinity != NULL && strcmp(affinity, "auto")==0)
+		vmc->affinity = VM_AFFINITY_AUTO;
+	else if(affinity != NULL && isdigit(affinity[0])) {
+		/* A list of CPUs, repeated over the cores */
+		uint n = 0;
+		for(const char* p = affinity; *p && n < MAX_CORES; n++) {
+			char* end;
+			vmc->core_cpu[n] = strtol(p, &end, 10);
+			if(end == p) break;
+			p = (*end == ',') ? end+1 : end;
+		}
+		for(uint c=n; c<MAX_CORES; c++)
+			vmc->core_cpu[c] = vmc->core_cpu[c % n];
+		vmc->affinity = VM_AFFINITY_LIST;
+	}
+	const char* pic_cpu = getenv("TINYOS_PIC_CPU");
+	vmc->pic_cpu = (pic_cpu != NULL) ? atoi(pic_cpu) : -1;
+
+	vmc->data = NULL;
 	CHECK(vm_config_terminals(vmc, serialno, 0));
 }
 
@@ -872,110 +2517,168 @@ void vm_run(vm_config* vmc)
 {
 
 	CHECK_CONDITION(vmc->cores > 0 && vmc->cores <= MAX_CORES);
-	CHECK_CONDITION(ncores==0);
 	CHECK_CONDITION(vmc->serialno <= MAX_TERMINALS);
+	CHECK_CONDITION(vmc->diskno <= MAX_DISKS);
+	CHECK_CONDITION(vmc->nic_fd == -1 || vmc->nic_node < NIC_MAX_NODES);
+	CHECK_CONDITION(vmc->irq_delivery==VM_IRQ_SIGNAL || (SOFT_INTR_MASK && vmc->irq_delivery==VM_IRQ_FUTEX));
 
 	/* This is called only once in the life of the process. */
 	CHECKRC(pthread_once(&init_control, initialize));
 
-	/* Install signal handler for SIGUSR1 */
-	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
+	/* Install signal handler for SIGUSR1, if this is the first running VM */
+	CHECKRC(pthread_mutex_lock(& USR1_mutex));
+	if(running_vms++ == 0)
+		CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
+	CHECKRC(pthread_mutex_unlock(& USR1_mutex));
+
+	/* Create the VM */
+	vm_instance* vm;
+	CHECKRC(posix_memalign((void**)&vm, 64, sizeof(vm_instance)));
+	memset(vm, 0, sizeof(vm_instance));
+	vm->data = vmc->data;
 
 	/* Set pic_active to 1 */
-	PIC_thread = pthread_self();
-	PIC_active = 1;	
+	vm->PIC_active = 1;
+	vm->PIC_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	CHECK(vm->PIC_eventfd);
+	vm->PIC_tid = syscall(SYS_gettid);
 
 	/* Initialize terminals */
-	nterm = vmc->serialno;
-	for(uint i=0; i<nterm; i++)
-		terminal_init(& TERM[i], vmc->serial_in[i], vmc->serial_out[i]);
+	vm->nterm = vmc->serialno;
+	if(vm->nterm > 0) {
+		vm->TERM = calloc(vm->nterm, sizeof(terminal));
+		vm->SERIAL = calloc(1, sizeof(serial_device));
+		CHECK_CONDITION(vm->TERM != NULL && vm->SERIAL != NULL);
+	}
+	for(uint i=0; i<vm->nterm; i++)
+		terminal_init(& vm->TERM[i], vm->CORE, i, vmc->serial_in[i], vmc->serial_out[i], & vmc->loopback[i]);
+	if(vm->nterm > 0)
+		serial_init(vm->SERIAL, vm->TERM, vm->nterm);
+
+	/* Initialize disks */
+	vm->ndisk = vmc->diskno;
+	if(vm->ndisk > 0) {
+		vm->DISK = calloc(vm->ndisk, sizeof(disk_device));
+		CHECK_CONDITION(vm->DISK != NULL);
+	}
+	for(uint i=0; i<vm->ndisk; i++)
+		disk_init(& vm->DISK[i], vm->CORE, i, vmc->disk_fd[i], vmc->disk_mem[i], vmc->disk_memsize[i]);
+
+	/* Initialize the NIC */
+	vm->nic_present = (vmc->nic_fd != -1);
+	if(vm->nic_present) {
+		vm->NIC = calloc(1, sizeof(nic_device));
+		CHECK_CONDITION(vm->NIC != NULL);
+		nic_init(vm->NIC, vm->CORE, vmc->nic_fd, vmc->nic_node, vmc->nic_dir);
+	}
+
+	/* Select the fine clock */
+	if(vmc->clock_tsc)
+		CHECKRC(pthread_once(&tsc_control, tsc_initialize));
+	vm->tsc_clock = vmc->clock_tsc && tsc_calibrated==1;
 
 	/* Init the cores */
-	ncores = vmc->cores;
+	vm->ncores = vmc->cores;
+	vm->irq_delivery = vmc->irq_delivery;
+	vm->alarm_mode = vmc->alarm;
+	vm->pic_alarm_armed = 0;
+	vm->pic_alarm_set = UINT64_MAX;
 
 	/* Initialize the barriers */
-	pthread_barrier_init(& system_barrier, NULL, ncores+1);
-	pthread_barrier_init(& core_barrier, NULL, ncores);
+	pthread_barrier_init(& vm->system_barrier, NULL, vm->ncores+1);
+	pthread_barrier_init(& vm->core_barrier, NULL, vm->ncores);
 
-	/* Initialize the halted vector */
-	halt_vector = 0;
+	/* Place the cores on host CPUs */
+	vm_layout(vm, vmc);
 
 	/* Launch the core threads */
-	for(uint c=0; c < ncores; c++) {
-		/* Initialize Core */
-		CORE[c].bootfunc = vmc->bootfunc;
-		CORE[c].id = c;
+	for(uint c=0; c < vm->ncores; c++) {
+		Core* core = & vm->CORE[c];
 
+		/* Initialize Core */
+		core->bootfunc = vmc->bootfunc;
+		core->id = c;
+		core->vm = vm;
 
-#if defined(CORE_STATISTICS)
 		/* Initialize Core statistics */
-		CORE[c].irq_count = 0;
-		for(uint intno=0; intno<maximum_interrupt_no;intno++) {
-			CORE[c].irq_delivered[intno] = 0;
-			CORE[c].irq_raised[intno] = 0;
-			CORE[c].hlt_count = 0;
-			CORE[c].rst_count = 0;
-			CORE[c].hlt_time = 0;
-			CORE[c].run_time = get_coarse_time();
+		core->stat.start_time = get_coarse_time();
+
+		/* Create the core thread, pinned if requested */
+		pthread_attr_t attr;
+		CHECKRC(pthread_attr_init(&attr));
+		if(core->host_cpu != -1) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(core->host_cpu, &cpus);
+			CHECKRC(pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus));
 		}
-#endif
-
-		/* Create the core thread */
-		CHECKRC(pthread_create(& CORE[c].thread, NULL, core_thread, &CORE[c]));
+		CHECKRC(pthread_create(& core->thread, &attr, core_thread, core));
+		CHECKRC(pthread_attr_destroy(&attr));
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
-		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
+		CHECKRC(pthread_setname_np(core->thread, thread_name));
 	}
 
-	/* Initialize PIC statistics */
-	PIC_loops = 0;
+	/* Pin the PIC thread, if requested */
+	cpu_set_t saved_cpus;
+	if(vmc->pic_cpu != -1) {
+		CHECK_CONDITION(vmc->pic_cpu >= 0 && vmc->pic_cpu < CPU_SETSIZE);
+		CHECKRC(pthread_getaffinity_np(pthread_self(), sizeof(saved_cpus), &saved_cpus));
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(vmc->pic_cpu, &cpus);
+		CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus));
+	}
 
-	/* Run the interrupt controller daemon on this thread */	
-	PIC_daemon();
+	/* Run the interrupt controller daemon on this thread */
+	PIC_daemon(vm);
 
-	/* Wait for core threads to finish */
-	for(uint c=0; c<ncores; c++) {
-		CHECKRC(pthread_join(CORE[c].thread, NULL));
+	if(vmc->pic_cpu != -1)
+		CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(saved_cpus), &saved_cpus));
 
-#if defined(CORE_STATISTICS)
-		CORE[c].run_time = get_coarse_time() - CORE[c].run_time;
-#endif
+	/* Wait for core threads to finish */
+	for(uint c=0; c<vm->ncores; c++) {
+		CHECKRC(pthread_join(vm->CORE[c].thread, NULL));
+		__atomic_store_n(& vm->CORE[c].stat.stop_time, get_coarse_time(), __ATOMIC_RELAXED);
 	}
 
-	/* Delete the Core table */
-	ncores = 0;
+	/* Print statistics */
+	if(vmc->core_stats)
+		core_stats_report(vm, stderr);
 
 	/* Destroy the core barrier */
-	pthread_barrier_destroy(& system_barrier);
-	pthread_barrier_destroy(& core_barrier);
+	pthread_barrier_destroy(& vm->system_barrier);
+	pthread_barrier_destroy(& vm->core_barrier);
 
 	/* Finalize terminals */
-	for(uint i=0; i<nterm; i++)
-		CHECK(terminal_destroy(& TERM[i]));
-	nterm = 0;
-
-	/* Restore signal mask before VM execution */
-	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
-
-
-	/* print statistics */
-#if defined(CORE_STATISTICS)
-	fprintf(stderr,"PIC loops: %lu \n", PIC_loops);
-	double total_util = 0.0;
-	for(uint c=0; c < vmc->cores; c++) {
-		fprintf(stderr,"Core %3d: irq_count=%6tu. deliv(raised):  ",
-			c, CORE[c].irq_count);
-		for(uint i=0;i<maximum_interrupt_no;i++) 
-			fprintf(stderr," %tu(%tu)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
-		fprintf(stderr, "  hlt(rst): %tu(%tu)", CORE[c].hlt_count, CORE[c].rst_count);
-		fprintf(stderr, "  hltt: %2.3lf", 1E-6*CORE[c].hlt_time);
-		double util = 100.0 - 100.0 * CORE[c].hlt_time / (double)CORE[c].run_time ;
-		total_util += util;
-		fprintf(stderr, "  util %%: %3.2lf", util);		
-		fprintf(stderr,"\n");
-	}
-	fprintf(stderr,"Avg(util)=%6.2lf\n", total_util);
-#endif
+	if(vm->nterm > 0)
+		serial_destroy(vm->SERIAL);
+	for(uint i=0; i<vm->nterm; i++)
+		CHECK(terminal_destroy(& vm->TERM[i]));
+	free(vm->SERIAL);
+	free(vm->TERM);
+
+	/* Finalize disks */
+	for(uint i=0; i<vm->ndisk; i++)
+		CHECK(disk_destroy(& vm->DISK[i]));
+	free(vm->DISK);
+
+	/* Finalize the NIC */
+	if(vm->nic_present)
+		CHECK(nic_destroy(vm->NIC));
+	free(vm->NIC);
+
+	/* Close the PIC eventfd */
+	CHECK(close(vm->PIC_eventfd));
+
+	/* Delete the VM */
+	free(vm);
+
+	/* Restore signal handler before VM execution, if this is the last running VM */
+	CHECKRC(pthread_mutex_lock(& USR1_mutex));
+	if(--running_vms == 0)
+		CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
+	CHECKRC(pthread_mutex_unlock(& USR1_mutex));
 }
 
 
@@ -987,64 +2690,119 @@ void vm_run(vm_config* vmc)
 
 uint cpu_cores()
 {
-	return ncores;
+	return cpu_vm->ncores;
+}
+
+
+static void core_stats_get(Core* core, core_stats* st)
+{
+	st->irq_count = __atomic_load_n(& core->stat.irq_count, __ATOMIC_RELAXED);
+	for(uint i=0; i<maximum_interrupt_no; i++) {
+		st->irq_raised[i] = __atomic_load_n(& core->rstat.irq_raised[i], __ATOMIC_RELAXED);
+		st->irq_delivered[i] = __atomic_load_n(& core->stat.irq_delivered[i], __ATOMIC_RELAXED);
+	}
+	st->hlt_count = __atomic_load_n(& core->stat.hlt_count, __ATOMIC_RELAXED);
+	st->rst_count = __atomic_load_n(& core->rstat.rst_count, __ATOMIC_RELAXED);
+	st->hlt_time = __atomic_load_n(& core->stat.hlt_time, __ATOMIC_RELAXED);
+
+	TimerDuration stop = __atomic_load_n(& core->stat.stop_time, __ATOMIC_RELAXED);
+	if(stop == 0) stop = get_coarse_time();
+	st->run_time = stop - core->stat.start_time;
+}
+
+
+int cpu_core_stats(uint core, core_stats* stats)
+{
+	if(core >= cpu_vm->ncores) return 0;
+	core_stats_get(cpu_vm->CORE+core, stats);
+	return 1;
+}
+
+
+static void core_stats_report(vm_instance* vm, FILE* out)
+{
+	fprintf(out,"PIC loops: %lu \n", vm->PIC_loops);
+	double total_util = 0.0;
+	for(uint c=0; c < vm->ncores; c++) {
+		core_stats st;
+		core_stats_get(vm->CORE+c, &st);
+		fprintf(out,"Core %3d: irq_count=%6lu. deliv(raised):  ", c, st.irq_count);
+		for(uint i=0;i<maximum_interrupt_no;i++) 
+			fprintf(out," %lu(%lu)", st.irq_delivered[i], st.irq_raised[i]);
+		fprintf(out, "  hlt(rst): %lu(%lu)", st.hlt_count, st.rst_count);
+		fprintf(out, "  hltt: %2.3lf", 1E-6*st.hlt_time);
+		double util = (st.run_time==0) ? 0.0 : 100.0 - 100.0 * st.hlt_time / (double)st.run_time;
+		total_util += util;
+		fprintf(out, "  util %%: %3.2lf", util);
+		fprintf(out,"\n");
+	}
+	fprintf(out,"Avg(util)=%6.2lf\n", total_util/vm->ncores);
 }
 
 
 
 void cpu_core_halt()
 {
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX)
+		intr_off_swap(1);
+	else
+		core_sigmask(SIG_BLOCK, &sigusr1_set, NULL);
 
 	Core* core = curr_core();
-	uint32_t cmask = 1 << cpu_core_id;
+	uint c = core->id;
 
-#if defined(CORE_STATISTICS)
 	TimerDuration stime0 = get_coarse_time();
-#endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	halt_vector_set(cpu_vm, c);
 
-#if defined(CORE_STATISTICS)
-	core->hlt_count ++;
-#endif
+	STAT_ADD(core->stat.hlt_count, 1);
 
-	siginfo_t info;
 	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
 
-	/* Sleep for 10 msec */
-	int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-		
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX) {
+		__atomic_store_n(& core->halt_futex, 0, __ATOMIC_SEQ_CST);
+		__atomic_store_n(& core->halted, 1, __ATOMIC_SEQ_CST);
+
+		/* Sleep for 10 msec, unless an interrupt is pending */
+		if(! __atomic_load_n(& core->intr_pending, __ATOMIC_SEQ_CST))
+			futex(& core->halt_futex, FUTEX_WAIT_PRIVATE, 0, &halt_time);
 
-	if(rc>0) {
-		/* Got signal, dispatch */
+		__atomic_store_n(& core->halted, 0, __ATOMIC_SEQ_CST);
 		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+	} else {
+		siginfo_t info;
+
+		/* Sleep for 10 msec */
+		int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+
+		if(rc>0) {
+			/* Got signal, dispatch */
+			dispatch_interrupts(core);
+		}
+		else {
+			assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		}
 	}
 
-#if defined(CORE_STATISTICS)
-	/* Unset halt bit */
-	core->hlt_time += get_coarse_time()-stime0;
-#endif
+	STAT_ADD(core->stat.hlt_time, get_coarse_time()-stime0);
 
-	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	halt_vector_clear(cpu_vm, c);
 
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX)
+		intr_safe_point();
+	else
+		core_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL);
 }
 
 static int __core_restart(uint c)
 {
-	uint32_t cmask = 1 << c;
-
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
-	if( prevhv & cmask ) {
-		interrupt_core(CORE+c);
-#if defined(CORE_STATISTICS)		
-		__atomic_fetch_add(& CORE[c].rst_count, 1 , __ATOMIC_RELAXED);
-#endif
+	if( halt_vector_clear(cpu_vm, c) ) {
+		if(cpu_vm->irq_delivery == VM_IRQ_FUTEX)
+			wake_core(cpu_vm->CORE+c);
+		else
+			interrupt_core(cpu_vm->CORE+c);
+		STAT_ADD(cpu_vm->CORE[c].rstat.rst_count, 1);
 
 		return 1;
 	} else 
@@ -1060,59 +2818,101 @@ void cpu_core_restart(uint c)
 
 void cpu_core_restart_one()
 {
-	/* Only restart if core_id < physical_cores */
-	uint32_t hv = halt_vector;
-
-	if( (hv=halt_vector)!=0 ) {
-		uint c = __builtin_ctz(hv);
-		if(c < physical_cores)
-			__core_restart(c);
+	/* Restart the lowest halted core, only if it is on its own physical core */
+	uint n = cpu_vm->restart_cores;
+
+	for(uint w=0; 64*w < n; w++) {
+		uint64_t hv = __atomic_load_n(& cpu_vm->halt_vector[w], __ATOMIC_RELAXED);
+		if(hv != 0) {
+			uint c = 64*w + __builtin_ctzll(hv);
+			if(c < n)
+				__core_restart(c);
+			return;
+		}
 	}
 
 }
 
+int cpu_core_host_cpu(uint c)
+{
+	return (c < cpu_vm->ncores) ? cpu_vm->CORE[c].host_cpu : -1;
+}
+
 void cpu_core_restart_all()
 {
-	for(uint c=0; c < ncores; c++)
+	for(uint c=0; c < cpu_vm->ncores; c++)
 		__core_restart(c);
 }
 
 void cpu_core_barrier_sync()
 {
-	pthread_barrier_wait(& core_barrier);
+	pthread_barrier_wait(& cpu_vm->core_barrier);
 }
 
 void cpu_ici(uint core)
 {
-	assert(core < ncores);
-	raise_interrupt(& CORE[core], ICI);
+	assert(core < cpu_vm->ncores);
+	raise_interrupt(& cpu_vm->CORE[core], ICI);
 }
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX) {
+		int intoff = intr_off_swap(1);
+		curr_core()->intvec[interrupt] = handler;
+		if(! intoff) intr_safe_point();
+		return;
+	}
+
 	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	core_sigmask(SIG_BLOCK, &sigusr1_set, &curss);
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	core_sigmask(SIG_SETMASK, &curss, NULL);
 }
 
 int cpu_interrupts_enabled()
 {
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX)
+		return ! intr_off_get();
+
 	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
+	core_sigmask(SIG_BLOCK, NULL, & curss);
 	return sigismember(&curss, SIGUSR1)==0;
 }
 
 int cpu_disable_interrupts()
 {
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX)
+		return ! intr_off_swap(1);
+
 	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
+	core_sigmask(SIG_BLOCK, &sigusr1_set, & curss);
 	return sigismember(&curss, SIGUSR1)==0;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	if(cpu_vm->irq_delivery == VM_IRQ_FUTEX) {
+		if(intr_off_get()) intr_safe_point();
+		return;
+	}
+
+	core_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL);
+}
+
+unsigned long cpu_sigmask_calls()
+{
+	return __atomic_load_n(& cpu_vm->sigmask_calls, __ATOMIC_RELAXED);
+}
+
+vm_irq_delivery cpu_irq_delivery()
+{
+	return cpu_vm->irq_delivery;
+}
+
+void* cpu_vm_data()
+{
+	return cpu_vm->data;
 }
 
 
@@ -1128,7 +2928,12 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_flags = 0;
 
   //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* With software masking, SIGUSR1 stays unblocked (the new context
+     starts with interrupts disabled, since cpu_intr_off is per-core) */
+  if(cpu_vm->irq_delivery == VM_IRQ_FUTEX)
+    ctx->uc_sigmask = core_signal_set;
+  else
+    sigfillset( & ctx->uc_sigmask );
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1145,8 +2950,26 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
  */
 
 
+/* VM_ALARM_PIC: set the core deadline, waking the PIC if it is too late */
+static TimerDuration pic_set_timer(TimerDuration usec)
+{
+	Core* core = curr_core();
+	uint64_t now = get_monotonic_ns();
+	uint64_t dl = (usec == 0) ? 0 : now + 1000ull*usec;
+
+	uint64_t old = __atomic_exchange_n(& core->alarm_deadline, dl, __ATOMIC_SEQ_CST);
+	if(dl != 0 && dl < __atomic_load_n(& cpu_vm->pic_alarm_armed, __ATOMIC_SEQ_CST))
+		interrupt_pic_thread(cpu_vm);
+
+	return (old > now) ? (old - now)/1000ull : 0;
+}
+
+
 TimerDuration bios_set_timer(TimerDuration usec)
 {
+	if(cpu_vm->alarm_mode == VM_ALARM_PIC)
+		return pic_set_timer(usec);
+
 	time_t sec = usec / 1000000;
 	long nsec = (usec % 1000000) * 1000ull;
 	
@@ -1171,14 +2994,22 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return get_coarse_time();
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_REALTIME_COARSE, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
 }	
 
 
+uint64_t bios_clock_ns()
+{
+	return get_fine_ns(cpu_vm);
+}
+
+
 
 uint bios_serial_ports()
 {
-	return nterm;
+	return cpu_vm->nterm;
 }
 
 
@@ -1188,16 +3019,23 @@ uint bios_serial_ports()
  */
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 {
-	if(!(serial < nterm)) return;
+	if(!(serial < cpu_vm->nterm)) return;
 	if(!(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY)) return;
-	if(!(coreid < ncores)) return;
+	if(!(coreid < cpu_vm->ncores)) return;
 
-	Core* core = & CORE[coreid];
+	Core* core = & cpu_vm->CORE[coreid];
 
 	if(intno==SERIAL_RX_READY)
-		TERM[serial].kbd.int_core = core;
+		cpu_vm->TERM[serial].kbd.int_core = core;
 	else 
-		TERM[serial].con.int_core = core;
+		cpu_vm->TERM[serial].con.int_core = core;
+}
+
+
+unsigned int bios_serial_rx_pending()
+{
+	if(cpu_vm->nterm == 0) return 0;
+	return __atomic_exchange_n(& cpu_vm->SERIAL->rx_pending, 0, __ATOMIC_SEQ_CST);
 }
 
 
@@ -1207,7 +3045,12 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& cpu_vm->TERM[serial].kbd, ptr, 1);
+}
+
+int bios_read_serial_buf(uint serial, char* buf, uint size)
+{
+	return io_device_read(& cpu_vm->TERM[serial].kbd, buf, size);
 }
 
 
@@ -1217,7 +3060,207 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& cpu_vm->TERM[serial].con, &value, 1);
+}
+
+int bios_write_serial_buf(uint serial, const char* buf, uint size)
+{
+	return io_device_write(& cpu_vm->TERM[serial].con, buf, size);
+}
+
+
+virtqueue* bios_serial_rx_queue(uint serial)
+{
+	if(serial >= cpu_vm->nterm) return NULL;
+	cpu_vm->TERM[serial].kbd.queued = 1;
+	return & cpu_vm->SERIAL->rxq[serial];
+}
+
+virtqueue* bios_serial_tx_queue(uint serial)
+{
+	if(serial >= cpu_vm->nterm) return NULL;
+	cpu_vm->TERM[serial].con.queued = 1;
+	return & cpu_vm->SERIAL->txq[serial];
+}
+
+
+int bios_vq_post(virtqueue* vq, vq_desc* desc)
+{
+	assert(desc->len > 0);
+	int intr = cpu_disable_interrupts();
+	CHECKRC(pthread_mutex_lock(vq->lock));
+
+	int ok = vq->count < VQ_SIZE;
+	if(ok) {
+		vq->ring[(vq->head + vq->count++) % VQ_SIZE] = desc;
+		/* The I/O thread does not poll a queue without available buffers */
+		if(vq_available(vq) == 1) {
+			uint64_t one = 1;
+			while(write(vq->kick_fd, &one, sizeof(one))==-1 && errno==EINTR);
+		}
+	}
+
+	CHECKRC(pthread_mutex_unlock(vq->lock));
+	if(intr) cpu_enable_interrupts();
+	return ok;
+}
+
+vq_desc* bios_vq_collect(virtqueue* vq)
+{
+	int intr = cpu_disable_interrupts();
+	CHECKRC(pthread_mutex_lock(vq->lock));
+
+	vq_desc* desc = NULL;
+	if(vq->used > 0) {
+		desc = vq->ring[vq->head];
+		vq->head = (vq->head + 1) % VQ_SIZE;
+		vq->used--;
+		vq->count--;
+	}
+
+	CHECKRC(pthread_mutex_unlock(vq->lock));
+	if(intr) cpu_enable_interrupts();
+	return desc;
+}
+
+
+
+uint bios_disks()
+{
+	return cpu_vm->ndisk;
+}
+
+
+uint64_t bios_disk_sectors(uint disk)
+{
+	return (disk < cpu_vm->ndisk) ? cpu_vm->DISK[disk].nsectors : 0;
+}
+
+
+void bios_disk_interrupt_core(uint disk, uint coreid)
+{
+	if(!(disk < cpu_vm->ndisk)) return;
+	if(!(coreid < cpu_vm->ncores)) return;
+	cpu_vm->DISK[disk].int_core = & cpu_vm->CORE[coreid];
+}
+
+
+int bios_disk_submit(uint disk, disk_request* req)
+{
+	assert(disk < cpu_vm->ndisk);
+	disk_device* dev = & cpu_vm->DISK[disk];
+	int intr = disk_lock(dev);
+
+	int ok = dev->inflight < DISK_QUEUE_SIZE;
+	if(ok) {
+		dev->inflight++;
+		if(req->sector > dev->nsectors || req->nsectors > dev->nsectors - req->sector)
+			disk_complete(dev, req, -1);
+		else if(dev->mem != NULL) {
+			/* A RAM disk: copy without the lock */
+			CHECKRC(pthread_mutex_unlock(& dev->lock));
+			int status = disk_transfer(dev, req);
+			CHECKRC(pthread_mutex_lock(& dev->lock));
+			disk_complete(dev, req, status);
+		}
+		else {
+			dev->sq[(dev->sq_head + dev->sq_count++) % DISK_QUEUE_SIZE] = req;
+			CHECKRC(pthread_cond_signal(& dev->work));
+		}
+	}
+
+	disk_unlock(dev, intr);
+	return ok;
+}
+
+
+disk_request* bios_disk_complete(uint disk)
+{
+	assert(disk < cpu_vm->ndisk);
+	disk_device* dev = & cpu_vm->DISK[disk];
+	disk_request* req = NULL;
+	int intr = disk_lock(dev);
+
+	if(dev->cq_count > 0) {
+		req = dev->cq[dev->cq_head];
+		dev->cq_head = (dev->cq_head + 1) % DISK_QUEUE_SIZE;
+		dev->cq_count--;
+		dev->inflight--;
+	}
+
+	disk_unlock(dev, intr);
+	return req;
+}
+
+
+
+int bios_nic_node()
+{
+	return cpu_vm->nic_present ? (int)cpu_vm->NIC->node : -1;
+}
+
+
+void bios_nic_interrupt_core(uint coreid)
+{
+	if(!cpu_vm->nic_present) return;
+	if(!(coreid < cpu_vm->ncores)) return;
+	cpu_vm->NIC->int_core = & cpu_vm->CORE[coreid];
+}
+
+
+int bios_nic_submit_tx(nic_packet* pkt)
+{
+	assert(cpu_vm->nic_present);
+	int intr = nic_lock(cpu_vm->NIC);
+
+	int ok = cpu_vm->NIC->tx_inflight < NIC_RING_SIZE;
+	if(ok) {
+		cpu_vm->NIC->tx_inflight++;
+		nic_ring_push(& cpu_vm->NIC->txq, pkt);
+		CHECKRC(pthread_cond_signal(& cpu_vm->NIC->tx_work));
+	}
+
+	nic_unlock(cpu_vm->NIC, intr);
+	return ok;
+}
+
+
+int bios_nic_post_rx(nic_packet* pkt)
+{
+	assert(cpu_vm->nic_present);
+	int intr = nic_lock(cpu_vm->NIC);
+
+	int ok = cpu_vm->NIC->rx_inflight < NIC_RING_SIZE;
+	if(ok) {
+		cpu_vm->NIC->rx_inflight++;
+		nic_ring_push(& cpu_vm->NIC->rxq, pkt);
+		CHECKRC(pthread_cond_signal(& cpu_vm->NIC->rx_work));
+	}
+
+	nic_unlock(cpu_vm->NIC, intr);
+	return ok;
+}
+
+
+nic_packet* bios_nic_tx_complete()
+{
+	assert(cpu_vm->nic_present);
+	int intr = nic_lock(cpu_vm->NIC);
+	nic_packet* pkt = nic_ring_pop(& cpu_vm->NIC->txc);
+	if(pkt) cpu_vm->NIC->tx_inflight--;
+	nic_unlock(cpu_vm->NIC, intr);
+	return pkt;
+}
+
+
+nic_packet* bios_nic_rx_complete()
+{
+	assert(cpu_vm->nic_present);
+	int intr = nic_lock(cpu_vm->NIC);
+	nic_packet* pkt = nic_ring_pop(& cpu_vm->NIC->rxc);
+	if(pkt) cpu_vm->NIC->rx_inflight--;
+	nic_unlock(cpu_vm->NIC, intr);
+	return pkt;
 }
 
 
@@ -98,6 +98,54 @@
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	Alternatively, a serial port can be accessed in bulk, through its two
+	device queues (see below). A serial port should be accessed either
+	by the byte functions or by its queues, but not by both.
+
+	Device queues
+	-------------
+
+	A device queue (@c virtqueue) is a ring of buffer descriptors 
+	(@c vq_desc), shared between the cores and a device. A core posts 
+	buffers to the queue with @c bios_vq_post. An I/O thread of the host
+	fills the buffers of a receive queue with input, or drains the buffers 
+	of a transmit queue, in bulk, and then raises one interrupt for the 
+	whole batch. The completed buffers are collected, in the order they 
+	were posted, by @c bios_vq_collect. 
+
+	The data is transferred directly between the device and the posted 
+	buffers, without intermediate copies.
+
+	Disks
+	-----
+
+	The virtual machine may have a number of disks, each backed by a file
+	of the host, or by memory of the host (a RAM disk). A disk is an array 
+	of sectors of @c DISK_SECTOR_SIZE bytes.
+
+	Disk I/O is asynchronous. A core submits a @c disk_request to the
+	queue of the disk, and the request is performed by a pool of I/O 
+	threads of the host. When a request completes, a @c DISK_COMPLETE 
+	interrupt is raised, and the completed request can be collected
+	by @c bios_disk_complete.
+
+	Network
+	-------
+
+	The virtual machine may have a network interface (NIC), which connects 
+	it to other virtual machines (nodes) running on the same host. Each node
+	has a node id, and listens on a unix socket named @c node-<id> in a
+	directory shared by all the nodes of the network. 
+
+	The NIC sends and receives packets of up to @c NIC_MTU bytes. Packets are
+	described by @c nic_packet descriptors, kept in a transmit ring and a 
+	receive ring. A core submits a packet for transmission with 
+	@c bios_nic_submit_tx, and posts empty buffers for reception with 
+	@c bios_nic_post_rx. When a packet is transmitted or received, a 
+	@c NIC_TX_COMPLETE or @c NIC_RX_COMPLETE interrupt is raised, and the
+	descriptor can be collected by @c bios_nic_tx_complete or 
+	@c bios_nic_rx_complete respectively.
+
  */
 
 
@@ -123,17 +171,193 @@ typedef enum Interrupt
 						   from a serial port */
 	SERIAL_TX_READY,	/**< Raised when a serial port is ready to accept 
 						   data */
+	DISK_COMPLETE,		/**< Raised when a disk request completes */
+	NIC_RX_COMPLETE,	/**< Raised when the NIC receives a packet */
+	NIC_TX_COMPLETE,	/**< Raised when the NIC transmits a packet */
 
 	maximum_interrupt_no 
 } Interrupt;
 
 
 /** @brief Maximum number of cores for a virtual machine. */
-#define MAX_CORES 32
+#define MAX_CORES 256
 
 /** @brief Maximum number of terminals for a virtual machine. */
-#define MAX_TERMINALS 4
+#define MAX_TERMINALS 16
+
+/** @brief Maximum number of disks for a virtual machine. */
+#define MAX_DISKS 4
+
+/** @brief The size of a disk sector in bytes. */
+#define DISK_SECTOR_SIZE 512
+
+/** @brief The maximum number of incomplete requests of a disk. */
+#define DISK_QUEUE_SIZE 64
+
+/** @brief Maximum number of nodes of a virtual network. */
+#define NIC_MAX_NODES 64
+
+/** @brief The maximum size of a network packet in bytes. */
+#define NIC_MTU 2048
+
+/** @brief The size of the transmit and receive rings of the NIC. */
+#define NIC_RING_SIZE 64
+
+/** @brief The maximum length of the network directory path. */
+#define NIC_DIR_MAX 96
+
+
+/**
+	@brief The mechanism used to deliver interrupts to cores.
+
+	@see vm_config
+ */
+typedef enum vm_irq_delivery {
+	/** Every interrupt is delivered by a signal to the core thread.
+	    A halted core waits for the signal. */
+	VM_IRQ_SIGNAL,
+	/** Interrupts are marked pending on the core, which checks them at
+	    safe points (when interrupts are enabled and when the core halts).
+	    Halted cores sleep on a futex, and signals are only sent to cores 
+	    that are running with interrupts enabled. Interrupts are disabled
+	    by a per-core flag, without system calls. This is only supported
+	    on x86-64. */
+	VM_IRQ_FUTEX
+} vm_irq_delivery;
+
+
+/**
+	@brief The mechanism used to implement the core timers.
+
+	@see vm_config
+	@see bios_set_timer
+ */
+typedef enum vm_alarm {
+	/** Each core has a POSIX timer, set by a system call on each
+	    @c bios_set_timer. Expiration is delivered to the PIC by SIGALRM. */
+	VM_ALARM_POSIX,
+	/** Each core stores its deadline in memory. The PIC thread checks
+	    the deadlines over a single timerfd, which is only reset by the PIC.
+	    Setting a timer makes no system call, unless the deadline is 
+	    earlier than the one the PIC is waiting for. */
+	VM_ALARM_PIC
+} vm_alarm;
+
+
+/**
+	@brief The placement of the core threads on the CPUs of the host.
+
+	@see vm_config
+	@see cpu_core_host_cpu
+ */
+typedef enum vm_affinity {
+	/** The host scheduler places the core threads, and may migrate them. */
+	VM_AFFINITY_NONE,
+	/** Each core thread is pinned to the host CPU given in 
+	    @c vm_config.core_cpu. */
+	VM_AFFINITY_LIST,
+	/** Each core thread is pinned to a host CPU by a layout which follows
+	    the topology of the host: the cores are spread over distinct 
+	    physical cores first, and use SMT siblings only when every physical
+	    core is taken. Cores with adjacent ids are placed on the same 
+	    NUMA node, as far as possible. */
+	VM_AFFINITY_AUTO
+} vm_affinity;
+
+
+/**
+	@brief A producer of keyboard input, for a loopback terminal.
+
+	It fills @c buf with up to @c size bytes, and returns their number.
+	A return value of 0 means that the input has ended.
+
+	@see vm_loopback
+ */
+typedef uint (*vm_term_producer)(void* arg, char* buf, uint size);
+
+/**
+	@brief A consumer of console output, for a loopback terminal.
+
+	@see vm_loopback
+ */
+typedef void (*vm_term_consumer)(void* arg, const char* buf, uint size);
+
+/**
+	@brief The backend of a loopback terminal.
 
+	A loopback terminal lives in the process: instead of reading and 
+	writing file descriptors, the serial device calls a producer for 
+	keyboard input and a consumer for console output, directly into and
+	out of the buffers of the transfers. This needs no terminal emulator
+	and makes no system calls per transfer, so it serves benchmarks of
+	terminal throughput.
+
+	The producer and consumer of a terminal are called by one host thread
+	at a time, but not always the same one. A NULL producer ends the input
+	at once, and a NULL consumer discards the output.
+
+	@see vm_config_loopback
+ */
+typedef struct vm_loopback {
+	vm_term_producer produce;	/**< @brief The keyboard input */
+	void* producer_arg;			/**< @brief Passed to @c produce */
+	vm_term_consumer consume;	/**< @brief The console output */
+	void* consumer_arg;			/**< @brief Passed to @c consume */
+} vm_loopback;
+
+
+/**
+	@brief Scripted keyboard input.
+
+	The data is repeated cyclically, until @c total bytes are produced.
+	@see vm_term_script_produce
+ */
+typedef struct vm_term_script {
+	const char* data;			/**< @brief The script */
+	uint len;					/**< @brief The length of the script */
+	uint64_t total;				/**< @brief The total input */
+	uint64_t pos;				/**< @brief The bytes produced so far */
+} vm_term_script;
+
+/**
+	@brief A producer for a @c vm_term_script, passed as @c arg.
+ */
+uint vm_term_script_produce(void* arg, char* buf, uint size);
+
+
+/**
+	@brief Console output statistics.
+
+	@see vm_term_discard
+	@see vm_term_checksum
+ */
+typedef struct vm_term_sink {
+	uint64_t bytes;				/**< @brief The bytes consumed */
+	uint64_t checksum;			/**< @brief The checksum of the bytes */
+} vm_term_sink;
+
+/**
+	@brief A consumer which counts the output in a @c vm_term_sink.
+
+	The sink, passed as @c arg, must be zeroed initially.
+ */
+void vm_term_discard(void* arg, const char* buf, uint size);
+
+/**
+	@brief A consumer which counts and checksums the output in a 
+	@c vm_term_sink.
+
+	The checksum is the 64-bit FNV-1a hash of the output, so it depends on 
+	the order of the bytes. To compute the expected checksum, pass the 
+	expected output to this function with another sink. The sink, passed
+	as @c arg, must be initialized by @c vm_term_sink_init.
+ */
+void vm_term_checksum(void* arg, const char* buf, uint size);
+
+/**
+	@brief Initialize a sink for @c vm_term_checksum.
+ */
+void vm_term_sink_init(vm_term_sink* sink);
 
 
 /**
@@ -153,6 +377,8 @@ typedef enum Interrupt
 	  keyboard (@c serial_in) file descriptor will be read from and the console
 	  (@c serial_out) file descriptor will be written to. These file descriptors
 	  should correspond to some pipe-like Linux stream (e.g., pipe, FIFO or socket).
+	  Alternatively, a serial device can be a loopback terminal, served in 
+	  memory by the backend in @c loopback.
 
  */
 typedef struct vm_config {
@@ -198,6 +424,122 @@ typedef struct vm_config {
 		must be valid in this structure.
 	*/
 	int serial_out[MAX_TERMINALS];
+
+	/** @brief The backends of loopback terminals.
+
+		A serial device whose @c serial_in and @c serial_out are both -1
+		is a loopback terminal, served by this backend.
+
+		@see vm_config_loopback
+	*/
+	vm_loopback loopback[MAX_TERMINALS];
+
+	/** @brief The number of disks. 
+
+		This is between 0 and @c MAX_DISKS.
+	*/
+	uint diskno;
+
+	/** @brief The file descriptors of the disk images.
+
+		Each must be a regular file of the host, opened for reading and
+		writing. Its size is rounded down to a multiple of 
+		@c DISK_SECTOR_SIZE. @c vm_configure opens the files listed (separated 
+		by ':') in the environment variable @c TINYOS_DISKS, if it is set.
+	*/
+	int disk_fd[MAX_DISKS];
+
+	/** @brief The memory of RAM disks.
+
+		A disk whose @c disk_fd is -1 is a RAM disk, whose sectors are
+		the @c disk_memsize bytes at @c disk_mem. The memory must have been
+		obtained by @c mmap, and is unmapped when the VM halts.
+		@c vm_configure creates a RAM disk if the environment variable 
+		@c TINYOS_RAMDISK is set to its size in megabytes, optionally 
+		followed by a comma and the path of the host file backing it.
+
+		@see vm_config_ramdisk
+	*/
+	void* disk_mem[MAX_DISKS];
+
+	/** @brief The size in bytes of the memory of RAM disks. */
+	uint64_t disk_memsize[MAX_DISKS];
+
+	/** @brief The listening socket of the NIC, or -1 for no NIC.
+
+		This is a unix socket of type @c SOCK_SEQPACKET, bound to 
+		@c node-<nic_node> in directory @c nic_dir. @c vm_configure creates
+		it if the environment variable @c TINYOS_NET is set to the 
+		directory, and @c TINYOS_NODE to the node id.
+	*/
+	int nic_fd;
+
+	/** @brief The node id of the NIC, less than @c NIC_MAX_NODES. */
+	uint nic_node;
+
+	/** @brief The directory of the network sockets. */
+	char nic_dir[NIC_DIR_MAX];
+
+	/** @brief The interrupt delivery mechanism.
+
+		This is set by @c vm_configure to @c VM_IRQ_FUTEX, unless the
+		environment variable @c TINYOS_IRQ is set to @c "signal".
+	*/
+	vm_irq_delivery irq_delivery;
+
+	/** @brief The core timer mechanism.
+
+		This is set by @c vm_configure to @c VM_ALARM_PIC, unless the
+		environment variable @c TINYOS_ALARM is set to @c "posix".
+	*/
+	vm_alarm alarm;
+
+	/** @brief Use the TSC for @c bios_clock_ns().
+
+		If this is non-zero and the CPU has an invariant TSC, 
+		@c bios_clock_ns() reads the TSC, calibrated against the monotonic 
+		clock of the host. This is set by @c vm_configure if the 
+		environment variable @c TINYOS_TSC is set to @c "1".
+	*/
+	int clock_tsc;
+
+	/** @brief Print the core statistics at shutdown.
+
+		If this is non-zero, @c vm_run prints the statistics of each core
+		to @c stderr before it returns. This is set by @c vm_configure if 
+		the environment variable @c TINYOS_CORE_STATS is set to @c "1".
+		Statistics are always collected, see @c cpu_core_stats().
+	*/
+	int core_stats;
+
+	/** @brief The placement of the core threads on host CPUs.
+
+		This is set by @c vm_configure from the environment variable
+		@c TINYOS_AFFINITY: @c "auto" selects @c VM_AFFINITY_AUTO, and a 
+		comma-separated list of host CPUs selects @c VM_AFFINITY_LIST, with
+		the list repeated over the cores. Otherwise, it is set to 
+		@c VM_AFFINITY_NONE.
+	*/
+	vm_affinity affinity;
+
+	/** @brief The host CPU of each core, for @c VM_AFFINITY_LIST. */
+	int core_cpu[MAX_CORES];
+
+	/** @brief The host CPU of the PIC thread, or -1 for no pinning.
+
+		The PIC runs on the thread that calls @c vm_run, whose affinity is 
+		restored when the VM stops. This is set by @c vm_configure from the
+		environment variable @c TINYOS_PIC_CPU, if it is set.
+	*/
+	int pic_cpu;
+
+	/** @brief Data passed to the cores of the VM.
+
+		This pointer is returned by @c cpu_vm_data() on the cores of the VM.
+		It allows a program to keep its state per VM, when several VMs run
+		in the same process. This is set to NULL by @c vm_configure.
+	*/
+	void* data;
 } vm_config;
 
 
@@ -222,6 +564,71 @@ typedef struct vm_config {
 int vm_config_terminals(vm_config* vmc, uint serialno, int nowait);
 
 
+/**
+	@brief Initialize a VM configuration's serial ports as loopback terminals.
+
+	The serial ports are connected to in-memory backends, instead of
+	terminal emulators. This is typically called after @c vm_configure
+	with no serial devices.
+
+	@param vmc the configuration to initialize
+	@param serialno the number of serial devices to prepare
+	@param loop an array of @c serialno backends, or NULL for terminals 
+		without input which discard their output
+	@return 0 on success, -1 if @c serialno exceeds @c MAX_TERMINALS
+	@see vm_loopback
+*/
+int vm_config_loopback(vm_config* vmc, uint serialno, const vm_loopback* loop);
+
+
+/**
+	@brief Add a disk to a VM configuration.
+
+	The file at @c path is opened for reading and writing, and becomes the
+	image of the next disk.
+
+	@param vmc the configuration to add the disk to
+	@param path the path of the disk image
+	@return 0 on success, -1 on failure (e.g., there are already 
+		@c MAX_DISKS disks or the file cannot be opened)
+*/
+int vm_config_disk(vm_config* vmc, const char* path);
+
+
+/**
+	@brief Add a RAM disk to a VM configuration.
+
+	The sectors of a RAM disk are kept in memory, and requests complete
+	at once, without the I/O threads of the host. If @c path is NULL, 
+	the disk is anonymous memory, which is initially zero and is lost
+	when the VM halts. Otherwise, the file at @c path (created if needed,
+	and extended to @c size bytes if it is smaller) is mapped into memory,
+	and the data of the disk is written to the file by the host.
+
+	@param vmc the configuration to add the disk to
+	@param size the size of the disk in bytes; for a file, 0 means the 
+		size of the file
+	@param path the backing file, or NULL
+	@return 0 on success, -1 on failure
+*/
+int vm_config_ramdisk(vm_config* vmc, uint64_t size, const char* path);
+
+
+/**
+	@brief Add a network interface to a VM configuration.
+
+	A unix socket named @c node-<node> is created (replacing any stale one)
+	in directory @c dir, and the NIC will listen on it. 
+
+	@param vmc the configuration to add the NIC to
+	@param dir the network directory
+	@param node the node id of the VM, less than @c NIC_MAX_NODES
+	@return 0 on success, -1 on failure (e.g., the node id is illegal,
+		the path is too long or the socket cannot be created)
+*/
+int vm_config_nic(vm_config* vmc, const char* dir, uint node);
+
+
 /**
 	@brief Initialize a VM configuration with passed parameters.
 
@@ -257,6 +664,11 @@ void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint s
 	If the configuration passed contains illegal values, this function will
 	print an error message and will @c abort().
 
+	Several VMs may run at the same time, by calling this function from 
+	different threads of the process. Each VM has its own cores, devices 
+	and interrupt controller, and the functions of this API called on a 
+	core refer to the VM of the core.
+
 	@param vmc the configuration of the virtual machine
 	@see vm_config
  */
@@ -297,6 +709,16 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
  */
 extern _Thread_local uint cpu_core_id;
 
+/**
+	@brief Returns the id of the current core.
+
+	This is equivalent to reading @c cpu_core_id, but it is safe to call
+	with interrupts enabled, where a context switch may move the caller 
+	to another core. The compiler may cache the address of a thread-local
+	variable within a function; this call always reads it anew.
+ */
+uint cpu_core_id_now();
+
 /**
    	@brief Returns the number of cores.
  */
@@ -370,6 +792,58 @@ int cpu_interrupts_enabled();
 void cpu_enable_interrupts();
 
 
+/**
+	@brief Return the interrupt delivery mechanism of the VM.
+	@see vm_irq_delivery
+ */
+vm_irq_delivery cpu_irq_delivery();
+
+/**
+	@brief Return the @c data pointer of the configuration of the VM.
+	@see vm_config
+ */
+void* cpu_vm_data();
+
+/**
+	@brief Return the number of signal mask changes made by the cores.
+
+	Each change is a system call. With @c VM_IRQ_SIGNAL delivery, each 
+	call to @c cpu_disable_interrupts and @c cpu_enable_interrupts makes
+	one. With @c VM_IRQ_FUTEX, the signal mask is not changed.
+ */
+unsigned long cpu_sigmask_calls();
+
+
+/**
+	@brief Statistics of a core.
+
+	All counters start at 0 when the VM boots. Times are in usec.
+	@see cpu_core_stats
+ */
+typedef struct core_stats {
+	unsigned long irq_count;	/**< @brief Interrupt signals handled by the core */
+	unsigned long irq_raised[maximum_interrupt_no];		/**< @brief Interrupts raised, by number */
+	unsigned long irq_delivered[maximum_interrupt_no];	/**< @brief Interrupts dispatched, by number */
+	unsigned long hlt_count;	/**< @brief Calls to @c cpu_core_halt */
+	unsigned long rst_count;	/**< @brief Restarts of the halted core */
+	TimerDuration hlt_time;		/**< @brief Total time spent halted */
+	TimerDuration run_time;		/**< @brief Time since the core booted */
+} core_stats;
+
+/**
+	@brief Read the statistics of a core.
+
+	The statistics are collected with relaxed atomic counters, and may
+	be read at any time by any core. Counters are read one by one, so
+	the snapshot is not atomic.
+
+	@param core the core number, less than @c cpu_cores()
+	@param stats the statistics are stored here
+	@returns 1 on success, or 0 if @c core is not a valid core
+ */
+int cpu_core_stats(uint core, core_stats* stats);
+
+
 /**
 	@brief Halt the core until an interrupt arrives. 
 
@@ -394,9 +868,26 @@ void cpu_core_restart(uint c);
 	@brief Restart some halted core.
 
 	This call will restart some halted core, if at least one exists.
+	Only the cores which run on distinct physical cores of the host are 
+	restarted, since more would compete for the host's resources: 
+	the lowest cores of the VM, up to the number of physical cores, or,
+	if the cores are pinned, those up to the first one which shares a 
+	physical core with a lower one.
+
+	@see cpu_core_host_cpu
 */
 void cpu_core_restart_one();
 
+/**
+	@brief Return the host CPU a core is pinned to.
+
+	@param c the core
+	@returns the host CPU, or -1 if the core is not pinned, or if @c c
+		is not a core of the VM.
+	@see vm_affinity
+*/
+int cpu_core_host_cpu(uint c);
+
 /**
 	@brief Signal all halted cores to restart.
 
@@ -453,6 +944,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 
 	If @c usec is specified as 0, any existing timer count is canceled.
 
+	With @c VM_ALARM_PIC timers, this call usually makes no system call.
+
 	@param usec the timer countdown interval in microseconds
 	@returns the time remaining interval since the last call
 	@see bios_cancel_timer
@@ -480,10 +973,26 @@ TimerDuration bios_cancel_timer();
 	The resolution of the clock is very low, currently 
 	around 100 msec. Therefore, it is inappropriate for any type of
 	precise timing.
+
+	@see bios_clock_ns
  */
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from a fine-grained monotonic clock.
+
+	This function returns the value of a monotonic clock, in nsec, with
+	a resolution much finer than @c bios_clock(). The clock does not
+	jump when the real-time clock is changed, so it is appropriate
+	for timeouts and benchmarking. Its origin is unspecified.
+
+	The cost of this call is a few tens of nsec. It is even lower with
+	the TSC fast path (see @c vm_config).
+ */
+uint64_t bios_clock_ns();
+
+
 
 
 /**
@@ -512,6 +1021,19 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Return and clear the serial ports with pending receive interrupts.
+
+	Bit @c i of the returned mask is set if serial port @c i has raised
+	@c SERIAL_RX_READY since the previous call. Since interrupts are not
+	queued, one interrupt may stand for several ports. The handler of
+	@c SERIAL_RX_READY can serve only the ports in the mask.
+
+	@returns the mask of serial ports
+ */
+unsigned int bios_serial_rx_pending();
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -546,4 +1068,284 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read a number of bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial into @c buf.
+	Data received by the serial port is buffered by the BIOS, and read
+	in bulk from the terminal. This call returns as soon as no more data is
+	immediately available.
+
+	If this operation returns 0, a @c SERIAL_RX_READY interrupt will be raised
+	when data is ready to be received. Bytes read by @c bios_read_serial and
+	by this call come from the same buffer, in order.
+
+	@param serial the serial device to read from
+	@param buf the location in which to store the bytes read
+	@param size the maximum number of bytes to read
+	@return the number of bytes read
+	@see bios_read_serial
+ */
+int bios_read_serial_buf(uint serial, char* buf, uint size);
+
+
+/**
+	@brief Write a number of bytes to a serial port.
+
+	Try to write up to @c size bytes from @c buf to serial port @c serial.
+	Fewer bytes may be written, if the terminal cannot accept them.
+
+	If this operation returns 0, a @c SERIAL_TX_READY interrupt will be raised
+	when the device is ready to accept data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send to the serial device
+	@param size the number of bytes to send
+	@return the number of bytes written
+	@see bios_write_serial
+ */
+int bios_write_serial_buf(uint serial, const char* buf, uint size);
+
+
+
+/** @brief The number of descriptors of a device queue. */
+#define VQ_SIZE 64
+
+/**
+	@brief A buffer descriptor of a device queue.
+
+	The descriptor is owned by the BIOS from its submission by 
+	@c bios_vq_post, until it is returned by @c bios_vq_collect. 
+ */
+typedef struct vq_desc {
+	void* buf;			/**< @brief The memory of the buffer */
+	uint len;			/**< @brief The size of the buffer, which must be positive */
+	uint used;			/**< @brief On completion, the number of bytes received
+							into the buffer, or transmitted from it */
+	int status;			/**< @brief On completion, 0 on success or -1 on error */
+	void* tag;			/**< @brief Free for use by the submitter */
+} vq_desc;
+
+/** @brief A device queue. */
+typedef struct virtqueue virtqueue;
+
+/**
+	@brief Post a buffer to a device queue.
+
+	At most @c VQ_SIZE buffers may be in a queue (i.e., posted and not
+	yet returned by @c bios_vq_collect).
+
+	@param vq the queue
+	@param desc the descriptor, with @c buf and @c len set
+	@return 1 if the buffer was posted, or 0 if the queue is full
+	@see bios_vq_collect
+ */
+int bios_vq_post(virtqueue* vq, vq_desc* desc);
+
+/**
+	@brief Collect a completed buffer of a device queue.
+
+	Buffers complete in the order they were posted. The device raises
+	an interrupt after each batch of completions, so this should be
+	called until it returns NULL.
+
+	@param vq the queue
+	@return a completed descriptor, whose @c used and @c status are set,
+		or NULL
+ */
+vq_desc* bios_vq_collect(virtqueue* vq);
+
+/**
+	@brief Return the receive queue of a serial port.
+
+	A buffer posted to this queue completes when some keyboard input is 
+	stored in it. Then, @c used is between 1 and @c len. A 
+	@c SERIAL_RX_READY interrupt is raised after each batch.
+
+	Once this is called, the port's input is served only by the queue:
+	@c bios_read_serial and @c bios_read_serial_buf must not be used, 
+	since the BIOS no longer raises interrupts for them.
+
+	@param serial the serial port, less than @c bios_serial_ports()
+	@return the queue, or NULL if @c serial is illegal
+ */
+virtqueue* bios_serial_rx_queue(uint serial);
+
+/**
+	@brief Return the transmit queue of a serial port.
+
+	A buffer posted to this queue completes when all of it has been sent
+	to the terminal, or on error. A @c SERIAL_TX_READY interrupt is 
+	raised after each batch.
+
+	Once this is called, the port's output is served only by the queue:
+	@c bios_write_serial and @c bios_write_serial_buf must not be used, 
+	since the BIOS no longer raises interrupts for them.
+
+	@param serial the serial port, less than @c bios_serial_ports()
+	@return the queue, or NULL if @c serial is illegal
+ */
+virtqueue* bios_serial_tx_queue(uint serial);
+
+
+
+/**
+	@brief A request for a disk transfer.
+
+	The request is owned by the BIOS from its submission by 
+	@c bios_disk_submit, until it is returned by @c bios_disk_complete. 
+ */
+typedef struct disk_request {
+	uint64_t sector;	/**< @brief The first sector of the transfer */
+	uint nsectors;		/**< @brief The number of sectors */
+	int write;			/**< @brief Non-zero for a write, zero for a read */
+	void* buf;			/**< @brief The memory of the transfer, 
+							@c nsectors*DISK_SECTOR_SIZE bytes long */
+	int status;			/**< @brief On completion, 0 on success or -1 on error */
+	void* tag;			/**< @brief Free for use by the submitter */
+} disk_request;
+
+
+/**
+	@brief Return the number of disks.
+ */
+uint bios_disks();
+
+/**
+	@brief Return the size of a disk in sectors.
+
+	@param disk the disk, less than @c bios_disks()
+	@return the number of sectors, or 0 if @c disk is not a disk
+ */
+uint64_t bios_disk_sectors(uint disk);
+
+/**
+	@brief Assign a core to the @c DISK_COMPLETE interrupts of a disk.
+
+	By default, interrupts are sent to core 0. If any parameter has an 
+	illegal value, this call has no effect.
+
+	@param disk the disk, less than @c bios_disks()
+	@param core the core that will handle the interrupts
+ */
+void bios_disk_interrupt_core(uint disk, uint core);
+
+/**
+	@brief Submit a request to a disk.
+
+	The request is queued, and is performed asynchronously. At most 
+	@c DISK_QUEUE_SIZE requests of a disk may be incomplete (i.e., 
+	submitted and not yet returned by @c bios_disk_complete). Requests 
+	may complete in any order.
+
+	A request that is out of the disk's range completes with an error.
+
+	@param disk the disk, less than @c bios_disks()
+	@param req the request
+	@return 1 if the request was queued, or 0 if the queue is full
+	@see bios_disk_complete
+ */
+int bios_disk_submit(uint disk, disk_request* req);
+
+/**
+	@brief Collect a completed request of a disk.
+
+	A @c DISK_COMPLETE interrupt is raised after each request completes.
+	An interrupt may signify more than one completion, so this should be 
+	called until it returns NULL.
+
+	@param disk the disk, less than @c bios_disks()
+	@return a completed request, whose @c status is set, or NULL
+ */
+disk_request* bios_disk_complete(uint disk);
+
+
+
+/**
+	@brief A network packet descriptor.
+
+	The descriptor is owned by the BIOS from its submission by 
+	@c bios_nic_submit_tx or @c bios_nic_post_rx, until it is returned by
+	@c bios_nic_tx_complete or @c bios_nic_rx_complete.
+ */
+typedef struct nic_packet {
+	uint node;			/**< @brief The destination node when transmitting,
+							the source node when received */
+	uint len;			/**< @brief The length of the packet, set on 
+							completion for received packets */
+	void* buf;			/**< @brief The packet data, @c NIC_MTU bytes long */
+	int status;			/**< @brief On completion, 0 on success or -1 on error */
+	void* tag;			/**< @brief Free for use by the submitter */
+} nic_packet;
+
+
+/**
+	@brief Return the node id of the VM.
+
+	@return the node id, or -1 if the VM does not have a NIC
+ */
+int bios_nic_node();
+
+/**
+	@brief Assign a core to the interrupts of the NIC.
+
+	By default, interrupts are sent to core 0. If the parameter has an 
+	illegal value, this call has no effect.
+
+	@param core the core that will handle the interrupts
+ */
+void bios_nic_interrupt_core(uint core);
+
+/**
+	@brief Submit a packet for transmission.
+
+	At most @c NIC_RING_SIZE packets may be in the transmit ring (i.e., 
+	submitted and not yet returned by @c bios_nic_tx_complete). Packets
+	to the same node are delivered in order. A packet to a node which
+	cannot be reached, or which is longer than @c NIC_MTU, completes with
+	an error.
+
+	@param pkt the packet, with @c node, @c len and @c buf set
+	@return 1 if the packet was queued, or 0 if the ring is full
+	@see bios_nic_tx_complete
+ */
+int bios_nic_submit_tx(nic_packet* pkt);
+
+/**
+	@brief Post a buffer for packet reception.
+
+	At most @c NIC_RING_SIZE buffers may be in the receive ring. When no
+	buffers are posted, packets are not lost; they wait in the host
+	sockets, and eventually the senders block.
+
+	@param pkt the descriptor, with @c buf set
+	@return 1 if the buffer was posted, or 0 if the ring is full
+	@see bios_nic_rx_complete
+ */
+int bios_nic_post_rx(nic_packet* pkt);
+
+/**
+	@brief Collect a transmitted packet.
+
+	A @c NIC_TX_COMPLETE interrupt is raised after each transmission. 
+	An interrupt may signify more than one completion, so this should be 
+	called until it returns NULL.
+
+	@return a completed descriptor, whose @c status is set, or NULL
+ */
+nic_packet* bios_nic_tx_complete();
+
+/**
+	@brief Collect a received packet.
+
+	A @c NIC_RX_COMPLETE interrupt is raised after each reception. 
+	An interrupt may signify more than one completion, so this should be 
+	called until it returns NULL.
+
+	@return a completed descriptor, whose @c node, @c len and @c status
+		are set, or NULL
+ */
+nic_packet* bios_nic_rx_complete();
+
+
 #endif
@@ -1,10 +1,13 @@
 
 
 #include <assert.h>
+#include <time.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_streams.h"
 #include "kernel_cc.h"
+#include "kernel_vm.h"
 
 
 /**
@@ -19,6 +22,151 @@
   */
 
 
+/*
+	Lock statistics.
+	----------------
+
+	When enabled, every Mutex_Lock/Mutex_Unlock and every kernel wait is
+	accounted for in a hash table keyed by the address of the mutex, or
+	by the name of the wait channel. The name of a wait channel is the
+	__FUNCTION__ string of the caller of kernel_wait(), so the pointer 
+	is a good key.
+
+	The table is accessed with atomics only, since it is updated from
+	inside Mutex_Lock itself, on all cores and in both the preemptive
+	and the non-preemptive domain. Entries are never removed while the
+	kernel runs, so the table may fill up with the addresses of dead
+	mutexes. A key is looked up in at most LOCKSTAT_PROBES slots; if it
+	is not found there and none is free, it is accounted in a single 
+	overflow entry. Since the overflow entry is shared by many mutexes,
+	their hold times are not measured.
+ */
+
+/* Size of the lock statistics table (a power of 2) */
+#define LOCKSTAT_BITS 10
+#define LOCKSTAT_SIZE (1<<LOCKSTAT_BITS)
+
+/* The maximum number of slots probed for a key */
+#define LOCKSTAT_PROBES 16
+
+typedef struct lock_stat {
+	const void* key;            /* The mutex address or wchan name */
+	const char* name;           /* A printable name, or NULL */
+	lockinfo_type type;         /* Mutex or wait channel */
+
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long timeouts;
+	unsigned long spins;
+	unsigned long yields;
+	unsigned long hold_time;
+	unsigned long wait_time;
+	unsigned long waiters;
+	unsigned long max_waiters;
+
+	uint64_t hold_start;        /* Time of the last acquisition (mutex only) */
+} lock_stat;
+
+/*
+	The state of this module, per kernel instance. 
+	FUTEX is shared by all kernels of the process, since it is keyed by 
+	address.
+ */
+/* The epoch announcement of a core (see epoch_enter) */
+typedef struct core_epoch {
+	unsigned long epoch;	/* the global epoch observed at entry */
+	int active;				/* nesting depth of epoch sections */
+} __attribute__((aligned(64))) core_epoch;
+
+/* A retired object, waiting for the end of its grace period */
+typedef struct retired_obj {
+	rlnode node;
+	void (*reclaim)(void*);
+	void* obj;
+	unsigned long epoch;
+} retired_obj;
+
+struct cc_state {
+	/* Epoch-based reclamation */
+	core_epoch CORE_EPOCH[MAX_CORES];
+	unsigned long epoch_global;
+	rlnode epoch_limbo;		/* retired objects, oldest first */
+
+	/* Lock statistics */
+	lock_stat LOCKSTAT[LOCKSTAT_SIZE];
+	lock_stat LOCKSTAT_OVERFLOW;
+	int lockstat_on;
+
+	/* The kernel lock */
+	Mutex kernel_mutex;
+	int kernel_sem;
+	CondVar kernel_sem_cv;
+};
+
+#define CORE_EPOCH (KVM->cc->CORE_EPOCH)
+#define epoch_global (KVM->cc->epoch_global)
+#define epoch_limbo (KVM->cc->epoch_limbo)
+#define LOCKSTAT (KVM->cc->LOCKSTAT)
+#define LOCKSTAT_OVERFLOW (KVM->cc->LOCKSTAT_OVERFLOW)
+#define lockstat_on (KVM->cc->lockstat_on)
+#define kernel_mutex (KVM->cc->kernel_mutex)
+#define kernel_sem (KVM->cc->kernel_sem)
+#define kernel_sem_cv (KVM->cc->kernel_sem_cv)
+
+#define LS_ADD(field, val) __atomic_fetch_add(&(field), (val), __ATOMIC_RELAXED)
+#define LS_SUB(field, val) __atomic_fetch_sub(&(field), (val), __ATOMIC_RELAXED)
+
+/* The lock statistics clock, in nsec */
+static inline uint64_t lockstat_clock()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+/*
+	Find or create the entry for a key.
+ */
+static lock_stat* lockstat_get(const void* key, lockinfo_type type)
+{
+	uintptr_t h = ((uintptr_t)key * 0x9E3779B97F4A7C15ull) >> (64-LOCKSTAT_BITS);
+
+	for(uint i=0; i<LOCKSTAT_PROBES; i++) {
+		lock_stat* ls = &LOCKSTAT[(h+i) & (LOCKSTAT_SIZE-1)];
+		const void* k = __atomic_load_n(&ls->key, __ATOMIC_ACQUIRE);
+		if(k == key) return ls;
+		if(k == NULL) {
+			if(__atomic_compare_exchange_n(&ls->key, &k, key, 0, 
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				ls->type = type;
+				if(type == LOCKINFO_WCHAN) ls->name = key;
+				return ls;
+			}
+			if(k == key) return ls;
+		}
+	}
+	return &LOCKSTAT_OVERFLOW;
+}
+
+static inline void lockstat_add_waiter(lock_stat* ls)
+{
+	unsigned long w = LS_ADD(ls->waiters, 1) + 1;
+	unsigned long m = __atomic_load_n(&ls->max_waiters, __ATOMIC_RELAXED);
+	while(w > m && ! __atomic_compare_exchange_n(&ls->max_waiters, &m, w, 0, 
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+int lockstat_enabled()
+{
+	return __atomic_load_n(&lockstat_on, __ATOMIC_RELAXED);
+}
+
+void lockstat_name(Mutex* lock, const char* name)
+{
+	lockstat_get(lock, LOCKINFO_MUTEX)->name = name;
+}
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
@@ -36,27 +184,59 @@ void Mutex_Lock(Mutex* lock)
 {
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
+  lock_stat* ls = lockstat_enabled() ? lockstat_get(lock, LOCKINFO_MUTEX) : NULL;
+  uint64_t wait_start = 0;
+  unsigned long spins = 0, yields = 0;
+
   while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
+    if(ls && wait_start==0) {
+      wait_start = lockstat_clock();
+      lockstat_add_waiter(ls);
+    }
     int spin=MUTEX_SPINS;
     while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
 #if defined(__x86__) || defined(__x86_64__)
       __builtin_ia32_pause();
 #endif
+      spins++;
       if(spin>0) 
       	spin--; 
       else { 
       	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
+      	if(cpu_interrupts_enabled()) {
+      		yields++;
       		yield(SCHED_MUTEX); 
+      	}
       }
     }
   }
+
+  if(ls) {
+    uint64_t now = lockstat_clock();
+    LS_ADD(ls->acquisitions, 1);
+    if(wait_start) {
+      LS_ADD(ls->contended, 1);
+      LS_ADD(ls->spins, spins);
+      LS_ADD(ls->yields, yields);
+      LS_ADD(ls->wait_time, now-wait_start);
+      LS_SUB(ls->waiters, 1);
+    }
+    if(ls != &LOCKSTAT_OVERFLOW)
+      ls->hold_start = now;
+  }
 #undef MUTEX_SPINS
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
+  if(lockstat_enabled()) {
+    lock_stat* ls = lockstat_get(lock, LOCKINFO_MUTEX);
+    if(ls->hold_start) {
+      LS_ADD(ls->hold_time, lockstat_clock() - ls->hold_start);
+      ls->hold_start = 0;
+    }
+  }
   __atomic_clear(lock, __ATOMIC_RELEASE);
 }
 
@@ -70,6 +250,8 @@ void Mutex_Unlock(Mutex* lock)
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
 	TCB* thread;				/* thread to wait */
+	CondVar* cv;				/* the cv whose ring holds this waiter; this
+								   changes when the waiter is requeued */
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
@@ -90,6 +272,21 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 	rlist_remove(& w->node);
 }
 
+/**
+   @internal
+   A helper routine to add a condition waiter to the back of the CondVar ring.
+ */
+static inline void add_to_ring(CondVar* cv, __cv_waiter* w)
+{
+	if(cv->waitset) {
+		__cv_waiter* wset = cv->waitset;
+		rlist_push_back(& wset->node, & w->node);
+	} else {
+		cv->waitset = w;
+	}
+	w->cv = cv;
+}
+
 
 /** 
    @internal
@@ -108,6 +305,9 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   because the thread was awoken by another kernel routine), 
   it first re-locks the mutex and then returns.  
 
+  While asleep, a signalled thread may be requeued to another condition
+  variable (see @c cv_requeue).
+
   @param mx The mutex to be unlocked as the thread sleeps.
   @param cv The condition variable to sleep on.
   @param cause A cause provided to the kernel scheduler.
@@ -126,26 +326,28 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 
 	Mutex_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
-	if(cv->waitset) {
-		__cv_waiter* wset = cv->waitset;
-		rlist_push_back(& wset->node, & waiter.node);
-	} else {
-		cv->waitset = &waiter;
-	}
+	add_to_ring(cv, &waiter);
 
 	/* Now atomically release mutex and sleep */
 	Mutex_Unlock(mutex);
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
-	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
-	if(! waiter.removed) {
-		assert(! waiter.signalled);
-
-		/* We must remove ourselves from the ring! */
-		remove_from_ring(cv, &waiter);
+	/* Woke up, we must check wether we were signaled, and tidy up.
+	   We may have been requeued to another cv in the meantime. */
+	while(1) {
+		CondVar* wcv = __atomic_load_n(&waiter.cv, __ATOMIC_ACQUIRE);
+		Mutex_Lock(&(wcv->waitset_lock));
+		if(wcv != waiter.cv) {
+			Mutex_Unlock(&(wcv->waitset_lock));
+			continue;
+		}
+		if(! waiter.removed) {
+			/* We must remove ourselves from the ring! */
+			remove_from_ring(wcv, &waiter);
+		}
+		Mutex_Unlock(&(wcv->waitset_lock));
+		break;
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
 
 	Mutex_Lock(mutex);
 	return waiter.signalled;
@@ -173,6 +375,29 @@ static inline void cv_signal(CondVar* cv)
 }
 
 
+/**
+  @internal
+  Move waiters of @c from to the back of @c to, without waking them up. 
+  The waiters are considered signalled; they will be woken up when @c to
+  is signalled. If @c all is zero, at most one waiter is moved.
+ */
+static void cv_requeue(CondVar* from, CondVar* to, int all)
+{
+	Mutex_Lock(&(from->waitset_lock));
+	if(from->waitset) {
+		Mutex_Lock(&(to->waitset_lock));
+		do {
+			__cv_waiter* waiter = from->waitset;
+			remove_from_ring(from, waiter);
+			waiter->signalled = 1;
+			add_to_ring(to, waiter);
+		} while(all && from->waitset);
+		Mutex_Unlock(&(to->waitset_lock));
+	}
+	Mutex_Unlock(&(from->waitset_lock));
+}
+
+
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
@@ -203,6 +428,93 @@ void Cond_Broadcast(CondVar* cv)
 
 
 
+/*
+	Futexes.
+	--------
+
+	Threads waiting on an address are kept in a hash table of wait 
+	queues, keyed by the address. Each bucket has its own lock, which
+	FutexWait releases atomically as it goes to sleep. No kernel lock
+	is needed.
+ */
+
+#define FUTEX_BITS 8
+#define FUTEX_SIZE (1<<FUTEX_BITS)
+
+typedef struct futex_bucket {
+	Mutex lock;
+	rlnode waiters;		/* list of __futex_waiter, lazily initialized */
+} futex_bucket;
+
+/** \cond HELPER Helper structure for futexes. */
+typedef struct __futex_waiter {
+	rlnode node;
+	int* addr;
+	TCB* thread;
+	sig_atomic_t woken;
+} __futex_waiter;
+/** \endcond */
+
+static futex_bucket FUTEX[FUTEX_SIZE];
+
+static inline futex_bucket* futex_lock(int* addr)
+{
+	uintptr_t h = ((uintptr_t)addr * 0x9E3779B97F4A7C15ull) >> (64-FUTEX_BITS);
+	futex_bucket* b = &FUTEX[h];
+	Mutex_Lock(&b->lock);
+	if(b->waiters.next == NULL) rlnode_init(&b->waiters, NULL);
+	return b;
+}
+
+
+int FutexWait(int* addr, int expected, timeout_t timeout)
+{
+	futex_bucket* b = futex_lock(addr);
+
+	if(__atomic_load_n(addr, __ATOMIC_SEQ_CST) != expected) {
+		Mutex_Unlock(&b->lock);
+		return 0;
+	}
+
+	__futex_waiter waiter = { .addr = addr, .thread = cur_thread(), .woken = 0 };
+	rlnode_init(&waiter.node, &waiter);
+	rlist_push_back(&b->waiters, &waiter.node);
+
+	sleep_releasing(STOPPED, &b->lock, SCHED_USER, 
+		(timeout==FUTEX_NO_TIMEOUT) ? NO_TIMEOUT : timeout*1000ul);
+
+	/* If we were not woken by FutexWake, we are still queued */
+	Mutex_Lock(&b->lock);
+	if(! waiter.woken)
+		rlist_remove(&waiter.node);
+	Mutex_Unlock(&b->lock);
+
+	return waiter.woken;
+}
+
+
+int FutexWake(int* addr, int n)
+{
+	int count = 0;
+	futex_bucket* b = futex_lock(addr);
+
+	for(rlnode* p = b->waiters.next; p != &b->waiters && count < n; ) {
+		__futex_waiter* w = p->obj;
+		p = p->next;
+		if(w->addr == addr) {
+			rlist_remove(&w->node);
+			w->woken = 1;
+			wakeup(w->thread);
+			count++;
+		}
+	}
+
+	Mutex_Unlock(&b->lock);
+	return count;
+}
+
+
+
 
 
 /*
@@ -222,14 +534,11 @@ void Cond_Broadcast(CondVar* cv)
  * 
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+/* 
+	The kernel semaphore is implemented as a monitor, with kernel_mutex. 
+	The semaphore counter is kernel_sem, and its condition is kernel_sem_cv
+	(see struct cc_state).
+ */
 
 void kernel_lock()
 {
@@ -257,8 +566,22 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);	
 
+	lock_stat* ls = lockstat_enabled() ? lockstat_get(wchan_name, LOCKINFO_WCHAN) : NULL;
+	uint64_t wait_start = 0;
+	if(ls) {
+		wait_start = lockstat_clock();
+		lockstat_add_waiter(ls);
+	}
+
 	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
 
+	if(ls) {
+		LS_ADD(ls->acquisitions, 1);
+		if(! ret) LS_ADD(ls->timeouts, 1);
+		LS_ADD(ls->wait_time, lockstat_clock() - wait_start);
+		LS_SUB(ls->waiters, 1);
+	}
+
 	/* Reacquire kernel semaphore */
 	while(kernel_sem<=0)
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
@@ -268,14 +591,24 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 	return ret;
 }
 
+/*
+	Kernel waiters must re-acquire the kernel semaphore after they 
+	are signalled. The semaphore is held by the signalling thread, so 
+	the waiters are requeued to the semaphore's condition variable 
+	(wait morphing), and are woken up one at a time by kernel_unlock().
+	Since the caller holds the semaphore, kernel_mutex is not needed:
+	the waiters are on kernel_sem_cv before the caller can release it.
+ */
 void kernel_signal(CondVar* cv) 
 { 
-	Cond_Signal(cv); 
+	assert(kernel_sem <= 0);
+	cv_requeue(cv, &kernel_sem_cv, 0);
 }
 
 void kernel_broadcast(CondVar* cv) 
 { 
-	Cond_Broadcast(cv); 
+	assert(kernel_sem <= 0);
+	cv_requeue(cv, &kernel_sem_cv, 1);
 }
 
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
@@ -289,3 +622,248 @@ void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 
 
 
+
+
+
+/*
+ *
+ * Epoch-based reclamation
+ *
+ */
+
+/*
+	Readers that access kernel objects without the kernel lock (PT[], the
+	FIDT and FCBs of the current process, PORT_MAP) do so inside an epoch 
+	section, with preemption off. Writers never free or recycle an object 
+	that such a reader may still hold. Instead, they retire it, and the 
+	object is reclaimed after a grace period, when every core that was 
+	inside an epoch section at the time has left it.
+
+	Each core announces the global epoch it entered at. The global epoch
+	advances only when all active cores have announced it. Hence, an object
+	retired at epoch e can be reclaimed once the global epoch reaches e+2.
+
+	The limbo list is protected by the kernel lock, which is held by all
+	callers of epoch_retire and epoch_reclaim. Readers never touch it.
+ */
+
+int epoch_enter()
+{
+	int preempt = preempt_off;
+	core_epoch* ce = &CORE_EPOCH[cpu_core_id];
+	if(ce->active == 0) {
+		__atomic_store_n(&ce->active, 1, __ATOMIC_SEQ_CST);
+		/* Our announcement must be current and visible before we read 
+		   any object */
+		unsigned long e;
+		do {
+			e = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&ce->epoch, e, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		} while(e != __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST));
+	} else
+		ce->active++;
+	return preempt;
+}
+
+
+void epoch_exit(int preempt)
+{
+	core_epoch* ce = &CORE_EPOCH[cpu_core_id];
+	assert(ce->active > 0);
+	__atomic_store_n(&ce->active, ce->active-1, __ATOMIC_RELEASE);
+	if(preempt) preempt_on;
+}
+
+
+/* Advance the global epoch from e, if every active core has announced e */
+static int epoch_try_advance(unsigned long e)
+{
+	for(uint c=0; c<cpu_cores(); c++) {
+		core_epoch* ce = &CORE_EPOCH[c];
+		if(__atomic_load_n(&ce->active, __ATOMIC_SEQ_CST) &&
+			__atomic_load_n(&ce->epoch, __ATOMIC_SEQ_CST) != e)
+			return 0;
+	}
+	/* This fails only if some other caller advanced it first */
+	__atomic_compare_exchange_n(&epoch_global, &e, e+1, 0, 
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+
+void epoch_reclaim()
+{
+	/* Two advances are enough for everything retired so far */
+	for(int i=0; i<2; i++)
+		if(! epoch_try_advance(__atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST)))
+			break;
+
+	unsigned long e = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	while(! is_rlist_empty(&epoch_limbo)) {
+		retired_obj* r = epoch_limbo.next->obj;
+		if(r->epoch + 2 > e) break;
+		rlist_remove(&r->node);
+		r->reclaim(r->obj);
+		free(r);
+	}
+}
+
+
+void epoch_retire(void (*reclaim)(void*), void* obj)
+{
+	retired_obj* r = xmalloc(sizeof(retired_obj));
+	rlnode_init(&r->node, r);
+	r->reclaim = reclaim;
+	r->obj = obj;
+	r->epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	rlist_push_back(&epoch_limbo, &r->node);
+
+	epoch_reclaim();
+}
+
+
+void epoch_barrier()
+{
+	unsigned long e = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	unsigned long target = e + 2;
+
+	/* Epoch sections are short and never block, so we just spin */
+	while(e < target) {
+		if(! epoch_try_advance(e)) {
+#if defined(__x86__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+		e = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	}
+}
+
+
+
+
+
+/*
+ *
+ * Lock statistics reports and the lock information stream
+ *
+ */
+
+void initialize_lockstat()
+{
+	/* The state of the module, zeroed */
+	KVM->cc = xcalloc_aligned(sizeof(struct cc_state));
+	kernel_sem = 1;
+
+	lockstat_on = 0;
+	memset(LOCKSTAT, 0, sizeof(LOCKSTAT));
+	memset(&LOCKSTAT_OVERFLOW, 0, sizeof(LOCKSTAT_OVERFLOW));
+	LOCKSTAT_OVERFLOW.name = "(other)";
+
+	lockstat_name(&kernel_mutex, "kernel_mutex");
+	lockstat_name(&kernel_sem_cv.waitset_lock, "kernel_sem_cv");
+
+	rlnode_init(&epoch_limbo, NULL);
+}
+
+/* Copy an entry into a lockinfo record */
+static void lockstat_snapshot(lock_stat* ls, lockinfo* info)
+{
+	info->type = ls->type;
+	if(ls->name)
+		snprintf(info->name, LOCKINFO_NAME_SIZE, "%s", ls->name);
+	else
+		snprintf(info->name, LOCKINFO_NAME_SIZE, "mutex@%p", ls->key);
+
+	info->acquisitions = __atomic_load_n(&ls->acquisitions, __ATOMIC_RELAXED);
+	info->contended = __atomic_load_n(&ls->contended, __ATOMIC_RELAXED);
+	info->timeouts = __atomic_load_n(&ls->timeouts, __ATOMIC_RELAXED);
+	info->spins = __atomic_load_n(&ls->spins, __ATOMIC_RELAXED);
+	info->yields = __atomic_load_n(&ls->yields, __ATOMIC_RELAXED);
+	info->hold_time = __atomic_load_n(&ls->hold_time, __ATOMIC_RELAXED);
+	info->wait_time = __atomic_load_n(&ls->wait_time, __ATOMIC_RELAXED);
+	info->waiters = __atomic_load_n(&ls->waiters, __ATOMIC_RELAXED);
+	info->max_waiters = __atomic_load_n(&ls->max_waiters, __ATOMIC_RELAXED);
+}
+
+static int lockinfo_compare(const void* a, const void* b)
+{
+	const lockinfo* la = a;
+	const lockinfo* lb = b;
+	if(la->wait_time != lb->wait_time)
+		return (la->wait_time < lb->wait_time) ? 1 : -1;
+	if(la->acquisitions != lb->acquisitions)
+		return (la->acquisitions < lb->acquisitions) ? 1 : -1;
+	return strcmp(la->name, lb->name);
+}
+
+/*
+	Take a sorted snapshot of all used entries. The returned array
+	must be freed by the caller. 
+ */
+static lockinfo* lockstat_collect(uint* count)
+{
+	lockinfo* infos = xmalloc((LOCKSTAT_SIZE+1)*sizeof(lockinfo));
+	uint n = 0;
+
+	for(uint i=0; i<LOCKSTAT_SIZE; i++) {
+		lock_stat* ls = &LOCKSTAT[i];
+		if(__atomic_load_n(&ls->key, __ATOMIC_ACQUIRE)==NULL) continue;
+		if(ls->acquisitions==0 && ls->waiters==0) continue;
+		lockstat_snapshot(ls, &infos[n++]);
+	}
+	if(LOCKSTAT_OVERFLOW.acquisitions > 0)
+		lockstat_snapshot(&LOCKSTAT_OVERFLOW, &infos[n++]);
+
+	qsort(infos, n, sizeof(lockinfo), lockinfo_compare);
+	*count = n;
+	return infos;
+}
+
+
+void lockstat_report(FILE* out)
+{
+	uint n;
+	lockinfo* infos = lockstat_collect(&n);
+
+	fprintf(out, "%-5s %-32s %10s %10s %10s %12s %8s %12s %12s %6s\n",
+		"TYPE", "NAME", "ACQUIRED", "CONTENDED", "TIMEOUTS", "SPINS", "YIELDS", 
+		"HOLD(ms)", "WAIT(ms)", "MAXW");
+	for(uint i=0; i<n; i++) {
+		lockinfo* li = &infos[i];
+		fprintf(out, "%-5s %-32s %10lu %10lu %10lu %12lu %8lu %12.3f %12.3f %6lu\n",
+			li->type==LOCKINFO_MUTEX ? "mutex" : "wchan", li->name,
+			li->acquisitions, li->contended, li->timeouts, li->spins, li->yields,
+			1E-6*li->hold_time, 1E-6*li->wait_time, li->max_waiters);
+	}
+
+	free(infos);
+}
+
+
+int sys_EnableLockStats(int enable)
+{
+	/* 
+		A mutex locked while collection was off has no hold_start, and its
+		release is not timed. Also forget the hold_start of mutexes locked
+		during an earlier collection period, which were released while 
+		collection was off.
+	 */
+	if(enable && ! lockstat_enabled()) {
+		for(uint i=0; i<LOCKSTAT_SIZE; i++)
+			LOCKSTAT[i].hold_start = 0;
+	}
+	return __atomic_exchange_n(&lockstat_on, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+
+/* Take the snapshot of a lock information stream */
+static void* lockinfo_fill(uint* count)
+{
+	return lockstat_collect(count);
+}
+
+Fid_t sys_OpenLockInfo()
+{
+	return open_snapshot_stream(sizeof(lockinfo), lockinfo_fill);
+}
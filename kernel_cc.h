@@ -62,12 +62,16 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 /**
 	@brief Signal a kernel condition to one waiter.
 
-	This call must be made 
+	This call must be made with the kernel lock held. The waiter is not
+	woken up at once; it is moved to the condition of the kernel lock, 
+	and wakes up when the lock becomes available.
   */
 void kernel_signal(CondVar* cv);
 
 /**
 	@brief Signal a kernel condition to all waiters.
+
+	@see kernel_signal
   */
 void kernel_broadcast(CondVar* cv);
 
@@ -82,6 +86,110 @@ void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
 
 
+/*
+ * Epoch-based reclamation.
+ */
+
+/**
+	@brief Enter an epoch section.
+
+	Inside an epoch section, a thread may read some kernel objects without 
+	holding the kernel lock: the PCBs in @c PT[], the FIDT of the current 
+	process and its FCBs (via @c get_fcb), and @c PORT_MAP. Objects reachable
+	from these are not reclaimed before the section exits. Epoch sections 
+	run with preemption off and may be nested; they must not block.
+
+	@code
+	int preempt = epoch_enter();
+	...
+	   // read kernel objects
+	...
+	epoch_exit(preempt);
+	@endcode
+
+	@returns the previous preemption status, to be passed to @c epoch_exit.
+  */
+int epoch_enter();
+
+/**
+	@brief Exit an epoch section.
+	@see epoch_enter
+  */
+void epoch_exit(int preempt);
+
+/**
+	@brief Defer the reclamation of an object.
+
+	The object must have been made unreachable to new epoch sections. 
+	Function @c reclaim is called on the object when no epoch section that 
+	may have observed it is still active. This may happen immediately.
+
+	This must be called with the kernel lock held. Reclamation is always 
+	performed by a caller of @c epoch_retire or @c epoch_reclaim, so 
+	@c reclaim runs with the kernel lock held. This never waits.
+  */
+void epoch_retire(void (*reclaim)(void*), void* obj);
+
+/**
+	@brief Reclaim the retired objects whose grace period is over.
+
+	This must be called with the kernel lock held. It never waits.
+  */
+void epoch_reclaim();
+
+/**
+	@brief Wait for a grace period.
+
+	When this returns, all objects retired before the call can be
+	reclaimed by @c epoch_reclaim. This spins until every active epoch 
+	section has exited, so it must be called neither inside an epoch 
+	section nor with the kernel lock held.
+  */
+void epoch_barrier();
+
+
+
+
+
+
+/*
+ * Lock statistics.
+ */
+
+/**
+	@brief Initialize the lock statistics.
+
+	This function is called at kernel startup, before any other 
+	initialization. It allocates the state of the module (the kernel lock
+	and lock statistics), clears all collected statistics and 
+	turns collection off.
+  */
+void initialize_lockstat();
+
+/**
+	@brief Give a name to a lock, for lock statistics reports.
+
+	Locks without a name are reported by address.
+
+	@param lock the address of the lock
+	@param name a string constant naming the lock
+  */
+void lockstat_name(Mutex* lock, const char* name);
+
+/**
+	@brief Print a lock statistics report, sorted by wait time.
+
+	This is called at shutdown, if lock statistics are enabled.
+  */
+void lockstat_report(FILE* out);
+
+/**
+	@brief Return true if lock statistics are being collected.
+  */
+int lockstat_enabled();
+
+
+
 /** @brief Set the preemption status for the current core.
 
  	Preemption is disabled by disabling interrupts. 
@@ -1,10 +1,13 @@
 
 #include <assert.h>
+#include <time.h>
 #include "kernel_cc.h"
 #include "kernel_dev.h"
 #include "kernel_sched.h"
 #include "kernel_streams.h"
 #include "kernel_proc.h"
+#include "kernel_net.h"
+#include "kernel_vm.h"
 
 /*************************************
 
@@ -12,7 +15,23 @@
 
  *************************************/
 
-DCB DT[MAX_TERMINALS];
+/* 
+  The state of this module, per kernel instance. The arrays of device
+  control blocks have one element per device of the VM.
+ */
+struct dev_state {
+  DCB devtable[MAX_DEVICE_TYPES];
+  uint ndevtypes;
+  uint64_t random_seed;
+  struct serial_device_control_block* serial_dcb;
+  struct block_device_control_block* block_dcb;
+};
+
+#define devtable (KVM->dev->devtable)
+#define ndevtypes (KVM->dev->ndevtypes)
+#define random_seed (KVM->dev->random_seed)
+#define serial_dcb (KVM->dev->serial_dcb)
+#define block_dcb (KVM->dev->block_dcb)
 
 
 /* ===================================
@@ -55,12 +74,128 @@ static file_ops nulldev_fops = {
 };
 
 
+/* ===================================
+
+  The zero device driver
+
+  ====================================*/
+
+/* Reads return zero bytes, writes are discarded */
+
+void* zerodev_open(uint minor)
+{
+  return NULL;
+}
+
+int zerodev_read(void* dev, char *buf, unsigned int size)
+{
+  memset(buf, 0, size);
+  return size;
+}
+
+int zerodev_close(void* dev) 
+{
+  return 0;
+}
+
+static file_ops zerodev_fops = {
+  .Open = zerodev_open,
+  .Read = zerodev_read,
+  .Write = nulldev_write,
+  .Close = zerodev_close
+};
+
+
+/* ===================================
+
+  The random device driver
+
+  ====================================*/
+
+/*
+  Each stream of the random device has its own xorshift64* generator, so 
+  that readers do not contend. The generators are seeded from a per-kernel
+  counter, mixed by splitmix64.
+ */
+
+void* random_open(uint minor)
+{
+  uint64_t* state = xmalloc(sizeof(uint64_t));
+  uint64_t z = (random_seed += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  *state = (z ^ (z >> 31)) | 1;
+  return state;
+}
+
+int random_read(void* dev, char* buf, unsigned int size)
+{
+  uint64_t x = *(uint64_t*)dev;
+  for(unsigned int i=0; i<size; i+=sizeof(uint64_t)) {
+    x ^= x >> 12;  x ^= x << 25;  x ^= x >> 27;
+    uint64_t r = x * 0x2545f4914f6cdd1dull;
+    unsigned int n = (size-i < sizeof(uint64_t)) ? size-i : sizeof(uint64_t);
+    memcpy(buf+i, &r, n);
+  }
+  *(uint64_t*)dev = x;
+  return size;
+}
+
+int random_close(void* dev)
+{
+  free(dev);
+  return 0;
+}
+
+static file_ops random_fops = {
+  .Open = random_open,
+  .Read = random_read,
+  .Write = nulldev_write,
+  .Close = random_close
+};
+
+
 /*============================================
 
   The serial device driver
 
  ============================================*/
 
+/*
+  The driver transfers data through the device queues of the serial port.
+  A number of receive buffers are kept posted to the receive queue; a 
+  reader copies data out of the completed ones, and then posts them back.
+
+  A writer copies its data into the transmit ring of the terminal, and
+  returns without waiting for the console. It sleeps only while the ring
+  is full. The data of the ring is posted to the transmit queue in 
+  contiguous segments, with up to SERIAL_TX_DESCS descriptors in flight.
+  On SERIAL_TX_READY, the sent segments are removed from the ring, more
+  data is posted and the writers are woken up. A close waits until the
+  ring is drained.
+
+  Between the device queues and the readers sits the line discipline of
+  the terminal, selected by SetTerminalMode. In raw mode (the default),
+  a read returns whatever input is available. In canonical mode, input
+  is first edited into a line buffer: erase (backspace or DEL) removes
+  the last character, and a newline, a ^D or a full buffer completes the
+  line. A read then returns (up to) one line. With echo, the input is
+  also copied to the transmit ring, and is dropped if the ring is full.
+
+  The state of a terminal is protected by its spinlock, which is held
+  with preemption off, because the interrupt handlers also take it.
+ */
+
+/* The receive buffers of a terminal */
+#define SERIAL_RX_BUFS 4
+#define SERIAL_RX_BUFSIZE 1024
+
+/* The transmit ring of a terminal, and the descriptors posted from it */
+#define SERIAL_TX_RING 16384
+#define SERIAL_TX_DESCS 8
+
+/* The line buffer of canonical mode */
+#define TTY_LINE_MAX 1024
 
 /* forward */
 void serial_rx_handler();
@@ -69,10 +204,30 @@ void serial_tx_handler();
 typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
-  CondVar rx_ready;
+  CondVar rx_ready;     /* broadcast when input is received */
+  CondVar tx_space;     /* broadcast when output is sent */
+  virtqueue* rxq;
+  virtqueue* txq;
+  vq_desc rxd[SERIAL_RX_BUFS];
+  vq_desc* rx_cur;      /* a received buffer, being read */
+  uint rx_pos;          /* the bytes of rx_cur already read */
+
+  char* tx_ring;        /* output is tx_ring[tx_head .. tx_head+tx_count) */
+  uint tx_head, tx_count;
+  uint tx_posted;       /* the bytes from tx_head posted to txq */
+  vq_desc txd[SERIAL_TX_DESCS];   /* the posted descriptors are */
+  uint tx_first, tx_ndesc;        /* txd[tx_first .. tx_first+tx_ndesc) */
+  int tx_error;         /* some output was lost */
+
+  int tty_mode;         /* the TTY_* flags of the line discipline */
+  char* tty_line;       /* the line being edited in canonical mode */
+  uint tty_len;         /* the length of the line */
+  uint tty_pos;         /* the bytes of the line already read */
+  int tty_ready;        /* the line is complete */
 } serial_dcb_t;
 
-serial_dcb_t serial_dcb[MAX_TERMINALS];
+/* forward */
+static uint serial_tx_put(serial_dcb_t* dcb, const char* buf, uint size);
 
 
 
@@ -84,87 +239,253 @@ void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
-  for(int i=0;i<bios_serial_ports();i++) {
+  /* Signal only the terminals which raised the interrupt */
+  unsigned int pending = bios_serial_rx_pending();
+  while(pending) {
+    int i = __builtin_ctz(pending);
+    pending &= pending - 1;
     serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
 
+/* Return true if there is received input, making it current */
+static inline int serial_rx_avail(serial_dcb_t* dcb)
+{
+  return dcb->rx_cur != NULL || (dcb->rx_cur = bios_vq_collect(dcb->rxq)) != NULL;
+}
+
+/* Copy from the received buffers, until size or no more input */
+static uint serial_rx_copy(serial_dcb_t* dcb, char* buf, uint size)
+{
+  uint count = 0;
+  while(count < size && serial_rx_avail(dcb)) {
+    vq_desc* d = dcb->rx_cur;
+    uint n = d->used - dcb->rx_pos;
+    if(n > size - count) n = size - count;
+    memcpy(buf + count, (char*)d->buf + dcb->rx_pos, n);
+    count += n;
+    dcb->rx_pos += n;
+
+    if(dcb->rx_pos == d->used) {
+      dcb->rx_pos = 0;
+      int ok = bios_vq_post(dcb->rxq, d);
+      assert(ok);  (void)ok;
+      dcb->rx_cur = NULL;
+    }
+  }
+  return count;
+}
+
+/* Echo input to the console, if enabled */
+static inline void tty_echo(serial_dcb_t* dcb, const char* buf, uint size)
+{
+  if(dcb->tty_mode & TTY_ECHO)
+    serial_tx_put(dcb, buf, size);
+}
+
+/* 
+  Edit the received input into the line buffer, until the line is
+  complete or there is no more input. Return true if the line is complete.
+ */
+static int tty_edit(serial_dcb_t* dcb)
+{
+  char c;
+  while(!dcb->tty_ready && serial_rx_copy(dcb, &c, 1)) {
+    switch(c) {
+      case '\b':
+      case 0x7f:    /* erase */
+        if(dcb->tty_len > 0) {
+          dcb->tty_len--;
+          tty_echo(dcb, "\b \b", 3);
+        }
+        break;
+      case 0x04:    /* ^D, end of file on an empty line */
+        dcb->tty_ready = 1;
+        break;
+      case '\r':
+        c = '\n';
+        /* fall through */
+      default:
+        dcb->tty_line[dcb->tty_len++] = c;
+        tty_echo(dcb, &c, 1);
+        if(c == '\n' || dcb->tty_len == TTY_LINE_MAX)
+          dcb->tty_ready = 1;
+    }
+  }
+  return dcb->tty_ready;
+}
+
+/* 
+  Read from the line buffer. A line is discarded when it is read fully.
+  In raw mode, this returns what was left over from canonical mode.
+ */
+static uint tty_take(serial_dcb_t* dcb, char* buf, uint size)
+{
+  uint n = dcb->tty_len - dcb->tty_pos;
+  if(n > size) n = size;
+  memcpy(buf, dcb->tty_line + dcb->tty_pos, n);
+  dcb->tty_pos += n;
+
+  if(dcb->tty_pos == dcb->tty_len && (dcb->tty_ready || !(dcb->tty_mode & TTY_CANON)))
+    dcb->tty_len = dcb->tty_pos = dcb->tty_ready = 0;
+  return n;
+}
+
 /*
   Read from the device, sleeping if needed.
  */
 int serial_read(void* dev, char *buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  if(size == 0) return 0;
 
-  preempt_off;            /* Stop preemption */
-
-  uint count =  0;
-
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
-    }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
-    }
-    else
-      break;
+  kernel_unlock();
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  uint count;
+  if(dcb->tty_mode & TTY_CANON) {
+    /* Deliver (the rest of) one line; an empty line is the end of file */
+    while(! tty_edit(dcb))
+      Cond_Wait(&dcb->spinlock, &dcb->rx_ready);
+    count = tty_take(dcb, buf, size);
+  }
+  else if((count = tty_take(dcb, buf, size)) == 0) {
+    while(! serial_rx_avail(dcb))
+      Cond_Wait(&dcb->spinlock, &dcb->rx_ready);
+    count = serial_rx_copy(dcb, buf, size);
+    tty_echo(dcb, buf, count);
   }
 
-  preempt_on;           /* Restart preemption */
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+  kernel_lock();
 
   return count;
 }
 
 
 /*
-  A polling driver for serial writes
-  */
+  Interrupt-driven driver for serial-device writes.
+ */
+
+/* Post the unposted data of the ring, in contiguous segments */
+static void serial_tx_post(serial_dcb_t* dcb)
+{
+  while(dcb->tx_posted < dcb->tx_count && dcb->tx_ndesc < SERIAL_TX_DESCS) {
+    uint start = (dcb->tx_head + dcb->tx_posted) % SERIAL_TX_RING;
+    uint len = dcb->tx_count - dcb->tx_posted;
+    if(len > SERIAL_TX_RING - start) len = SERIAL_TX_RING - start;
+
+    vq_desc* d = &dcb->txd[(dcb->tx_first + dcb->tx_ndesc) % SERIAL_TX_DESCS];
+    d->buf = dcb->tx_ring + start;
+    d->len = len;
+    int ok = bios_vq_post(dcb->txq, d);
+    assert(ok);  (void)ok;
+    dcb->tx_ndesc++;
+    dcb->tx_posted += len;
+  }
+}
 
-/* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  for(int i=0;i<bios_serial_ports();i++) {
+    serial_dcb_t* dcb = &serial_dcb[i];
+    int completed = 0;
+
+    Mutex_Lock(&dcb->spinlock);
+    vq_desc* d;
+    while((d = bios_vq_collect(dcb->txq)) != NULL) {
+      /* Descriptors complete in order. A failed segment is dropped. */
+      assert(d == &dcb->txd[dcb->tx_first]);
+      if(d->status == -1) dcb->tx_error = 1;
+      dcb->tx_head = (dcb->tx_head + d->len) % SERIAL_TX_RING;
+      dcb->tx_count -= d->len;
+      dcb->tx_posted -= d->len;
+      dcb->tx_first = (dcb->tx_first + 1) % SERIAL_TX_DESCS;
+      dcb->tx_ndesc--;
+      completed = 1;
+    }
+    if(completed) {
+      serial_tx_post(dcb);
+      Cond_Broadcast(&dcb->tx_space);
+    }
+    Mutex_Unlock(&dcb->spinlock);
+  }
+  if(pre) preempt_on;
+}
+
+/* Copy as much data as fits into the transmit ring, and post it */
+static uint serial_tx_put(serial_dcb_t* dcb, const char* buf, uint size)
+{
+  uint tail = (dcb->tx_head + dcb->tx_count) % SERIAL_TX_RING;
+  uint n = size;
+  if(n > SERIAL_TX_RING - dcb->tx_count) n = SERIAL_TX_RING - dcb->tx_count;
+  uint n1 = (n < SERIAL_TX_RING - tail) ? n : SERIAL_TX_RING - tail;
+  memcpy(dcb->tx_ring + tail, buf, n1);
+  memcpy(dcb->tx_ring, buf + n1, n - n1);
+  dcb->tx_count += n;
+
+  serial_tx_post(dcb);
+  return n;
 }
 
 /* 
-  Write call 
-  This is currently a polling driver.
+  Write call. The data is copied into the transmit ring, sleeping while
+  it is full. Output that the device fails to send is reported by Close.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  if(size == 0) return 0;
 
-  unsigned int count = 0;
+  kernel_unlock();
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  int count = 0;
   while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
-
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
-    }
-    else
-      break;
+    while(dcb->tx_count == SERIAL_TX_RING)
+      Cond_Wait(&dcb->spinlock, &dcb->tx_space);
+    count += serial_tx_put(dcb, buf + count, size - count);
   }
 
-  return count;  
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+  kernel_lock();
+
+  return count;
 }
 
 
+/*
+  Close call. The output of the terminal is drained. If some output
+  was lost since the previous Close, this returns -1.
+ */
 int serial_close(void* dev) 
 {
-  return 0;
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  kernel_unlock();
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  while(dcb->tx_count > 0)
+    Cond_Wait(&dcb->spinlock, &dcb->tx_space);
+  int retval = dcb->tx_error ? -1 : 0;
+  dcb->tx_error = 0;
+
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+  kernel_lock();
+
+  return retval;
 }
 
 
@@ -184,6 +505,318 @@ file_ops serial_fops = {
 };
 
 
+int sys_SetTerminalMode(Fid_t fid, int mode)
+{
+  FCB* fcb = get_fcb(fid);
+  if(fcb == NULL || fcb->streamfunc != &devtable[DEV_SERIAL].dev_fops) 
+    return -1;
+  if(mode & ~(TTY_CANON|TTY_ECHO))
+    return -1;
+
+  serial_dcb_t* dcb = fcb->streamobj;
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  int prev = dcb->tty_mode;
+  dcb->tty_mode = mode;
+  /* The readers may now return a partial line */
+  Cond_Broadcast(&dcb->rx_ready);
+
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
+  return prev;
+}
+
+
+
+/*============================================
+
+  The block device driver
+
+ ============================================*/
+
+/*
+  Requests are kept in an elevator queue, sorted by sector, and are
+  dispatched in C-LOOK order: the next request is the first one at or 
+  after the end of the previous one, or the lowest one. A dispatched
+  request is merged with the following adjacent requests of the same
+  direction, into one BIOS request, using a bounce buffer.
+
+  At most BLOCK_MAX_INFLIGHT requests per disk are submitted to the BIOS.
+  The rest wait in the queue, where they can be merged.
+
+  The state of a disk is protected by its lock, which is held with 
+  preemption off, because the DISK_COMPLETE handler also takes it.
+ */
+
+/* Max. number of BIOS requests per disk */
+#define BLOCK_MAX_INFLIGHT 8
+
+/* Max. size of a merged request, in sectors */
+#define BLOCK_MAX_MERGE 128
+
+/* forward */
+void block_complete_handler();
+
+typedef struct block_request {
+  rlnode node;          /* in the queue, or in the parts of a batch */
+  uint64_t sector;
+  uint nsectors;
+  int write;
+  char* buf;
+  int done;
+  int status;
+} block_request;
+
+/* A BIOS request, serving one or more merged block requests */
+typedef struct block_batch {
+  disk_request dreq;
+  rlnode parts;
+  rlnode fnode;         /* in the free list */
+  char* bounce;         /* BLOCK_MAX_MERGE sectors */
+} block_batch;
+
+typedef struct block_device_control_block {
+  uint devno;
+  Mutex lock;
+  CondVar done;         /* broadcast when requests complete */
+  rlnode queue;         /* the elevator queue */
+  uint64_t head;        /* the sector after the last dispatched request */
+  rlnode free_batches;
+  block_batch batch[BLOCK_MAX_INFLIGHT];
+} block_dcb_t;
+
+
+/* Insert a request in the elevator queue */
+static void block_enqueue(block_dcb_t* dcb, block_request* r)
+{
+  rlnode* p = dcb->queue.next;
+  while(p != &dcb->queue && ((block_request*)p->obj)->sector <= r->sector)
+    p = p->next;
+  rlist_push_back(p, &r->node);
+}
+
+
+/* Submit queued requests to the BIOS, while there are free batches */
+static void block_dispatch(block_dcb_t* dcb)
+{
+  while(! is_rlist_empty(&dcb->queue) && ! is_rlist_empty(&dcb->free_batches)) {
+
+    /* C-LOOK */
+    rlnode* n = dcb->queue.next;
+    for(rlnode* p = n; p != &dcb->queue; p = p->next)
+      if(((block_request*)p->obj)->sector >= dcb->head) { n = p; break; }
+
+    block_batch* b = rlist_pop_front(&dcb->free_batches)->obj;
+    block_request* r = n->obj;
+    rlnode* next = n->next;
+    rlist_push_back(&b->parts, rlist_remove(n));
+
+    /* Merge the following adjacent requests */
+    uint64_t end = r->sector + r->nsectors;
+    uint total = r->nsectors;
+    while(next != &dcb->queue) {
+      block_request* q = next->obj;
+      if(q->sector != end || q->write != r->write || total + q->nsectors > BLOCK_MAX_MERGE)
+        break;
+      rlnode* nn = next->next;
+      rlist_push_back(&b->parts, rlist_remove(next));
+      end += q->nsectors;
+      total += q->nsectors;
+      next = nn;
+    }
+
+    disk_request* d = &b->dreq;
+    d->sector = r->sector;
+    d->nsectors = total;
+    d->write = r->write;
+    d->tag = b;
+    if(total == r->nsectors)
+      d->buf = r->buf;
+    else {
+      d->buf = b->bounce;
+      if(d->write) {
+        char* pos = b->bounce;
+        for(rlnode* p = b->parts.next; p != &b->parts; p = p->next) {
+          block_request* q = p->obj;
+          memcpy(pos, q->buf, q->nsectors * DISK_SECTOR_SIZE);
+          pos += q->nsectors * DISK_SECTOR_SIZE;
+        }
+      }
+    }
+
+    dcb->head = end;
+    int ok = bios_disk_submit(dcb->devno, d);
+    assert(ok);  (void)ok;
+  }
+}
+
+
+/*
+  Interrupt handler: complete the requests of the finished BIOS requests,
+  and dispatch more.
+ */
+void block_complete_handler()
+{
+  int pre = preempt_off;
+
+  for(uint i=0; i<bios_disks(); i++) {
+    block_dcb_t* dcb = &block_dcb[i];
+    int completed = 0;
+
+    Mutex_Lock(&dcb->lock);
+    disk_request* d;
+    while((d = bios_disk_complete(i)) != NULL) {
+      block_batch* b = d->tag;
+      char* pos = b->bounce;
+      while(! is_rlist_empty(&b->parts)) {
+        block_request* q = rlist_pop_front(&b->parts)->obj;
+        if(d->buf == b->bounce && ! d->write)
+          memcpy(q->buf, pos, q->nsectors * DISK_SECTOR_SIZE);
+        pos += q->nsectors * DISK_SECTOR_SIZE;
+        q->status = d->status;
+        q->done = 1;
+      }
+      rlist_push_back(&dcb->free_batches, &b->fnode);
+      completed = 1;
+    }
+    if(completed) {
+      block_dispatch(dcb);
+      Cond_Broadcast(&dcb->done);
+    }
+    Mutex_Unlock(&dcb->lock);
+  }
+
+  if(pre) preempt_on;
+}
+
+
+/* Perform a request, sleeping until it completes */
+static int block_io(uint minor, uint64_t sector, char* buf, uint nsectors, int write)
+{
+  if(minor >= bios_disks()) return -1;
+  if(nsectors == 0) return 0;
+
+  block_dcb_t* dcb = &block_dcb[minor];
+  block_request r = { .sector = sector, .nsectors = nsectors, .write = write,
+    .buf = buf, .done = 0, .status = 0 };
+  rlnode_init(&r.node, &r);
+
+  kernel_unlock();
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->lock);
+
+  block_enqueue(dcb, &r);
+  block_dispatch(dcb);
+  while(! r.done)
+    Cond_Wait(&dcb->lock, &dcb->done);
+
+  Mutex_Unlock(&dcb->lock);
+  if(pre) preempt_on;
+  kernel_lock();
+
+  return r.status;
+}
+
+int block_read(uint minor, uint64_t sector, void* buf, uint nsectors)
+{
+  return block_io(minor, sector, buf, nsectors, 0);
+}
+
+int block_write(uint minor, uint64_t sector, const void* buf, uint nsectors)
+{
+  return block_io(minor, sector, (char*) buf, nsectors, 1);
+}
+
+
+/* 
+  A block device stream reads and writes whole sectors, sequentially
+  from the start of the disk.
+*/
+typedef struct block_stream {
+  uint minor;
+  uint64_t pos;         /* in sectors */
+} block_stream;
+
+static int block_stream_io(block_stream* bs, char* buf, unsigned int size, int write)
+{
+  if(size % DISK_SECTOR_SIZE != 0) return -1;
+
+  uint64_t avail = bios_disk_sectors(bs->minor) - bs->pos;
+  uint n = size / DISK_SECTOR_SIZE;
+  if(n > avail) n = avail;
+  if(n == 0) return 0;
+
+  if(block_io(bs->minor, bs->pos, buf, n, write) == -1) return -1;
+  bs->pos += n;
+  return n * DISK_SECTOR_SIZE;
+}
+
+int block_stream_read(void* dev, char *buf, unsigned int size)
+{
+  return block_stream_io(dev, buf, size, 0);
+}
+
+int block_stream_write(void* dev, const char* buf, unsigned int size)
+{
+  return block_stream_io(dev, (char*)buf, size, 1);
+}
+
+/* The position is in bytes, and must be a sector within the disk */
+int64_t block_stream_seek(void* dev, int64_t offset, int whence)
+{
+  block_stream* bs = dev;
+  int64_t sectors = bios_disk_sectors(bs->minor);
+  int64_t base;
+  switch(whence) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = bs->pos * DISK_SECTOR_SIZE; break;
+    case SEEK_END: base = sectors * DISK_SECTOR_SIZE; break;
+    default: return -1;
+  }
+  int64_t pos = base + offset;
+  if(pos < 0 || pos % DISK_SECTOR_SIZE != 0 || pos > sectors * DISK_SECTOR_SIZE) 
+    return -1;
+  bs->pos = pos / DISK_SECTOR_SIZE;
+  return pos;
+}
+
+int block_stream_close(void* dev)
+{
+  free(dev);
+  return 0;
+}
+
+void* block_stream_open(uint minor)
+{
+  assert(minor < bios_disks());
+  block_stream* bs = xmalloc(sizeof(block_stream));
+  bs->minor = minor;
+  bs->pos = 0;
+  return bs;
+}
+
+file_ops block_fops = {
+  .Open = block_stream_open,
+  .Read = block_stream_read,
+  .Write = block_stream_write,
+  .Close = block_stream_close,
+  .Seek = block_stream_seek
+};
+
+
+int sys_BlockRead(unsigned int dev, uint64_t sector, char* buf, unsigned int nsectors)
+{
+  return block_read(dev, sector, buf, nsectors);
+}
+
+int sys_BlockWrite(unsigned int dev, uint64_t sector, const char* buf, unsigned int nsectors)
+{
+  return block_write(dev, sector, buf, nsectors);
+}
+
+
 
 /***********************************
 
@@ -191,36 +824,148 @@ file_ops serial_fops = {
 
 ***********************************/
 
-DCB devtable[DEV_MAX];
+static void serial_init(uint nminor)
+{
+  serial_dcb = xcalloc_aligned(nminor * sizeof(serial_dcb_t));
+
+  for(uint i=0; i<nminor; i++) {
+    serial_dcb_t* dcb = &serial_dcb[i];
+    dcb->devno = i;
+    dcb->rx_ready = COND_INIT;
+    dcb->tx_space = COND_INIT;
+    dcb->spinlock = MUTEX_INIT;
+    dcb->rxq = bios_serial_rx_queue(i);
+    dcb->txq = bios_serial_tx_queue(i);
+    dcb->rx_cur = NULL;
+    dcb->rx_pos = 0;
+    dcb->tx_ring = xmalloc(SERIAL_TX_RING);
+    dcb->tx_head = dcb->tx_count = dcb->tx_posted = 0;
+    dcb->tx_first = dcb->tx_ndesc = 0;
+    dcb->tx_error = 0;
+    dcb->tty_mode = TTY_RAW;
+    dcb->tty_line = xmalloc(TTY_LINE_MAX);
+    dcb->tty_len = dcb->tty_pos = dcb->tty_ready = 0;
+    for(uint b=0; b<SERIAL_RX_BUFS; b++) {
+      vq_desc* d = &dcb->rxd[b];
+      d->buf = xmalloc(SERIAL_RX_BUFSIZE);
+      d->len = SERIAL_RX_BUFSIZE;
+      int ok = bios_vq_post(dcb->rxq, d);
+      assert(ok);  (void)ok;
+    }
+  }
+
+  cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
+  cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+}
 
 
+static void block_init(uint nminor)
+{
+  block_dcb = xcalloc_aligned(nminor * sizeof(block_dcb_t));
+
+  for(uint i=0; i<nminor; i++) {
+    block_dcb_t* dcb = &block_dcb[i];
+    dcb->devno = i;
+    dcb->lock = MUTEX_INIT;
+    dcb->done = COND_INIT;
+    rlnode_init(&dcb->queue, NULL);
+    dcb->head = 0;
+    rlnode_init(&dcb->free_batches, NULL);
+    for(uint b=0; b<BLOCK_MAX_INFLIGHT; b++) {
+      block_batch* batch = &dcb->batch[b];
+      rlnode_init(&batch->parts, NULL);
+      rlnode_init(&batch->fnode, batch);
+      batch->bounce = xmalloc(BLOCK_MAX_MERGE * DISK_SECTOR_SIZE);
+      rlist_push_back(&dcb->free_batches, &batch->fnode);
+    }
+  }
 
-void initialize_devices()
+  cpu_interrupt_handler(DISK_COMPLETE, block_complete_handler);
+}
+
+
+static void net_init(uint nminor)
 {
+  initialize_network();
+}
 
-  devtable[DEV_NULL].type = DEV_NULL;
-  devtable[DEV_NULL].devnum = 1;
-  devtable[DEV_NULL].dev_fops = nulldev_fops;
 
-  devtable[DEV_SERIAL].type = DEV_SERIAL;
-  devtable[DEV_SERIAL].devnum = bios_serial_ports();
-  devtable[DEV_SERIAL].dev_fops = serial_fops;
+void initialize_devices()
+{
+  KVM->dev = xcalloc_aligned(sizeof(struct dev_state));
+  ndevtypes = 0;
+  random_seed = (uint64_t) time(NULL);
+
+  /* The built-in drivers, in the order of Device_type */
+  int major;
+  major = register_device("null", 1, &nulldev_fops, NULL);
+  assert(major == DEV_NULL);
+  major = register_device("serial", bios_serial_ports(), &serial_fops, serial_init);
+  assert(major == DEV_SERIAL);
+  major = register_device("block", bios_disks(), &block_fops, block_init);
+  assert(major == DEV_BLOCK);
+  major = register_device("net", (bios_nic_node() >= 0), &net_fops, net_init);
+  assert(major == DEV_NET);
+  (void)major;
+
+  /* Pseudo-devices */
+  register_device("zero", 1, &zerodev_fops, NULL);
+  register_device("random", 1, &random_fops, NULL);
+}
+
 
-  /* Initialize the serial devices */
-  for(int i=0; i<bios_serial_ports(); i++) {
-    serial_dcb[i].devno = i;
-    serial_dcb[i].rx_ready = COND_INIT;
-    serial_dcb[i].spinlock = MUTEX_INIT;
+void finalize_devices()
+{
+  finalize_network();
+
+  /* The VM has stopped, so we cannot ask the BIOS */
+  for(uint i=0; i<devtable[DEV_BLOCK].devnum; i++)
+    for(uint b=0; b<BLOCK_MAX_INFLIGHT; b++)
+      free(block_dcb[i].batch[b].bounce);
+  for(uint i=0; i<devtable[DEV_SERIAL].devnum; i++) {
+    for(uint b=0; b<SERIAL_RX_BUFS; b++)
+      free(serial_dcb[i].rxd[b].buf);
+    free(serial_dcb[i].tx_ring);
+    free(serial_dcb[i].tty_line);
   }
 
-  cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
-  cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+  free(block_dcb);
+  free(serial_dcb);
+  free(KVM->dev);
+  KVM->dev = NULL;
+}
+
+
+int register_device(const char* name, uint nminor, file_ops* fops, device_init init)
+{
+  if(ndevtypes == MAX_DEVICE_TYPES || strlen(name) > MAX_DEVICE_NAME 
+     || device_lookup(name) != -1)
+    return -1;
+
+  uint major = ndevtypes++;
+  DCB* dcb = &devtable[major];
+  dcb->type = major;
+  strcpy(dcb->name, name);
+  dcb->devnum = nminor;
+  dcb->dev_fops = *fops;
+
+  if(init) init(nminor);
+  return major;
+}
+
+
+int device_lookup(const char* name)
+{
+  for(uint major=0; major<ndevtypes; major++)
+    if(strcmp(devtable[major].name, name) == 0)
+      return major;
+  return -1;
 }
 
 
 int device_open(Device_type major, uint minor, void** obj, file_ops** ops)
 {
-  assert(major < DEV_MAX);  
+  assert(major < ndevtypes);  
   if(minor >= devtable[major].devnum)
     return -1;
   *obj = devtable[major].dev_fops.Open(minor);
@@ -232,5 +977,3 @@ uint device_no(Device_type major)
 {
   return devtable[major].devnum;
 }
-
-
@@ -30,6 +30,12 @@
   a pointer to a file_ops object, which contains driver routines
   for this device.
 
+  Device drivers are added to the table by @c register_device, which
+  assigns them the next free major number. Each driver also has a name
+  (e.g., "serial"), by which programs open its devices with
+  @c OpenDevice. The built-in drivers are registered at kernel startup,
+  in the order of @c Device_type.
+
   @{ 
 */
 
@@ -92,6 +98,23 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Seek operation.
+
+      Move the position of stream 'this', as described in @c Seek, 
+      returning the new position or -1 on error. This method is optional;
+      streams which do not have a position leave it NULL.
+     */
+    int64_t (*Seek)(void* this, int64_t offset, int whence);
+
+    /** @brief Non-zero if the Read operation is lock-free.
+
+      Then, @c Read is called without the kernel lock, inside an epoch
+      section (see @c epoch_enter), possibly by several threads at once. 
+      It must not block. Also, @c Close must not free the stream object 
+      directly, but retire it with @c epoch_retire.
+     */
+    int lockfree_read;
 } file_ops;
 
 
@@ -99,14 +122,31 @@ typedef struct file_operations {
 /**
   @brief The device type.
 	
-  The device type of a device determines the driver used.
+  The device type of a device determines the driver used. These are the
+  major numbers of the built-in drivers; drivers registered later get
+  the following numbers.
 */
 typedef enum { 
 	DEV_NULL,    /**< @brief Null device */
 	DEV_SERIAL,  /**< @brief Serial device */
-	DEV_MAX      /**< @brief placeholder for maximum device number */
+	DEV_BLOCK,   /**< @brief Block device (disk) */
+	DEV_NET,     /**< @brief Network device */
+	DEV_BUILTIN  /**< @brief placeholder for the number of built-in drivers */
 }  Device_type;
 
+/** @brief The maximum number of device drivers (major numbers). */
+#define MAX_DEVICE_TYPES 16
+
+/** @brief The maximum length of the name of a device driver. */
+#define MAX_DEVICE_NAME 15
+
+/**
+  @brief The initialization routine of a device driver.
+
+  It is passed the number of devices of the driver.
+ */
+typedef void (*device_init)(uint nminor);
+
 
 /**
   @brief Device control block.
@@ -119,6 +159,8 @@ typedef struct device_control_block
   Device_type type;     /**< @brief Device type. 
 
                             Much like 'major number' in Unix, determines the driver. */
+
+  char name[MAX_DEVICE_NAME+1];  /**< @brief The name of the driver. */
   
   uint devnum;           /**< @brief Number of devices for this major number.
                           */
@@ -136,6 +178,38 @@ typedef struct device_control_block
  */
 void initialize_devices();
 
+/** 
+  @brief Release the memory of the device drivers.
+
+  This function is called after the VM of the kernel has stopped.
+ */
+void finalize_devices();
+
+
+/**
+  @brief Register a device driver.
+
+  The driver is added to the device table under the next free major 
+  number, with @c nminor devices. Its file operations are copied into the
+  table, and then @c init (if not NULL) is called, to initialize the 
+  devices. The @c name is copied into the table.
+
+  This must be called with the kernel lock held, normally at kernel startup
+  from @c initialize_devices.
+
+  @returns the major number of the driver, or -1 if the name is longer
+  than @c MAX_DEVICE_NAME or already registered, or the device table is 
+  full.
+  */
+int register_device(const char* name, uint nminor, file_ops* fops, device_init init);
+
+/**
+  @brief Find a device driver by name.
+
+  @returns the major number of the driver, or -1 if there is no driver
+  by this name.
+  */
+int device_lookup(const char* name);
 
 /**
   @brief Open a device.
@@ -156,6 +230,30 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
   */
 uint device_no(Device_type major);
 
+
+/**
+  @brief Read sectors from a block device.
+
+  The request is queued by the block driver, which serves requests in 
+  elevator order and merges adjacent requests. The calling thread sleeps
+  until the transfer completes. This must be called with the kernel
+  lock held; the lock is released while the thread waits.
+
+  @param minor the block device
+  @param sector the first sector to read
+  @param buf the buffer, of @c nsectors*DISK_SECTOR_SIZE bytes
+  @param nsectors the number of sectors to read
+  @returns 0 on success, or -1 on error
+  */
+int block_read(uint minor, uint64_t sector, void* buf, uint nsectors);
+
+/**
+  @brief Write sectors to a block device.
+
+  @see block_read
+  */
+int block_write(uint minor, uint64_t sector, const void* buf, uint nsectors);
+
 /** @} */
 
 #endif
@@ -0,0 +1,1063 @@
+
+#include <assert.h>
+#include "kernel_cc.h"
+#include "kernel_dev.h"
+#include "kernel_sched.h"
+#include "kernel_streams.h"
+#include "kernel_fs.h"
+#include "kernel_vm.h"
+
+/*************************************
+
+  The file system
+
+ *************************************/
+
+#define FS_SECTORS (FS_BLOCK_SIZE/DISK_SECTOR_SIZE)
+#define FS_MAGIC 0x3153466f6e6954ull     /* "TinoFS1" */
+#define FS_ROOT 1
+#define FS_NINDIRECT (FS_BLOCK_SIZE/sizeof(uint32_t))
+#define FS_BITS_PER_BLOCK (FS_BLOCK_SIZE*8)
+
+/* The superblock, in block 0 */
+typedef struct fs_super {
+  uint64_t magic;
+  uint32_t nblocks;       /* the size of the file system */
+  uint32_t ninodes;
+  uint32_t bitmap_start;  /* the first block of the bitmap */
+  uint32_t inode_start;   /* the first block of the inode table */
+  uint32_t data_start;    /* the first data block */
+} fs_super;
+
+/* An inode on the disk. A free inode has type 0. */
+typedef struct fs_dinode {
+  uint16_t type;
+  uint16_t nlink;
+  uint32_t unused;
+  uint64_t size;
+  uint32_t direct[FS_NDIRECT];
+  uint32_t indirect;
+  uint32_t dindirect;
+} fs_dinode;
+
+#define FS_INODES_PER_BLOCK (FS_BLOCK_SIZE/sizeof(fs_dinode))
+
+/* A directory entry on the disk. A free entry has ino 0. */
+typedef struct fs_dirent {
+  uint32_t ino;
+  char name[MAX_NAME_LENGTH+1];
+} fs_dirent;
+
+_Static_assert(sizeof(fs_dinode) == 128, "the inode size must divide the block size");
+_Static_assert(sizeof(fs_dirent) == sizeof(dir_entry), "directory entries are returned as is");
+
+
+/*
+  A page of the page cache holds a block of the mounted file system.
+  Pages are found by block number in a hash table, and are kept in LRU
+  order (the least recently used first). A pinned page is in use, and
+  cannot be evicted. Block 0 (the superblock) is never cached, so a page
+  with block 0 is unused.
+ */
+typedef struct pcache_page {
+  uint32_t blockno;
+  int dirty;
+  uint pin;
+  char* data;
+  struct pcache_page* hnext;    /* the hash chain */
+  rlnode lru;
+} pcache_page;
+
+#define PCACHE_HASH 1024
+
+/* An inode in memory, for as long as it is used */
+typedef struct fs_inode {
+  uint ino;
+  uint ref;
+  fs_dinode d;
+  rlnode node;
+} fs_inode;
+
+/* An open file */
+typedef struct fs_file {
+  fs_inode* ip;
+  uint64_t pos;
+  int flags;
+  uint64_t ra_next;     /* the page expected next by a sequential reader */
+  uint ra_window;       /* the pages to read ahead */
+} fs_file;
+
+/* The state of this module, per kernel instance */
+struct fs_state {
+  int busy;             /* the sleeping lock */
+  CondVar idle;
+
+  int mounted;
+  uint dev;
+  fs_super sb;
+  rlnode inodes;        /* the inodes in memory */
+  uint32_t balloc_hint, ialloc_hint;
+
+  pcache_page* pages;
+  char* page_mem;
+  char* bounce;         /* PCACHE_CLUSTER blocks, for clustered transfers */
+  pcache_page* hash[PCACHE_HASH];
+  rlnode lru;
+};
+
+#define FS (KVM->fs)
+
+
+static void fs_lock()
+{
+  while(FS->busy)
+    kernel_wait(&FS->idle, SCHED_IO);
+  FS->busy = 1;
+}
+
+static void fs_unlock()
+{
+  FS->busy = 0;
+  kernel_signal(&FS->idle);
+}
+
+
+/* ===================================
+
+  The page cache
+
+  ====================================*/
+
+static inline pcache_page** pcache_bucket(uint32_t b)
+{
+  return &FS->hash[b % PCACHE_HASH];
+}
+
+static pcache_page* pcache_lookup(uint32_t b)
+{
+  for(pcache_page* p = *pcache_bucket(b); p != NULL; p = p->hnext)
+    if(p->blockno == b) return p;
+  return NULL;
+}
+
+static void pcache_hash(pcache_page* p, uint32_t b)
+{
+  pcache_page** bucket = pcache_bucket(b);
+  p->blockno = b;
+  p->hnext = *bucket;
+  *bucket = p;
+}
+
+static void pcache_unhash(pcache_page* p)
+{
+  if(p->blockno == 0) return;
+  pcache_page** pp = pcache_bucket(p->blockno);
+  while(*pp != p) pp = &(*pp)->hnext;
+  *pp = p->hnext;
+  p->blockno = 0;
+}
+
+/* Make p the most recently used page */
+static inline void pcache_touch(pcache_page* p)
+{
+  rlist_push_back(&FS->lru, rlist_remove(&p->lru));
+}
+
+/*
+  Write a dirty page, together with the dirty pages of the following
+  blocks, in one request.
+ */
+static int pcache_writeback(pcache_page* p)
+{
+  pcache_page* run[PCACHE_CLUSTER];
+  uint n = 0;
+  for(pcache_page* q = p; q != NULL && q->dirty && n < PCACHE_CLUSTER; q = pcache_lookup(p->blockno + n)) {
+    memcpy(FS->bounce + n*FS_BLOCK_SIZE, q->data, FS_BLOCK_SIZE);
+    run[n++] = q;
+  }
+
+  if(block_write(FS->dev, (uint64_t)p->blockno * FS_SECTORS, FS->bounce, n*FS_SECTORS) == -1)
+    return -1;
+  for(uint i=0; i<n; i++)
+    run[i]->dirty = 0;
+  return 0;
+}
+
+/* Return the least recently used unpinned page, written back and unhashed */
+static pcache_page* pcache_victim()
+{
+  for(rlnode* n = FS->lru.next; n != &FS->lru; n = n->next) {
+    pcache_page* p = n->obj;
+    if(p->pin > 0) continue;
+    if(p->dirty && pcache_writeback(p) == -1) return NULL;
+    pcache_unhash(p);
+    return p;
+  }
+  return NULL;
+}
+
+/*
+  Return the pinned page of block b. On a miss, the block is read from
+  the disk if fill is true, else the page is zeroed. Returns NULL on error.
+ */
+static pcache_page* pcache_get(uint32_t b, int fill)
+{
+  pcache_page* p = pcache_lookup(b);
+  if(p == NULL) {
+    p = pcache_victim();
+    if(p == NULL) return NULL;
+    if(fill) {
+      if(block_read(FS->dev, (uint64_t)b * FS_SECTORS, p->data, FS_SECTORS) == -1)
+        return NULL;
+    } else
+      memset(p->data, 0, FS_BLOCK_SIZE);
+    pcache_hash(p, b);
+  }
+  p->pin++;
+  pcache_touch(p);
+  return p;
+}
+
+static inline void pcache_put(pcache_page* p)
+{
+  assert(p->pin > 0);
+  p->pin--;
+}
+
+/* Drop the page of a released block */
+static void pcache_forget(uint32_t b)
+{
+  pcache_page* p = pcache_lookup(b);
+  if(p == NULL) return;
+  assert(p->pin == 0);
+  pcache_unhash(p);
+  p->dirty = 0;
+  rlist_push_front(&FS->lru, rlist_remove(&p->lru));
+}
+
+/* Read n uncached blocks, starting at b, in one request */
+static int pcache_fill(uint32_t b, uint n)
+{
+  pcache_page* run[PCACHE_CLUSTER];
+  uint count = 0;
+  while(count < n && (run[count] = pcache_victim()) != NULL)
+    run[count++]->pin++;
+  if(count == 0) return -1;
+
+  int rc = block_read(FS->dev, (uint64_t)b * FS_SECTORS, FS->bounce, count*FS_SECTORS);
+  for(uint i=0; i<count; i++) {
+    pcache_page* p = run[i];
+    p->pin--;
+    if(rc == 0) {
+      memcpy(p->data, FS->bounce + i*FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+      pcache_hash(p, b+i);
+      pcache_touch(p);
+    }
+  }
+  return rc;
+}
+
+static int pcache_cmp(const void* a, const void* b)
+{
+  uint32_t x = (*(pcache_page**)a)->blockno, y = (*(pcache_page**)b)->blockno;
+  return (x > y) - (x < y);
+}
+
+/* Write back all dirty pages, in block order */
+static int pcache_sync()
+{
+  pcache_page** dirty = xmalloc(PCACHE_PAGES * sizeof(pcache_page*));
+  uint n = 0;
+  for(uint i=0; i<PCACHE_PAGES; i++)
+    if(FS->pages[i].dirty) dirty[n++] = &FS->pages[i];
+  qsort(dirty, n, sizeof(pcache_page*), pcache_cmp);
+
+  int rc = 0;
+  for(uint i=0; i<n && rc == 0; i++)
+    if(dirty[i]->dirty) rc = pcache_writeback(dirty[i]);
+  free(dirty);
+  return rc;
+}
+
+static void pcache_init()
+{
+  FS->pages = xmalloc(PCACHE_PAGES * sizeof(pcache_page));
+  FS->page_mem = xmalloc((size_t)PCACHE_PAGES * FS_BLOCK_SIZE);
+  FS->bounce = xmalloc(PCACHE_CLUSTER * FS_BLOCK_SIZE);
+  memset(FS->hash, 0, sizeof(FS->hash));
+  rlnode_init(&FS->lru, NULL);
+  for(uint i=0; i<PCACHE_PAGES; i++) {
+    pcache_page* p = &FS->pages[i];
+    p->blockno = 0;
+    p->dirty = 0;
+    p->pin = 0;
+    p->data = FS->page_mem + (size_t)i * FS_BLOCK_SIZE;
+    p->hnext = NULL;
+    rlist_push_back(&FS->lru, rlnode_init(&p->lru, p));
+  }
+}
+
+static void pcache_release()
+{
+  free(FS->pages);
+  free(FS->page_mem);
+  free(FS->bounce);
+  FS->pages = NULL;
+}
+
+
+/* ===================================
+
+  Blocks
+
+  ====================================*/
+
+/* Allocate a block, returning 0 if the disk is full */
+static uint32_t fs_balloc()
+{
+  uint32_t nb = FS->sb.nblocks;
+  uint32_t b = FS->balloc_hint;
+  for(uint32_t scanned = 0; scanned < nb; ) {
+    if(b >= nb) b = 0;
+    pcache_page* p = pcache_get(FS->sb.bitmap_start + b / FS_BITS_PER_BLOCK, 1);
+    if(p == NULL) return 0;
+    uint8_t* bits = (uint8_t*)p->data;
+    uint32_t end = (b / FS_BITS_PER_BLOCK + 1) * FS_BITS_PER_BLOCK;
+    if(end > nb) end = nb;
+
+    for(; b < end; b++, scanned++) {
+      uint32_t i = b % FS_BITS_PER_BLOCK;
+      if((i & 7) == 0 && bits[i>>3] == 0xff && b + 8 <= end) {
+        b += 7;  scanned += 7;
+        continue;
+      }
+      if(!(bits[i>>3] & (1 << (i&7)))) {
+        bits[i>>3] |= 1 << (i&7);
+        p->dirty = 1;
+        pcache_put(p);
+        FS->balloc_hint = b+1;
+        pcache_forget(b);
+        return b;
+      }
+    }
+    pcache_put(p);
+  }
+  return 0;
+}
+
+static void fs_bfree(uint32_t b)
+{
+  pcache_page* p = pcache_get(FS->sb.bitmap_start + b / FS_BITS_PER_BLOCK, 1);
+  if(p == NULL) return;
+  uint32_t i = b % FS_BITS_PER_BLOCK;
+  p->data[i>>3] &= ~(1 << (i&7));
+  p->dirty = 1;
+  pcache_put(p);
+  pcache_forget(b);
+}
+
+/* Free a block, and the blocks it points to if it is an indirect block of the given level */
+static void fs_bfree_tree(uint32_t b, int level)
+{
+  if(b == 0) return;
+  if(level > 0) {
+    pcache_page* p = pcache_get(b, 1);
+    if(p != NULL) {
+      uint32_t* a = (uint32_t*)p->data;
+      for(uint i=0; i<FS_NINDIRECT; i++)
+        fs_bfree_tree(a[i], level-1);
+      pcache_put(p);
+    }
+  }
+  fs_bfree(b);
+}
+
+/* Return the block in *slot, allocating it if needed. A new block is reported in *fresh. */
+static uint32_t fs_bslot(uint32_t* slot, int alloc, int* fresh)
+{
+  if(*slot == 0 && alloc) {
+    *slot = fs_balloc();
+    *fresh = (*slot != 0);
+  }
+  return *slot;
+}
+
+/*
+  Map entry idx of the tree of indirect blocks of the given level, whose
+  root is in *slot.
+ */
+static uint32_t fs_bmap_ind(uint32_t* slot, uint64_t idx, int level, int alloc, int* fresh)
+{
+  int newind = 0;
+  uint32_t ind = fs_bslot(slot, alloc, &newind);
+  if(ind == 0) return 0;
+
+  /* A new indirect block is zero */
+  pcache_page* p = pcache_get(ind, !newind);
+  if(p == NULL) return 0;
+  if(newind) p->dirty = 1;
+
+  uint64_t span = (level == 2) ? FS_NINDIRECT : 1;
+  uint32_t* a = (uint32_t*)p->data + idx / span;
+  uint32_t old = *a;
+  uint32_t b = (level == 2) ? fs_bmap_ind(a, idx % span, 1, alloc, fresh)
+                            : fs_bslot(a, alloc, fresh);
+  if(*a != old) p->dirty = 1;
+  pcache_put(p);
+  return b;
+}
+
+/*
+  Return the block of page pg of a file, or 0 for a hole. If alloc is
+  true, a missing block is allocated and reported in *fresh; then 0 means
+  that the disk is full.
+ */
+static uint32_t fs_bmap(fs_inode* ip, uint64_t pg, int alloc, int* fresh)
+{
+  int dummy;
+  if(fresh == NULL) fresh = &dummy;
+  *fresh = 0;
+
+  if(pg < FS_NDIRECT)
+    return fs_bslot(&ip->d.direct[pg], alloc, fresh);
+  pg -= FS_NDIRECT;
+  if(pg < FS_NINDIRECT)
+    return fs_bmap_ind(&ip->d.indirect, pg, 1, alloc, fresh);
+  pg -= FS_NINDIRECT;
+  if(pg < FS_NINDIRECT*FS_NINDIRECT)
+    return fs_bmap_ind(&ip->d.dindirect, pg, 2, alloc, fresh);
+  return 0;
+}
+
+
+/* ===================================
+
+  Inodes
+
+  ====================================*/
+
+static inline uint32_t fs_inode_block(uint ino)
+{
+  return FS->sb.inode_start + ino / FS_INODES_PER_BLOCK;
+}
+
+/* Write the inode to its block */
+static int fs_iupdate(fs_inode* ip)
+{
+  pcache_page* p = pcache_get(fs_inode_block(ip->ino), 1);
+  if(p == NULL) return -1;
+  memcpy(p->data + (ip->ino % FS_INODES_PER_BLOCK)*sizeof(fs_dinode), &ip->d, sizeof(fs_dinode));
+  p->dirty = 1;
+  pcache_put(p);
+  return 0;
+}
+
+/* Return the inode in memory, with a new reference */
+static fs_inode* fs_iget(uint ino)
+{
+  for(rlnode* n = FS->inodes.next; n != &FS->inodes; n = n->next) {
+    fs_inode* ip = n->obj;
+    if(ip->ino == ino) {
+      ip->ref++;
+      return ip;
+    }
+  }
+
+  pcache_page* p = pcache_get(fs_inode_block(ino), 1);
+  if(p == NULL) return NULL;
+  fs_inode* ip = xmalloc(sizeof(fs_inode));
+  ip->ino = ino;
+  ip->ref = 1;
+  memcpy(&ip->d, p->data + (ino % FS_INODES_PER_BLOCK)*sizeof(fs_dinode), sizeof(fs_dinode));
+  pcache_put(p);
+  rlist_push_back(&FS->inodes, rlnode_init(&ip->node, ip));
+  return ip;
+}
+
+/* Release the data blocks of the inode */
+static void fs_itrunc(fs_inode* ip)
+{
+  for(uint i=0; i<FS_NDIRECT; i++)
+    fs_bfree_tree(ip->d.direct[i], 0);
+  fs_bfree_tree(ip->d.indirect, 1);
+  fs_bfree_tree(ip->d.dindirect, 2);
+  memset(ip->d.direct, 0, sizeof(ip->d.direct));
+  ip->d.indirect = ip->d.dindirect = 0;
+  ip->d.size = 0;
+  fs_iupdate(ip);
+}
+
+/* Drop a reference. An inode without links is released with its last reference. */
+static void fs_iput(fs_inode* ip)
+{
+  if(--ip->ref > 0) return;
+  if(ip->d.nlink == 0) {
+    fs_itrunc(ip);
+    ip->d.type = 0;
+    fs_iupdate(ip);
+  }
+  rlist_remove(&ip->node);
+  free(ip);
+}
+
+/* Allocate an inode of the given type, with one link */
+static fs_inode* fs_ialloc(int type)
+{
+  uint n = FS->sb.ninodes;
+  for(uint k=0; k<n; k++) {
+    uint ino = (FS->ialloc_hint + k) % n;
+    if(ino == 0) continue;
+    pcache_page* p = pcache_get(fs_inode_block(ino), 1);
+    if(p == NULL) return NULL;
+    fs_dinode* d = (fs_dinode*)(p->data + (ino % FS_INODES_PER_BLOCK)*sizeof(fs_dinode));
+    if(d->type == 0) {
+      memset(d, 0, sizeof(fs_dinode));
+      d->type = type;
+      d->nlink = 1;
+      p->dirty = 1;
+      pcache_put(p);
+      FS->ialloc_hint = ino+1;
+      return fs_iget(ino);
+    }
+    pcache_put(p);
+  }
+  return NULL;
+}
+
+
+/* ===================================
+
+  File data
+
+  ====================================*/
+
+/*
+  Read ahead the pages following page pg (in block b) of a sequential
+  stream. The window doubles with every sequential read, and the pages
+  are read in one request, as long as their blocks are contiguous.
+ */
+static void fs_readahead(fs_inode* ip, uint64_t pg, uint32_t b, fs_file* f)
+{
+  if(pg == f->ra_next) {
+    if(f->ra_window < PCACHE_CLUSTER) f->ra_window *= 2;
+  } else
+    f->ra_window = 1;
+  f->ra_next = pg + 1;
+
+  if(pcache_lookup(b) != NULL) return;
+  uint64_t last = (ip->d.size - 1) / FS_BLOCK_SIZE;
+  uint n = 1;
+  while(n < f->ra_window && pg + n <= last
+        && pcache_lookup(b+n) == NULL && fs_bmap(ip, pg+n, 0, NULL) == b+n)
+    n++;
+  pcache_fill(b, n);
+}
+
+/*
+  Read or write the data of an inode. The stream f is used for read-ahead,
+  it may be NULL. Returns the number of bytes transferred, or -1.
+ */
+static int fs_rw(fs_inode* ip, uint64_t pos, char* buf, uint size, int write, fs_file* f)
+{
+  if(!write) {
+    if(pos >= ip->d.size) return 0;
+    if(size > ip->d.size - pos) size = ip->d.size - pos;
+  }
+
+  uint count = 0;
+  while(count < size) {
+    uint64_t pg = pos / FS_BLOCK_SIZE;
+    uint off = pos % FS_BLOCK_SIZE;
+    uint n = FS_BLOCK_SIZE - off;
+    if(n > size - count) n = size - count;
+
+    if(write) {
+      int fresh;
+      uint32_t b = fs_bmap(ip, pg, 1, &fresh);
+      if(b == 0) break;
+      /* A new block, or one that is written whole, need not be read */
+      pcache_page* p = pcache_get(b, !(fresh || n == FS_BLOCK_SIZE));
+      if(p == NULL) break;
+      memcpy(p->data + off, buf + count, n);
+      p->dirty = 1;
+      pcache_put(p);
+    } else {
+      uint32_t b = fs_bmap(ip, pg, 0, NULL);
+      if(b == 0)
+        memset(buf + count, 0, n);
+      else {
+        if(f) fs_readahead(ip, pg, b, f);
+        pcache_page* p = pcache_get(b, 1);
+        if(p == NULL) break;
+        memcpy(buf + count, p->data + off, n);
+        pcache_put(p);
+      }
+    }
+    count += n;
+    pos += n;
+  }
+
+  if(write) {
+    if(pos > ip->d.size) ip->d.size = pos;
+    fs_iupdate(ip);
+  }
+  return (count > 0 || size == 0) ? count : -1;
+}
+
+
+/* ===================================
+
+  Directories and paths
+
+  ====================================*/
+
+/* Return the inode of a name in a directory, or 0. The offset of the entry is stored in off. */
+static uint fs_dir_lookup(fs_inode* dp, const char* name, uint64_t* off)
+{
+  fs_dirent de;
+  for(uint64_t pos = 0; pos < dp->d.size; pos += sizeof(de)) {
+    if(fs_rw(dp, pos, (char*)&de, sizeof(de), 0, NULL) != sizeof(de)) return 0;
+    if(de.ino != 0 && strncmp(de.name, name, MAX_NAME_LENGTH+1) == 0) {
+      if(off) *off = pos;
+      return de.ino;
+    }
+  }
+  return 0;
+}
+
+/* Add an entry to a directory, in the first free slot */
+static int fs_dir_link(fs_inode* dp, const char* name, uint ino)
+{
+  fs_dirent de;
+  uint64_t pos;
+  for(pos = 0; pos < dp->d.size; pos += sizeof(de)) {
+    if(fs_rw(dp, pos, (char*)&de, sizeof(de), 0, NULL) != sizeof(de)) return -1;
+    if(de.ino == 0) break;
+  }
+  memset(&de, 0, sizeof(de));
+  de.ino = ino;
+  strncpy(de.name, name, MAX_NAME_LENGTH);
+  return (fs_rw(dp, pos, (char*)&de, sizeof(de), 1, NULL) == sizeof(de)) ? 0 : -1;
+}
+
+static int fs_dir_empty(fs_inode* dp)
+{
+  fs_dirent de;
+  for(uint64_t pos = 0; pos < dp->d.size; pos += sizeof(de))
+    if(fs_rw(dp, pos, (char*)&de, sizeof(de), 0, NULL) != sizeof(de) || de.ino != 0)
+      return 0;
+  return 1;
+}
+
+/*
+  Copy the next name of the path into name, returning the rest of the
+  path, or NULL if the name is too long. At the end, name is empty.
+ */
+static const char* fs_skipelem(const char* path, char* name)
+{
+  while(*path == '/') path++;
+  const char* s = path;
+  while(*path != '/' && *path != 0) path++;
+  size_t len = path - s;
+  if(len > MAX_NAME_LENGTH) return NULL;
+  memcpy(name, s, len);
+  name[len] = 0;
+  while(*path == '/') path++;
+  return path;
+}
+
+/*
+  Return the inode of a path, with a new reference, or NULL. If name is
+  not NULL, return the directory of the last name of the path instead,
+  copying the name into name (which is empty for the root).
+ */
+static fs_inode* fs_namei(const char* path, char* name)
+{
+  char elem[MAX_NAME_LENGTH+1];
+  if(name) name[0] = 0;
+  fs_inode* ip = fs_iget(FS_ROOT);
+
+  while(ip != NULL) {
+    path = fs_skipelem(path, elem);
+    if(path == NULL || (elem[0] != 0 && ip->d.type != FILE_DIR)) {
+      fs_iput(ip);
+      return NULL;
+    }
+    if(elem[0] == 0)
+      break;
+    if(name && *path == 0) {
+      strcpy(name, elem);
+      break;
+    }
+    uint ino = fs_dir_lookup(ip, elem, NULL);
+    fs_iput(ip);
+    ip = (ino != 0) ? fs_iget(ino) : NULL;
+  }
+  return ip;
+}
+
+/* Create a file in directory dp */
+static fs_inode* fs_create(fs_inode* dp, const char* name, int type)
+{
+  fs_inode* ip = fs_ialloc(type);
+  if(ip == NULL) return NULL;
+  if(fs_dir_link(dp, name, ip->ino) == -1) {
+    ip->d.nlink = 0;
+    fs_iput(ip);
+    return NULL;
+  }
+  return ip;
+}
+
+
+/* ===================================
+
+  File streams
+
+  ====================================*/
+
+/* Return whole directory entries, skipping the free ones */
+static int fs_dir_read(fs_file* f, char* buf, unsigned int size)
+{
+  if(size < sizeof(dir_entry)) return -1;
+  fs_inode* dp = f->ip;
+  f->pos = (f->pos + sizeof(fs_dirent) - 1) / sizeof(fs_dirent) * sizeof(fs_dirent);
+
+  uint count = 0;
+  while(count + sizeof(dir_entry) <= size && f->pos < dp->d.size) {
+    fs_dirent de;
+    if(fs_rw(dp, f->pos, (char*)&de, sizeof(de), 0, f) != sizeof(de))
+      return (count > 0) ? count : -1;
+    f->pos += sizeof(de);
+    if(de.ino == 0) continue;
+    dir_entry* e = (dir_entry*)(buf + count);
+    e->inode = de.ino;
+    memcpy(e->name, de.name, sizeof(e->name));
+    count += sizeof(dir_entry);
+  }
+  return count;
+}
+
+static int fs_file_read(void* this, char* buf, unsigned int size)
+{
+  fs_file* f = this;
+  fs_lock();
+  int rc;
+  if(f->ip->d.type == FILE_DIR)
+    rc = fs_dir_read(f, buf, size);
+  else if((rc = fs_rw(f->ip, f->pos, buf, size, 0, f)) > 0)
+    f->pos += rc;
+  fs_unlock();
+  return rc;
+}
+
+static int fs_file_write(void* this, const char* buf, unsigned int size)
+{
+  fs_file* f = this;
+  if(f->ip->d.type == FILE_DIR) return -1;
+  fs_lock();
+  if(f->flags & OPEN_APPEND) f->pos = f->ip->d.size;
+  int rc = fs_rw(f->ip, f->pos, (char*)buf, size, 1, NULL);
+  if(rc > 0) f->pos += rc;
+  fs_unlock();
+  return rc;
+}
+
+static int64_t fs_file_seek(void* this, int64_t offset, int whence)
+{
+  fs_file* f = this;
+  int64_t base;
+  switch(whence) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = f->pos; break;
+    case SEEK_END: base = f->ip->d.size; break;
+    default: return -1;
+  }
+  if(base + offset < 0) return -1;
+  f->pos = base + offset;
+  return f->pos;
+}
+
+static int fs_file_close(void* this)
+{
+  fs_file* f = this;
+  fs_lock();
+  fs_iput(f->ip);
+  fs_unlock();
+  free(f);
+  return 0;
+}
+
+static void* fs_file_open(uint minor)
+{
+  return NULL;
+}
+
+static file_ops fs_file_ops = {
+  .Open = fs_file_open,
+  .Read = fs_file_read,
+  .Write = fs_file_write,
+  .Close = fs_file_close,
+  .Seek = fs_file_seek
+};
+
+
+/* ===================================
+
+  System calls
+
+  ====================================*/
+
+/* Lock the file system, returning 0 if it is not mounted */
+static int fs_begin()
+{
+  fs_lock();
+  if(FS->mounted) return 1;
+  fs_unlock();
+  return 0;
+}
+
+
+Fid_t sys_Open(const char* pathname, int flags)
+{
+  if(pathname == NULL || !fs_begin()) return NOFILE;
+
+  char name[MAX_NAME_LENGTH+1];
+  fs_inode* ip = NULL;
+  fs_inode* dp = fs_namei(pathname, name);
+  if(dp != NULL && name[0] == 0)
+    ip = dp;
+  else if(dp != NULL) {
+    uint ino = fs_dir_lookup(dp, name, NULL);
+    if(ino != 0)
+      ip = fs_iget(ino);
+    else if(flags & OPEN_CREATE)
+      ip = fs_create(dp, name, FILE_REGULAR);
+    fs_iput(dp);
+  }
+
+  Fid_t fid = NOFILE;
+  FCB* fcb;
+  if(ip != NULL) {
+    if((ip->d.type == FILE_DIR && (flags & (OPEN_TRUNC|OPEN_APPEND))) || !FCB_reserve(1, &fid, &fcb)) {
+      fid = NOFILE;
+      fs_iput(ip);
+    } else {
+      if(flags & OPEN_TRUNC) fs_itrunc(ip);
+      fs_file* f = xmalloc(sizeof(fs_file));
+      f->ip = ip;
+      f->pos = 0;
+      f->flags = flags;
+      f->ra_next = 0;
+      f->ra_window = 1;
+      fcb->streamobj = f;
+      fcb->streamfunc = &fs_file_ops;
+    }
+  }
+
+  fs_unlock();
+  return fid;
+}
+
+
+int sys_Stat(const char* pathname, file_stat* st)
+{
+  if(pathname == NULL || st == NULL || !fs_begin()) return -1;
+  fs_inode* ip = fs_namei(pathname, NULL);
+  if(ip != NULL) {
+    st->inode = ip->ino;
+    st->type = ip->d.type;
+    st->nlink = ip->d.nlink;
+    st->size = ip->d.size;
+    fs_iput(ip);
+  }
+  fs_unlock();
+  return (ip != NULL) ? 0 : -1;
+}
+
+
+int sys_MkDir(const char* pathname)
+{
+  if(pathname == NULL || !fs_begin()) return -1;
+  int rc = -1;
+  char name[MAX_NAME_LENGTH+1];
+  fs_inode* dp = fs_namei(pathname, name);
+  if(dp != NULL) {
+    if(name[0] != 0 && fs_dir_lookup(dp, name, NULL) == 0) {
+      fs_inode* ip = fs_create(dp, name, FILE_DIR);
+      if(ip != NULL) {
+        fs_iput(ip);
+        rc = 0;
+      }
+    }
+    fs_iput(dp);
+  }
+  fs_unlock();
+  return rc;
+}
+
+
+int sys_Unlink(const char* pathname)
+{
+  if(pathname == NULL || !fs_begin()) return -1;
+  int rc = -1;
+  char name[MAX_NAME_LENGTH+1];
+  fs_inode* dp = fs_namei(pathname, name);
+  if(dp != NULL) {
+    uint64_t off;
+    uint ino = (name[0] != 0) ? fs_dir_lookup(dp, name, &off) : 0;
+    fs_inode* ip = (ino != 0) ? fs_iget(ino) : NULL;
+    if(ip != NULL) {
+      if(ip->d.type != FILE_DIR || fs_dir_empty(ip)) {
+        fs_dirent de;
+        memset(&de, 0, sizeof(de));
+        if(fs_rw(dp, off, (char*)&de, sizeof(de), 1, NULL) == sizeof(de)) {
+          ip->d.nlink--;
+          fs_iupdate(ip);
+          rc = 0;
+        }
+      }
+      fs_iput(ip);
+    }
+    fs_iput(dp);
+  }
+  fs_unlock();
+  return rc;
+}
+
+
+int sys_Mount(unsigned int dev)
+{
+  fs_lock();
+  int rc = -1;
+  char* buf = xmalloc(FS_BLOCK_SIZE);
+  if(!FS->mounted && dev < bios_disks() && block_read(dev, 0, buf, FS_SECTORS) == 0) {
+    fs_super* sb = (fs_super*)buf;
+    if(sb->magic == FS_MAGIC && sb->nblocks <= bios_disk_sectors(dev) / FS_SECTORS) {
+      FS->sb = *sb;
+      FS->dev = dev;
+      FS->balloc_hint = sb->data_start;
+      FS->ialloc_hint = FS_ROOT;
+      rlnode_init(&FS->inodes, NULL);
+      pcache_init();
+      FS->mounted = 1;
+      rc = 0;
+    }
+  }
+  free(buf);
+  fs_unlock();
+  return rc;
+}
+
+
+int sys_Unmount()
+{
+  if(!fs_begin()) return -1;
+  int rc = -1;
+  if(is_rlist_empty(&FS->inodes) && pcache_sync() == 0) {
+    pcache_release();
+    FS->mounted = 0;
+    rc = 0;
+  }
+  fs_unlock();
+  return rc;
+}
+
+
+int sys_Sync()
+{
+  if(!fs_begin()) return -1;
+  int rc = pcache_sync();
+  fs_unlock();
+  return rc;
+}
+
+
+int sys_MakeFileSystem(unsigned int dev)
+{
+  fs_lock();
+  int rc = -1;
+  uint64_t nblocks = (dev < bios_disks()) ? bios_disk_sectors(dev) / FS_SECTORS : 0;
+  if(nblocks > UINT32_MAX) nblocks = UINT32_MAX;
+
+  /* The layout: an inode per 4 blocks, rounded up to a whole block */
+  fs_super sb = { .magic = FS_MAGIC, .nblocks = nblocks };
+  uint64_t ninodes = (nblocks / 4 + FS_INODES_PER_BLOCK - 1) / FS_INODES_PER_BLOCK * FS_INODES_PER_BLOCK;
+  if(ninodes < FS_INODES_PER_BLOCK) ninodes = FS_INODES_PER_BLOCK;
+  if(ninodes > (1u<<24)) ninodes = 1u<<24;
+  sb.ninodes = ninodes;
+  sb.bitmap_start = 1;
+  sb.inode_start = sb.bitmap_start + (nblocks + FS_BITS_PER_BLOCK - 1) / FS_BITS_PER_BLOCK;
+  sb.data_start = sb.inode_start + ninodes / FS_INODES_PER_BLOCK;
+
+  if(dev < bios_disks() && !(FS->mounted && FS->dev == dev) && sb.data_start + 8 <= nblocks) {
+    char* buf = xmalloc(FS_BLOCK_SIZE);
+    rc = 0;
+
+    /* The bitmap, with the metadata blocks allocated */
+    for(uint32_t b = sb.bitmap_start; b < sb.inode_start && rc == 0; b++) {
+      memset(buf, 0, FS_BLOCK_SIZE);
+      uint32_t first = (b - sb.bitmap_start) * FS_BITS_PER_BLOCK;
+      for(uint32_t i = first; i < sb.data_start && i < first + FS_BITS_PER_BLOCK; i++)
+        buf[(i-first)>>3] |= 1 << ((i-first)&7);
+      rc = block_write(dev, (uint64_t)b*FS_SECTORS, buf, FS_SECTORS);
+    }
+
+    /* The inode table, with the root directory */
+    for(uint32_t b = sb.inode_start; b < sb.data_start && rc == 0; b++) {
+      memset(buf, 0, FS_BLOCK_SIZE);
+      if(b == sb.inode_start + FS_ROOT / FS_INODES_PER_BLOCK) {
+        fs_dinode* root = (fs_dinode*)buf + FS_ROOT % FS_INODES_PER_BLOCK;
+        root->type = FILE_DIR;
+        root->nlink = 1;
+      }
+      rc = block_write(dev, (uint64_t)b*FS_SECTORS, buf, FS_SECTORS);
+    }
+
+    /* The superblock is written last */
+    if(rc == 0) {
+      memset(buf, 0, FS_BLOCK_SIZE);
+      memcpy(buf, &sb, sizeof(sb));
+      rc = block_write(dev, 0, buf, FS_SECTORS);
+    }
+    free(buf);
+  }
+
+  fs_unlock();
+  return rc;
+}
+
+
+/***********************************
+
+  Initialization
+
+***********************************/
+
+void initialize_filesystem()
+{
+  KVM->fs = xcalloc_aligned(sizeof(struct fs_state));
+  FS->busy = 0;
+  FS->idle = COND_INIT;
+  FS->mounted = 0;
+}
+
+
+void fs_shutdown()
+{
+  if(!fs_begin()) return;
+  pcache_sync();
+  fs_unlock();
+}
+
+
+void finalize_filesystem()
+{
+  if(FS->mounted) {
+    while(! is_rlist_empty(&FS->inodes))
+      free(rlist_pop_front(&FS->inodes)->obj);
+    pcache_release();
+  }
+  free(KVM->fs);
+  KVM->fs = NULL;
+}
@@ -0,0 +1,67 @@
+#ifndef __KERNEL_FS_H
+#define __KERNEL_FS_H
+
+#include "util.h"
+#include "bios.h"
+
+/**
+  @file kernel_fs.h
+  @brief The file system.
+
+  @defgroup fs File system
+  @ingroup kernel
+  @brief A small inode-based file system, over a page cache.
+
+  The file system lives on a block device, in blocks of @c FS_BLOCK_SIZE
+  bytes. Block 0 is the superblock, followed by the bitmap of the
+  allocated blocks, the inode table and the data blocks. An inode has
+  @c FS_NDIRECT direct blocks, one indirect and one double-indirect block.
+  A directory is a file of fixed-size entries. Inode 1 is the root
+  directory; inode 0 denotes a free directory entry.
+
+  All blocks of the file system, data and metadata alike, are accessed
+  through a page cache, one page per block, with LRU replacement. Sequential
+  reads of a stream are read ahead, in a single disk request over the
+  following blocks that are contiguous on the disk, and dirty pages are
+  written back in clusters of adjacent blocks.
+
+  The operations of the file system are serialized by a sleeping lock.
+  The kernel lock is released during disk I/O, so that other system calls
+  can proceed.
+
+  @{
+*/
+
+/** @brief The block size of the file system, which is also the page size. */
+#define FS_BLOCK_SIZE 4096
+
+/** @brief The number of direct blocks of an inode. */
+#define FS_NDIRECT 26
+
+/** @brief The number of pages of the page cache. */
+#define PCACHE_PAGES 1024
+
+/** @brief The maximum number of blocks of a read-ahead or write-back transfer. */
+#define PCACHE_CLUSTER 32
+
+/** @brief Initialize the file system module.
+
+  This function is called at kernel startup.
+ */
+void initialize_filesystem();
+
+/** @brief Write back the mounted file system.
+
+  This is called when the init process exits, before the VM halts.
+ */
+void fs_shutdown();
+
+/** @brief Release the memory of the file system module.
+
+  This function is called after the VM of the kernel has stopped.
+ */
+void finalize_filesystem();
+
+/** @} */
+
+#endif
@@ -9,6 +9,10 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_socket.h"
+#include "kernel_fs.h"
+#include "kernel_vm.h"
 
 
 
@@ -20,28 +24,30 @@
  */
 
 
-/* Parameters from the 'boot' call are passed to boot_tinyos()
-   via static variables. */
-static struct {
-  Task init_task;
-  int argl;
-  void* args;
-} boot_rec;
+/* The kernel of this core */
+_Thread_local kernel_instance* KVM;
 
 
 /* Per-core boot function for tinyos */
 void boot_tinyos_kernel()
 {
+  /* Parameters from the 'boot' call are passed via the kernel instance,
+     which is the data of the VM */
+  KVM = cpu_vm_data();
 
   if(cpu_core_id==0) {
     /* Initialize the kenrel data structures */
+    initialize_lockstat();
     initialize_processes();
+    /* The port map must exist before the network driver can take interrupts */
+    initialize_port_map();
     initialize_devices();
     initialize_files();
+    initialize_filesystem();
     initialize_scheduler();
 
     /* The boot task is executed normally! */
-    if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
+    if(Exec(KVM->init_task, KVM->argl, KVM->args)!=1)
       FATAL("The init process does not have PID==1");
   }
 
@@ -55,17 +61,47 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+
+    /* No thread is left to hold the kernel lock or an epoch section, 
+       so every retired object can be reclaimed now */
+    epoch_reclaim();
+
+    if(lockstat_enabled())
+      lockstat_report(stderr);
   }
 }
 
 
-void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+void boot_vm(vm_config* vmc, Task boot_task, int argl, void* args)
 {
-  boot_rec.init_task = boot_task;
-  boot_rec.argl = argl;
-  boot_rec.args = args;
+  kernel_instance kvm = { 
+    .init_task = boot_task,
+    .argl = argl,
+    .args = args 
+  };
+
+  vmc->bootfunc = boot_tinyos_kernel;
+  vmc->data = &kvm;
+  vm_run(vmc);
+
+  /* Release the kernel state */
+  KVM = &kvm;
+  finalize_filesystem();
+  finalize_devices();
+  free(kvm.socket);
+  free(kvm.streams);
+  free(kvm.proc);
+  free(kvm.sched);
+  free(kvm.cc);
+  KVM = NULL;
+}
 
-  vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  vm_config VMC;
+  vm_configure(&VMC, boot_tinyos_kernel, ncores, nterm);
+  boot_vm(&VMC, boot_task, argl, args);
 }
 
 
@@ -0,0 +1,655 @@
+#include <assert.h>
+#include <string.h>
+#include "kernel_cc.h"
+#include "kernel_dev.h"
+#include "kernel_sched.h"
+#include "kernel_net.h"
+#include "kernel_vm.h"
+
+/*============================================
+
+  The network driver
+
+ ============================================*/
+
+/*
+  Connections are identified at each node by an id, which is carried
+  by the messages. A message is a NIC packet with a header, followed by
+  data for NET_DATA messages.
+
+  To connect, node A sends NET_CONNECT with the id of its connection and
+  the port. Node B keeps the request pending, until a listener of the
+  port accepts it with NET_ACCEPT, which carries the id of the new
+  connection at B, or refuses it with NET_REFUSE.
+
+  Connection ids are reused with a new generation, so that messages to
+  a closed connection are ignored.
+ */
+
+typedef enum {
+  NET_CONNECT,    /* src, port: connection request from src */
+  NET_ACCEPT,     /* dst, src: the request of dst was accepted by src */
+  NET_REFUSE,     /* dst: the request of dst was refused */
+  NET_DATA,       /* dst: data for dst */
+  NET_CREDIT,     /* dst, credit: the peer of dst has read some data */
+  NET_SHUTDOWN    /* dst, how: the peer of dst was shut down */
+} net_msg_type;
+
+typedef struct net_header {
+  uint8_t type;
+  uint8_t how;
+  uint16_t port;
+  uint32_t dst;         /* the connection id at the receiver */
+  uint32_t src;         /* the connection id at the sender */
+  uint32_t credit;
+} net_header;
+
+/* Max. data in a packet */
+#define NET_PAYLOAD (NIC_MTU - sizeof(net_header))
+
+/* Max. number of connections, including pending requests */
+#define NET_MAX_CONNS 64
+
+/* Number of packet buffers, for each direction */
+#define NET_TX_SLOTS 32
+#define NET_RX_SLOTS 32
+
+_Static_assert(MAX_NODES <= NIC_MAX_NODES, "MAX_NODES too large for the NIC");
+_Static_assert(NET_TX_SLOTS <= NIC_RING_SIZE && NET_RX_SLOTS <= NIC_RING_SIZE,
+  "too many packet buffers for the NIC rings");
+
+typedef enum { NET_FREE, NET_PENDING, NET_CONNECTING, NET_OPEN } net_state;
+
+struct net_conn {
+  uint id;              /* index + generation*NET_MAX_CONNS */
+  net_state state;
+  node_t node;          /* the remote node */
+  uint peer;            /* the id of the connection at the remote node */
+  port_t port;          /* the port of a pending request */
+  rlnode pnode;         /* in the pending list */
+  int refused;          /* a connect request was refused */
+
+  int rx_eof;           /* the peer will not write more */
+  int rx_shut;          /* we will not read more */
+  int tx_shut;          /* we will not write more */
+  int tx_broken;        /* the peer will not read more */
+  uint credit;          /* bytes we may send */
+  uint consumed;        /* bytes read, not yet returned as credit */
+
+  uint r_pos, count;    /* the data in rxbuf */
+  char rxbuf[NET_WINDOW];
+
+  CondVar changed;      /* broadcast when any of the above changes */
+};
+
+
+/*
+  The state of the driver is protected by net_lock, which is held
+  with preemption off, because the NIC interrupt handlers also take it.
+  There is one state per kernel instance.
+ */
+struct net_state {
+  Mutex net_lock;
+  net_conn conns[NET_MAX_CONNS];
+  rlnode pending;               /* requests waiting for a listener */
+  char listening[MAX_PORT+1];   /* the ports with a listener */
+  uint request_gen;             /* incremented when listeners must look */
+  CondVar request_cv;           /* broadcast when request_gen changes */
+
+  nic_packet tx_pkt[NET_TX_SLOTS];
+  nic_packet* tx_free[NET_TX_SLOTS];
+  uint tx_nfree;
+  CondVar tx_available;         /* broadcast when packets are freed */
+
+  nic_packet rx_pkt[NET_RX_SLOTS];
+};
+
+#define net_lock (KVM->net->net_lock)
+#define conns (KVM->net->conns)
+#define pending (KVM->net->pending)
+#define listening (KVM->net->listening)
+#define request_gen (KVM->net->request_gen)
+#define request_cv (KVM->net->request_cv)
+#define tx_pkt (KVM->net->tx_pkt)
+#define tx_free (KVM->net->tx_free)
+#define tx_nfree (KVM->net->tx_nfree)
+#define tx_available (KVM->net->tx_available)
+#define rx_pkt (KVM->net->rx_pkt)
+
+
+/* Release the kernel lock and take net_lock */
+static inline int net_enter()
+{
+  kernel_unlock();
+  int preempt = preempt_off;
+  Mutex_Lock(&net_lock);
+  return preempt;
+}
+
+static inline void net_exit(int preempt)
+{
+  Mutex_Unlock(&net_lock);
+  if(preempt) preempt_on;
+  kernel_lock();
+}
+
+
+static net_conn* conn_alloc()
+{
+  for(uint i=0; i<NET_MAX_CONNS; i++) {
+    net_conn* c = &conns[i];
+    if(c->state == NET_FREE) {
+      c->id += NET_MAX_CONNS;
+      c->refused = 0;
+      c->rx_eof = c->rx_shut = c->tx_shut = c->tx_broken = 0;
+      c->credit = c->consumed = 0;
+      c->r_pos = c->count = 0;
+      c->changed = COND_INIT;
+      rlnode_init(&c->pnode, c);
+      return c;
+    }
+  }
+  return NULL;
+}
+
+static net_conn* conn_lookup(uint id, node_t node)
+{
+  net_conn* c = &conns[id % NET_MAX_CONNS];
+  return (c->id == id && c->state != NET_FREE && c->node == node) ? c : NULL;
+}
+
+
+/* Get a free packet, waiting for one if 'wait' is set */
+static nic_packet* tx_get(int wait)
+{
+  while(tx_nfree == 0) {
+    if(! wait) return NULL;
+    Cond_Wait(&net_lock, &tx_available);
+  }
+  return tx_free[--tx_nfree];
+}
+
+/* Transmit a message with 'len' bytes of data */
+static void net_transmit(nic_packet* pkt, node_t node, net_header* h, const char* data, uint len)
+{
+  pkt->node = node;
+  pkt->len = sizeof(net_header) + len;
+  memcpy(pkt->buf, h, sizeof(net_header));
+  if(len > 0)
+    memcpy((char*)pkt->buf + sizeof(net_header), data, len);
+  int ok = bios_nic_submit_tx(pkt);
+  assert(ok);  (void)ok;
+}
+
+/* Send a message without data. Interrupt handlers cannot wait,
+   so their messages may be dropped. */
+static int net_send(node_t node, net_header* h, int wait)
+{
+  nic_packet* pkt = tx_get(wait);
+  if(pkt == NULL) return 0;
+  net_transmit(pkt, node, h, NULL, 0);
+  return 1;
+}
+
+
+/* Wake up the listeners waiting in net_wait_request. Called with net_lock held. */
+static void net_request_arrived()
+{
+  request_gen++;
+  Cond_Broadcast(&request_cv);
+}
+
+
+/* Shut down our end of a connection */
+static void conn_shutdown(net_conn* c, shutdown_mode how)
+{
+  net_header h = { .type = NET_SHUTDOWN, .how = 0, .dst = c->peer };
+  if((how & SHUTDOWN_READ) && !c->rx_shut) {
+    c->rx_shut = 1;
+    c->count = 0;
+    h.how |= SHUTDOWN_READ;
+  }
+  if((how & SHUTDOWN_WRITE) && !c->tx_shut) {
+    c->tx_shut = 1;
+    h.how |= SHUTDOWN_WRITE;
+  }
+  if(h.how != 0)
+    net_send(c->node, &h, 1);
+  Cond_Broadcast(&c->changed);
+}
+
+
+/*
+  Interrupt handlers
+ */
+
+/* A connection request arrived */
+static void net_request(node_t node, net_header* h)
+{
+  net_conn* c = conn_alloc();
+  if(c != NULL) {
+    c->state = NET_PENDING;
+    c->node = node;
+    c->peer = h->src;
+    c->port = h->port;
+
+    /* 
+      Wake up the listener, if there is one. We cannot take the kernel
+      lock here, so listeners wait for requests at request_cv.
+     */
+    if(h->port > NOPORT && h->port <= MAX_PORT && listening[h->port]) {
+      rlist_push_back(&pending, &c->pnode);
+      net_request_arrived();
+      return;
+    }
+
+    c->state = NET_FREE;
+  }
+
+  net_header reply = { .type = NET_REFUSE, .dst = h->src };
+  net_send(node, &reply, 0);
+}
+
+
+static void net_receive(nic_packet* pkt)
+{
+  net_header* h = pkt->buf;
+  node_t node = pkt->node;
+  const char* data = (char*)pkt->buf + sizeof(net_header);
+  uint len = pkt->len - sizeof(net_header);
+
+  if(h->type == NET_CONNECT) {
+    net_request(node, h);
+    return;
+  }
+
+  net_conn* c = conn_lookup(h->dst, node);
+
+  switch(h->type) {
+  case NET_ACCEPT:
+    if(c != NULL && c->state == NET_CONNECTING) {
+      c->state = NET_OPEN;
+      c->peer = h->src;
+      c->credit = NET_WINDOW;
+    } else {
+      /* We have given up on the request, close the new connection */
+      net_header reply = { .type = NET_SHUTDOWN, .how = SHUTDOWN_BOTH, .dst = h->src };
+      net_send(node, &reply, 0);
+    }
+    break;
+
+  case NET_REFUSE:
+    if(c != NULL && c->state == NET_CONNECTING)
+      c->refused = 1;
+    break;
+
+  case NET_DATA:
+    if(c != NULL && c->state == NET_OPEN && !c->rx_shut) {
+      /* The sender respects our window, but make sure */
+      if(len > NET_WINDOW - c->count) len = NET_WINDOW - c->count;
+      uint w_pos = (c->r_pos + c->count) % NET_WINDOW;
+      uint n1 = (len < NET_WINDOW - w_pos) ? len : NET_WINDOW - w_pos;
+      memcpy(c->rxbuf + w_pos, data, n1);
+      memcpy(c->rxbuf, data + n1, len - n1);
+      c->count += len;
+    }
+    break;
+
+  case NET_CREDIT:
+    if(c != NULL && c->state == NET_OPEN)
+      c->credit += h->credit;
+    break;
+
+  case NET_SHUTDOWN:
+    if(c != NULL) {
+      if(h->how & SHUTDOWN_WRITE) c->rx_eof = 1;
+      if(h->how & SHUTDOWN_READ) c->tx_broken = 1;
+    }
+    break;
+  }
+
+  if(c != NULL) Cond_Broadcast(&c->changed);
+}
+
+
+static void net_rx_handler()
+{
+  int preempt = preempt_off;
+  Mutex_Lock(&net_lock);
+
+  nic_packet* pkt;
+  while((pkt = bios_nic_rx_complete()) != NULL) {
+    if(pkt->status == 0 && pkt->len >= sizeof(net_header))
+      net_receive(pkt);
+    int ok = bios_nic_post_rx(pkt);
+    assert(ok);  (void)ok;
+  }
+
+  Mutex_Unlock(&net_lock);
+  if(preempt) preempt_on;
+}
+
+
+static void net_tx_handler()
+{
+  int preempt = preempt_off;
+  Mutex_Lock(&net_lock);
+
+  nic_packet* pkt;
+  int freed = 0;
+  while((pkt = bios_nic_tx_complete()) != NULL) {
+    if(pkt->status != 0) {
+      /* The node is unreachable, break its connections */
+      for(uint i=0; i<NET_MAX_CONNS; i++) {
+        net_conn* c = &conns[i];
+        if(c->node != pkt->node) continue;
+        if(c->state == NET_CONNECTING)
+          c->refused = 1;
+        else if(c->state == NET_OPEN)
+          c->rx_eof = c->tx_broken = 1;
+        else
+          continue;
+        Cond_Broadcast(&c->changed);
+      }
+    }
+    tx_free[tx_nfree++] = pkt;
+    freed = 1;
+  }
+  if(freed) Cond_Broadcast(&tx_available);
+
+  Mutex_Unlock(&net_lock);
+  if(preempt) preempt_on;
+}
+
+
+/*
+  The API
+ */
+
+node_t net_node()
+{
+  return bios_nic_node() < 0 ? NONODE : bios_nic_node();
+}
+
+
+net_conn* net_connect(node_t node, port_t port, timeout_t timeout)
+{
+  int preempt = net_enter();
+
+  net_conn* c = conn_alloc();
+  if(c != NULL) {
+    c->state = NET_CONNECTING;
+    c->node = node;
+    net_header h = { .type = NET_CONNECT, .port = port, .src = c->id };
+    net_send(node, &h, 1);
+
+    while(c->state == NET_CONNECTING && !c->refused) {
+      if(timeout < 0)
+        Cond_Wait(&net_lock, &c->changed);
+      else if(! Cond_TimedWait(&net_lock, &c->changed, timeout))
+        break;
+    }
+
+    if(c->state != NET_OPEN) {
+      c->state = NET_FREE;
+      c = NULL;
+    }
+  }
+
+  net_exit(preempt);
+  return c;
+}
+
+
+net_conn* net_accept_pending(port_t port)
+{
+  if(bios_nic_node() < 0) return NULL;
+
+  int preempt = preempt_off;
+  Mutex_Lock(&net_lock);
+
+  net_conn* c = NULL;
+  for(rlnode* p = pending.next; p != &pending; p = p->next)
+    if(((net_conn*)p->obj)->port == port) {
+      c = rlist_remove(p)->obj;
+      break;
+    }
+
+  Mutex_Unlock(&net_lock);
+  if(preempt) preempt_on;
+  return c;
+}
+
+
+void net_listen(port_t port)
+{
+  int preempt = preempt_off;
+  Mutex_Lock(&net_lock);
+  listening[port] = 1;
+  Mutex_Unlock(&net_lock);
+  if(preempt) preempt_on;
+}
+
+
+uint net_request_gen()
+{
+  return __atomic_load_n(&request_gen, __ATOMIC_ACQUIRE);
+}
+
+
+void net_wait_request(uint gen)
+{
+  int preempt = net_enter();
+  while(request_gen == gen)
+    Cond_Wait(&net_lock, &request_cv);
+  net_exit(preempt);
+}
+
+
+void net_wake_listeners()
+{
+  int preempt = preempt_off;
+  Mutex_Lock(&net_lock);
+  net_request_arrived();
+  Mutex_Unlock(&net_lock);
+  if(preempt) preempt_on;
+}
+
+
+void net_accept(net_conn* c)
+{
+  int preempt = net_enter();
+  c->state = NET_OPEN;
+  c->credit = NET_WINDOW;
+  net_header h = { .type = NET_ACCEPT, .dst = c->peer, .src = c->id };
+  net_send(c->node, &h, 1);
+  net_exit(preempt);
+}
+
+
+void net_refuse(net_conn* c)
+{
+  int preempt = net_enter();
+  net_header h = { .type = NET_REFUSE, .dst = c->peer };
+  net_send(c->node, &h, 1);
+  c->state = NET_FREE;
+  net_exit(preempt);
+}
+
+
+void net_refuse_port(port_t port)
+{
+  /* New requests for the port are refused by the interrupt handler */
+  int preempt = preempt_off;
+  Mutex_Lock(&net_lock);
+  listening[port] = 0;
+  Mutex_Unlock(&net_lock);
+  if(preempt) preempt_on;
+
+  net_conn* c;
+  while((c = net_accept_pending(port)) != NULL)
+    net_refuse(c);
+}
+
+
+int net_read(net_conn* c, char* buf, unsigned int size)
+{
+  int preempt = net_enter();
+
+  while(c->count == 0 && !c->rx_eof && !c->rx_shut)
+    Cond_Wait(&net_lock, &c->changed);
+
+  int ret = -1;
+  if(! c->rx_shut) {
+    uint n = (size < c->count) ? size : c->count;
+    uint n1 = (n < NET_WINDOW - c->r_pos) ? n : NET_WINDOW - c->r_pos;
+    memcpy(buf, c->rxbuf + c->r_pos, n1);
+    memcpy(buf + n1, c->rxbuf, n - n1);
+    c->r_pos = (c->r_pos + n) % NET_WINDOW;
+    c->count -= n;
+
+    /* Return credit in batches */
+    c->consumed += n;
+    if(c->consumed >= NET_WINDOW/4 && !c->rx_eof) {
+      net_header h = { .type = NET_CREDIT, .dst = c->peer, .credit = c->consumed };
+      c->consumed = 0;
+      net_send(c->node, &h, 1);
+    }
+    ret = n;
+  }
+
+  net_exit(preempt);
+  return ret;
+}
+
+
+int net_write(net_conn* c, const char* buf, unsigned int size)
+{
+  int preempt = net_enter();
+
+  while(c->credit == 0 && !c->tx_broken && !c->tx_shut)
+    Cond_Wait(&net_lock, &c->changed);
+
+  int ret = -1;
+  if(! c->tx_broken && ! c->tx_shut) {
+    uint sent = 0;
+    while(sent < size && c->credit > 0 && !c->tx_broken) {
+      /* Wait only for the first packet */
+      nic_packet* pkt = tx_get(sent == 0);
+      if(pkt == NULL) break;
+
+      uint n = size - sent;
+      if(n > c->credit) n = c->credit;
+      if(n > NET_PAYLOAD) n = NET_PAYLOAD;
+      net_header h = { .type = NET_DATA, .dst = c->peer };
+      net_transmit(pkt, c->node, &h, buf + sent, n);
+      c->credit -= n;
+      sent += n;
+    }
+    if(sent > 0 || size == 0) ret = sent;
+  }
+
+  net_exit(preempt);
+  return ret;
+}
+
+
+int net_shutdown(net_conn* c, shutdown_mode how)
+{
+  if(how < SHUTDOWN_READ || how > SHUTDOWN_BOTH) return -1;
+  int preempt = net_enter();
+  conn_shutdown(c, how);
+  net_exit(preempt);
+  return 0;
+}
+
+
+int net_close(net_conn* c)
+{
+  int preempt = net_enter();
+  conn_shutdown(c, SHUTDOWN_BOTH);
+  c->state = NET_FREE;
+  net_exit(preempt);
+  return 0;
+}
+
+
+/*
+  The network device. Its streams are the remote connections, which
+  are opened by the socket layer.
+ */
+
+static void* net_stream_open(uint minor)
+{
+  return NULL;
+}
+
+static int net_stream_read(void* this, char* buf, unsigned int size)
+{
+  return net_read(this, buf, size);
+}
+
+static int net_stream_write(void* this, const char* buf, unsigned int size)
+{
+  return net_write(this, buf, size);
+}
+
+static int net_stream_close(void* this)
+{
+  return net_close(this);
+}
+
+file_ops net_fops = {
+  .Open = net_stream_open,
+  .Read = net_stream_read,
+  .Write = net_stream_write,
+  .Close = net_stream_close
+};
+
+
+void initialize_network()
+{
+  KVM->net = xcalloc_aligned(sizeof(struct net_state));
+  rlnode_init(&pending, NULL);
+  for(uint i=0; i<NET_MAX_CONNS; i++) {
+    conns[i].id = i;
+    conns[i].state = NET_FREE;
+  }
+  tx_available = COND_INIT;
+  tx_nfree = 0;
+  request_cv = COND_INIT;
+
+  if(bios_nic_node() < 0) return;
+
+  for(uint i=0; i<NET_TX_SLOTS; i++) {
+    tx_pkt[i].buf = xmalloc(NIC_MTU);
+    tx_free[tx_nfree++] = &tx_pkt[i];
+  }
+
+  cpu_interrupt_handler(NIC_RX_COMPLETE, net_rx_handler);
+  cpu_interrupt_handler(NIC_TX_COMPLETE, net_tx_handler);
+
+  for(uint i=0; i<NET_RX_SLOTS; i++) {
+    rx_pkt[i].buf = xmalloc(NIC_MTU);
+    int ok = bios_nic_post_rx(&rx_pkt[i]);
+    assert(ok);  (void)ok;
+  }
+}
+
+
+void finalize_network()
+{
+  /* The packet buffers are NULL if there is no NIC */
+  for(uint i=0; i<NET_TX_SLOTS; i++)
+    free(tx_pkt[i].buf);
+  for(uint i=0; i<NET_RX_SLOTS; i++)
+    free(rx_pkt[i].buf);
+  free(KVM->net);
+  KVM->net = NULL;
+}
+
+
+node_t sys_GetNodeId()
+{
+  return net_node();
+}
@@ -0,0 +1,150 @@
+#ifndef __KERNEL_NET_H
+#define __KERNEL_NET_H
+
+#include "tinyos.h"
+#include "kernel_dev.h"
+
+/**
+	@file kernel_net.h
+	@brief The network driver.
+
+	@defgroup net Network
+	@ingroup kernel
+	@brief The network driver.
+
+	The network driver (@c DEV_NET) carries socket connections between
+	nodes, i.e., tinyos virtual machines connected by the NIC of the BIOS.
+
+	A remote connection is a @c net_conn object at each end. Data is sent
+	in packets, and buffered at the receiving end. Flow control is by
+	credit: a sender may have at most @c NET_WINDOW bytes unread at the
+	receiver, and the receiver returns credit as data is read.
+
+	All functions of this API are called with the kernel lock held, which
+	they release while they wait.
+
+	@{
+*/
+
+/** @brief The receive buffer size of a connection. */
+#define NET_WINDOW 8192
+
+/** @brief A remote connection. */
+typedef struct net_conn net_conn;
+
+/** @brief The file operations of the network device. */
+extern file_ops net_fops;
+
+/**
+	@brief Initialize the network driver.
+
+	This is called by @c initialize_devices, at kernel startup.
+  */
+void initialize_network();
+
+/**
+	@brief Release the memory of the network driver.
+
+	This is called by @c finalize_devices, after the VM has stopped.
+  */
+void finalize_network();
+
+/**
+	@brief Return the node id of this node, or @c NONODE.
+  */
+node_t net_node();
+
+/**
+	@brief Connect to a listening socket of a remote node.
+
+	@param node the remote node
+	@param port the port of the listening socket
+	@param timeout the timeout in msec, as in @c Connect
+	@returns the new connection, or NULL on error
+  */
+net_conn* net_connect(node_t node, port_t port, timeout_t timeout);
+
+/**
+	@brief Take a remote connection request for a port.
+
+	@returns a pending request, to be passed to either @c net_accept
+	or @c net_refuse, or NULL if there are none.
+  */
+net_conn* net_accept_pending(port_t port);
+
+/**
+	@brief Mark a port as listening.
+
+	Remote requests for a port which is not listening are refused at
+	once. @c net_refuse_port ends the listening.
+  */
+void net_listen(port_t port);
+
+/**
+	@brief Return the current request generation.
+
+	The generation changes when a remote request arrives, or when
+	@c net_wake_listeners is called. A listener reads it before checking
+	for requests, and then passes it to @c net_wait_request.
+  */
+uint net_request_gen();
+
+/**
+	@brief Wait until the request generation differs from @c gen.
+
+	The @c NIC_RX_COMPLETE handler cannot take the kernel lock, so 
+	listeners wait for remote requests at a condition of the driver.
+	The kernel lock is released during the wait.
+  */
+void net_wait_request(uint gen);
+
+/**
+	@brief Wake up all listeners waiting in @c net_wait_request.
+
+	This is called when a local request arrives, or a listener is closed.
+  */
+void net_wake_listeners();
+
+/**
+	@brief Accept a pending request.
+  */
+void net_accept(net_conn* conn);
+
+/**
+	@brief Refuse a pending request.
+  */
+void net_refuse(net_conn* conn);
+
+/**
+	@brief Refuse all pending requests for a port.
+
+	This is called when the listener of the port is closed.
+  */
+void net_refuse_port(port_t port);
+
+/**
+	@brief Read from a remote connection.
+	@see file_ops
+  */
+int net_read(net_conn* conn, char* buf, unsigned int size);
+
+/**
+	@brief Write to a remote connection.
+	@see file_ops
+  */
+int net_write(net_conn* conn, const char* buf, unsigned int size);
+
+/**
+	@brief Shut down one or both directions of a remote connection.
+	@see ShutDown
+  */
+int net_shutdown(net_conn* conn, shutdown_mode how);
+
+/**
+	@brief Close a remote connection.
+  */
+int net_close(net_conn* conn);
+
+/** @} */
+
+#endif
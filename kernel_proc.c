@@ -3,6 +3,7 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
+#include "kernel_vm.h"
 
 
 /* 
@@ -15,9 +16,16 @@
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
-unsigned int process_count;
+/* The state of this module, per kernel instance */
+struct proc_state {
+  PCB PT[MAX_PROC];           /* The process table */
+  unsigned int process_count;
+  PCB* pcb_freelist;
+};
+
+#define PT (KVM->proc->PT)
+#define process_count (KVM->proc->process_count)
+#define pcb_freelist (KVM->proc->pcb_freelist)
 
 PCB* get_pcb(Pid_t pid)
 {
@@ -62,10 +70,10 @@ void initialize_PTCB(PTCB* ptcb)
 
 
 
-static PCB* pcb_freelist;
-
 void initialize_processes()
 {
+  KVM->proc = xcalloc_aligned(sizeof(struct proc_state));
+
   /* initialize the PCBs */
   for(Pid_t p=0; p<MAX_PROC; p++) {
     initialize_PCB(&PT[p]);
@@ -89,31 +97,54 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with kernel_mutex held.
+
+  Released PCBs return to the freelist after their grace period (see
+  release_PCB). If all free PCBs are waiting for it, we wait too, but 
+  without the kernel lock.
 */
 PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  while(pcb_freelist == NULL && process_count < MAX_PROC) {
+    epoch_reclaim();
+    if(pcb_freelist != NULL) break;
+    kernel_unlock();
+    epoch_barrier();
+    kernel_lock();
+  }
+
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
-    pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
+    /* Lock-free readers of PT[] must not see the fields of the last process */
+    pcb->parent = NULL;
+    pcb->main_task = NULL;
+    pcb->argl = 0;
+    __atomic_store_n(&pcb->pstate, ALIVE, __ATOMIC_RELEASE);
     process_count++;
   }
 
   return pcb;
 }
 
+static void reclaim_PCB(void* obj)
+{
+  PCB* pcb = obj;
+  pcb->parent = pcb_freelist;
+  pcb_freelist = pcb;
+}
+
 /*
   Must be called with kernel_mutex held
 */
 void release_PCB(PCB* pcb)
 {
+  /* Lock-free readers of PT[] may still hold the PCB */
   pcb->pstate = FREE;
-  pcb->parent = pcb_freelist;
-  pcb_freelist = pcb;
   process_count--;
+  epoch_retire(reclaim_PCB, pcb);
 }
 
 
@@ -185,18 +216,20 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   }
 
 
-  /* Set the main thread's function */
-  newproc->main_task = call;
-
   /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
   if(args!=NULL) {
-    newproc->args = malloc(argl);
-    memcpy(newproc->args, args, argl);
+    void* newargs = malloc(argl);
+    memcpy(newargs, args, argl);
+    /* Lock-free readers of PT[] must see argl before args */
+    __atomic_store_n(&newproc->args, newargs, __ATOMIC_RELEASE);
   }
   else
     newproc->args=NULL;
 
+  /* Set the main thread's function, last, for lock-free readers of PT[] */
+  __atomic_store_n(&newproc->main_task, call, __ATOMIC_RELEASE);
+
   /* 
     Create and wake up the thread for the main function. This must be the last thing
     we do, because once we wakeup the new thread it may run! so we need to have finished
@@ -233,15 +266,20 @@ finish:
 
 
 /* System call */
+/* 
+  GetPid and GetPPid do not take the kernel lock. The parent may change
+  concurrently (when it exits), so it is read atomically.
+*/
 Pid_t sys_GetPid()
 {
-  return get_pid(CURPROC);
+  return get_pid(cur_thread_fast()->owner_pcb);
 }
 
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  PCB* curproc = cur_thread_fast()->owner_pcb;
+  return get_pid(__atomic_load_n(&curproc->parent, __ATOMIC_RELAXED));
 }
 
 
@@ -353,7 +391,8 @@ static file_ops procinfo_ops = {
   .Open = null_procinfo_open,
   .Read = procinfo_read,
   .Write = null_procinfo_write,
-  .Close = procinfo_close
+  .Close = procinfo_close,
+  .lockfree_read = 1
 };
 
 
@@ -382,7 +421,7 @@ Fid_t sys_OpenInfo()
   procinfoCB->PCB_cursor = 1;
 
   fcb->streamobj = procinfoCB;
-  fcb->streamfunc = & procinfo_ops;
+  __atomic_store_n(&fcb->streamfunc, & procinfo_ops, __ATOMIC_RELEASE);
 
   return fid;
 }
@@ -391,57 +430,70 @@ int procinfo_close(void* procinfoCB_t)
 {
   if (procinfoCB_t == NULL)
     return -1;
-  free(procinfoCB_t);
+  /* Lock-free readers may still hold it */
+  epoch_retire(free, procinfoCB_t);
   return 0;
 }
 
+/*
+  This is lock-free: it is called inside an epoch section (see sys_Read),
+  so the PCBs it reads are not reclaimed under it. Each reader claims a 
+  PCB by advancing the cursor, and fills its own record.
+ */
 int procinfo_read(void* procinfoCB_t, char *buf, unsigned int n)
 {
-
   procinfo_cb* procinfoCB = (procinfo_cb*)procinfoCB_t;
 
   if (procinfoCB == NULL)
     return -1;
+
+  int cursor = __atomic_load_n(&procinfoCB->PCB_cursor, __ATOMIC_RELAXED);
   /*oso to PCB->cursor deixne sta oria tou PT[]*/
-  while(procinfoCB->PCB_cursor < MAX_PROC){
+  while(cursor < MAX_PROC){
+    PCB* proc = &PT[cursor];
+    pid_state pstate = __atomic_load_n(&proc->pstate, __ATOMIC_ACQUIRE);
+
+    /* Claim this PCB, or see who claimed it first */
+    if(! __atomic_compare_exchange_n(&procinfoCB->PCB_cursor, &cursor, cursor+1, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      continue;
+
     /*an to process einai FREE proxwra*/
-    if (PT[procinfoCB->PCB_cursor].pstate == FREE)
-    {
-      procinfoCB->PCB_cursor++;
+    if (pstate == FREE) {
+      cursor++;
+      continue;
     }
-    /*to process einai alive h' zombie*/
-    else
-    {
-      PCB proc = PT[procinfoCB->PCB_cursor];
-      /*enhmerwsh procinfo*/
-      procinfoCB->p_info.pid = get_pid(&PT[procinfoCB->PCB_cursor]);
-      procinfoCB->p_info.ppid = get_pid(proc.parent);
 
-      procinfoCB->p_info.alive = (proc.pstate == ALIVE) ? 1 : 0;
-
-      procinfoCB->p_info.thread_count = proc.thread_count;
+    /*to process einai alive h' zombie*/
+    procinfo p_info;
+    memset(&p_info, 0, sizeof(p_info));
+    /*enhmerwsh procinfo*/
+    /* The other fields of a new process are set before its main task */
+    p_info.main_task = __atomic_load_n(&proc->main_task, __ATOMIC_ACQUIRE);
 
-      procinfoCB->p_info.main_task = PT[procinfoCB->PCB_cursor].main_task;
+    p_info.pid = get_pid(proc);
+    p_info.ppid = get_pid(__atomic_load_n(&proc->parent, __ATOMIC_RELAXED));
 
-      procinfoCB->p_info.argl =  proc.argl;
-      /*an argl megalutero tou PROCINFO_MAX_ARGS_SIZE kanw memcpy PROCINFO_MAX_ARGS_SIZE bytes
-        alliws kanw memcpy argl bytes*/
-      int sizeof_args = (proc.argl > PROCINFO_MAX_ARGS_SIZE) ? PROCINFO_MAX_ARGS_SIZE :proc.argl ; 
+    p_info.alive = (pstate == ALIVE) ? 1 : 0;
 
-      if (proc.args != NULL){
-        memcpy(procinfoCB->p_info.args,proc.args,sizeof_args);
-      }
+    p_info.thread_count = __atomic_load_n(&proc->thread_count, __ATOMIC_RELAXED);
 
-      memcpy(buf,(char*)&procinfoCB->p_info,n);
+    /* The args are published after argl, and retired on exit */
+    void* args = __atomic_load_n(&proc->args, __ATOMIC_ACQUIRE);
+    p_info.argl = __atomic_load_n(&proc->argl, __ATOMIC_RELAXED);
+    /*an argl megalutero tou PROCINFO_MAX_ARGS_SIZE kanw memcpy PROCINFO_MAX_ARGS_SIZE bytes
+      alliws kanw memcpy argl bytes*/
+    int sizeof_args = (p_info.argl > PROCINFO_MAX_ARGS_SIZE) ? PROCINFO_MAX_ARGS_SIZE : p_info.argl;
 
-      procinfoCB->PCB_cursor++;
+    if (args != NULL){
+      memcpy(p_info.args, args, sizeof_args);
+    }
 
-      return n; 
-    }     
+    if(n > sizeof(p_info)) n = sizeof(p_info);
+    memcpy(buf, (char*)&p_info, n);
 
-    
+    return n; 
   }
   /*EOF* afou kseperasa ta oria tou pinaka kai vghka apo th while*/
   return 0;
-  
-}
\ No newline at end of file
+}
@@ -23,7 +23,6 @@ void initialize_PTCB(PTCB* ptcb);
 
 /**************************************************/
 typedef struct procinfo_cb{
-  procinfo p_info;
   int PCB_cursor;
 }procinfo_cb;
 
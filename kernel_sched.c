@@ -5,6 +5,8 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_sched.h"
+#include "kernel_streams.h"
+#include "kernel_vm.h"
 #include "tinyos.h"
 
 #ifndef NVALGRIND
@@ -18,8 +20,29 @@
 
  *********************************************/
 
-/* Core control blocks */
-CCB cctx[MAX_CORES];
+/*
+	The state of the scheduler, per kernel instance.
+ */
+struct sched_state {
+	CCB cctx[MAX_CORES];			/* Core control blocks */
+
+	volatile unsigned int active_threads;	/* see below */
+	Mutex active_threads_spinlock;
+
+	rlnode SCHED[PRIORITY_QUEUES];	/* The scheduler queue */
+	rlnode TIMEOUT_LIST;			/* The list of threads with a timeout */
+	Mutex sched_spinlock;
+
+	int yield_count;				/* calls to yield(), for boost() */
+};
+
+#define cctx (KVM->sched->cctx)
+#define active_threads (KVM->sched->active_threads)
+#define active_threads_spinlock (KVM->sched->active_threads_spinlock)
+#define SCHED (KVM->sched->SCHED)
+#define TIMEOUT_LIST (KVM->sched->TIMEOUT_LIST)
+#define sched_spinlock (KVM->sched->sched_spinlock)
+#define yield_count (KVM->sched->yield_count)
 
 
 /* 
@@ -51,6 +74,74 @@ TCB* cur_thread()
 
 
 
+TCB* cur_thread_fast()
+{
+  while(1) {
+    uint core = cpu_core_id_now();
+    unsigned long sw = __atomic_load_n(&cctx[core].switches, __ATOMIC_ACQUIRE);
+    TCB* cur = __atomic_load_n(&cctx[core].current_thread, __ATOMIC_ACQUIRE);
+    /* 
+      If we were switched out of 'core' at any point, its switch count has
+      changed, or we are on another core now.
+     */
+    if(cpu_core_id_now() == core && 
+      __atomic_load_n(&cctx[core].switches, __ATOMIC_ACQUIRE) == sw)
+      return cur;
+  }
+}
+
+
+TimerDuration sched_clock()
+{
+  /* If we are moved to another core, its cache is just as good */
+  TimerDuration t = __atomic_load_n(&cctx[cpu_core_id_now()].clock, __ATOMIC_RELAXED);
+  return (t != 0) ? t : bios_clock();
+}
+
+
+timeout_t sys_GetTime()
+{
+  return sched_clock() / 1000ul;
+}
+
+
+uint64_t sys_GetTimeNs()
+{
+  return bios_clock_ns();
+}
+
+
+/* Take the snapshot of a core information stream */
+static void* coreinfo_fill(uint* count)
+{
+  *count = cpu_cores();
+  coreinfo* infos = xmalloc(*count * sizeof(coreinfo));
+
+  for(uint c=0; c<*count; c++) {
+    core_stats st;
+    cpu_core_stats(c, &st);
+
+    coreinfo* ci = &infos[c];
+    ci->core = c;
+    ci->interrupts = 0;
+    for(uint i=0; i<maximum_interrupt_no; i++)
+      ci->interrupts += st.irq_delivered[i];
+    ci->alarms = st.irq_delivered[ALARM];
+    ci->switches = __atomic_load_n(&cctx[c].switches, __ATOMIC_RELAXED);
+    ci->halts = st.hlt_count;
+    ci->restarts = st.rst_count;
+    ci->halt_time = st.hlt_time;
+    ci->run_time = st.run_time;
+  }
+  return infos;
+}
+
+Fid_t sys_OpenCoreInfo()
+{
+  return open_snapshot_stream(sizeof(coreinfo), coreinfo_fill);
+}
+
+
 /*
    The thread layout.
   --------------------
@@ -79,11 +170,9 @@ TCB* cur_thread()
  */
 
 /*
-  A counter for active threads. By "active", we mean 'existing',
+  active_threads counts the active threads. By "active", we mean 'existing',
   with the exception of idle threads (they don't count).
  */
-volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -231,11 +320,6 @@ void release_TCB(TCB* tcb)
 */
 /************************************************************/
 /*o SCHED ginetai pinakas pou deixnei se PRIORITY_QUEUES oures*/
-rlnode SCHED[PRIORITY_QUEUES]; /* The scheduler queue */
-
-
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
@@ -254,7 +338,7 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
+		TimerDuration curtime = bios_clock_ns() / 1000ul;
 		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
 
 		/* add to the TIMEOUT_LIST in sorted order */
@@ -316,7 +400,7 @@ static void sched_make_ready(TCB* tcb)
 static void sched_wakeup_expired_timeouts()
 {
 	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	TimerDuration curtime = bios_clock_ns() / 1000ul;
 
 	while (!is_rlist_empty(&TIMEOUT_LIST)) {
 		TCB* tcb = TIMEOUT_LIST.next->tcb;
@@ -326,6 +410,19 @@ static void sched_wakeup_expired_timeouts()
 	}
 }
 
+/*
+  Return true if no thread is in the scheduler queues.
+ */
+static int sched_queue_empty()
+{
+	int empty = 1;
+	Mutex_Lock(&sched_spinlock);
+	for (int i = 0; i < PRIORITY_QUEUES && empty; i++)
+		empty = is_rlist_empty(&SCHED[i]);
+	Mutex_Unlock(&sched_spinlock);
+	return empty;
+}
+
 /*
   Remove the head of the scheduler list, if any, and
   return it. Return NULL if the list is empty.
@@ -420,8 +517,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 /* This function is the entry point to the scheduler's context switching */
 
-/*metrhths pou metraei poses fores kalesthke h yield()*/
-static int yield_count = 0;
+/*metrhths pou metraei poses fores kalesthke h yield() (yield_count)*/
 
 void boost(){
 	rlnode* node_ptr;
@@ -508,7 +604,8 @@ void yield(enum SCHED_CAUSE cause)
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		__atomic_fetch_add(&CURCORE.switches, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&CURTHREAD, next, __ATOMIC_RELEASE);
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -541,6 +638,9 @@ void gain(int preempt)
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
 
+	/* Refresh the cached clock */
+	__atomic_store_n(&CURCORE.clock, bios_clock(), __ATOMIC_RELAXED);
+
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
@@ -577,7 +677,16 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		/* 
+			An interrupt handler (e.g., run in gain() above) may have made
+			a thread ready. Check with preemption off, since cpu_core_halt()
+			returns at once on a pending interrupt, and turns preemption on.
+		 */
+		int preempt = preempt_off;
+		if (sched_queue_empty())
+			cpu_core_halt();
+		else if (preempt)
+			preempt_on;
 		yield(SCHED_IDLE);
 	}
 
@@ -593,11 +702,17 @@ static void idle_thread()
  */
 void initialize_scheduler()
 {
+	/* The state of the scheduler, zeroed */
+	KVM->sched = xcalloc_aligned(sizeof(struct sched_state));
+
 	for(int i=0; i<PRIORITY_QUEUES; i++){
 		rlnode_init(&SCHED[i], NULL);
 	}
 	
 	rlnode_init(&TIMEOUT_LIST, NULL);
+
+	lockstat_name(&sched_spinlock, "sched_spinlock");
+	lockstat_name(&active_threads_spinlock, "active_threads_spinlock");
 }
 
 void run_scheduler()
@@ -108,7 +108,8 @@ typedef struct thread_control_block {
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
-	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler,
+								   in usec of the monotonic clock (@c bios_clock_ns()/1000) */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
@@ -159,10 +160,11 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
-} CCB;
+	TimerDuration clock; /**< @brief The kernel clock, cached at the start of each timeslice */
+	unsigned long switches; /**< @brief Incremented at each change of @c current_thread */
+
+} __attribute__((aligned(64))) CCB;
 
-/** @brief the array of Core Control Blocks (CCB) for the kernel */
-extern CCB cctx[MAX_CORES];
 
 
 /** 
@@ -178,6 +180,28 @@ extern CCB cctx[MAX_CORES];
 */
 TCB* cur_thread();
 
+/**
+  @brief The current thread, without disabling preemption.
+
+  This returns the same as @c cur_thread(), but it does not turn preemption
+  off and on (which costs two system calls on the host). It reads the
+  current core's @c current_thread and @c switches fields, and retries if
+  the caller was switched out in the meantime.
+*/
+TCB* cur_thread_fast();
+
+/**
+  @brief The kernel clock, as cached by the current core.
+
+  This returns the value of @c bios_clock() at the start of the current
+  timeslice of this core. It is much cheaper than @c bios_clock(), but its
+  resolution is the length of a timeslice. It can be called in the
+  preemptive context.
+
+  @returns the cached clock, in usec.
+*/
+TimerDuration sched_clock();
+
 /** 
   @brief The current process.
 
@@ -69,14 +69,16 @@ int sys_Listen(Fid_t sock)
 		(socketCB->type != SOCKET_UNBOUND) || (socketCB->type == SOCKET_LISTENER) ){
 		return -1;
 	}
-	/*install socket to PORT_MAP[]*/
-	PORT_MAP[socketCB->port] = socketCB;
 	/*kanw to socket listener*/
 	socketCB->type = SOCKET_LISTENER;
 	/*arxikopoihsh tou head ths queue*/ 
 	rlnode_init(& socketCB->listener_s.request_queue, NULL); 
 	/*arxikopoihsh tou condition variable*/
 	socketCB->listener_s.req_available_cv = COND_INIT;
+	/*install socket to PORT_MAP[], last, for the lock-free probe of sys_Connect*/
+	__atomic_store_n(&PORT_MAP[socketCB->port], socketCB, __ATOMIC_RELEASE);
+	/* Remote requests for the port may now be accepted */
+	net_listen(socketCB->port);
 
 	
 	return 0;	
@@ -116,16 +118,46 @@ Fid_t sys_Accept(Fid_t lsock)
 	socketCB->refcount++;
 
 	int port = socketCB->port;
+	net_conn* remote = NULL;
 	/*oso h oura einai adeia kai den exei kleisei to port kane kernel_wait*/
-	while (is_rlist_empty(& socketCB->listener_s.request_queue) && PORT_MAP[port]!= NULL){
-		kernel_wait(& socketCB->listener_s.req_available_cv ,SCHED_PIPE);
+	/* Remote requests are signalled by the network driver (see net_wait_request) */
+	uint gen = net_request_gen();
+	while (is_rlist_empty(& socketCB->listener_s.request_queue) && PORT_MAP[port]!= NULL
+		&& (remote = net_accept_pending(port)) == NULL){
+		if (net_node() == NONODE)
+			kernel_wait(& socketCB->listener_s.req_available_cv ,SCHED_PIPE);
+		else
+			net_wait_request(gen);
+		gen = net_request_gen();
 	}
 	/*an ekleise to port*/
 	if (PORT_MAP[port] == NULL){
+		if (remote != NULL)
+			net_refuse(remote);
 		socketCB->refcount--;
 		return NOFILE;
 	}
 
+	/* A request from another node */
+	if (remote != NULL) {
+		Fid_t srv_sock = sys_Socket(socketCB->port);
+		if (srv_sock == NOFILE){
+			net_refuse(remote);
+			socketCB->refcount--;
+			return NOFILE;
+		}
+		socket_cb* srv_sockCB = get_fcb(srv_sock)->streamobj;
+		srv_sockCB->type = SOCKET_PEER;
+		srv_sockCB->peer_s.peer = NULL;
+		srv_sockCB->peer_s.write_pipe = NULL;
+		srv_sockCB->peer_s.read_pipe = NULL;
+		srv_sockCB->peer_s.remote = remote;
+		net_accept(remote);
+
+		socketCB->refcount--;
+		return srv_sock;
+	}
+
 	/*yparxei request*/
 
 	/*pernw apo th lista to request*/
@@ -193,6 +225,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	srv_shockCB->peer_s.peer = cli_sockCB;
 	srv_shockCB->peer_s.write_pipe = pipeCB1;
 	srv_shockCB->peer_s.read_pipe = pipeCB2;
+	srv_shockCB->peer_s.remote = NULL;
 
 	/*metatroph tou client apo UNBOUND se PEER*/
 
@@ -201,6 +234,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	cli_sockCB->peer_s.peer = cli_sockCB;
 	cli_sockCB->peer_s.write_pipe = pipeCB2;
 	cli_sockCB->peer_s.read_pipe = pipeCB1;
+	cli_sockCB->peer_s.remote = NULL;
 	
 	/*ksypna auton pou exei kanei request kai perimenei*/
 	kernel_signal(& cli_node->req->connected_cv);
@@ -212,7 +246,8 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	
 
-int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+/* Connect to a local listener, with the kernel lock held */
+static int socket_connect(Fid_t sock, port_t port, timeout_t timeout)
 {	
 	//elegxoi gia lathos
 	/*asundeto port
@@ -257,6 +292,7 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	rlist_push_back(& listen_sock->listener_s.request_queue,& req->queue_node);
 	/*ksupanei ton listener*/
 	kernel_signal(&listen_sock->listener_s.req_available_cv);
+	net_wake_listeners();
 	/*oso den eksuphrethtai to request kane kernel_wait gia timeout xrono*/
 	while(req->admitted == 0)
 	{
@@ -276,6 +312,68 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 }
 
 
+int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+{
+	if (port <=0 || port >= MAX_PORT)
+		return -1;
+
+	/* Probe the port without the kernel lock, so that connecting to a port
+	   with no listener fails at once */
+	int preempt = epoch_enter();
+	socket_cb* listen_sock = __atomic_load_n(&PORT_MAP[port], __ATOMIC_ACQUIRE);
+	int listening = listen_sock != NULL 
+		&& __atomic_load_n(&listen_sock->type, __ATOMIC_RELAXED) == SOCKET_LISTENER;
+	epoch_exit(preempt);
+
+	if (! listening)
+		return -1;
+
+	kernel_lock();
+	int retcode = socket_connect(sock, port, timeout);
+	kernel_unlock();
+	return retcode;
+}
+
+
+int sys_ConnectNode(Fid_t sock, node_t node, port_t port, timeout_t timeout)
+{
+	FCB* fcb = get_fcb(sock);
+	if (fcb == NULL || fcb->streamfunc != &socket_file_ops)
+		return -1;
+
+	if (node == NONODE || node == net_node())
+		return socket_connect(sock, port, timeout);
+
+	if (node < 0 || node >= MAX_NODES || net_node() == NONODE)
+		return -1;
+	if (port <=0 || port >= MAX_PORT)
+		return -1;
+
+	socket_cb* cli_sockCB = fcb->streamobj;
+	if (cli_sockCB->type != SOCKET_UNBOUND)
+		return -1;
+
+	/* The kernel lock is released while connecting */
+	cli_sockCB->refcount++;
+	net_conn* remote = net_connect(node, port, timeout);
+	cli_sockCB->refcount--;
+
+	if (remote == NULL)
+		return -1;
+	if (cli_sockCB->type != SOCKET_UNBOUND) {
+		net_close(remote);
+		return -1;
+	}
+
+	cli_sockCB->type = SOCKET_PEER;
+	cli_sockCB->peer_s.peer = NULL;
+	cli_sockCB->peer_s.write_pipe = NULL;
+	cli_sockCB->peer_s.read_pipe = NULL;
+	cli_sockCB->peer_s.remote = remote;
+	return 0;
+}
+
+
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
 
@@ -289,6 +387,8 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 	if (socketCB->type != SOCKET_PEER)
 		return -1;
 
+	if (socketCB->peer_s.remote != NULL)
+		return net_shutdown(socketCB->peer_s.remote, how);
 	
 	switch(how)
 	{
@@ -324,6 +424,9 @@ int socket_read(void* socketcb_t, char *buf, unsigned int n)
 	if (socketCB == NULL)
 		return -1;
 
+	if (socketCB->type == SOCKET_PEER && socketCB->peer_s.remote != NULL)
+		return net_read(socketCB->peer_s.remote, buf, n);
+
 	if (socketCB->peer_s.read_pipe == NULL || socketCB->type != SOCKET_PEER)
 		return -1;
 
@@ -337,6 +440,9 @@ int socket_write(void* socketcb_t, const char *buf, unsigned int n)
 	if (socketCB == NULL)
 		return -1;
 
+	if (socketCB->type == SOCKET_PEER && socketCB->peer_s.remote != NULL)
+		return net_write(socketCB->peer_s.remote, buf, n);
+
 	if (socketCB->peer_s.write_pipe == NULL || socketCB->type != SOCKET_PEER)
 		return -1;
 
@@ -355,13 +461,19 @@ int socket_close(void* socketcb_t)
 
 	if (socketCB->type == SOCKET_LISTENER)
 	{
-		PORT_MAP[socketCB->port] = NULL;
+		__atomic_store_n(&PORT_MAP[socketCB->port], NULL, __ATOMIC_RELEASE);
 
 		kernel_broadcast(& socketCB->listener_s.req_available_cv);
+		net_wake_listeners();
+		net_refuse_port(socketCB->port);
 	}
 	//else if (socketCB->type == SOCKET_UNBOUND){
 
 	//}
+	else if (socketCB->type == SOCKET_PEER && socketCB->peer_s.remote != NULL)
+	{
+		net_close(socketCB->peer_s.remote);
+	}
 	else if (socketCB->type == SOCKET_PEER)
 	{
 		if (socketCB->peer_s.read_pipe != NULL)
@@ -375,8 +487,9 @@ int socket_close(void* socketcb_t)
 	if (socketCB == NULL)
 		return -1;
 	
+	/* A lock-free probe of PORT_MAP may still hold it */
 	if (socketCB->refcount == 0)
-		free(socketCB);
+		epoch_retire(free, socketCB);
 
 
 	return 0;
@@ -388,6 +501,7 @@ void* socket_open(uint minor){
 }
 
 void initialize_port_map(){
+	KVM->socket = xcalloc_aligned(sizeof(struct socket_state));
 	for (int i = 1; i < MAX_PORT - 1; i++){
 		PORT_MAP[i] = NULL;
 	}
@@ -3,6 +3,8 @@
 
 #include "tinyos.h"
 #include "kernel_pipe.h"
+#include "kernel_net.h"
+#include "kernel_vm.h"
 
 typedef enum {
 	SOCKET_LISTENER,
@@ -26,6 +28,7 @@ typedef struct peer_socket {
 	socket_cb* peer;
 	pipe_cb* write_pipe;
 	pipe_cb* read_pipe;
+	net_conn* remote;		/* a connection to another node, instead of the pipes */
 }peer_socket;
 
 
@@ -45,9 +48,6 @@ struct socket_control_block{
 //typedef struct socket_control_block socket_cb;
 
 
-socket_cb* socket_t;
-
-	
 
 void* socket_open(uint minor);
 
@@ -57,7 +57,12 @@ int socket_write(void* socketcb_t, const char *buf, unsigned int n);
 
 int socket_close(void* socketcb_t);
 
-socket_cb* PORT_MAP[MAX_PORT];
+/* The state of the sockets, per kernel instance */
+struct socket_state {
+	socket_cb* PORT_MAP[MAX_PORT];
+};
+
+#define PORT_MAP (KVM->socket->PORT_MAP)
 
 typedef struct connection_request{
 	int admitted;					/*flag=1 to request eksuphrethtai*/
@@ -5,15 +5,26 @@
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_vm.h"
 
 #define MAX_FILES MAX_PROC
 
-FCB FT[MAX_FILES];
-rlnode FCB_freelist;
+/* The state of this module, per kernel instance */
+struct streams_state {
+  FCB FT[MAX_FILES];
+  rlnode FCB_freelist;
+  uint FCB_count;     /* live FCBs */
+};
+
+#define FT (KVM->streams->FT)
+#define FCB_freelist (KVM->streams->FCB_freelist)
+#define FCB_count (KVM->streams->FCB_count)
 
 
 void initialize_files()
 {
+  KVM->streams = xcalloc_aligned(sizeof(struct streams_state));
+
   rlnode_init(&FCB_freelist,NULL);
   for(int i=0;i<MAX_FILES;i++) {
 
@@ -24,20 +35,47 @@ void initialize_files()
 }
 
 
+/*
+  Released FCBs return to the freelist after their grace period (see 
+  release_FCB). We must not wait for it with the kernel lock held, so 
+  while they wait, their places are taken by allocated FCBs.
+ */
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
-    fcb->refcount = 0;
-    return fcb;
+  if(is_rlist_empty(& FCB_freelist))
+    epoch_reclaim();
+
+  FCB* fcb;
+  if(! is_rlist_empty(& FCB_freelist))
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
+  else if(FCB_count < MAX_FILES) {
+    fcb = xmalloc(sizeof(FCB));
+    rlnode_init(& fcb->freelist_node, fcb);
   }
   else
     return NULL;
+
+  FCB_count++;
+  fcb->refcount = 0;
+  /* Until it is set up, lock-free readers must not use the stream */
+  fcb->streamfunc = NULL;
+  return fcb;
+}
+
+static void reclaim_FCB(void* obj)
+{
+  FCB* fcb = obj;
+  if(fcb >= FT && fcb < FT+MAX_FILES)
+    rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  else
+    free(fcb);
 }
 
 void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  /* Lock-free readers may still hold the FCB */
+  FCB_count--;
+  epoch_retire(reclaim_FCB, fcb);
 }
 
 
@@ -90,7 +128,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     }
     /* Found all */
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
+	__atomic_store_n(&cur->FIDT[fid[i]], fcb[i], __ATOMIC_RELEASE);
 	FCB_incref(fcb[i]);
     }
     return 1;
@@ -103,7 +141,7 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
     PCB* cur = CURPROC;
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	__atomic_store_n(&cur->FIDT[fid[i]], NULL, __ATOMIC_RELEASE);
 	release_FCB(fcb[i]);
     }
 }
@@ -124,11 +162,12 @@ FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  return __atomic_load_n(&CURPROC->FIDT[fid], __ATOMIC_ACQUIRE);
 }
 
 
-int sys_Read(Fid_t fd, char *buf, unsigned int size)
+/* Read from a stream, with the kernel lock held */
+static int stream_read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
   int (*devread)(void*,char*,uint);
@@ -160,6 +199,32 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 }
 
 
+int sys_Read(Fid_t fd, char *buf, unsigned int size)
+{
+  /* Streams with a lock-free Read are read inside an epoch section */
+  int preempt = epoch_enter();
+
+  FCB* fcb = get_fcb(fd);
+  if(fcb == NULL) {
+    epoch_exit(preempt);
+    return -1;
+  }
+
+  file_ops* ops = __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE);
+  if(ops && ops->lockfree_read) {
+    int retcode = ops->Read(fcb->streamobj, buf, size);
+    epoch_exit(preempt);
+    return retcode;
+  }
+  epoch_exit(preempt);
+
+  kernel_lock();
+  int retcode = stream_read(fd, buf, size);
+  kernel_unlock();
+  return retcode;
+}
+
+
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -193,6 +258,18 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+int64_t sys_Seek(Fid_t fd, int64_t offset, int whence)
+{
+  FCB* fcb = get_fcb(fd);
+  if(fcb == NULL || fcb->streamfunc->Seek == NULL) return -1;
+
+  FCB_incref(fcb);
+  int64_t pos = fcb->streamfunc->Seek(fcb->streamobj, offset, whence);
+  FCB_decref(fcb);
+  return pos;
+}
+
+
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
@@ -200,7 +277,7 @@ int sys_Close(int fd)
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+    __atomic_store_n(&CURPROC->FIDT[fd], NULL, __ATOMIC_RELEASE);
     retcode = FCB_decref(fcb);    
   }
 
@@ -231,7 +308,7 @@ int sys_Dup2(int oldfd, int newfd)
     if(new)
       FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    __atomic_store_n(&CURPROC->FIDT[newfd], old, __ATOMIC_RELEASE);
   }
 
   return retcode;
@@ -239,6 +316,27 @@ int sys_Dup2(int oldfd, int newfd)
 
 
 
+int sys_SysBatch(sysop* ops, unsigned int n)
+{
+  if(ops == NULL) return -1;
+
+  int failed = 0;
+  for(unsigned int i=0; i<n; i++) {
+    sysop* op = &ops[i];
+    switch(op->code) {
+      case SYSOP_READ:  op->result = stream_read(op->fid, op->buf, op->size); break;
+      case SYSOP_WRITE: op->result = sys_Write(op->fid, op->buf, op->size); break;
+      case SYSOP_CLOSE: op->result = sys_Close(op->fid); break;
+      case SYSOP_DUP2:  op->result = sys_Dup2(op->fid, op->fid2); break;
+      default: op->result = -1;
+    }
+    if(op->result == -1) failed++;
+  }
+  return failed;
+}
+
+
+
 unsigned int sys_GetTerminalDevices()
 {
   return device_no(DEV_SERIAL);
@@ -276,8 +374,105 @@ int sys_OpenNull()
 }
 
 
+Fid_t sys_OpenDevice(const char* name, unsigned int minor)
+{
+  int major = (name == NULL) ? -1 : device_lookup(name);
+  if(major == -1)
+    return NOFILE;
+  return open_stream(major, minor);
+}
+
+
 Fid_t sys_OpenTerminal(unsigned int termno)
 {
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+unsigned int sys_GetBlockDevices()
+{
+  return device_no(DEV_BLOCK);
+}
+
+
+Fid_t sys_OpenBlock(unsigned int minor)
+{
+  return open_stream(DEV_BLOCK, minor);
+}
+
+
+
+
+/*
+ *
+ *   Snapshot streams
+ *
+ */
+
+/* The stream object of a snapshot stream */
+typedef struct snapshot_cb {
+  char* recs;
+  size_t recsize;
+  uint count;
+  uint cursor;
+} snapshot_cb;
+
+/* This is lock-free; each reader claims a record by advancing the cursor */
+static int snapshot_read(void* this, char* buf, unsigned int size)
+{
+  snapshot_cb* scb = this;
+
+  if(size < scb->recsize) return -1;
+
+  uint cur = __atomic_load_n(&scb->cursor, __ATOMIC_RELAXED);
+  do {
+    if(cur == scb->count) return 0;
+  } while(! __atomic_compare_exchange_n(&scb->cursor, &cur, cur+1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  memcpy(buf, scb->recs + cur * scb->recsize, scb->recsize);
+  return scb->recsize;
+}
+
+static int snapshot_write(void* this, const char* buf, unsigned int size)
+{
+  return -1;
+}
+
+static void reclaim_snapshot(void* this)
+{
+  snapshot_cb* scb = this;
+  free(scb->recs);
+  free(scb);
+}
+
+static int snapshot_close(void* this)
+{
+  epoch_retire(reclaim_snapshot, this);
+  return 0;
+}
+
+static file_ops snapshot_ops = {
+  .Read = snapshot_read,
+  .Write = snapshot_write,
+  .Close = snapshot_close,
+  .lockfree_read = 1
+};
+
+Fid_t open_snapshot_stream(size_t recsize, snapshot_fill fill)
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  snapshot_cb* scb = xmalloc(sizeof(snapshot_cb));
+  scb->recs = fill(&scb->count);
+  scb->recsize = recsize;
+  scb->cursor = 0;
+
+  fcb->streamobj = scb;
+  __atomic_store_n(&fcb->streamfunc, &snapshot_ops, __ATOMIC_RELEASE);
+  return fid;
+}
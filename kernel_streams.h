@@ -68,7 +68,8 @@ void FCB_incref(FCB* fcb);
 	@brief Decrease the reference count of the fcb.
 
 	If the reference count drops to 0, release the FCB, calling the 
-	Close method and returning its return value.
+	Close method and returning its return value. The FCB is retired
+	(see @c epoch_retire), since lock-free readers may still hold it.
 	If the reference count is still >0, return 0. 
 
 	@param fcb  the fcb whose reference count is decreased
@@ -122,12 +123,39 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 	This routine will return NULL if the fid is not legal.
 
+	It may be called without the kernel lock, inside an epoch section
+	(see @c epoch_enter). Then, the stream may only be used if it has a 
+	lock-free Read (see @c file_ops). A new stream becomes visible to 
+	such readers when its @c streamfunc is stored, which must be done last.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief A function which takes a snapshot for a snapshot stream.
+
+	It returns an array of records, allocated by @c xmalloc, and stores
+	the number of records in @c count.
+ */
+typedef void* (*snapshot_fill)(uint* count);
+
+
+/** @brief Open a read-only stream over a snapshot.
+
+	The snapshot is taken by @c fill when the stream is opened. Each
+	@c Read returns the next record of @c recsize bytes, or 0 at the end
+	of the snapshot; it fails if the buffer is smaller than a record.
+	Reads are lock-free. The snapshot is retired when the stream is closed.
+
+	@param recsize the size of a record
+	@param fill the function which takes the snapshot
+	@returns the new fid, or @c NOFILE if no fid is available.
+ */
+Fid_t open_snapshot_stream(size_t recsize, snapshot_fill fill);
+
+
 /** @} */
 
 #endif
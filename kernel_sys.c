@@ -32,6 +32,18 @@ RET NAME SIG \
 	return __ret;\
 }\
 
+/* 
+	Without the kernel lock. These calls only read data of the calling 
+	thread, which cannot change under it, or per-core cached data, or 
+	they read kernel objects inside an epoch section (see epoch_enter) 
+	and take the kernel lock themselves when they need it.
+ */
+#define SYSCALL_NOLOCK(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
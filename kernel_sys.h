@@ -7,34 +7,61 @@
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
+SYSCALL_NOLOCK(GetPid, int, (void), ())\
+SYSCALL_NOLOCK(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
+SYSCALL_NOLOCK(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
+SYSCALL(SetTerminalMode, int, (Fid_t fid, int mode), (fid, mode))\
 SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(OpenDevice, Fid_t, (const char* name, unsigned int minor), (name, minor))\
+SYSCALL(GetBlockDevices, unsigned int, (), ())\
+SYSCALL(OpenBlock, Fid_t, (unsigned int minor), (minor))\
+SYSCALL(BlockRead, int, (unsigned int dev, uint64_t sector, char* buf, unsigned int nsectors), (dev, sector, buf, nsectors))\
+SYSCALL(BlockWrite, int, (unsigned int dev, uint64_t sector, const char* buf, unsigned int nsectors), (dev, sector, buf, nsectors))\
+SYSCALL(MakeFileSystem, int, (unsigned int dev), (dev))\
+SYSCALL(Mount, int, (unsigned int dev), (dev))\
+SYSCALL(Unmount, int, (), ())\
+SYSCALL(Sync, int, (), ())\
+SYSCALL(Open, Fid_t, (const char* pathname, int flags), (pathname, flags))\
+SYSCALL(Seek, int64_t, (Fid_t fid, int64_t offset, int whence), (fid, offset, whence))\
+SYSCALL(Stat, int, (const char* pathname, file_stat* st), (pathname, st))\
+SYSCALL(MkDir, int, (const char* pathname), (pathname))\
+SYSCALL(Unlink, int, (const char* pathname), (pathname))\
+SYSCALL_NOLOCK(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(SysBatch, int, (sysop* ops, unsigned int n), (ops, n))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
-SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
+SYSCALL_NOLOCK(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL_NOLOCK(GetNodeId, node_t, (), ())\
+SYSCALL(ConnectNode, int, (Fid_t sock, node_t node, port_t port, timeout_t timeout), (sock, node, port, timeout))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(EnableLockStats, int, (int enable), (enable))\
+SYSCALL(OpenLockInfo, Fid_t, (), ())\
+SYSCALL(OpenCoreInfo, Fid_t, (), ())\
+SYSCALL_NOLOCK(GetTime, timeout_t, (), ())\
+SYSCALL_NOLOCK(GetTimeNs, uint64_t, (), ())\
 
 
 
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET sys_ ## NAME SIG;
 
+/* without the kernel lock */
+#define SYSCALL_NOLOCK(NAME, RET, SIG, ARGS)\
+RET sys_ ## NAME SIG;
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
@@ -42,6 +69,7 @@ void sys_ ## NAME SIG;
 SYSCALLS
 
 #undef SYSCALL
+#undef SYSCALL_NOLOCK
 #undef SYSCALLV
 
 #endif
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_streams.h"
+#include "kernel_fs.h"
 
 void start_new_thread();
 
@@ -52,7 +53,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) cur_thread()->ptcb;
+	return (Tid_t) cur_thread_fast()->ptcb;
 }
 
 /**
@@ -195,10 +196,11 @@ void sys_ThreadExit(int exitval)
     Do all the other cleanup we want here, close files etc. 
     */
 
-    /* Release the args data */
+    /* Release the args data, which lock-free readers of PT[] may hold */
     if(curproc->args) {
-      free(curproc->args);
-      curproc->args = NULL;
+      void* args = curproc->args;
+      __atomic_store_n(&curproc->args, NULL, __ATOMIC_RELEASE);
+      epoch_retire(free, args);
     }
 
     /* Clean up FIDT */
@@ -209,6 +211,10 @@ void sys_ThreadExit(int exitval)
       }
     } 
 
+    /* The VM halts after the init process, so the file system is written back */
+    if(get_pid(curproc)==1)
+      fs_shutdown();
+
     /* Disconnect my main_thread */
     curproc->main_thread = NULL;
 
@@ -0,0 +1,52 @@
+#ifndef __KERNEL_VM_H
+#define __KERNEL_VM_H
+
+#include "tinyos.h"
+
+/**
+	@file kernel_vm.h
+	@brief The kernel instance.
+
+	@defgroup kernel_vm Kernel instance
+	@ingroup kernel
+	@brief The state of a running kernel.
+
+	Several kernels may run in the same process, each on its own VM
+	(see @c vm_run). The state of each kernel module is kept in a structure
+	private to the module, which is allocated by the initialization function
+	of the module. A @c kernel_instance holds these structures, and each core
+	of the VM points to its instance via @c KVM.
+
+	A module refers to its state via macros, e.g., @c PT stands for
+	@c KVM->proc->PT, so that its code reads as if the state were global.
+
+	@{
+*/
+
+/** @brief The state of a kernel. */
+typedef struct kernel_instance
+{
+	struct cc_state* cc;           /**< @brief The kernel lock and lock statistics */
+	struct sched_state* sched;     /**< @brief The scheduler and the core control blocks */
+	struct proc_state* proc;       /**< @brief The process table */
+	struct streams_state* streams; /**< @brief The file table */
+	struct dev_state* dev;         /**< @brief The device table and the driver state */
+	struct socket_state* socket;   /**< @brief The port map */
+	struct net_state* net;         /**< @brief The network driver */
+	struct fs_state* fs;           /**< @brief The mounted file system and the page cache */
+
+	Task init_task;                /**< @brief The boot task, passed to @c boot */
+	int argl;                      /**< @brief The argument length of the boot task */
+	void* args;                    /**< @brief The argument of the boot task */
+} kernel_instance;
+
+/**
+	@brief The kernel of the calling core.
+
+	This is set by each core of the VM at boot.
+  */
+extern _Thread_local kernel_instance* KVM;
+
+/** @} */
+
+#endif
@@ -205,6 +205,45 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief A timeout value for @c FutexWait, meaning "wait for ever". */
+#define FUTEX_NO_TIMEOUT ((timeout_t)-1)
+
+/** @brief Wait on an address, if it holds an expected value.
+
+  If `*addr == expected`, the calling thread is put to sleep, until another
+  thread calls @c FutexWake on the same address. The test and the sleep
+  happen atomically with respect to @c FutexWake. 
+  A thread may wake up if,
+  - another thread called @c FutexWake on @c addr
+  - the timeout expired
+  - other reasons, not specified
+
+  The calling thread must re-check the value at @c addr after the call 
+  returns. This call is the building block of user-level synchronization
+  objects, whose uncontended paths need no system call at all.
+
+  @param addr The address to wait on.
+  @param expected The value @c addr must hold, for the thread to sleep.
+  @param timeout The time in milliseconds to wait, or @c FUTEX_NO_TIMEOUT.
+  @returns 1 if this thread was woken up by @c FutexWake, 0 otherwise 
+    (including when `*addr != expected`).
+  @see FutexWake
+  */
+int FutexWait(int* addr, int expected, timeout_t timeout);
+
+/** @brief Wake up threads waiting on an address.
+
+  Wakes up at most @c n threads blocked in @c FutexWait on @c addr,
+  in the order in which they started waiting.
+
+  @param addr The address to wake up waiters of.
+  @param n The maximum number of threads to wake up.
+  @returns the number of threads woken up.
+  @see FutexWait
+ */
+int FutexWake(int* addr, int n);
+
+
 /*******************************************
  *
  * Process creation
@@ -294,6 +333,25 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief Return the current time, in milliseconds.
+
+ The time is read from a clock which the kernel caches at the start of
+ every timeslice. This call does not lock the kernel and is very cheap,
+ but its resolution is one scheduling quantum. It is meant for timestamps
+ (e.g., in logging), not for precise timing.
+ */
+timeout_t GetTime(void);
+
+/** @brief Return the current time, in nanoseconds.
+
+ The time is read from a fine-grained monotonic clock, which is
+ appropriate for measuring short intervals. Its origin is unspecified.
+ Like @c GetTime, this call does not lock the kernel.
+
+ @see GetTime
+ */
+uint64_t GetTimeNs(void);
+
 /*******************************************
  *
  * Threads
@@ -403,6 +461,40 @@ unsigned int GetTerminalDevices();
 Fid_t OpenTerminal(unsigned int termno);
 
 
+/** @brief Raw terminal input: a read returns the input available. */
+#define TTY_RAW 0
+
+/** @brief Canonical terminal input: a read returns (up to) one edited line. */
+#define TTY_CANON 1
+
+/** @brief Echo terminal input to the console. */
+#define TTY_ECHO 2
+
+/** @brief Set the line discipline of a terminal.
+
+  The mode is a combination of the flags @c TTY_CANON and @c TTY_ECHO,
+  or @c TTY_RAW. It applies to all the streams of the terminal. Terminals
+  start in raw mode.
+
+  In canonical mode, the input is collected into a line, of up to 1024
+  characters. Backspace and DEL erase the last character of the line, 
+  and carriage return is translated to newline. The line is completed by 
+  a newline or a ^D, which is not stored; a @c Read returns the line,
+  or as much of it as fits in the buffer. A @c Read which finds a line
+  completed by ^D with no characters returns 0 (end of data).
+
+  With echo, input is copied to the console as it is read (in canonical
+  mode, as it is edited).
+
+  @param fid a stream of a terminal
+  @param mode the new mode
+  @return the previous mode, or -1 on error. Possible errors are:
+   - The file id is invalid or not a terminal.
+   - The mode contains invalid flags.
+ */
+int SetTerminalMode(Fid_t fid, int mode);
+
+
 /** @brief Open a stream on the null device.
 
   The null device is a virtual device representing an "infinite"
@@ -417,6 +509,244 @@ Fid_t OpenTerminal(unsigned int termno);
 Fid_t OpenNull();
 
 
+/** @brief Open a stream on a device, by the name of its driver.
+
+  The devices of a driver are numbered starting from 0. Besides the
+  drivers of the terminals ("serial"), the disks ("block") and the 
+  null device ("null"), the kernel provides the following pseudo-devices:
+  - "zero": every read fills the buffer with zero bytes, and writes have 
+    no effect.
+  - "random": every read returns pseudo-random bytes, and writes have 
+    no effect. Each stream has its own generator.
+
+  @param name the name of the driver
+  @param minor the number of the device
+  @return the file ID of the new descriptor, or @c NOFILE on error.
+    Possible errors are:
+   - There is no driver by this name.
+   - The device does not exist.
+   - The maximum number of file descriptors has been reached.
+ */
+Fid_t OpenDevice(const char* name, unsigned int minor);
+
+
+/** @brief The size of a block device sector, in bytes. */
+#define BLOCK_SECTOR_SIZE 512
+
+/** @brief Return the number of block devices (disks).
+
+  Block devices are numbered starting from 0. 
+ */
+unsigned int GetBlockDevices();
+
+/** @brief Open a stream on block device 'minor'.
+
+  The stream reads and writes whole sectors of @c BLOCK_SECTOR_SIZE bytes, 
+  sequentially from the start of the device. The @c size of each @c Read 
+  and @c Write must be a multiple of @c BLOCK_SECTOR_SIZE. A @c Read at the
+  end of the device returns 0.
+
+  @param minor the block device to open
+  @return the file ID of the new descriptor, or @c NOFILE on error.
+    Possible errors are:
+   - The block device does not exist.
+   - The maximum number of file descriptors has been reached.
+ */
+Fid_t OpenBlock(unsigned int minor);
+
+/** @brief Read sectors from a block device.
+
+  This call sleeps until the transfer is complete. Concurrent requests
+  to the same device may be reordered and merged by the kernel.
+
+  @param dev the block device
+  @param sector the first sector to read
+  @param buf the buffer, of size at least @c nsectors*BLOCK_SECTOR_SIZE
+  @param nsectors the number of sectors to read
+  @return 0 on success, or -1 on error. Possible errors are:
+   - The block device does not exist.
+   - The sectors are out of the range of the device.
+   - There was an I/O error.
+ */
+int BlockRead(unsigned int dev, uint64_t sector, char* buf, unsigned int nsectors);
+
+/** @brief Write sectors to a block device.
+
+  @see BlockRead
+ */
+int BlockWrite(unsigned int dev, uint64_t sector, const char* buf, unsigned int nsectors);
+
+
+
+/*******************************************
+ *
+ * File system
+ *
+ *******************************************/
+
+/**
+  @brief The maximum length of a file name.
+
+  A path is a sequence of names separated by '/'. All paths are taken
+  from the root directory of the file system; a leading '/' is optional.
+ */
+#define MAX_NAME_LENGTH 27
+
+/** @brief Flags of @c Open: create the file if it does not exist. */
+#define OPEN_CREATE 1
+
+/** @brief Flags of @c Open: truncate the file to size 0. */
+#define OPEN_TRUNC 2
+
+/** @brief Flags of @c Open: every write appends to the end of the file. */
+#define OPEN_APPEND 4
+
+/** @brief The types of files. */
+typedef enum {
+  FILE_REGULAR=1,     /**< A regular file */
+  FILE_DIR=2          /**< A directory */
+} file_type;
+
+/** @brief The attributes of a file, returned by @c Stat. */
+typedef struct file_stat {
+  unsigned int inode;     /**< @brief The inode number of the file */
+  file_type type;         /**< @brief The type of the file */
+  unsigned int nlink;     /**< @brief The number of directory entries of the file */
+  uint64_t size;          /**< @brief The size of the file in bytes */
+} file_stat;
+
+/**
+  @brief A directory entry.
+
+  A @c Read of a directory returns an array of entries. Only whole entries
+  are returned, so the size of the read must be at least 
+  @c sizeof(dir_entry).
+ */
+typedef struct dir_entry {
+  unsigned int inode;                 /**< @brief The inode of the file */
+  char name[MAX_NAME_LENGTH+1];       /**< @brief The name, zero-terminated */
+} dir_entry;
+
+/** @brief Create an empty file system on a block device.
+
+  The disk must not be mounted. All data on the disk is lost.
+  The file system keeps its data in blocks of 4096 bytes; the disk must
+  have room for at least a few tens of blocks.
+
+  @param dev the block device
+  @return 0 on success, or -1 on error. Possible errors are:
+   - The block device does not exist, or is too small.
+   - The block device is mounted.
+   - There was an I/O error.
+ */
+int MakeFileSystem(unsigned int dev);
+
+/** @brief Mount the file system of a block device.
+
+  There is at most one mounted file system. Its pages are kept in a page
+  cache of the kernel, and are written to the disk by @c Sync, by 
+  @c Unmount, when they are evicted, and when the init process exits.
+
+  @param dev the block device
+  @return 0 on success, or -1 on error. Possible errors are:
+   - The block device does not exist, or does not contain a file system.
+   - A file system is already mounted.
+   - There was an I/O error.
+ */
+int Mount(unsigned int dev);
+
+/** @brief Unmount the file system.
+
+  The data of the file system is written to the disk.
+  @return 0 on success, or -1 on error. Possible errors are:
+   - No file system is mounted.
+   - Some files of the file system are open.
+   - There was an I/O error.
+ */
+int Unmount();
+
+/** @brief Write the modified data of the file system to the disk.
+
+  @return 0 on success, or -1 on error. Possible errors are:
+   - No file system is mounted.
+   - There was an I/O error.
+ */
+int Sync();
+
+/** @brief Open a file or directory.
+
+  The stream of a regular file reads and writes the file at its current
+  position, which starts at 0 and is moved by @c Seek. A @c Read at the 
+  end of the file returns 0. A @c Write past the end of the file extends
+  it; any gap reads as zeros. The stream of a directory can only be read,
+  and returns its entries as @c dir_entry records.
+
+  @param pathname the path of the file
+  @param flags a combination of @c OPEN_CREATE, @c OPEN_TRUNC and 
+    @c OPEN_APPEND, or 0
+  @return the file ID of the new descriptor, or @c NOFILE on error.
+    Possible errors are:
+   - No file system is mounted.
+   - The file does not exist, and @c OPEN_CREATE was not given.
+   - A directory of the path does not exist.
+   - The name is longer than @c MAX_NAME_LENGTH.
+   - The file is a directory, and @c OPEN_TRUNC or @c OPEN_APPEND was given.
+   - The maximum number of file descriptors has been reached.
+   - The file system is full.
+ */
+Fid_t Open(const char* pathname, int flags);
+
+/** @brief Move the position of a stream.
+
+  This is supported by file streams and block device streams (whose 
+  position must be a multiple of @c BLOCK_SECTOR_SIZE). The position of
+  a file may be moved past its end.
+
+  @param fid the stream
+  @param offset the offset of the new position
+  @param whence @c SEEK_SET, @c SEEK_CUR or @c SEEK_END (as in 
+    @c stdio.h), for an offset from the start, the current position, or
+    the end of the stream
+  @return the new position, or -1 on error. Possible errors are:
+   - The file ID is invalid, or the stream cannot seek.
+   - The new position is negative or invalid.
+ */
+int64_t Seek(Fid_t fid, int64_t offset, int whence);
+
+/** @brief Return the attributes of a file.
+
+  @param pathname the path of the file
+  @param st the location to store the attributes
+  @return 0 on success, or -1 if no file system is mounted or the file
+    does not exist.
+ */
+int Stat(const char* pathname, file_stat* st);
+
+/** @brief Create a directory.
+
+  @param pathname the path of the new directory
+  @return 0 on success, or -1 on error. Possible errors are:
+   - No file system is mounted.
+   - The file exists, or a directory of the path does not exist.
+   - The name is longer than @c MAX_NAME_LENGTH.
+   - The file system is full.
+ */
+int MkDir(const char* pathname);
+
+/** @brief Remove a file or an empty directory.
+
+  The entry is removed at once. The data of the file is released after
+  the last stream of the file is closed.
+
+  @param pathname the path of the file
+  @return 0 on success, or -1 on error. Possible errors are:
+   - No file system is mounted.
+   - The file does not exist, or is the root directory.
+   - The file is a directory which is not empty.
+ */
+int Unlink(const char* pathname);
+
+
 /** 
   @brief Read bytes from a stream. 
 
@@ -492,6 +822,57 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/**
+  @brief The operations that can be batched by @c SysBatch.
+  */
+typedef enum {
+  SYSOP_READ,     /**< @brief `Read(fid, buf, size)` */
+  SYSOP_WRITE,    /**< @brief `Write(fid, buf, size)` */
+  SYSOP_CLOSE,    /**< @brief `Close(fid)` */
+  SYSOP_DUP2      /**< @brief `Dup2(fid, fid2)` */
+} sysop_code;
+
+/**
+  @brief A system call descriptor for @c SysBatch.
+
+  The helper macros @c SYSOP_Read, @c SYSOP_Write, @c SYSOP_Close and
+  @c SYSOP_Dup2 build descriptors.
+  */
+typedef struct sysop
+{
+  sysop_code code;     /**< @brief The operation. */
+  Fid_t fid;           /**< @brief The file id (@c oldfd for Dup2). */
+  Fid_t fid2;          /**< @brief The @c newfd for Dup2. */
+  char* buf;           /**< @brief The buffer for Read and Write. */
+  unsigned int size;   /**< @brief The size for Read and Write. */
+  int result;          /**< @brief The return value of the operation. */
+} sysop;
+
+#define SYSOP_Read(f, b, n)  ((sysop){ .code=SYSOP_READ, .fid=(f), .buf=(b), .size=(n) })
+#define SYSOP_Write(f, b, n) ((sysop){ .code=SYSOP_WRITE, .fid=(f), .buf=(char*)(b), .size=(n) })
+#define SYSOP_Close(f)       ((sysop){ .code=SYSOP_CLOSE, .fid=(f) })
+#define SYSOP_Dup2(o, n)     ((sysop){ .code=SYSOP_DUP2, .fid=(o), .fid2=(n) })
+
+/**
+  @brief Execute several I/O system calls under a single kernel entry.
+
+  The operations in `ops[0..n-1]` are executed in order, exactly as if
+  the corresponding system calls were made one after the other. The 
+  return value of each operation is stored in its @c result field. All 
+  operations are executed, even if some of them fail. An operation with
+  an illegal code fails with -1.
+
+  Note that a blocking operation (e.g., a @c Read from an empty pipe) 
+  releases the kernel while it blocks, as usual.
+
+  @param ops the array of operation descriptors
+  @param n the number of operations
+  @returns the number of operations whose result was -1, or -1 if
+     @c ops is NULL.
+ */
+int SysBatch(sysop* ops, unsigned int n);
+
 /*******************************************
  *
  * Pipes
@@ -718,6 +1099,71 @@ int ShutDown(Fid_t sock, shutdown_mode how);
 
 
 
+/*******************************************
+ *
+ * Sockets (network)
+ *
+ *******************************************/
+
+/**
+	@brief A type for node ids.
+
+	The nodes of a network are tinyos virtual machines on the same host,
+	connected by their network interfaces. A node id is an integer 
+	between 0 and @c MAX_NODES-1.
+*/
+typedef int node_t;
+
+/**
+	@brief the maximum number of nodes of a network
+*/
+#define MAX_NODES 64
+
+/**
+	@brief a null value for a node id
+*/
+#define NONODE ((node_t)-1)
+
+
+/**
+	@brief Return the node id of this machine.
+
+	@returns the node id, or @c NONODE if the machine is not connected
+	   to a network.
+*/
+node_t GetNodeId();
+
+
+/**
+	@brief Create a connection to a listener at a port of a node.
+
+	This call is similar to @c Connect, except that the listening socket
+	is sought on node @c node. If @c node is this node or @c NONODE, this
+	call is equivalent to @c Connect.
+
+	A connection to another node behaves like a local connection. In
+	particular, @c Read, @c Write, @c ShutDown and @c Close have the same
+	semantics. If the other node becomes unreachable, the connection
+	behaves as if the other end was closed.
+
+	@params sock the socket to connect to the other end
+	@params node the node of the listening socket
+	@params port the port on which to seek a listening socket
+	@params timeout the approximate amount of time to wait for a
+	        connection, in msec. A negative timeout means "infinite".
+	@returns 0 on success and -1 on error. Possible reasons for error:
+	   - the file id @c sock is not legal (i.e., an unconnected, non-listening socket)
+	   - the given node or port is illegal.
+	   - this machine is not connected to a network.
+	   - the node cannot be reached, or it does not have a listening socket 
+	     bound to the port.
+	   - the timeout has expired without a successful connection.
+	@see Connect
+*/
+int ConnectNode(Fid_t sock, node_t node, port_t port, timeout_t timeout);
+
+
+
 /*******************************************
  *
  * System information
@@ -783,6 +1229,140 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+  @brief The kind of object described by a @c lockinfo record.
+  */
+typedef enum {
+  LOCKINFO_MUTEX,   /**< @brief A @c Mutex, identified by its address */
+  LOCKINFO_WCHAN    /**< @brief A kernel wait channel, identified by name */
+} lockinfo_type;
+
+/**
+  @brief The max. size of a name in a lockinfo structure.
+  */
+#define LOCKINFO_NAME_SIZE (32)
+
+/**
+  @brief Contention statistics for a lock or a kernel wait channel.
+
+  This structure is returned by lock information streams. All times
+  are in nanoseconds.
+
+  For a @c LOCKINFO_MUTEX record, @c acquisitions counts the calls to
+  @c Mutex_Lock, @c contended those calls which found the mutex locked,
+  @c spins and @c yields the busy-wait iterations and @c SCHED_MUTEX
+  yields performed while waiting, @c hold_time the total time the mutex
+  was held and @c wait_time the total time spent waiting for it.
+
+  For a @c LOCKINFO_WCHAN record, @c acquisitions counts the number of
+  kernel waits on the channel, @c timeouts those that ended without
+  a signal (e.g., by timeout), and @c wait_time is the total time
+  spent asleep. The @c contended, @c spins, @c yields and @c hold_time
+  fields of such records are 0.
+
+  In both cases, @c waiters is the number of threads waiting at the
+  time of the snapshot, and @c max_waiters the maximum observed.
+
+  Mutexes which do not fit in the statistics table are accounted
+  together, in a record named "(other)", whose @c hold_time is 0.
+
+  @see OpenLockInfo
+  */
+typedef struct lockinfo
+{
+  lockinfo_type type;     /**< @brief The kind of record. */
+  char name[LOCKINFO_NAME_SIZE];  /**< @brief A printable name for the lock or channel. */
+
+  unsigned long acquisitions;  /**< @brief Number of acquisitions (waits for a wchan). */
+  unsigned long contended;     /**< @brief Number of contended acquisitions. */
+  unsigned long timeouts;      /**< @brief Number of waits ended without a signal (wchan only). */
+  unsigned long spins;         /**< @brief Number of busy-wait iterations. */
+  unsigned long yields;        /**< @brief Number of @c SCHED_MUTEX yields. */
+  unsigned long hold_time;     /**< @brief Total hold time (nsec). */
+  unsigned long wait_time;     /**< @brief Total wait time (nsec). */
+  unsigned long waiters;       /**< @brief Current number of waiters. */
+  unsigned long max_waiters;   /**< @brief Maximum number of waiters. */
+} lockinfo;
+
+
+/**
+  @brief Turn lock statistics collection on or off.
+
+  Lock statistics are collected for every @c Mutex and kernel wait
+  channel while enabled. Collection is off at boot. When collection
+  is on at shutdown, a report sorted by wait time is printed to
+  @c stderr.
+
+  @param enable non-zero to turn collection on, zero to turn it off
+  @returns the previous setting
+  @see OpenLockInfo
+  */
+int EnableLockStats(int enable);
+
+
+/**
+  @brief Open a lock information stream.
+
+  This is a read-only stream that returns a sequence of @c lockinfo
+  structures, each packed into a block of size @c sizeof(lockinfo).
+  Each @c Read must provide a buffer of at least that size.
+
+  The stream contains a snapshot of the lock statistics, taken when
+  the stream was opened, sorted by decreasing wait time.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the available file ids for the process are exhausted.
+  @see EnableLockStats
+ */
+Fid_t OpenLockInfo();
+
+
+/**
+  @brief Statistics for a CPU core.
+
+  This structure is returned by core information streams. All times
+  are in microseconds, counted from the boot of the VM.
+
+  @c interrupts counts the interrupts dispatched to the core, of which
+  @c alarms were timer interrupts (i.e., preemptions). @c halts counts
+  the times the core became idle, @c restarts those that were ended
+  by another core, and @c halt_time is the total time spent idle.
+  The utilization of the core is <tt>1 - halt_time/run_time</tt>.
+
+  @see OpenCoreInfo
+  */
+typedef struct coreinfo
+{
+  unsigned int core;           /**< @brief The core number. */
+  unsigned long interrupts;    /**< @brief Number of interrupts dispatched. */
+  unsigned long alarms;        /**< @brief Number of timer interrupts dispatched. */
+  unsigned long switches;      /**< @brief Number of context switches. */
+  unsigned long halts;         /**< @brief Number of times the core was halted. */
+  unsigned long restarts;      /**< @brief Number of times the halted core was restarted. */
+  unsigned long halt_time;     /**< @brief Total time halted (usec). */
+  unsigned long run_time;      /**< @brief Time since boot (usec). */
+} coreinfo;
+
+
+/**
+  @brief Open a core information stream.
+
+  This is a read-only stream that returns a sequence of @c coreinfo
+  structures, one for each core, each packed into a block of size 
+  @c sizeof(coreinfo). Each @c Read must provide a buffer of at least 
+  that size.
+
+  The stream contains a snapshot of the statistics of the running cores,
+  taken when the stream was opened.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the available file ids for the process are exhausted.
+ */
+Fid_t OpenCoreInfo();
+
+
 
 
 /*******************************************
@@ -804,6 +1384,17 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+struct vm_config;
+
+/** @brief Boot tinyos3 on a VM with the given configuration.
+
+   This is like @c boot, but the VM is configured by the caller (see
+   @c vm_configure in @c bios.h), e.g., with loopback terminals. The boot 
+   function of the configuration is set by this call.
+   */
+void boot_vm(struct vm_config* vmc, Task boot_task, int argl, void* args);
+
+
 /** @} */
 
 #endif
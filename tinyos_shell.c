@@ -798,6 +798,13 @@ static inline Fid_t savefid(Fid_t fsaved)
 	return savior;
 }
 
+/* Move fid 'from' to 'to', i.e., Dup2 and Close under one kernel entry */
+static inline void move_fid(Fid_t from, Fid_t to)
+{
+	sysop ops[2] = { SYSOP_Dup2(from, to), SYSOP_Close(from) };
+	SysBatch(ops, 2);
+}
+
 
 int process_line(int argc, const char** argv)
 {
@@ -848,24 +855,20 @@ int process_line(int argc, const char** argv)
 		if(i<frag-1) {
 			/* Not the last fragment, make a pipe */
 			Pipe(& pipe);
-			Dup2(pipe.write,1);
-			Close(pipe.write);
+			move_fid(pipe.write, 1);
 		} else {
 			/* Last fragment, restore saved 1 */
-			Dup2(saveout, 1);
-			Close(saveout);				
+			move_fid(saveout, 1);
 		}
 
 		child[i] = Execute(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
 
 		if(i<frag-1) {
 			/* Not the last fragment, make a pipe */
-			Dup2(pipe.read,0);
-			Close(pipe.read);
+			move_fid(pipe.read, 0);
 		} else {
 			/* Last fragment, restore saved 1 */
-			Dup2(savein, 0);
-			Close(savein);
+			move_fid(savein, 0);
 		}
 	}
 
@@ -966,6 +969,8 @@ int boot_shell(int argl, void* args)
 			if(fdin!=0) {  Dup2(fdin, 0 ); Close(fdin);  }
 			int fdout = OpenTerminal(i);
 			if(fdout!=1) {  Dup2(fdout, 1 ); Close(fdout);  }
+			/* Read a line at a time; the terminal emulator echoes the input */
+			SetTerminalMode(0, TTY_CANON);
 			Execute(COMMANDS[shprog].prog, 1, & COMMANDS[shprog].cmdname );
 			Close(0);
 		}
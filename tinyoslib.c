@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio_ext.h>
+#include <string.h>
+#include <limits.h>
 
 #include "util.h"
 #include "tinyos.h"
@@ -40,6 +42,8 @@ static FILE* get_std_stream(int fid, const char* mode)
 {
 	FILE* term = fidopen(fid, mode);
 	assert(term);
+	/* The std streams are shared by all processes, so they must not read ahead */
+	CHECKRC(setvbuf(term, NULL, _IONBF, 0));
 	/* This is glibc-specific and tunrs off fstream locking */
 	__fsetlocking(term, FSETLOCKING_BYCALLER);	
 	return term;
@@ -53,7 +57,11 @@ FILE* fidopen(Fid_t fid, const char* mode)
 	* fidloc = fid;
 	FILE* f = fopencookie(fidloc, mode, tinyos_fid_functions);
 
-	CHECKRC(setvbuf(f, NULL, _IONBF, 0));
+	if(strcmp(mode, "r")==0) {
+		CHECKRC(setvbuf(f, NULL, _IOFBF, BUFSIZ));
+	} else {
+		CHECKRC(setvbuf(f, NULL, _IONBF, 0));
+	}
 	return f;
 }
 
@@ -191,3 +199,86 @@ void BarrierSync(barrier* bar, unsigned int n)
 }
 
 
+
+/*
+	Futex-based synchronization.
+ */
+
+int LwLockTry(lwlock* lock)
+{
+	int c = 0;
+	return __atomic_compare_exchange_n(&lock->state, &c, 1, 0, 
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void LwLockAcquire(lwlock* lock)
+{
+	int c = 0;
+	if(__atomic_compare_exchange_n(&lock->state, &c, 1, 0, 
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* Contended: mark the lock as having waiters, and sleep */
+	if(c != 2)
+		c = __atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		FutexWait(&lock->state, 2, FUTEX_NO_TIMEOUT);
+		c = __atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+void LwLockRelease(lwlock* lock)
+{
+	if(__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2)
+		FutexWake(&lock->state, 1);
+}
+
+
+void CallOnce(once_control* once, void (*func)(void*), void* arg)
+{
+	int s = __atomic_load_n(&once->state, __ATOMIC_ACQUIRE);
+	if(s == 3) return;
+
+	s = 0;
+	if(__atomic_compare_exchange_n(&once->state, &s, 1, 0, 
+		__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		func(arg);
+		if(__atomic_exchange_n(&once->state, 3, __ATOMIC_RELEASE) == 2)
+			FutexWake(&once->state, INT_MAX);
+		return;
+	}
+
+	while((s = __atomic_load_n(&once->state, __ATOMIC_ACQUIRE)) != 3) {
+		if(s == 1 && ! __atomic_compare_exchange_n(&once->state, &s, 2, 0, 
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			continue;
+		FutexWait(&once->state, 2, FUTEX_NO_TIMEOUT);
+	}
+}
+
+
+int EventRead(eventcount* ec)
+{
+	return __atomic_load_n(&ec->count, __ATOMIC_ACQUIRE);
+}
+
+int EventAdvance(eventcount* ec)
+{
+	int value = __atomic_add_fetch(&ec->count, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ec->waiters, __ATOMIC_SEQ_CST) > 0)
+		FutexWake(&ec->count, INT_MAX);
+	return value;
+}
+
+int EventAwait(eventcount* ec, int value)
+{
+	int c = __atomic_load_n(&ec->count, __ATOMIC_ACQUIRE);
+	if(c != value) return c;
+
+	__atomic_add_fetch(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+	while((c = __atomic_load_n(&ec->count, __ATOMIC_SEQ_CST)) == value)
+		FutexWait(&ec->count, value, FUTEX_NO_TIMEOUT);
+	__atomic_sub_fetch(&ec->waiters, 1, __ATOMIC_RELAXED);
+	return c;
+}
+
@@ -17,7 +17,11 @@
     @brief Open a C stream on a tinyos file descriptor.
 
 	This call returns a new FILE pointer on success and NULL
-	on failure.
+	on failure. Streams opened for reading only are buffered, so
+	that a read of a terminal in canonical mode returns a whole
+	line to the stream at once. Note that the stream may read
+	ahead, up to the data returned by a single @c Read.
+	Other streams are unbuffered.
 */
 FILE* fidopen(Fid_t fid, const char* mode);
 
@@ -86,4 +90,74 @@ typedef struct barrier {
 void BarrierSync(barrier* bar, unsigned int n);
 
 
+
+/**
+	@brief A lightweight lock.
+
+	This lock is built on @ref FutexWait and @ref FutexWake. When it is
+	not contended, locking and unlocking need no system call.
+  */
+typedef struct lwlock {
+	int state;		/**< 0: unlocked, 1: locked, 2: locked with waiters */
+} lwlock;
+
+#define LWLOCK_INIT ((lwlock){ 0 })
+
+/** @brief Lock a lightweight lock. */
+void LwLockAcquire(lwlock* lock);
+
+/** @brief Try to lock a lightweight lock, without blocking. 
+	@returns 1 if the lock was acquired, 0 otherwise. */
+int LwLockTry(lwlock* lock);
+
+/** @brief Unlock a lightweight lock. */
+void LwLockRelease(lwlock* lock);
+
+
+/**
+	@brief A once-flag.
+
+	@see CallOnce
+  */
+typedef struct once_control {
+	int state;		/**< 0: not called, 1: running, 2: running with waiters, 3: done */
+} once_control;
+
+#define ONCE_CONTROL_INIT ((once_control){ 0 })
+
+/**
+	@brief Call a function exactly once.
+
+	The first thread to call this on @c once calls `func(arg)`. All other 
+	calls block until `func` has returned, and then return without calling it.
+	After that, the call is just a memory read.
+  */
+void CallOnce(once_control* once, void (*func)(void*), void* arg);
+
+
+/**
+	@brief An event counter.
+
+	Threads can wait for the counter to advance. Advancing the counter 
+	needs no system call, unless there are waiting threads.
+  */
+typedef struct eventcount {
+	int count;		/**< the current value */
+	int waiters;	/**< the number of threads in @ref EventAwait */
+} eventcount;
+
+#define EVENTCOUNT_INIT ((eventcount){ 0, 0 })
+
+/** @brief Return the current value of an event counter. */
+int EventRead(eventcount* ec);
+
+/** @brief Advance an event counter, waking up all waiting threads.
+	@returns the new value of the counter. */
+int EventAdvance(eventcount* ec);
+
+/** @brief Wait until the value of an event counter is different than @c value.
+	@returns the new value of the counter. */
+int EventAwait(eventcount* ec, int value);
+
+
 #endif
@@ -119,6 +119,26 @@ static inline void * xmalloc (size_t size)
 }
 
 
+/**
+	@brief Allocate zeroed memory, aligned to a cache line.
+
+	This is used for objects with cache-aligned members. As with 
+	@c xmalloc, if there is no memory to fulfill a request, FATAL is used
+	to abort.
+
+	@param size the number of bytes allocated
+	@returns the new memory block, zeroed and aligned to 64 bytes
+  */
+static inline void * xcalloc_aligned (size_t size)
+{
+  void *value;
+  if (posix_memalign (&value, 64, size) != 0)
+    FATAL("virtual memory exhausted");
+  memset (value, 0, size);
+  return value;
+}
+
+
 /** @}   check_macros  */
 
 
@@ -5,6 +5,9 @@
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "util.h"
 #include "symposium.h"
@@ -70,6 +73,190 @@ BARE_TEST(test_boot,
 
 
 
+BARE_TEST(test_many_cores,
+	"Test that a VM with more than 64 cores boots, and that threads run on\n"
+	"cores beyond the first 64.",
+	.timeout = 60
+	)
+{
+	const uint NCORES = 130;
+	static uint64_t seen[(MAX_CORES+63)/64];
+	static uint ncores;
+
+	int spin_thread(int argl, void* args)
+	{
+		uint64_t tend = GetTimeNs() + 50000000ull;
+		while(GetTimeNs() < tend) {
+			uint c = cpu_core_id_now();
+			__atomic_fetch_or(&seen[c>>6], 1ull<<(c&63), __ATOMIC_RELAXED);
+		}
+		return 0;
+	}
+
+	int spin_boot(int argl, void* args)
+	{
+		ncores = cpu_cores();
+		Tid_t tids[2*NCORES];
+		for(uint i=0; i<2*NCORES; i++)
+			tids[i] = CreateThread(spin_thread, 0, NULL);
+		for(uint i=0; i<2*NCORES; i++)
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+		return 0;
+	}
+
+	memset(seen, 0, sizeof(seen));
+	boot(NCORES, 0, spin_boot, 0, NULL);
+
+	ASSERT(ncores == NCORES);
+	uint nseen = 0, maxseen = 0;
+	for(uint c=0; c<MAX_CORES; c++)
+		if(seen[c>>6] & (1ull<<(c&63))) { nseen++; maxseen = c; }
+	ASSERT(maxseen < NCORES);
+	ASSERT_MSG(maxseen >= 64, "threads ran on %u cores, highest core id %u\n", nseen, maxseen);
+}
+
+
+
+BARE_TEST(test_concurrent_vms,
+	"Test that two kernels run concurrently in the same process, each on\n"
+	"its own VM, with separate process tables and devices.",
+	.timeout = 60
+	)
+{
+	const int NCHILD = 4;
+
+	int vm_child(int argl, void* args)
+	{
+		/* Pass some data through a pipe */
+		pipe_t p;
+		ASSERT(Pipe(&p)==0);
+		char buf[256], rbuf[256];
+		for(int i=0; i<sizeof(buf); i++) buf[i] = (GetPid()+i) % 251;
+		for(int k=0; k<100; k++) {
+			ASSERT(Write(p.write, buf, sizeof(buf))==sizeof(buf));
+			ASSERT(Read(p.read, rbuf, sizeof(rbuf))==sizeof(rbuf));
+			ASSERT(memcmp(buf, rbuf, sizeof(buf))==0);
+		}
+		ASSERT(Close(p.write)==0 && Close(p.read)==0);
+		return GetPid();
+	}
+
+	int vm_init(int argl, void* args)
+	{
+		int* result = *(int**)args;
+		ASSERT(GetPid()==1);
+
+		/* The process table is private, so the pids are 2,3,... */
+		for(int i=0; i<NCHILD; i++)
+			ASSERT(Exec(vm_child, 0, NULL)==2+i);
+
+		int sum = 0;
+		for(int i=0; i<NCHILD; i++) {
+			int status;
+			ASSERT(WaitChild(NOPROC, &status)!=NOPROC);
+			sum += status;
+		}
+		*result = sum;
+		return 0;
+	}
+
+	void* vm_thread(void* arg)
+	{
+		boot(2, 0, vm_init, sizeof(int*), &arg);
+		return NULL;
+	}
+
+	int result[2] = { 0, 0 };
+	pthread_t thread[2];
+	for(int v=0; v<2; v++)
+		ASSERT(pthread_create(&thread[v], NULL, vm_thread, &result[v])==0);
+	for(int v=0; v<2; v++)
+		ASSERT(pthread_join(thread[v], NULL)==0);
+
+	/* 2+3+4+5 */
+	for(int v=0; v<2; v++)
+		ASSERT(result[v] == 14);
+}
+
+
+
+BARE_TEST(test_core_affinity,
+	"Test that with TINYOS_AFFINITY set, each core runs on the host CPU\n"
+	"reported by cpu_core_host_cpu().",
+	.timeout = 30
+	)
+{
+	static int mismatches, unpinned;
+
+	int pin_thread(int argl, void* args)
+	{
+		for(int i=0; i<1000; i++) {
+			int pre = cpu_disable_interrupts();
+			int cpu = cpu_core_host_cpu(cpu_core_id);
+			if(cpu < 0) __atomic_fetch_add(&unpinned, 1, __ATOMIC_RELAXED);
+			else if(sched_getcpu() != cpu) __atomic_fetch_add(&mismatches, 1, __ATOMIC_RELAXED);
+			if(pre) cpu_enable_interrupts();
+		}
+		return 0;
+	}
+
+	int pin_boot(int argl, void* args)
+	{
+		Tid_t tids[4];
+		for(uint i=0; i<4; i++)
+			tids[i] = CreateThread(pin_thread, 0, NULL);
+		for(uint i=0; i<4; i++)
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+		return 0;
+	}
+
+	cpu_set_t allowed;
+	ASSERT(sched_getaffinity(0, sizeof(allowed), &allowed)==0);
+	int first = 0;
+	while(! CPU_ISSET(first, &allowed)) first++;
+	char list[16];
+	snprintf(list, sizeof(list), "%d", first);
+
+	const char* layouts[] = { "auto", list };
+	for(int l=0; l<2; l++) {
+		mismatches = unpinned = 0;
+		ASSERT(setenv("TINYOS_AFFINITY", layouts[l], 1)==0);
+		boot(2, 0, pin_boot, 0, NULL);
+		ASSERT(unsetenv("TINYOS_AFFINITY")==0);
+		ASSERT(unpinned == 0);
+		ASSERT(mismatches == 0);
+	}
+}
+
+
+
+BOOT_TEST(test_interrupt_masking_syscalls,
+	"Test that disabling and enabling interrupts makes no system calls\n"
+	"with VM_IRQ_FUTEX delivery (run with TINYOS_IRQ=signal to compare).",
+	.minimum_cores = 1
+	)
+{
+	const int N = 100000;
+	ASSERT(cpu_interrupts_enabled());
+
+	unsigned long calls0 = cpu_sigmask_calls();
+	for(int i=0; i<N; i++) {
+		int preempt = cpu_disable_interrupts();
+		ASSERT(preempt && !cpu_interrupts_enabled());
+		cpu_enable_interrupts();
+	}
+	unsigned long calls = cpu_sigmask_calls() - calls0;
+
+	ASSERT(cpu_interrupts_enabled());
+	if(cpu_irq_delivery()==VM_IRQ_FUTEX)
+		ASSERT_MSG(calls==0, "calls=%lu\n", calls);
+	else
+		ASSERT_MSG(calls>=3ul*N, "calls=%lu\n", calls);
+	return 0;
+}
+
+
+
 
 /*********************************************
  *
@@ -737,6 +924,391 @@ static int greeted_child(int argl, void* args)
 	return 0;
 }
 
+/*
+	Create a disk image of the given size, and boot with it as disk 0.
+	The image is removed after the VM halts.
+ */
+static void boot_with_disk(uint ncores, size_t size, Task task, int argl, void* args)
+{
+	char path[] = "/tmp/tinyos_disk_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT(fd != -1);
+	ASSERT(ftruncate(fd, size)==0);
+	ASSERT(close(fd)==0);
+
+	ASSERT(setenv("TINYOS_DISKS", path, 1)==0);
+	boot(ncores, 0, task, argl, args);
+	ASSERT(unsetenv("TINYOS_DISKS")==0);
+	ASSERT(unlink(path)==0);
+}
+
+
+BOOT_TEST(test_no_block_devices,
+	"Test that there are no block devices, unless disk images are given."
+	)
+{
+	ASSERT(GetBlockDevices()==0);
+	ASSERT(OpenBlock(0)==NOFILE);
+	char buf[BLOCK_SECTOR_SIZE];
+	ASSERT(BlockRead(0, 0, buf, 1)==-1);
+	return 0;
+}
+
+
+#define BLOCK_TEST_SECTORS 2048
+
+/* Each sector is filled with its number, xor the fill byte */
+static void fill_sectors(char* buf, uint64_t sector, unsigned int n, char fill)
+{
+	for(unsigned int i=0; i<n; i++)
+		memset(buf + i*BLOCK_SECTOR_SIZE, (char)(sector+i) ^ fill, BLOCK_SECTOR_SIZE);
+}
+
+static int check_sectors(char* buf, uint64_t sector, unsigned int n, char fill)
+{
+	for(unsigned int i=0; i<n*BLOCK_SECTOR_SIZE; i++)
+		if(buf[i] != ((char)(sector + i/BLOCK_SECTOR_SIZE) ^ fill)) return 0;
+	return 1;
+}
+
+/* Write, then read back, a stripe of 2-sector blocks: argl is the stripe */
+static int block_stripe_thread(int argl, void* args)
+{
+	const int NSTRIPES = 16;
+	char buf[2*BLOCK_SECTOR_SIZE];
+	for(uint64_t s = 2*argl; s < BLOCK_TEST_SECTORS; s += 2*NSTRIPES) {
+		fill_sectors(buf, s, 2, 0x5a);
+		ASSERT(BlockWrite(0, s, buf, 2)==0);
+	}
+	for(uint64_t s = 2*argl; s < BLOCK_TEST_SECTORS; s += 2*NSTRIPES) {
+		ASSERT(BlockRead(0, s, buf, 2)==0);
+		ASSERT(check_sectors(buf, s, 2, 0x5a));
+	}
+	return 0;
+}
+
+static int block_device_boot(int argl, void* args)
+{
+	ASSERT(GetBlockDevices()==1);
+
+	/* Range errors */
+	char buf[4*BLOCK_SECTOR_SIZE];
+	ASSERT(BlockRead(1, 0, buf, 1)==-1);
+	ASSERT(BlockRead(0, BLOCK_TEST_SECTORS, buf, 1)==-1);
+	ASSERT(BlockWrite(0, BLOCK_TEST_SECTORS-1, buf, 2)==-1);
+	ASSERT(BlockRead(0, 0, buf, 0)==0);
+
+	/* Concurrent adjacent requests, which may be merged */
+	Tid_t tids[16];
+	for(int i=0; i<16; i++)
+		tids[i] = CreateThread(block_stripe_thread, i, NULL);
+	for(int i=0; i<16; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	/* The stream reads sequentially, in whole sectors */
+	Fid_t fid = OpenBlock(0);
+	ASSERT(fid != NOFILE);
+	ASSERT(Read(fid, buf, 100)==-1);
+	uint64_t sector = 0;
+	int rc;
+	while((rc = Read(fid, buf, sizeof(buf))) > 0) {
+		ASSERT(rc==sizeof(buf));
+		ASSERT(check_sectors(buf, sector, 4, 0x5a));
+		sector += 4;
+	}
+	ASSERT(rc==0);
+	ASSERT(sector==BLOCK_TEST_SECTORS);
+	ASSERT(Close(fid)==0);
+
+	/* Overwrite the start with the stream */
+	fid = OpenBlock(0);
+	fill_sectors(buf, 0, 4, 0x33);
+	ASSERT(Write(fid, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Close(fid)==0);
+	ASSERT(BlockRead(0, 2, buf, 2)==0);
+	ASSERT(check_sectors(buf, 2, 2, 0x33));
+	return 0;
+}
+
+BARE_TEST(test_block_device,
+	"Test reading and writing a block device, with concurrent requests and\n"
+	"with a stream."
+	)
+{
+	boot_with_disk(2, BLOCK_TEST_SECTORS*BLOCK_SECTOR_SIZE, block_device_boot, 0, NULL);
+}
+
+
+/*
+	Boot with a RAM disk as disk 0, anonymous if path is NULL.
+ */
+static void boot_with_ramdisk(uint ncores, uint64_t size, const char* path, Task task, int argl, void* args)
+{
+	vm_config vmc;
+	vm_configure(&vmc, NULL, ncores, 0);
+	vmc.diskno = 0;
+	ASSERT(vm_config_ramdisk(&vmc, size, path)==0);
+	boot_vm(&vmc, task, argl, args);
+}
+
+static int ramdisk_seek_boot(int argl, void* args)
+{
+	char buf[2*BLOCK_SECTOR_SIZE];
+	Fid_t fid = OpenBlock(0);
+	ASSERT(fid != NOFILE);
+	ASSERT(Seek(fid, 100, SEEK_SET)==-1);
+	ASSERT(Seek(fid, -2*BLOCK_SECTOR_SIZE, SEEK_END)==(BLOCK_TEST_SECTORS-2)*BLOCK_SECTOR_SIZE);
+	fill_sectors(buf, BLOCK_TEST_SECTORS-2, 2, 0x77);
+	ASSERT(Write(fid, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Read(fid, buf, sizeof(buf))==0);
+	ASSERT(Seek(fid, -(int64_t)sizeof(buf), SEEK_CUR)==(BLOCK_TEST_SECTORS-2)*BLOCK_SECTOR_SIZE);
+	ASSERT(Read(fid, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(check_sectors(buf, BLOCK_TEST_SECTORS-2, 2, 0x77));
+	ASSERT(Close(fid)==0);
+	return 0;
+}
+
+BARE_TEST(test_ramdisk,
+	"Test a RAM disk, anonymous and backed by a host file, and seeking on\n"
+	"a block device stream."
+	)
+{
+	boot_with_ramdisk(2, BLOCK_TEST_SECTORS*BLOCK_SECTOR_SIZE, NULL, block_device_boot, 0, NULL);
+
+	/* The data of a file-backed disk is in the file */
+	char path[] = "/tmp/tinyos_ramdisk_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT(fd != -1);
+	boot_with_ramdisk(2, BLOCK_TEST_SECTORS*BLOCK_SECTOR_SIZE, path, block_device_boot, 0, NULL);
+	boot_with_ramdisk(1, 0, path, ramdisk_seek_boot, 0, NULL);
+	char buf[2*BLOCK_SECTOR_SIZE];
+	ASSERT(pread(fd, buf, sizeof(buf), 0)==sizeof(buf));
+	ASSERT(check_sectors(buf, 0, 2, 0x33));
+	ASSERT(pread(fd, buf, sizeof(buf), (BLOCK_TEST_SECTORS-2)*BLOCK_SECTOR_SIZE)==sizeof(buf));
+	ASSERT(check_sectors(buf, BLOCK_TEST_SECTORS-2, 2, 0x77));
+	ASSERT(close(fd)==0);
+	ASSERT(unlink(path)==0);
+}
+
+
+/* Return the names of a directory, separated by spaces */
+static void list_dir(const char* path, char* names)
+{
+	Fid_t dir = Open(path, 0);
+	ASSERT(dir != NOFILE);
+	dir_entry ent[3];
+	int rc;
+	names[0] = 0;
+	while((rc = Read(dir, (char*)ent, sizeof(ent))) > 0) {
+		ASSERT(rc % sizeof(dir_entry) == 0);
+		for(uint i=0; i<rc/sizeof(dir_entry); i++) {
+			strcat(names, ent[i].name);
+			strcat(names, " ");
+		}
+	}
+	ASSERT(rc==0);
+	ASSERT(Close(dir)==0);
+}
+
+static int file_system_boot(int argl, void* args)
+{
+	ASSERT(Open("/a", OPEN_CREATE)==NOFILE);
+	ASSERT(Mount(0)==-1);
+	ASSERT(MakeFileSystem(1)==-1);
+	ASSERT(MakeFileSystem(0)==0);
+	ASSERT(Mount(0)==0);
+	ASSERT(Mount(0)==-1);
+	ASSERT(MakeFileSystem(0)==-1);
+
+	/* Create, write, seek and read */
+	ASSERT(Open("/a", 0)==NOFILE);
+	Fid_t fa = Open("/a", OPEN_CREATE);
+	ASSERT(fa != NOFILE);
+	ASSERT(Write(fa, "Hello world", 11)==11);
+	ASSERT(Seek(fa, 6, SEEK_SET)==6);
+	char buf[100];
+	ASSERT(Read(fa, buf, sizeof(buf))==5);
+	ASSERT(memcmp(buf, "world", 5)==0);
+	ASSERT(Read(fa, buf, sizeof(buf))==0);
+	ASSERT(Seek(fa, -1, SEEK_SET)==-1);
+
+	/* A gap reads as zeros */
+	ASSERT(Seek(fa, 10000, SEEK_SET)==10000);
+	ASSERT(Write(fa, "!", 1)==1);
+	ASSERT(Seek(fa, -2, SEEK_END)==9999);
+	ASSERT(Read(fa, buf, 10)==2);
+	ASSERT(buf[0]==0 && buf[1]=='!');
+
+	file_stat st;
+	ASSERT(Stat("a", &st)==0);
+	ASSERT(st.type==FILE_REGULAR && st.size==10001 && st.nlink==1);
+	ASSERT(Stat("/", &st)==0);
+	ASSERT(st.type==FILE_DIR);
+	ASSERT(Stat("/b", &st)==-1);
+
+	/* Append and truncate */
+	Fid_t fb = Open("/a", OPEN_APPEND);
+	ASSERT(Write(fb, "?", 1)==1);
+	ASSERT(Close(fb)==0);
+	ASSERT(Stat("/a", &st)==0 && st.size==10002);
+	fb = Open("/a", OPEN_TRUNC);
+	ASSERT(Stat("/a", &st)==0 && st.size==0);
+	ASSERT(Close(fb)==0);
+
+	/* Directories */
+	ASSERT(MkDir("/d")==0);
+	ASSERT(MkDir("/d")==-1);
+	ASSERT(MkDir("/x/y")==-1);
+	ASSERT(Open("/d", OPEN_TRUNC)==NOFILE);
+	Fid_t fd = Open("/d", 0);
+	ASSERT(Write(fd, "x", 1)==-1);
+	ASSERT(Open("/a/b", OPEN_CREATE)==NOFILE);
+	ASSERT(Open("/d/a_name_which_is_far_too_long", OPEN_CREATE)==NOFILE);
+	for(int i=0; i<5; i++) {
+		char name[20];
+		sprintf(name, "/d/f%d", i);
+		Fid_t f = Open(name, OPEN_CREATE);
+		ASSERT(f != NOFILE);
+		ASSERT(Close(f)==0);
+	}
+	ASSERT(Unlink("/d/f2")==0);
+	ASSERT(Unlink("/d/f2")==-1);
+	char names[200];
+	list_dir("/d", names);
+	ASSERT(strcmp(names, "f0 f1 f3 f4 ")==0);
+	list_dir("", names);
+	ASSERT(strcmp(names, "a d ")==0);
+
+	ASSERT(Unlink("/d")==-1);
+	ASSERT(Unlink("/")==-1);
+
+	/* An unlinked file remains until it is closed */
+	ASSERT(Unlink("/a")==0);
+	ASSERT(Open("/a", 0)==NOFILE);
+	ASSERT(Seek(fa, 0, SEEK_SET)==0);
+	ASSERT(Write(fa, "data", 4)==4);
+	ASSERT(Seek(fa, 0, SEEK_SET)==0);
+	ASSERT(Read(fa, buf, sizeof(buf))==4);
+	ASSERT(memcmp(buf, "data", 4)==0);
+
+	ASSERT(Unmount()==-1);
+	ASSERT(Close(fa)==0);
+	ASSERT(Close(fd)==0);
+	ASSERT(Unmount()==0);
+	ASSERT(Unmount()==-1);
+
+	/* The files persist */
+	ASSERT(Mount(0)==0);
+	list_dir("/d/", names);
+	ASSERT(strcmp(names, "f0 f1 f3 f4 ")==0);
+	ASSERT(Stat("/a", &st)==-1);
+	return 0;
+}
+
+BARE_TEST(test_file_system,
+	"Test the file system calls: creating, writing, seeking and reading\n"
+	"files, directories, unlinking and remounting."
+	)
+{
+	boot_with_ramdisk(2, 2<<20, NULL, file_system_boot, 0, NULL);
+}
+
+
+#define FS_TEST_FILE (12<<20)
+
+/* The data of a test file at an offset, word by word */
+static void fill_file_data(uint32_t* buf, uint64_t off, uint n, uint32_t seed)
+{
+	for(uint i=0; i<n; i++) buf[i] = (uint32_t)(off/4 + i) * 2654435761u + seed;
+}
+
+static int check_file_data(uint32_t* buf, uint64_t off, uint n, uint32_t seed)
+{
+	for(uint i=0; i<n; i++) 
+		if(buf[i] != (uint32_t)(off/4 + i) * 2654435761u + seed) return 0;
+	return 1;
+}
+
+static void write_test_file(const char* path, uint32_t seed)
+{
+	static uint32_t buf[16384];
+	Fid_t f = Open(path, OPEN_CREATE|OPEN_TRUNC);
+	ASSERT(f != NOFILE);
+	for(uint64_t off = 0; off < FS_TEST_FILE; off += sizeof(buf)) {
+		fill_file_data(buf, off, 16384, seed);
+		ASSERT(Write(f, (char*)buf, sizeof(buf))==sizeof(buf));
+	}
+	ASSERT(Close(f)==0);
+}
+
+static void check_test_file(const char* path, uint32_t seed)
+{
+	static uint32_t buf[3000];
+	Fid_t f = Open(path, 0);
+	ASSERT(f != NOFILE);
+	uint64_t off = 0;
+	int rc;
+	while((rc = Read(f, (char*)buf, sizeof(buf))) > 0) {
+		ASSERT(rc % 4 == 0);
+		ASSERT(check_file_data(buf, off, rc/4, seed));
+		off += rc;
+	}
+	ASSERT(rc == 0);
+	ASSERT(off == FS_TEST_FILE);
+
+	/* Random reads */
+	for(int i=0; i<200; i++) {
+		uint64_t pos = (uint64_t)(lrand48() % (FS_TEST_FILE/4 - 100)) * 4;
+		ASSERT(Seek(f, pos, SEEK_SET)==pos);
+		ASSERT(Read(f, (char*)buf, 400)==400);
+		ASSERT(check_file_data(buf, pos, 100, seed));
+	}
+	ASSERT(Close(f)==0);
+}
+
+static int large_file_boot(int argl, void* args)
+{
+	if(argl) {
+		/* Create on a fresh disk; the data is written back at exit */
+		ASSERT(MakeFileSystem(0)==0);
+		ASSERT(Mount(0)==0);
+		write_test_file("/big", 1);
+		check_test_file("/big", 1);
+
+		/* Overwriting needs the blocks of the truncated file */
+		write_test_file("/big", 2);
+		check_test_file("/big", 2);
+		Fid_t f = Open("/big2", OPEN_CREATE);
+		ASSERT(f != NOFILE);
+		ASSERT(Close(f)==0);
+	} else {
+		ASSERT(Mount(0)==0);
+		check_test_file("/big", 2);
+		/* Unlinking releases the blocks */
+		ASSERT(Unlink("/big")==0);
+		write_test_file("/big2", 3);
+		check_test_file("/big2", 3);
+		ASSERT(Unmount()==0);
+	}
+	return 0;
+}
+
+BARE_TEST(test_file_system_large_file,
+	"Test a file larger than the page cache, using double-indirect blocks,\n"
+	"and that the file system persists on a file-backed RAM disk."
+	)
+{
+	char path[] = "/tmp/tinyos_ramdisk_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT(fd != -1);
+	ASSERT(close(fd)==0);
+	boot_with_ramdisk(2, FS_TEST_FILE + (3<<20), path, large_file_boot, 1, NULL);
+	boot_with_ramdisk(2, 0, path, large_file_boot, 0, NULL);
+	ASSERT(unlink(path)==0);
+}
+
+
+
 BOOT_TEST(test_child_inherits_files,
 	"Test that a child process inherits files.",
 	.minimum_terminals = 1
@@ -784,97 +1356,537 @@ BOOT_TEST(test_null_device,
 }
 
 
+BOOT_TEST(test_open_device,
+	"Test that devices can be opened by the name of their driver."
+	)
+{
+	/* The built-in drivers */
+	Fid_t fid = OpenDevice("null", 0);
+	ASSERT(fid!=NOFILE);
+	ASSERT(Close(fid)==0);
+	ASSERT(OpenDevice("null", 1)==NOFILE);
 
-/***********************************************************************************8
-*************************************************/
+	for(uint i=0; i<GetTerminalDevices(); i++) {
+		fid = OpenDevice("serial", i);
+		ASSERT(fid!=NOFILE);
+		ASSERT(Close(fid)==0);
+	}
+	ASSERT(OpenDevice("serial", GetTerminalDevices())==NOFILE);
+	ASSERT(OpenDevice("block", GetBlockDevices())==NOFILE);
+
+	ASSERT(OpenDevice("nosuchdevice", 0)==NOFILE);
+	ASSERT(OpenDevice("", 0)==NOFILE);
+	ASSERT(OpenDevice(NULL, 0)==NOFILE);
 
+	/* The zero device */
+	char buf[64];
+	memset(buf, 1, sizeof(buf));
+	fid = OpenDevice("zero", 0);
+	ASSERT(fid!=NOFILE);
+	ASSERT(Read(fid, buf, sizeof(buf))==sizeof(buf));
+	for(uint i=0; i<sizeof(buf); i++) ASSERT(buf[i]==0);
+	ASSERT(Write(fid, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Close(fid)==0);
+
+	/* The random device: distinct streams give distinct bytes */
+	char buf2[64];
+	Fid_t r1 = OpenDevice("random", 0);
+	Fid_t r2 = OpenDevice("random", 0);
+	ASSERT(r1!=NOFILE && r2!=NOFILE);
+	ASSERT(Read(r1, buf, 13)==13);
+	ASSERT(Read(r1, buf+13, sizeof(buf)-13)==sizeof(buf)-13);
+	ASSERT(Read(r2, buf2, sizeof(buf2))==sizeof(buf2));
+	ASSERT(memcmp(buf, buf2, sizeof(buf))!=0);
+	uint zeros = 0;
+	for(uint i=0; i<sizeof(buf); i++) zeros += (buf[i]==0);
+	ASSERT(zeros < sizeof(buf)/4);
+	ASSERT(Write(r1, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Close(r1)==0);
+	ASSERT(Close(r2)==0);
 
+	return 0;
+}
 
 
-void checked_write(Fid_t fid, const char* message)
+
+BOOT_TEST(test_gettime,
+	"Test that GetTime advances with real time."
+	)
 {
-	int mlen = strlen(message);
-	for(int count=0; count < mlen;) {
-		int wno = Write(fid, message+count, 1);
-		ASSERT(wno>0);
-		count += wno;
-	}
+	int dummy = 0;
+	timeout_t t0 = GetTime();
+	ASSERT(FutexWait(&dummy, 0, 300)==0);
+	timeout_t t1 = GetTime();
+	ASSERT_MSG(t1 >= t0+200 && t1 < t0+5000, "t0=%lu t1=%lu\n", t0, t1);
+	return 0;
 }
 
 
 
-BOOT_TEST(test_write_con,
-	"Test that we can write a few bytes to the console on terminal 0.",
-	.minimum_terminals = 1
+BOOT_TEST(test_gettime_ns,
+	"Test that GetTimeNs is monotonic, has fine resolution and advances with\n"
+	"real time."
 	)
 {
-	assert(GetTerminalDevices()>0);
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
+	/* Monotonic, and it changes within a few calls */
+	uint64_t prev = GetTimeNs();
+	int changes = 0;
+	for(int i=0; i<10000; i++) {
+		uint64_t t = GetTimeNs();
+		ASSERT(t >= prev);
+		changes += (t != prev);
+		prev = t;
+	}
+	ASSERT(changes > 1000);
+
+	/* A 100 msec sleep */
+	int dummy = 0;
+	uint64_t t0 = GetTimeNs();
+	ASSERT(FutexWait(&dummy, 0, 100)==0);
+	uint64_t t1 = GetTimeNs();
+	ASSERT_MSG(t1-t0 >= 90000000ull && t1-t0 < 2000000000ull, "delta=%lu\n", (unsigned long)(t1-t0));
+	return 0;
+}
 
-	expect(0, "Hello");
-	checked_write(fterm, "Hello");
+
+
+BOOT_TEST(test_sysbatch,
+	"Test that SysBatch executes a sequence of I/O calls in order, and returns\n"
+	"the result of each."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	char buf[6] = { 0 };
+	sysop ops[] = {
+		SYSOP_Write(pipe.write, "hello", 5),
+		SYSOP_Dup2(pipe.read, 7),
+		SYSOP_Close(pipe.read),
+		SYSOP_Read(7, buf, 5),
+		SYSOP_Close(-1),			/* fails, illegal fid */
+		{ .code = 1000 },			/* fails, illegal code */
+		SYSOP_Close(pipe.write),
+		SYSOP_Close(7),
+	};
+	int n = sizeof(ops)/sizeof(sysop);
+
+	ASSERT(SysBatch(ops, n)==2);
+	ASSERT(ops[0].result==5);
+	ASSERT(ops[1].result==0);
+	ASSERT(ops[2].result==0);
+	ASSERT(ops[3].result==5);
+	ASSERT(strcmp(buf, "hello")==0);
+	ASSERT(ops[4].result==-1);
+	ASSERT(ops[5].result==-1);
+	ASSERT(ops[6].result==0);
+	ASSERT(ops[7].result==0);
+
+	ASSERT(SysBatch(NULL, 1)==-1);
+	ASSERT(SysBatch(ops, 0)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_write_con_big,
-	"Test that we can write massively to the console on terminal 0.",
-	.minimum_terminals = 1
+
+static int read_one_byte(int argl, void* args)
+{
+	char c;
+	ASSERT(Read(0, &c, 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_lock_info,
+	"Test that lock statistics are collected for mutexes and kernel wait channels\n"
+	"and are returned by a lock information stream."
 	)
 {
-	assert(GetTerminalDevices()>0);
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
+	ASSERT(EnableLockStats(1)==0);
 
-	char bytes[1025];
-	FUDGE(bytes);
-	bytes[1024]='\0';
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Dup2(pipe.read, 0)==0);
+	Pid_t pid = Exec(read_one_byte, 0, NULL);
+	ASSERT(pid!=NOPROC);
+	ASSERT(Write(pipe.write, "x", 1)==1);
+	ASSERT(WaitChild(pid, NULL)==pid);
 
-	/* send me 1Mbyte */
-	for(int i=0; i<1024; i++)
-		expect(0, bytes);
+	/* A mutex held across a period without collection is not timed */
+	Mutex mx = MUTEX_INIT;
+	char mxname[LOCKINFO_NAME_SIZE];
+	snprintf(mxname, LOCKINFO_NAME_SIZE, "mutex@%p", &mx);
+	Mutex_Lock(&mx);
+	ASSERT(EnableLockStats(0)==1);
+	Mutex_Unlock(&mx);
+	Mutex_Lock(&mx);
+	int dummy = 0;
+	ASSERT(FutexWait(&dummy, 0, 100)==0);
+	ASSERT(EnableLockStats(1)==0);
+	Mutex_Unlock(&mx);
 
-	/* Create a 16kb block */
-	char buffer[16384];
-	FUDGE(buffer);
+	ASSERT(EnableLockStats(0)==1);
 
-	int total = 1<<20;
-	int count = 0;
+	Fid_t finfo = OpenLockInfo();
+	ASSERT(finfo!=NOFILE);
 
-	while(count < total)
-	{
-		int remain = total-count;
+	lockinfo info;
+	char small[sizeof(lockinfo)-1];
+	ASSERT(Read(finfo, small, sizeof(small))==-1);
 
-		int rc = Write(fterm, buffer, (remain<16384)? remain: 16384);
-		ASSERT(rc>0);
-		count += rc;
+	int found_kernel_mutex = 0, found_mx = 0;
+	unsigned long last_wait = (unsigned long)-1;
+	int rc;
+	while((rc = Read(finfo, (char*)&info, sizeof(info)))>0) {
+		ASSERT(rc==sizeof(info));
+		ASSERT(info.wait_time <= last_wait);
+		last_wait = info.wait_time;
+		if(info.type==LOCKINFO_MUTEX && strcmp(info.name, "kernel_mutex")==0) {
+			found_kernel_mutex = 1;
+			ASSERT(info.acquisitions > 0);
+			ASSERT(info.contended <= info.acquisitions);
+		}
+		if(info.type==LOCKINFO_MUTEX && strcmp(info.name, mxname)==0) {
+			found_mx = 1;
+			ASSERT(info.acquisitions == 1);
+			ASSERT(info.hold_time == 0);
+		}
+		if(info.type==LOCKINFO_WCHAN) {
+			ASSERT(info.contended == 0);
+			ASSERT(info.timeouts <= info.acquisitions);
+		}
 	}
-
+	ASSERT(rc==0);
+	ASSERT(found_kernel_mutex);
+	ASSERT(found_mx);
+	ASSERT(Close(finfo)==0);
 	return 0;
 }
 
 
 
-BOOT_TEST(test_write_error_on_bad_fid,
-	"Test that Write will return an error when called on a bad fid"
+BOOT_TEST(test_lock_info_overflow,
+	"Test that mutexes which do not fit in the lock statistics table are\n"
+	"accounted in the \"(other)\" record, without hold times."
 	)
 {
-	char buffer[10];
-	ASSERT(Write(0, buffer, 10)==-1);
+	const uint N = 4096;
+	static Mutex mx[4096];
+	for(uint i=0; i<N; i++) mx[i] = MUTEX_INIT;
+
+	ASSERT(EnableLockStats(1)==0);
+	for(uint i=0; i<N; i++) {
+		Mutex_Lock(&mx[i]);
+		Mutex_Unlock(&mx[i]);
+	}
+	ASSERT(EnableLockStats(0)==1);
+
+	Fid_t finfo = OpenLockInfo();
+	ASSERT(finfo!=NOFILE);
+	lockinfo info;
+	int found_other = 0;
+	while(Read(finfo, (char*)&info, sizeof(info))==sizeof(info)) {
+		if(info.type==LOCKINFO_MUTEX && strcmp(info.name, "(other)")==0) {
+			found_other = 1;
+			ASSERT(info.acquisitions > 0);
+			ASSERT(info.hold_time == 0);
+		}
+	}
+	ASSERT(found_other);
+	ASSERT(Close(finfo)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_write_to_many_terminals,
-	"Test that Write can send to all terminals",
-	.minimum_terminals = 2
+
+BOOT_TEST(test_core_info,
+	"Test that a core information stream returns the statistics of each core."
 	)
 {
-	Fid_t term[MAX_TERMINALS];
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		term[i] = OpenTerminal(i);
-		ASSERT(term[i]!=NOFILE);
+	/* Sleep, so that some core halts */
+	int dummy = 0;
+	ASSERT(FutexWait(&dummy, 0, 50)==0);
+
+	Fid_t finfo = OpenCoreInfo();
+	ASSERT(finfo!=NOFILE);
+
+	coreinfo info;
+	char small[sizeof(coreinfo)-1];
+	ASSERT(Read(finfo, small, sizeof(small))==-1);
+
+	unsigned int ncores = 0;
+	unsigned long halts = 0, switches = 0;
+	int rc;
+	while((rc = Read(finfo, (char*)&info, sizeof(info)))>0) {
+		ASSERT(rc==sizeof(info));
+		ASSERT(info.core == ncores);
+		ASSERT(info.alarms <= info.interrupts);
+		ASSERT(info.restarts <= info.halts);
+		ASSERT(info.halt_time <= info.run_time);
+		halts += info.halts;
+		switches += info.switches;
+		ncores++;
+	}
+	ASSERT(rc==0);
+	ASSERT(ncores == cpu_cores());
+	ASSERT(halts > 0);
+	ASSERT(switches > 0);
+	ASSERT(Close(finfo)==0);
+	return 0;
+}
+
+
+
+static int churn_child(int argl, void* args)
+{
+	return 0;
+}
+
+static int churn_spawner(int argl, void* args)
+{
+	const char* msg = "churn";
+	for(int i=0; i<argl; i++) {
+		Pid_t pid = Exec(churn_child, strlen(msg)+1, (void*)msg);
+		ASSERT(pid!=NOPROC);
+		ASSERT(WaitChild(pid, NULL)==pid);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_procinfo_under_churn,
+	"Test that the process information stream returns consistent records while\n"
+	"processes are created and reclaimed concurrently."
+	)
+{
+	Pid_t spawner = Exec(churn_spawner, 200, NULL);
+	ASSERT(spawner!=NOPROC);
+
+	for(int round=0; round<50; round++) {
+		Fid_t finfo = OpenInfo();
+		ASSERT(finfo!=NOFILE);
+		procinfo info;
+		int rc, count=0;
+		while((rc = Read(finfo, (char*)&info, sizeof(info)))>0) {
+			ASSERT(rc==sizeof(info));
+			ASSERT(info.pid>0 && info.pid<MAX_PROC);
+			if(info.main_task==churn_child) {
+				ASSERT(info.argl==6);
+				ASSERT(info.ppid==spawner);
+			}
+			count++;
+		}
+		ASSERT(rc==0);
+		ASSERT(count>=1);
+		ASSERT(Close(finfo)==0);
+	}
+
+	ASSERT(WaitChild(spawner, NULL)==spawner);
+	return 0;
+}
+
+
+/* The number of acquisitions of the kernel lock so far */
+static unsigned long kernel_lock_acquisitions()
+{
+	Fid_t finfo = OpenLockInfo();
+	ASSERT(finfo!=NOFILE);
+	lockinfo info;
+	unsigned long acq = 0;
+	while(Read(finfo, (char*)&info, sizeof(info))>0)
+		if(info.type==LOCKINFO_MUTEX && strcmp(info.name, "kernel_mutex")==0)
+			acq = info.acquisitions;
+	ASSERT(Close(finfo)==0);
+	return acq;
+}
+
+BOOT_TEST(test_lockfree_reads,
+	"Test that reading information streams and connecting to a port without a\n"
+	"listener do not take the kernel lock."
+	)
+{
+	ASSERT(EnableLockStats(1)==0);
+
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(sock!=NOFILE);
+
+	unsigned long before = kernel_lock_acquisitions();
+	for(int i=0; i<100; i++) {
+		procinfo info;
+		ASSERT(Read(finfo, (char*)&info, sizeof(info))>=0);
+		ASSERT(Connect(sock, 100, 10)==-1);
+	}
+	unsigned long after = kernel_lock_acquisitions();
+
+	/* Only the lock information stream itself takes the lock */
+	ASSERT_MSG(after-before < 100, "%lu kernel lock acquisitions\n", after-before);
+	ASSERT(EnableLockStats(0)==1);
+	ASSERT(Close(finfo)==0);
+	ASSERT(Close(sock)==0);
+	return 0;
+}
+
+
+static Fid_t shared_info;
+static int shared_info_seen[MAX_PROC];
+
+static int shared_info_reader(int argl, void* args)
+{
+	procinfo info;
+	int rc;
+	while((rc = Read(shared_info, (char*)&info, sizeof(info)))>0) {
+		ASSERT(rc==sizeof(info));
+		ASSERT(info.pid>0 && info.pid<MAX_PROC);
+		__atomic_fetch_add(&shared_info_seen[info.pid], 1, __ATOMIC_RELAXED);
+	}
+	ASSERT(rc==0);
+	return 0;
+}
+
+static int shared_info_reads;
+
+static int read_until_closed(int argl, void* args)
+{
+	lockinfo info;
+	while(Read(shared_info, (char*)&info, sizeof(info))>=0)
+		__atomic_fetch_add(&shared_info_reads, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+BOOT_TEST(test_lockfree_shared_readers,
+	"Test that threads reading one information stream concurrently get each record\n"
+	"once, and that a stream can be closed while another thread reads it."
+	)
+{
+	const int nchildren = 10, nreaders = 4;
+	Pid_t children[nchildren];
+	for(int i=0; i<nchildren; i++) {
+		children[i] = Exec(churn_child, 0, NULL);
+		ASSERT(children[i]!=NOPROC);
+	}
+
+	/* The children remain in the table until they are waited for */
+	memset(shared_info_seen, 0, sizeof(shared_info_seen));
+	shared_info = OpenInfo();
+	ASSERT(shared_info!=NOFILE);
+	Tid_t tids[nreaders];
+	for(int i=0; i<nreaders; i++)
+		tids[i] = CreateThread(shared_info_reader, 0, NULL);
+	for(int i=0; i<nreaders; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(Close(shared_info)==0);
+
+	ASSERT(shared_info_seen[GetPid()]==1);
+	for(int i=0; i<nchildren; i++)
+		ASSERT(shared_info_seen[children[i]]==1);
+
+	shared_info = OpenLockInfo();
+	ASSERT(shared_info!=NOFILE);
+	shared_info_reads = 0;
+	Tid_t t = CreateThread(read_until_closed, 0, NULL);
+	int dummy = 0;
+	while(__atomic_load_n(&shared_info_reads, __ATOMIC_RELAXED) < 100)
+		ASSERT(FutexWait(&dummy, 0, 1)==0);
+	ASSERT(Close(shared_info)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	for(int i=0; i<nchildren; i++)
+		ASSERT(WaitChild(children[i], NULL)==children[i]);
+	return 0;
+}
+
+
+
+/***********************************************************************************8
+*************************************************/
+
+
+
+
+void checked_write(Fid_t fid, const char* message)
+{
+	int mlen = strlen(message);
+	for(int count=0; count < mlen;) {
+		int wno = Write(fid, message+count, 1);
+		ASSERT(wno>0);
+		count += wno;
+	}
+}
+
+
+
+BOOT_TEST(test_write_con,
+	"Test that we can write a few bytes to the console on terminal 0.",
+	.minimum_terminals = 1
+	)
+{
+	assert(GetTerminalDevices()>0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	expect(0, "Hello");
+	checked_write(fterm, "Hello");
+	return 0;
+}
+
+
+BOOT_TEST(test_write_con_big,
+	"Test that we can write massively to the console on terminal 0.",
+	.minimum_terminals = 1
+	)
+{
+	assert(GetTerminalDevices()>0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+
+	/* send me 1Mbyte */
+	for(int i=0; i<1024; i++)
+		expect(0, bytes);
+
+	/* Create a 16kb block */
+	char buffer[16384];
+	FUDGE(buffer);
+
+	int total = 1<<20;
+	int count = 0;
+
+	while(count < total)
+	{
+		int remain = total-count;
+
+		int rc = Write(fterm, buffer, (remain<16384)? remain: 16384);
+		ASSERT(rc>0);
+		count += rc;
+	}
+
+	return 0;
+}
+
+
+
+BOOT_TEST(test_write_error_on_bad_fid,
+	"Test that Write will return an error when called on a bad fid"
+	)
+{
+	char buffer[10];
+	ASSERT(Write(0, buffer, 10)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_write_to_many_terminals,
+	"Test that Write can send to all terminals",
+	.minimum_terminals = 2
+	)
+{
+	Fid_t term[MAX_TERMINALS];
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		term[i] = OpenTerminal(i);
+		ASSERT(term[i]!=NOFILE);
 	}
 
 	for(uint i = 0; i < GetTerminalDevices(); i++) {
@@ -895,6 +1907,233 @@ BOOT_TEST(test_write_to_many_terminals,
 }
 
 
+/*
+	Boot with loopback terminals, without the terminal proxies. 
+ */
+static void boot_with_loopback(uint ncores, uint nterm, const vm_loopback* loop, 
+	Task task, int argl, void* args)
+{
+	vm_config vmc;
+	vm_configure(&vmc, NULL, ncores, 0);
+	ASSERT(vm_config_loopback(&vmc, nterm, loop)==0);
+	boot_vm(&vmc, task, argl, args);
+}
+
+#define LOOPBACK_INPUT (1<<20)
+
+static const char loopback_script[] = "The quick brown fox jumps over the lazy dog\n";
+
+static int loopback_boot(int argl, void* args)
+{
+	ASSERT(GetTerminalDevices()==2);
+
+	/* Read the whole input of terminal 0, which repeats the script */
+	Fid_t kbd = OpenTerminal(0);
+	ASSERT(kbd != NOFILE);
+	char buf[5000];
+	uint count = 0;
+	while(count < LOOPBACK_INPUT) {
+		int rc = Read(kbd, buf, sizeof(buf));
+		ASSERT(rc > 0);
+		for(int i=0; i<rc; i++)
+			if(buf[i] != loopback_script[(count+i) % (sizeof(loopback_script)-1)]) {
+				ASSERT(0); break;
+			}
+		count += rc;
+	}
+	ASSERT(count == LOOPBACK_INPUT);
+
+	/* Write to terminal 1 */
+	Fid_t con = OpenTerminal(1);
+	ASSERT(con != NOFILE);
+	for(uint i=0; i<sizeof(buf); i++) buf[i] = i % 251;
+	for(int k=0; k<100; k++)
+		ASSERT(Write(con, buf, sizeof(buf))==sizeof(buf));
+	return 0;
+}
+
+BARE_TEST(test_loopback_terminals,
+	"Test that loopback terminals deliver scripted input and pass the output\n"
+	"to their consumer, without terminal emulators."
+	)
+{
+	vm_term_script script = { loopback_script, sizeof(loopback_script)-1, LOOPBACK_INPUT, 0 };
+	vm_term_sink sink;
+	vm_term_sink_init(&sink);
+	vm_loopback loop[2] = {
+		{ .produce = vm_term_script_produce, .producer_arg = &script },
+		{ .consume = vm_term_checksum, .consumer_arg = &sink }
+	};
+	boot_with_loopback(2, 2, loop, loopback_boot, 0, NULL);
+
+	ASSERT(script.pos == LOOPBACK_INPUT);
+
+	/* The expected output */
+	char buf[5000];
+	for(uint i=0; i<sizeof(buf); i++) buf[i] = i % 251;
+	vm_term_sink expected;
+	vm_term_sink_init(&expected);
+	for(int k=0; k<100; k++)
+		vm_term_checksum(&expected, buf, sizeof(buf));
+	ASSERT(sink.bytes == expected.bytes);
+	ASSERT(sink.checksum == expected.checksum);
+}
+
+
+/* A console which is held until the writer releases it */
+typedef struct held_console {
+	vm_term_sink sink;
+	int released;
+} held_console;
+
+static void held_console_consume(void* arg, const char* buf, uint size)
+{
+	held_console* hc = arg;
+	while(! __atomic_load_n(&hc->released, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	__atomic_fetch_add(&hc->sink.bytes, size, __ATOMIC_RELAXED);
+}
+
+static int held_console_boot(int argl, void* args)
+{
+	held_console* hc = *(held_console**)args;
+	Fid_t con = OpenTerminal(0);
+	ASSERT(con != NOFILE);
+	char buf[1000];
+	FUDGE(buf);
+
+	/* The writes are buffered, so they return while the console is held */
+	for(int i=0; i<10; i++)
+		ASSERT(Write(con, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(__atomic_load_n(&hc->sink.bytes, __ATOMIC_RELAXED) == 0);
+	__atomic_store_n(&hc->released, 1, __ATOMIC_RELEASE);
+
+	/* Close drains the output */
+	ASSERT(Close(con)==0);
+	ASSERT(__atomic_load_n(&hc->sink.bytes, __ATOMIC_RELAXED) == sizeof(buf)*10);
+	return 0;
+}
+
+BARE_TEST(test_serial_write_buffered,
+	"Test that writes to a console return without waiting for it to consume\n"
+	"the output, and that closing the terminal waits until the output is sent."
+	)
+{
+	held_console hc = { { 0, 0 }, 0 };
+	vm_loopback loop = { .consume = held_console_consume, .consumer_arg = &hc };
+	held_console* phc = &hc;
+	boot_with_loopback(1, 1, &loop, held_console_boot, sizeof(phc), &phc);
+	ASSERT(hc.sink.bytes == 10000);
+}
+
+
+
+/* Count the serial interrupts delivered to all cores */
+static unsigned long serial_interrupts()
+{
+	unsigned long n = 0;
+	for(uint c=0; c<cpu_cores(); c++) {
+		core_stats st;
+		ASSERT(cpu_core_stats(c, &st)==1);
+		n += st.irq_delivered[SERIAL_RX_READY] + st.irq_delivered[SERIAL_TX_READY];
+	}
+	return n;
+}
+
+static int idle_terminal_boot(int argl, void* args)
+{
+	/* Let the serial driver settle, then stay idle for several SERIAL_TIMEOUTs */
+	int dummy = 0;
+	FutexWait(&dummy, 0, 100);
+	unsigned long n0 = serial_interrupts();
+	FutexWait(&dummy, 0, 1000);
+	ASSERT_MSG(serial_interrupts() == n0, "%lu serial interrupts\n", serial_interrupts()-n0);
+	return 0;
+}
+
+BARE_TEST(test_idle_terminal_no_interrupts,
+	"Test that an idle terminal, served through its device queues, does\n"
+	"not raise periodic serial interrupts."
+	)
+{
+	vm_term_sink sink = { 0, 0 };
+	vm_loopback loop = { .consume = vm_term_discard, .consumer_arg = &sink };
+	boot_with_loopback(2, 1, &loop, idle_terminal_boot, 0, NULL);
+}
+
+
+
+/* A console which keeps its output */
+static char tty_console[256];
+static uint tty_console_len;
+
+static void tty_console_consume(void* arg, const char* buf, uint size)
+{
+	ASSERT(tty_console_len + size <= sizeof(tty_console));
+	memcpy(tty_console + tty_console_len, buf, size);
+	tty_console_len += size;
+}
+
+static int tty_modes_boot(int argl, void* args)
+{
+	Fid_t tty = OpenTerminal(0);
+	ASSERT(tty != NOFILE);
+	char buf[100];
+
+	ASSERT(SetTerminalMode(tty, TTY_CANON|TTY_ECHO) == TTY_RAW);
+
+	/* Each read returns one edited line */
+	ASSERT(Read(tty, buf, sizeof(buf)) == 3);
+	ASSERT(memcmp(buf, "ac\n", 3)==0);
+	ASSERT(Read(tty, buf, 2) == 2);
+	ASSERT(memcmp(buf, "do", 2)==0);
+	ASSERT(Read(tty, buf, sizeof(buf)) == 1);
+	ASSERT(buf[0] == '\n');
+
+	/* ^D on an empty line */
+	ASSERT(Read(tty, buf, sizeof(buf)) == 0);
+
+	/* Carriage return ends the line; the rest of it is returned in raw mode */
+	ASSERT(Read(tty, buf, 2) == 2);
+	ASSERT(memcmp(buf, "xy", 2)==0);
+	ASSERT(SetTerminalMode(tty, TTY_RAW) == (TTY_CANON|TTY_ECHO));
+	uint count = 0;
+	while(count < 7) {
+		int rc = Read(tty, buf+count, sizeof(buf)-count);
+		ASSERT(rc > 0);
+		count += rc;
+	}
+	ASSERT(count == 7);
+	ASSERT(memcmp(buf, "\nz\nraw\b", 7)==0);
+
+	ASSERT(SetTerminalMode(tty, 8) == -1);
+	Fid_t null = OpenNull();
+	ASSERT(SetTerminalMode(null, TTY_CANON) == -1);
+	ASSERT(SetTerminalMode(NOFILE, TTY_CANON) == -1);
+	ASSERT(Close(null)==0);
+
+	/* Close waits for the echo */
+	ASSERT(Close(tty)==0);
+	const char* echo = "ab\b \bc\ndef\b \b\b \bo\nxy\n";
+	ASSERT(tty_console_len == strlen(echo));
+	ASSERT(memcmp(tty_console, echo, tty_console_len)==0);
+	return 0;
+}
+
+BARE_TEST(test_terminal_modes,
+	"Test the line discipline of the terminals: canonical mode with\n"
+	"erase and echo, end of file, and switching back to raw mode."
+	)
+{
+	static char input[] = "ab\bc\ndef\x7f\x7fo\n\x04xy\rz\nraw\b";
+	vm_term_script script = { input, sizeof(input)-1, sizeof(input)-1, 0 };
+	vm_loopback loop = { 
+		.produce = vm_term_script_produce, .producer_arg = &script, 
+		.consume = tty_console_consume, .consumer_arg = NULL 
+	};
+	tty_console_len = 0;
+	boot_with_loopback(1, 1, &loop, tty_modes_boot, 0, NULL);
+}
 
 
 TEST_SUITE(basic_tests, 
@@ -903,6 +2142,10 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_many_cores,
+	&test_concurrent_vms,
+	&test_core_affinity,
+	&test_interrupt_masking_syscalls,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
@@ -916,6 +2159,16 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
 	&test_null_device,
+	&test_open_device,
+	&test_gettime,
+	&test_gettime_ns,
+	&test_sysbatch,
+	&test_lock_info,
+	&test_lock_info_overflow,
+	&test_core_info,
+	&test_procinfo_under_churn,
+	&test_lockfree_reads,
+	&test_lockfree_shared_readers,
 	&test_get_terminals,
 	&test_open_terminals,
 	&test_dup2_error_on_nonfile,
@@ -932,6 +2185,15 @@ TEST_SUITE(basic_tests,
 	&test_write_con_big,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
+	&test_loopback_terminals,
+	&test_serial_write_buffered,
+	&test_idle_terminal_no_interrupts,
+	&test_terminal_modes,
+	&test_no_block_devices,
+	&test_block_device,
+	&test_ramdisk,
+	&test_file_system,
+	&test_file_system_large_file,
 	&test_child_inherits_files,
 	NULL
 };
@@ -1393,40 +2655,179 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
-TEST_SUITE(thread_tests, 
-	"A suite of tests for threads."
+struct futex_test {
+	int word;
+	int started;
+	int woken;
+};
+
+static int futex_waiter_thread(int argl, void* args)
+{
+	struct futex_test* F = args;
+	__atomic_add_fetch(&F->started, 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&F->word, __ATOMIC_SEQ_CST)==0)
+		if(FutexWait(&F->word, 0, FUTEX_NO_TIMEOUT))
+			__atomic_add_fetch(&F->woken, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+BOOT_TEST(test_futex_wait_wake,
+	"Test that FutexWait sleeps only on the expected value, times out, and is\n"
+	"woken up by FutexWake."
 	)
 {
-	&test_join_illegal_tid_gives_error,
-	&test_detach_illegal_tid_gives_error,
-	&test_detach_self,
-	&test_detach_other,
-	&test_multiple_detach,
-	&test_join_main_thread,
-	&test_detach_main_thread,
-	&test_detach_after_join,
-	&test_create_join_thread,
-	&test_join_many_threads,
-	&test_exit_many_threads,
-	&test_main_exit_cleanup,
-	&test_noexit_cleanup,
-	&test_cyclic_joins,
-	NULL
-};
+	const int N = 5;
+	struct futex_test F = { 0, 0, 0 };
 
+	/* Mismatch and timeout */
+	ASSERT(FutexWait(&F.word, 1, FUTEX_NO_TIMEOUT)==0);
+	ASSERT(FutexWait(&F.word, 0, 10)==0);
+	ASSERT(FutexWake(&F.word, 1)==0);
 
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(futex_waiter_thread, 0, &F);
+	while(__atomic_load_n(&F.started, __ATOMIC_SEQ_CST) < N)
+		FutexWait(&F.started, F.started, 1);
 
+	__atomic_store_n(&F.word, 1, __ATOMIC_SEQ_CST);
+	int woken = FutexWake(&F.word, N+10);
+	ASSERT(woken>=0 && woken<=N);
 
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(F.woken==woken);
+	return 0;
+}
 
 
+struct futex_lib_test {
+	lwlock lock;
+	once_control once;
+	eventcount ec;
+	int counter;
+	int once_calls;
+};
 
-/*********************************************
- *
- *
- *
- *  Pipe tests
- *
- *
+static void count_once(void* arg)
+{
+	struct futex_lib_test* F = arg;
+	F->once_calls++;
+}
+
+static int futex_lib_thread(int argl, void* args)
+{
+	struct futex_lib_test* F = args;
+	CallOnce(&F->once, count_once, F);
+	for(int i=0; i<argl; i++) {
+		LwLockAcquire(&F->lock);
+		F->counter++;
+		LwLockRelease(&F->lock);
+	}
+	/* Wait for the signal to exit */
+	int e = 0;
+	while(e < 1) e = EventAwait(&F->ec, e);
+	return 0;
+}
+
+BOOT_TEST(test_futex_lib,
+	"Test the lightweight locks, once-flags and event counters of tinyoslib."
+	)
+{
+	const int N = 8;
+	const int M = 2000;
+	struct futex_lib_test F = { LWLOCK_INIT, ONCE_CONTROL_INIT, EVENTCOUNT_INIT, 0, 0 };
+
+	ASSERT(LwLockTry(&F.lock));
+	ASSERT(! LwLockTry(&F.lock));
+	LwLockRelease(&F.lock);
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(futex_lib_thread, M, &F);
+
+	CallOnce(&F.once, count_once, &F);
+	ASSERT(EventRead(&F.ec)==0);
+	ASSERT(EventAdvance(&F.ec)==1);
+
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(F.counter == N*M);
+	ASSERT(F.once_calls == 1);
+	ASSERT(F.lock.state == 0);
+	return 0;
+}
+
+
+
+static int spin_until_set(int argl, void* args)
+{
+	while(! __atomic_load_n((int*)args, __ATOMIC_ACQUIRE));
+	return 0;
+}
+
+static int set_flag(int argl, void* args)
+{
+	__atomic_store_n((int*)args, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+BOOT_TEST(test_alarm_preemption,
+	"Test that a spinning thread is preempted by the core timer, so that\n"
+	"the thread it waits for can run (run with TINYOS_ALARM=posix to test\n"
+	"the POSIX timers).",
+	.timeout = 10
+	)
+{
+	int flag = 0;
+	Tid_t spinner = CreateThread(spin_until_set, 0, &flag);
+	Tid_t setter = CreateThread(set_flag, 0, &flag);
+	ASSERT(ThreadJoin(spinner, NULL)==0);
+	ASSERT(ThreadJoin(setter, NULL)==0);
+	ASSERT(flag==1);
+	return 0;
+}
+
+
+
+TEST_SUITE(thread_tests, 
+	"A suite of tests for threads."
+	)
+{
+	&test_join_illegal_tid_gives_error,
+	&test_detach_illegal_tid_gives_error,
+	&test_detach_self,
+	&test_detach_other,
+	&test_multiple_detach,
+	&test_join_main_thread,
+	&test_detach_main_thread,
+	&test_detach_after_join,
+	&test_create_join_thread,
+	&test_join_many_threads,
+	&test_exit_many_threads,
+	&test_main_exit_cleanup,
+	&test_noexit_cleanup,
+	&test_cyclic_joins,
+	&test_futex_wait_wake,
+	&test_futex_lib,
+	&test_alarm_preemption,
+	NULL
+};
+
+
+
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Pipe tests
+ *
+ *
  *
  *********************************************/
 
@@ -2184,6 +3585,195 @@ BOOT_TEST(test_shudown_write,
 
 
 
+BOOT_TEST(test_no_network,
+	"Test that without a network, there is no node id and ConnectNode\n"
+	"connects only locally."
+	)
+{
+	ASSERT(GetNodeId()==NONODE);
+
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(ConnectNode(cli, 1, 100, 100)==-1);
+	ASSERT(ConnectNode(cli, MAX_NODES, 100, 100)==-1);
+	ASSERT(ConnectNode(OpenNull(), NONODE, 100, 100)==-1);
+
+	/* With NONODE, this is a Connect */
+	ASSERT(ConnectNode(cli, NONODE, 100, 100)==-1);
+	return 0;
+}
+
+
+/*
+	Boot as a node of the network in directory dir.
+ */
+static void boot_with_net(const char* dir, node_t node, uint ncores, Task task, int argl, void* args)
+{
+	char nodestr[16];
+	sprintf(nodestr, "%d", node);
+	ASSERT(setenv("TINYOS_NET", dir, 1)==0);
+	ASSERT(setenv("TINYOS_NODE", nodestr, 1)==0);
+	boot(ncores, 0, task, argl, args);
+	ASSERT(unsetenv("TINYOS_NET")==0);
+	ASSERT(unsetenv("TINYOS_NODE")==0);
+}
+
+/*
+	Boot 'server' as node 1, in a child process, and 'client' as node 0.
+ */
+static void boot_two_nodes(uint ncores, Task server, Task client, int argl, void* args)
+{
+	char dir[] = "/tmp/tinyos_net_XXXXXX";
+	ASSERT(mkdtemp(dir) != NULL);
+
+	pid_t pid = fork();
+	ASSERT(pid != -1);
+	if(pid == 0) {
+		FLAG_FAILURE = 0;
+		boot_with_net(dir, 1, ncores, server, argl, args);
+		_exit(FLAG_FAILURE);
+	}
+
+	boot_with_net(dir, 0, ncores, client, argl, args);
+
+	int status;
+	ASSERT(waitpid(pid, &status, 0)==pid);
+	ASSERT(WIFEXITED(status) && WEXITSTATUS(status)==0);
+	ASSERT(rmdir(dir)==0);
+}
+
+/* Connect to a port of node 1, waiting until it listens */
+static Fid_t connect_node1(port_t port)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	for(int i=0; i<500; i++) {
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(sock != NOFILE);
+		if(ConnectNode(sock, 1, port, 1000)==0) 
+			return sock;
+		Close(sock);
+
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 10);
+		Mutex_Unlock(&mx);
+	}
+	return NOFILE;
+}
+
+static int write_all(Fid_t fid, const char* buf, unsigned int size)
+{
+	unsigned int done = 0;
+	while(done < size) {
+		int n = Write(fid, buf+done, size-done);
+		if(n <= 0) return -1;
+		done += n;
+	}
+	return done;
+}
+
+#define NET_TEST_PORT 100
+#define NET_TEST_BYTES (1<<20)
+
+/* Connect to a local port, after the listener has blocked */
+static int local_connect_later(int argl, void* args)
+{
+	int dummy = 0;
+	ASSERT(FutexWait(&dummy, 0, 50)==0);
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, argl, 1000)==0);
+	ASSERT(Close(sock)==0);
+	return 0;
+}
+
+static int remote_server(int argl, void* args)
+{
+	ASSERT(GetNodeId()==1);
+	Fid_t lsock = Socket(NET_TEST_PORT);
+	ASSERT(Listen(lsock)==0);
+
+	/* Echo small messages */
+	Fid_t sock = Accept(lsock);
+	ASSERT(sock != NOFILE);
+	char buf[4096];
+	int n;
+	while((n = Read(sock, buf, 12)) > 0)
+		ASSERT(write_all(sock, buf, n)==n);
+	ASSERT(n==0);
+	ASSERT(Close(sock)==0);
+
+	/* Receive a large stream and return its size */
+	sock = Accept(lsock);
+	ASSERT(sock != NOFILE);
+	int total = 0;
+	while((n = Read(sock, buf, sizeof(buf))) > 0) {
+		for(int i=0; i<n; i++)
+			if(buf[i] != (char)((total+i) % 251)) { ASSERT(0); break; }
+		total += n;
+	}
+	ASSERT(n==0);
+	ASSERT(write_all(sock, (char*)&total, sizeof(total))==sizeof(total));
+	ASSERT(Close(sock)==0);
+
+	/* A local request wakes up a listener waiting for remote ones */
+	Tid_t t = CreateThread(local_connect_later, NET_TEST_PORT, NULL);
+	sock = Accept(lsock);
+	ASSERT(sock != NOFILE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Close(sock)==0);
+
+	ASSERT(Close(lsock)==0);
+	return 0;
+}
+
+static int remote_client(int argl, void* args)
+{
+	ASSERT(GetNodeId()==0);
+	Fid_t sock = connect_node1(NET_TEST_PORT);
+	ASSERT(sock != NOFILE);
+
+	/* Node 1 is up */
+	Fid_t sock2 = Socket(NOPORT);
+	ASSERT(ConnectNode(sock2, 1, NET_TEST_PORT+1, 1000)==-1);
+	ASSERT(ConnectNode(sock2, 5, NET_TEST_PORT, 1000)==-1);
+	ASSERT(ConnectNode(sock, 1, NET_TEST_PORT, 1000)==-1);
+	ASSERT(Close(sock2)==0);
+
+	for(int i=0; i<1000; i++)
+		check_transfer(sock, sock);
+	ASSERT(ShutDown(sock, SHUTDOWN_WRITE)==0);
+	char buf[4096];
+	ASSERT(Read(sock, buf, sizeof(buf))==0);
+	ASSERT(Close(sock)==0);
+
+	sock = connect_node1(NET_TEST_PORT);
+	ASSERT(sock != NOFILE);
+	for(int sent=0; sent < NET_TEST_BYTES; sent += sizeof(buf)) {
+		for(int i=0; i<sizeof(buf); i++)
+			buf[i] = (sent+i) % 251;
+		ASSERT(write_all(sock, buf, sizeof(buf))==sizeof(buf));
+	}
+	ASSERT(ShutDown(sock, SHUTDOWN_WRITE)==0);
+	int total;
+	ASSERT(Read(sock, (char*)&total, sizeof(total))==sizeof(total));
+	ASSERT(total==NET_TEST_BYTES);
+	ASSERT(Read(sock, buf, sizeof(buf))==0);
+	ASSERT(Close(sock)==0);
+	return 0;
+}
+
+BARE_TEST(test_remote_socket,
+	"Test connections between two nodes, with small messages, with a large\n"
+	"stream and with shutdown."
+	)
+{
+	boot_two_nodes(2, remote_server, remote_client, 0, NULL);
+}
+
+
+
+
 
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
@@ -2220,6 +3810,9 @@ TEST_SUITE(socket_tests,
 	&test_shudown_read,
 	&test_shudown_write,
 
+	&test_no_network,
+	&test_remote_socket,
+
 	NULL
 };
 
@@ -2545,6 +4138,744 @@ TEST_SUITE(io_tests,
 
 
 
+/*********************************************
+ *
+ *
+ *
+ *  Benchmarks
+ *
+ *
+ *
+ *********************************************/
+
+
+BOOT_TEST(bench_interrupt_masking,
+	"Measure the cost of disabling and enabling interrupts (run with\n"
+	"TINYOS_IRQ=signal to compare).",
+	.minimum_cores = 1
+	)
+{
+	const int N = 1000000;
+	struct timeval t0;
+	mark_time(&t0);
+	unsigned long calls0 = cpu_sigmask_calls();
+	for(int i=0; i<N; i++) {
+		cpu_disable_interrupts();
+		cpu_enable_interrupts();
+	}
+	unsigned long calls = cpu_sigmask_calls() - calls0;
+	double T = time_since(&t0);
+
+	MSG("%d disable/enable pairs: %lu sigmask calls, %.1f nsec/pair\n", N, calls, 1E9*T/N);
+	return 0;
+}
+
+
+/* Sum the contention counters of all mutexes, from the lock info stream */
+static void mutex_contention(unsigned long* spins, unsigned long* yields)
+{
+	*spins = *yields = 0;
+	Fid_t finfo = OpenLockInfo();
+	ASSERT(finfo!=NOFILE);
+	lockinfo info;
+	while(Read(finfo, (char*)&info, sizeof(info))==sizeof(info)) {
+		if(info.type!=LOCKINFO_MUTEX) continue;
+		*spins += info.spins;
+		*yields += info.yields;
+	}
+	ASSERT(Close(finfo)==0);
+}
+
+
+struct broadcast_bench {
+	Mutex mx;
+	CondVar round_cv;		/* broadcast at the start of each round */
+	CondVar done_cv;		/* signalled when all threads finish a round */
+	unsigned int round;
+	unsigned int done;
+	unsigned int nthreads;
+	unsigned int nrounds;
+};
+
+static int broadcast_bench_thread(int argl, void* args)
+{
+	struct broadcast_bench* B = args;
+	Mutex_Lock(&B->mx);
+	for(unsigned int r=1; r<=B->nrounds; r++) {
+		while(B->round < r)
+			Cond_Wait(&B->mx, &B->round_cv);
+		if(++B->done == B->nthreads)
+			Cond_Signal(&B->done_cv);
+	}
+	Mutex_Unlock(&B->mx);
+	return 0;
+}
+
+BOOT_TEST(bench_cond_broadcast,
+	"Measure the cost of Cond_Broadcast with many waiters, which all re-lock\n"
+	"the mutex held by the broadcaster.",
+	.minimum_cores = 2, .timeout = 60
+	)
+{
+	const unsigned int N = 64;
+	struct broadcast_bench B = { .mx = MUTEX_INIT, .round_cv = COND_INIT, 
+		.done_cv = COND_INIT, .round = 0, .done = 0, .nthreads = N, .nrounds = 500 };
+
+	Tid_t tids[N];
+	for(unsigned int i=0; i<N; i++) {
+		tids[i] = CreateThread(broadcast_bench_thread, 0, &B);
+		ASSERT(tids[i]!=NOTHREAD);
+	}
+
+	EnableLockStats(1);
+	struct timeval t0;
+	mark_time(&t0);
+
+	Mutex_Lock(&B.mx);
+	for(unsigned int r=1; r<=B.nrounds; r++) {
+		B.done = 0;
+		B.round = r;
+		Cond_Broadcast(&B.round_cv);
+		while(B.done < N)
+			Cond_Wait(&B.mx, &B.done_cv);
+	}
+	Mutex_Unlock(&B.mx);
+
+	double T = time_since(&t0);
+	EnableLockStats(0);
+
+	for(unsigned int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	unsigned long spins, yields;
+	mutex_contention(&spins, &yields);
+	MSG("%u threads, %u rounds: %.3f sec, %.1f usec/round, mutex spins=%lu yields=%lu\n",
+		N, B.nrounds, T, 1E6*T/B.nrounds, spins, yields);
+	return 0;
+}
+
+
+static int pipe_bench_reader(int argl, void* args)
+{
+	char c;
+	for(int i=0; i<argl; i++)
+		ASSERT(Read(0, &c, 1)==1);
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_many_readers,
+	"Measure the cost of kernel broadcasts, with many readers blocked on a pipe.",
+	.minimum_cores = 2, .timeout = 60
+	)
+{
+	const int N = 64;
+	const int PER_READER = 400;
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Dup2(pipe.read, 0)==0);
+
+	for(int i=0; i<N; i++)
+		ASSERT(Exec(pipe_bench_reader, PER_READER, NULL)!=NOPROC);
+
+	EnableLockStats(1);
+	struct timeval t0;
+	mark_time(&t0);
+
+	const char buf[16] = "0123456789abcdef";
+	for(int sent=0; sent < N*PER_READER; ) {
+		int w = Write(pipe.write, buf, sizeof(buf));
+		ASSERT(w>0);
+		sent += w;
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	double T = time_since(&t0);
+	EnableLockStats(0);
+
+	unsigned long spins, yields;
+	mutex_contention(&spins, &yields);
+	MSG("%d readers, %d bytes: %.3f sec, mutex spins=%lu yields=%lu\n",
+		N, N*PER_READER, T, spins, yields);
+	return 0;
+}
+
+
+
+BOOT_TEST(bench_sysbatch,
+	"Measure the kernel entry overhead saved by SysBatch, on Dup2/Close sequences.",
+	.timeout = 60
+	)
+{
+	const int N = 20000;
+	Fid_t f = OpenNull();
+	ASSERT(f!=NOFILE);
+
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<N; i++) {
+		ASSERT(Dup2(f, 5)==0);
+		ASSERT(Dup2(5, 6)==0);
+		ASSERT(Close(5)==0);
+		ASSERT(Close(6)==0);
+	}
+	double Tsingle = time_since(&t0);
+
+	mark_time(&t0);
+	for(int i=0; i<N; i++) {
+		sysop ops[4] = { SYSOP_Dup2(f, 5), SYSOP_Dup2(5, 6), SYSOP_Close(5), SYSOP_Close(6) };
+		ASSERT(SysBatch(ops, 4)==0);
+	}
+	double Tbatch = time_since(&t0);
+
+	MSG("%d x 4 calls: single %.3f sec (%.2f usec/call), batched %.3f sec (%.2f usec/call)\n",
+		N, Tsingle, 1E6*Tsingle/(4*N), Tbatch, 1E6*Tbatch/(4*N));
+	return 0;
+}
+
+
+
+static int identity_calls(int argl, void* args)
+{
+	int sum = 0;
+	for(int i=0; i<argl; i++) {
+		if(args) 
+			sum += GetPid() + GetPPid() + (ThreadSelf()!=NOTHREAD) + (int)GetTime();
+		else
+			sum += GetTerminalDevices();
+	}
+	return sum!=0;
+}
+
+BOOT_TEST(bench_identity_calls,
+	"Measure GetPid/GetPPid/ThreadSelf/GetTime, which do not lock the kernel,\n"
+	"against a call which does, from several concurrent threads.",
+	.minimum_cores = 2, .timeout = 60
+	)
+{
+	const int N = 4;
+	const int M = 50000;
+	double T[2];
+
+	for(int locked=0; locked<2; locked++) {
+		struct timeval t0;
+		mark_time(&t0);
+		Tid_t tids[N];
+		for(int i=0; i<N; i++)
+			tids[i] = CreateThread(identity_calls, M, locked ? NULL : &T);
+		for(int i=0; i<N; i++)
+			ASSERT(ThreadJoin(tids[i], NULL)==0);
+		T[locked] = time_since(&t0);
+	}
+
+	MSG("%d threads x %d: 4 lock-free calls %.3f sec (%.3f usec/call), locked call %.3f sec (%.3f usec/call)\n",
+		N, M, T[0], 1E6*T[0]/(4.0*N*M), T[1], 1E6*T[1]/((double)N*M));
+	return 0;
+}
+
+
+
+BOOT_TEST(bench_serial_big,
+	"Measure the throughput of the serial driver, writing 4 Mbytes to the\n"
+	"console and reading 4 Mbytes from the keyboard of terminal 0.",
+	.minimum_terminals = 1, .timeout = 120
+	)
+{
+	const int MB = 4;
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+
+	char buffer[16384];
+	FUDGE(buffer);
+	int total = MB<<20;
+
+	for(int i=0; i<(MB<<10); i++)
+		expect(0, bytes);
+
+	struct timeval t0;
+	mark_time(&t0);
+	for(int count=0; count<total; ) {
+		int remain = total-count;
+		int rc = Write(fterm, buffer, (remain<16384)? remain: 16384);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	double Twrite = time_since(&t0);
+
+	for(int i=0; i<(MB<<10); i++)
+		sendme(0, bytes);
+
+	mark_time(&t0);
+	for(int count=0; count<total; ) {
+		int remain = total-count;
+		int rc = Read(fterm, buffer, (remain<16384)? remain: 16384);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	double Tread = time_since(&t0);
+
+	MSG("%d Mbytes: write %.3f sec (%.1f MB/s), read %.3f sec (%.1f MB/s)\n",
+		MB, Twrite, MB/Twrite, Tread, MB/Tread);
+	return 0;
+}
+
+
+#define BENCH_TERM_INPUT (256<<20)
+#define BENCH_TERM_OUTPUT (64<<20)
+
+static int term_read_bench(int argl, void* args)
+{
+	Fid_t kbd = OpenTerminal(0);
+	ASSERT(kbd != NOFILE);
+	static char buf[16384];
+	uint64_t t0 = GetTimeNs();
+	uint64_t count = 0;
+	while(count < BENCH_TERM_INPUT) {
+		int rc = Read(kbd, buf, sizeof(buf));
+		ASSERT(rc > 0);
+		count += rc;
+	}
+	double T = 1E-9*(GetTimeNs()-t0);
+	MSG("keyboard read, 16K requests: %.1f MB/s\n", count/(double)(1<<20)/T);
+	return 0;
+}
+
+static int term_write_thread(int argl, void* args)
+{
+	Fid_t con = OpenTerminal(argl);
+	ASSERT(con != NOFILE);
+	char buf[16384];
+	for(uint i=0; i<sizeof(buf); i++) buf[i] = i % 251;
+	for(uint sent=0; sent < BENCH_TERM_OUTPUT; sent += sizeof(buf))
+		ASSERT(Write(con, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Close(con)==0);
+	return 0;
+}
+
+static int term_write_bench(int argl, void* args)
+{
+	for(uint nterm=1; nterm<=GetTerminalDevices(); nterm*=2) {
+		Tid_t tids[nterm];
+		uint64_t t0 = GetTimeNs();
+		for(uint t=0; t<nterm; t++)
+			tids[t] = CreateThread(term_write_thread, t, NULL);
+		for(uint t=0; t<nterm; t++)
+			ASSERT(ThreadJoin(tids[t], NULL)==0);
+		double T = 1E-9*(GetTimeNs()-t0);
+		MSG("console write to %u terminals, 16K requests: %.1f MB/s\n", 
+			nterm, nterm*(double)BENCH_TERM_OUTPUT/(1<<20)/T);
+	}
+	return 0;
+}
+
+BARE_TEST(bench_terminals,
+	"Measure the throughput of keyboard reads and console writes, with\n"
+	"loopback terminals.",
+	.timeout = 120
+	)
+{
+	static char script_data[4096];
+	for(uint i=0; i<sizeof(script_data); i++) script_data[i] = i % 251;
+	vm_term_script script = { script_data, sizeof(script_data), BENCH_TERM_INPUT, 0 };
+	vm_loopback kbd = { .produce = vm_term_script_produce, .producer_arg = &script };
+	boot_with_loopback(2, 1, &kbd, term_read_bench, 0, NULL);
+
+	vm_term_sink sink[MAX_TERMINALS];
+	vm_loopback con[MAX_TERMINALS];
+	for(uint t=0; t<MAX_TERMINALS; t++) {
+		vm_term_sink_init(&sink[t]);
+		con[t] = (vm_loopback){ .consume = vm_term_checksum, .consumer_arg = &sink[t] };
+	}
+	boot_with_loopback(2, MAX_TERMINALS, con, term_write_bench, 0, NULL);
+	for(uint t=0; t<MAX_TERMINALS; t++)
+		ASSERT(sink[t].bytes % BENCH_TERM_OUTPUT == 0);
+}
+
+
+#define BENCH_MANY_TERM_INPUT (8<<20)
+
+static int term_reader_thread(int argl, void* args)
+{
+	Fid_t kbd = OpenTerminal(argl);
+	ASSERT(kbd != NOFILE);
+	char buf[1024];
+	char expected[32];
+	int len = sprintf(expected, "This is terminal %d\n", argl);
+	uint count = 0;
+	while(count < BENCH_MANY_TERM_INPUT) {
+		int rc = Read(kbd, buf, sizeof(buf));
+		ASSERT(rc > 0);
+		if(buf[0] != expected[count % len]) ASSERT(0);
+		count += rc;
+	}
+	ASSERT(Close(kbd)==0);
+	return 0;
+}
+
+static int many_term_read_bench(int argl, void* args)
+{
+	uint nterm = GetTerminalDevices();
+	Tid_t tids[nterm];
+	uint64_t t0 = GetTimeNs();
+	for(uint t=0; t<nterm; t++)
+		tids[t] = CreateThread(term_reader_thread, t, NULL);
+	for(uint t=0; t<nterm; t++)
+		ASSERT(ThreadJoin(tids[t], NULL)==0);
+	double T = 1E-9*(GetTimeNs()-t0);
+	MSG("keyboard read from %2u terminals, 1K requests: %.1f MB/s\n", 
+		nterm, nterm*(double)BENCH_MANY_TERM_INPUT/(1<<20)/T);
+	return 0;
+}
+
+BARE_TEST(bench_read_many_terminals,
+	"Measure the throughput of concurrent keyboard reads from many loopback\n"
+	"terminals, one reader per terminal.",
+	.timeout = 120
+	)
+{
+	static char script_data[MAX_TERMINALS][32];
+	vm_term_script script[MAX_TERMINALS];
+	vm_loopback kbd[MAX_TERMINALS];
+	for(uint nterm=1; nterm<=MAX_TERMINALS; nterm*=4) {
+		for(uint t=0; t<nterm; t++) {
+			int len = sprintf(script_data[t], "This is terminal %u\n", t);
+			script[t] = (vm_term_script){ script_data[t], len, BENCH_MANY_TERM_INPUT, 0 };
+			kbd[t] = (vm_loopback){ .produce = vm_term_script_produce, .producer_arg = &script[t] };
+		}
+		boot_with_loopback(2, nterm, kbd, many_term_read_bench, 0, NULL);
+	}
+}
+
+
+
+BOOT_TEST(bench_keyboard_latency,
+	"Measure the round trip of a byte sent to the keyboard of terminal 0 and\n"
+	"read back by a single thread. On one core, the serial interrupt is\n"
+	"handled by the idle thread, which must not halt afterwards.",
+	.minimum_terminals = 1, .timeout = 60
+	)
+{
+	const int N = 1000;
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<N; i++) {
+		char c;
+		sendme(0, "x");
+		ASSERT(Read(fterm, &c, 1)==1);
+		ASSERT(c=='x');
+	}
+	double T = time_since(&t0);
+
+	MSG("%d round trips: %.3f sec (%.2f usec/round trip)\n", N, T, 1E6*T/N);
+	return 0;
+}
+
+
+
+struct pingpong { int* turn; int me; };
+
+/* Pass the turn back and forth, argl times */
+static int pingpong_thread(int argl, void* args)
+{
+	struct pingpong* P = args;
+	for(int i=0; i<argl; i++) {
+		int t;
+		while((t=__atomic_load_n(P->turn, __ATOMIC_ACQUIRE)) != P->me)
+			FutexWait(P->turn, t, FUTEX_NO_TIMEOUT);
+		__atomic_store_n(P->turn, !P->me, __ATOMIC_RELEASE);
+		FutexWake(P->turn, 1);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_wakeup_latency,
+	"Measure the round trip of two threads waking each other up. Each wakeup\n"
+	"restarts a halted core or interrupts a running one, so this depends on\n"
+	"the interrupt delivery of the VM (compare with TINYOS_IRQ=signal).",
+	.minimum_cores = 2, .timeout = 60
+	)
+{
+	const int N = 5000;
+	int turn = 0;
+	struct pingpong P[2] = { { &turn, 0 }, { &turn, 1 } };
+
+	struct timeval t0;
+	mark_time(&t0);
+	Tid_t t1 = CreateThread(pingpong_thread, N, &P[0]);
+	Tid_t t2 = CreateThread(pingpong_thread, N, &P[1]);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+	double T = time_since(&t0);
+
+	MSG("%d round trips: %.3f sec (%.2f usec/round trip)\n", N, T, 1E6*T/N);
+	return 0;
+}
+
+
+
+#define BENCH_DISK_SECTORS (64<<11)	/* 64 Mbytes */
+#define BENCH_DISK_CORES 4
+
+struct block_bench { int write; int nreq; double lat_sum; };
+
+/* Random 4 Kbyte requests, recording the total latency */
+static int block_bench_thread(int argl, void* args)
+{
+	struct block_bench* B = args;
+	char buf[4096];
+	memset(buf, argl, sizeof(buf));
+	unsigned int seed = argl;
+	double lat = 0.0;
+	for(int i=0; i<B->nreq; i++) {
+		uint64_t sector = (rand_r(&seed) % (BENCH_DISK_SECTORS/8)) * 8;
+		uint64_t t0 = GetTimeNs();
+		int rc = B->write ? BlockWrite(0, sector, buf, 8) : BlockRead(0, sector, buf, 8);
+		ASSERT(rc==0);
+		lat += GetTimeNs() - t0;
+	}
+	B->lat_sum += lat;
+	return 0;
+}
+
+#define BLOCK_SEQ_THREADS 16
+
+/* Sequential 4K writes of every BLOCK_SEQ_THREADS-th block */
+static int block_seq_thread(int argl, void* args)
+{
+	char buf[4096];
+	memset(buf, argl, sizeof(buf));
+	for(uint64_t s = 8*argl; s < BENCH_DISK_SECTORS; s += 8*BLOCK_SEQ_THREADS)
+		ASSERT(BlockWrite(0, s, buf, 8)==0);
+	return 0;
+}
+
+static int block_bench_boot(int argl, void* args)
+{
+	const int NREQ = 2000;
+	for(int write=0; write<2; write++)
+		for(int nthreads=1; nthreads<=16; nthreads*=4) {
+			struct block_bench B = { write, NREQ/nthreads, 0.0 };
+			Tid_t tids[nthreads];
+			uint64_t t0 = GetTimeNs();
+			for(int i=0; i<nthreads; i++)
+				tids[i] = CreateThread(block_bench_thread, i+1, &B);
+			for(int i=0; i<nthreads; i++)
+				ASSERT(ThreadJoin(tids[i], NULL)==0);
+			double T = 1E-9*(GetTimeNs()-t0);
+			int total = B.nreq*nthreads;
+			MSG("random 4K %s, %2d threads: %8.0f IOPS, latency %7.1f usec\n",
+				write ? "write" : "read ", nthreads, total/T, 1E-3*B.lat_sum/total);
+		}
+
+	/* Sequential 4K writes, interleaved among threads, so that they merge */
+	uint64_t t0 = GetTimeNs();
+	Tid_t tids[BLOCK_SEQ_THREADS];
+	for(int i=0; i<BLOCK_SEQ_THREADS; i++)
+		tids[i] = CreateThread(block_seq_thread, i, NULL);
+	for(int i=0; i<BLOCK_SEQ_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	double T = 1E-9*(GetTimeNs()-t0);
+	MSG("sequential 4K writes, %d threads: %.1f MB/s\n", BLOCK_SEQ_THREADS, 
+		BENCH_DISK_SECTORS*(double)BLOCK_SECTOR_SIZE/(1<<20)/T);
+	return 0;
+}
+
+BARE_TEST(bench_block_io,
+	"Measure the IOPS and latency of random 4 Kbyte block device requests,\n"
+	"and the throughput of sequential writes that the driver can merge.",
+	.timeout = 120
+	)
+{
+	boot_with_disk(BENCH_DISK_CORES, BENCH_DISK_SECTORS*(size_t)BLOCK_SECTOR_SIZE, block_bench_boot, 0, NULL);
+}
+
+
+#define BENCH_FS_BIG (128<<20)
+#define BENCH_FS_SMALL (2<<20)
+
+/* Read the whole file in requests of the given size, returning the MB/s */
+static double bench_fs_read(const char* path, uint reqsize, int times)
+{
+	static char buf[1<<16];
+	uint64_t t0 = GetTimeNs();
+	uint64_t total = 0;
+	for(int k=0; k<times; k++) {
+		Fid_t f = Open(path, 0);
+		ASSERT(f != NOFILE);
+		int rc;
+		while((rc = Read(f, buf, reqsize)) > 0) total += rc;
+		ASSERT(rc==0);
+		ASSERT(Close(f)==0);
+	}
+	return total / (1E-9*(GetTimeNs()-t0)) / (1<<20);
+}
+
+static int fs_bench_boot(int argl, void* args)
+{
+	static char buf[1<<16];
+	FUDGE(buf);
+	ASSERT(MakeFileSystem(0)==0);
+	ASSERT(Mount(0)==0);
+
+	/* Sequential writes, including the write-back */
+	uint64_t t0 = GetTimeNs();
+	Fid_t f = Open("/big", OPEN_CREATE);
+	for(uint64_t off = 0; off < BENCH_FS_BIG; off += sizeof(buf))
+		ASSERT(Write(f, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Close(f)==0);
+	ASSERT(Sync()==0);
+	double T = 1E-9*(GetTimeNs()-t0);
+	MSG("sequential write of %d MB, 64K requests:  %.1f MB/s\n", BENCH_FS_BIG>>20, (BENCH_FS_BIG>>20)/T);
+
+	/* Sequential reads of a file larger than the page cache, with read-ahead */
+	MSG("sequential read (cold), 64K requests:      %.1f MB/s\n", bench_fs_read("/big", sizeof(buf), 1));
+	MSG("sequential read (cold), 4K requests:       %.1f MB/s\n", bench_fs_read("/big", 4096, 1));
+
+	/* A file which fits in the page cache */
+	f = Open("/small", OPEN_CREATE);
+	for(uint64_t off = 0; off < BENCH_FS_SMALL; off += sizeof(buf))
+		ASSERT(Write(f, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Close(f)==0);
+	MSG("sequential read (cached), 64K requests:    %.1f MB/s\n", bench_fs_read("/small", sizeof(buf), 32));
+	MSG("sequential read (cached), 4K requests:     %.1f MB/s\n", bench_fs_read("/small", 4096, 32));
+
+	/* Random 4K reads of the large file */
+	const int N = 20000;
+	f = Open("/big", 0);
+	t0 = GetTimeNs();
+	for(int i=0; i<N; i++) {
+		ASSERT(Seek(f, (uint64_t)(lrand48() % (BENCH_FS_BIG/4096)) * 4096, SEEK_SET) >= 0);
+		ASSERT(Read(f, buf, 4096)==4096);
+	}
+	T = 1E-9*(GetTimeNs()-t0);
+	ASSERT(Close(f)==0);
+	MSG("random 4K reads:                           %.0f IOPS\n", N/T);
+
+	ASSERT(Unmount()==0);
+	return 0;
+}
+
+BARE_TEST(bench_file_system,
+	"Measure the throughput of the file system on a RAM disk: sequential\n"
+	"writes, sequential reads with read-ahead and from the page cache, and\n"
+	"random reads.",
+	.timeout = 300
+	)
+{
+	boot_with_ramdisk(2, BENCH_FS_BIG + (16<<20), NULL, fs_bench_boot, 0, NULL);
+}
+
+
+#define BENCH_NET_PINGS 10000
+#define BENCH_NET_BYTES (64<<20)
+
+static int net_bench_server(int argl, void* args)
+{
+	Fid_t lsock = Socket(NET_TEST_PORT);
+	ASSERT(Listen(lsock)==0);
+
+	/* Ping-pong */
+	Fid_t sock = Accept(lsock);
+	ASSERT(sock != NOFILE);
+	char buf[16384];
+	int n;
+	while((n = Read(sock, buf, 1)) > 0)
+		ASSERT(Write(sock, buf, n)==n);
+	ASSERT(Close(sock)==0);
+
+	/* Stream */
+	sock = Accept(lsock);
+	ASSERT(sock != NOFILE);
+	int total = 0;
+	while((n = Read(sock, buf, sizeof(buf))) > 0)
+		total += n;
+	ASSERT(write_all(sock, (char*)&total, sizeof(total))==sizeof(total));
+	ASSERT(Close(sock)==0);
+
+	/* A local request wakes up a listener waiting for remote ones */
+	Tid_t t = CreateThread(local_connect_later, NET_TEST_PORT, NULL);
+	sock = Accept(lsock);
+	ASSERT(sock != NOFILE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Close(sock)==0);
+
+	ASSERT(Close(lsock)==0);
+	return 0;
+}
+
+static int net_bench_client(int argl, void* args)
+{
+	Fid_t sock = connect_node1(NET_TEST_PORT);
+	ASSERT(sock != NOFILE);
+
+	char buf[16384] = { 0 };
+	uint64_t t0 = GetTimeNs();
+	for(int i=0; i<BENCH_NET_PINGS; i++) {
+		ASSERT(Write(sock, buf, 1)==1);
+		ASSERT(Read(sock, buf, 1)==1);
+	}
+	uint64_t t1 = GetTimeNs();
+	ASSERT(Close(sock)==0);
+	MSG("ping-pong: round trip %.1f usec\n", (t1-t0)/1000.0/BENCH_NET_PINGS);
+
+	sock = connect_node1(NET_TEST_PORT);
+	ASSERT(sock != NOFILE);
+	t0 = GetTimeNs();
+	for(int sent=0; sent < BENCH_NET_BYTES; sent += sizeof(buf))
+		ASSERT(write_all(sock, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(ShutDown(sock, SHUTDOWN_WRITE)==0);
+	int total;
+	ASSERT(Read(sock, (char*)&total, sizeof(total))==sizeof(total));
+	t1 = GetTimeNs();
+	ASSERT(total==BENCH_NET_BYTES);
+	ASSERT(Close(sock)==0);
+	MSG("stream: %.1f MB/s\n", BENCH_NET_BYTES/1E6 / ((t1-t0)/1E9));
+	return 0;
+}
+
+BARE_TEST(bench_net,
+	"Measure the round trip time and the stream throughput of a connection\n"
+	"between two nodes.",
+	.timeout = 120
+	)
+{
+	boot_two_nodes(2, net_bench_server, net_bench_client, 0, NULL);
+}
+
+
+
+TEST_SUITE(bench_tests,
+	"A suite of benchmarks, reporting timings and lock contention."
+	)
+{
+	&bench_interrupt_masking,
+	&bench_cond_broadcast,
+	&bench_pipe_many_readers,
+	&bench_sysbatch,
+	&bench_identity_calls,
+	&bench_wakeup_latency,
+	&bench_serial_big,
+	&bench_keyboard_latency,
+	&bench_terminals,
+	&bench_read_many_terminals,
+	&bench_block_io,
+	&bench_file_system,
+	&bench_net,
+	NULL
+};
+
+
+
+
 /*********************************************
  *
  *
@@ -2607,6 +4938,7 @@ int main(int argc, char** argv)
 {
 	register_test(&all_tests);
 	register_test(&user_tests);
+	register_test(&bench_tests);
 	return run_program(argc, argv, &all_tests);
 }
 